@@ -2,19 +2,120 @@
 #define __AUDIO_HPP___
 
 #include <stdlib.h>
+#include <string>
+#include <vector>
+
+#include "audio/audiodata.hpp"
+#include "audio/clicktrack.hpp"
+#include "audio/latencystats.hpp"
+#include "audio/offlinerenderer.hpp"
+#include "audio/tempomap.hpp"
 
 namespace AudioComp {
+  // The click can use a different sound for the downbeat of each bar, and for
+  // subdivisions between beats. Voices without a sound of their own fall back to
+  // CV_Normal.
+  enum ClickVoice_t {
+    CV_Normal,
+    CV_Accent,
+    CV_Subdivision,
+    CV_NumVoices
+  };
+
+  // Time from a trigger hit to the click responding, in microseconds.
+  class TriggerLatency {
+  public:
+    TriggerLatency():
+      hits(0),
+      handoffUs(0),
+      maxHandoffUs(0),
+      outputUs(0) {}
+
+    uint32_t hits;
+    uint32_t handoffUs;    // From the hit to the audio task picking it up, for the last hit
+    uint32_t maxHandoffUs;
+    uint32_t outputUs;     // From the audio task to the speaker
+  };
+
+  // One song of a click track to be exported. The song's clicks are looked up
+  // from clickVoice, like SetClickVoice().
+  class ExportSong {
+  public:
+    std::string clickVoice;
+    AudioLib::RenderSong song;
+  };
+
   void Init();
 
+  // Streams a .wav or .mp3 file of any length from the SD card, alongside the
+  // click. Starting another one cuts off the first. MP3s are decoded on the other
+  // core, and the stats say how long that takes per second of audio.
   bool PlayAudioFile(const char *fileName);
 
-  bool SetClickFile(const char *fileName);
-  bool StartClick(uint16_t bpm);
+  // Doesn't wait for the audio task, and does nothing if there's no backing track
+  // going, so it's cheap to call on every song change.
+  bool StopAudioFile();
+  AudioLib::StreamStats GetBackingTrackStats();
+
+  // Loads every .wav file in dirName into memory, once, at boot. Not while the
+  // click is going, since it stops it.
+  bool LoadClickBank(const char *dirName);
+
+  // Switches the click to the sounds called name (see ClickBank), without going
+  // to the card. Unknown names get the default sounds.
+  bool SetClickVoice(const char *name);
+  bool SetTimeSignature(uint8_t beatsPerBar);
+  bool SetClickPattern(AudioLib::Subdivision_t subdivision, uint8_t swing = CLICKTRACK_DEFAULT_SWING);
+  // How loud 8ths (or triplets) and 16ths are, in percent of the beat
+  bool SetSubdivisionLevels(uint8_t level1Percent, uint8_t level2Percent);
+  // Copies the map, so the caller's can go away. An empty map clears it. The map
+  // is followed from the next StartClick() or RestartClick().
+  bool SetTempoMap(const AudioLib::TempoMap& tempoMap);
+  bool StartClick(float bpm);
+
+  // Like StartClick(), but keeps the beat and bar going, so it can be used while
+  // playing. Stops following the tempo map.
+  bool ChangeTempo(float bpm);
   bool RestartClick(uint32_t startTime = 0);
 
+  // Re-anchors the beat grid on a trigger hit, like RestartClick(), but without
+  // going through the command ring. It's lock-free, never waits, and can be called
+  // from any task. hitTimeUs is the low 32 bits of esp_timer_get_time() when the
+  // hit happened. The audio task picks it up before rendering its next block, and
+  // lines the grid up with the frame that was being heard at that moment.
+  void ResetClickPhase(uint32_t hitTimeUs);
+  TriggerLatency GetTriggerLatency();
+
+  // Every click's timing, in histograms over the last minute or so, plus output
+  // underruns. Written out a line at a time as CSV (see LatencyStats).
+  void WriteLatencyCsv(AudioLib::LatencyStats::LineWriter writeLine);
+  void ClearLatencyStats();
+
+  // Renders songs, one after the other, to a .wav file at the current volume, for
+  // monitor mixes. Much faster than real time, but it's done on the caller's task,
+  // which it keeps until it's finished. The live click carries on as it was.
+  bool ExportClickTrack(const char *fileName, const std::vector<ExportSong>& songs);
+
+  // Runs the audio checks and benchmarks (see AudioLib::Diagnostics) on the audio
+  // task, logging what they find. They take a while, and the click stops until
+  // they're done, so they're only ever run when asked for. Waits for them.
+  bool RunDiagnostics();
+
+  // Streams /diag/stream-check.wav from the card at twice real time, checking
+  // for underruns (see AudioLib::Diagnostics::CheckStreamWav()), through a stream
+  // of its own. It takes over the audio task the whole time: there's no click,
+  // and the audio task opens the file itself. For a long file that's minutes.
+  // Waits for it.
+  bool RunStreamCheck();
+
   bool StopClick();
   bool StartFlash();
   bool StopFlash();
+
+  // Health of the command ring feeding the audio task
+  uint32_t GetCommandQueueDepth();
+  uint32_t GetCommandQueueHighWater();
+  uint32_t GetCommandsDropped();
 }
 
 #endif
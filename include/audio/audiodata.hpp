@@ -16,6 +16,15 @@ public:
 // An interface to be used by the Player class for data retrival when
 // playing. Initial implementation will be .wav, but an MP3 implementation
 // is expected later.
+//
+// Samples come in chunks. GetSamples() returns the current one, and when the
+// player has used it all up it calls HasMoreData(), which moves on to the next.
+// The player calls these from the audio task, so they must never block: a source
+// that can't keep up returns an empty chunk from GetSamples() (and the player
+// asks again next block), and NULL once there's nothing left at all.
+//
+// Samples are 16-bit, either mono or interleaved stereo. The player spreads mono
+// to both channels as it mixes.
 class AudioDataInterface {
 public:
   virtual bool HasMoreData() = 0;
@@ -23,9 +32,47 @@ public:
 
   virtual uint32_t GetSampleRate() = 0;
   virtual uint16_t GetBitsPerSample() = 0;
+  virtual uint16_t GetNumChannels() = 0;
   virtual const AudioSamples* GetSamples() = 0;
 };
 
+
+// Health of a stream, as seen by the audio task. Safe to read from any task.
+class StreamStats {
+public:
+  StreamStats():
+    underruns(0),
+    starvedBlocks(0),
+    bufferedFrames(0),
+    minBufferedFrames(0),
+    capacityFrames(0),
+    workUsPerSecond(0),
+    maxWorkUs(0),
+    errors(0) {}
+
+  uint32_t underruns;          // Times the audio task needed samples and none were ready
+  uint32_t starvedBlocks;      // Blocks it went without, over all of them
+  uint32_t bufferedFrames;     // Ready to play right now
+  uint32_t minBufferedFrames;  // Fewest ready while playing, before the end of the file
+  uint32_t capacityFrames;
+
+  // Time the background task spent producing samples (reading, decoding), per
+  // second of audio produced. Wall time, so it includes being preempted.
+  uint32_t workUsPerSecond;
+  uint32_t maxWorkUs;          // Longest single read or decode
+  uint32_t errors;             // Read or decode errors
+};
+
+
+// A source that's read (and maybe decoded) ahead of the audio task, on a task of
+// its own. Open() is for the caller's task, while the stream isn't being played.
+// Files at any other rate than outputRate are resampled as they're read.
+class AudioStreamInterface : public AudioDataInterface {
+public:
+  virtual bool Open(const char *fileName, uint32_t outputRate) = 0;
+  virtual StreamStats GetStats() const = 0;
+};
+
 } // namespace AudioLib
 
 #endif
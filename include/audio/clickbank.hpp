@@ -0,0 +1,140 @@
+#ifndef __CLICKBANK_HPP___
+#define __CLICKBANK_HPP___
+
+#include <stdint.h>
+#include <vector>
+
+#include "audio/adpcm.hpp"
+#include "audio/audiodata.hpp"
+
+
+// Most .wav files the bank will take from the directory
+#define CLICKBANK_MAX_SAMPLES 32
+
+// Longest name (the file name, less ".wav") that can be looked up
+#define CLICKBANK_MAX_NAME 32
+
+// Voice used by songs that don't pick one
+#define CLICKBANK_DEFAULT_VOICE "click"
+
+// Built-in voice, synthesized as the bank is loaded, so there's always a click
+// even with no files (see ClickSynth). A file of the same name takes its place.
+#define CLICKBANK_SYNTH_VOICE "synth"
+
+// Clicks are cut off (and faded out) after this long
+#define CLICKBANK_MAX_CLICK_MS 1000
+
+// Sounds at least this long (cues, counts) are kept as IMA ADPCM, in about a
+// quarter of the memory, and decoded as they play. Shorter ones, which is most
+// clicks, stay 16-bit so they can be baked.
+#define CLICKBANK_ADPCM_MIN_MS 200
+
+
+namespace AudioLib {
+
+// One sound in a ClickBank. Its samples live in the bank's arena, so it's never
+// reloaded, and can be pointed at from any number of places.
+class ClickSample : public AudioDataInterface {
+public:
+  ClickSample():
+    sampleRate(0),
+    numChannels(2),
+    bitsPerSample(16),
+    numFrames(0),
+    trimmedFrames(0) {
+    name[0] = '\0';
+  }
+  virtual ~ClickSample() {}
+
+  const char* GetName() const { return name; }
+  uint32_t GetNumSamples() const { return numFrames * numChannels; }
+
+  // Kept as ADPCM, which the mixer decodes as it plays. It can't be baked.
+  bool IsCompressed() const { return bitsPerSample == ADPCM_BITS_PER_SAMPLE; }
+
+  // Silence that was trimmed off the front, which would have been latency
+  uint32_t GetTrimmedFrames() const { return trimmedFrames; }
+
+  // AudioDataInterface methods
+  virtual bool HasMoreData() { return false; }
+  virtual void Restart() {}
+  virtual uint32_t GetSampleRate() { return sampleRate; }
+  virtual uint16_t GetBitsPerSample() { return bitsPerSample; }
+  virtual uint16_t GetNumChannels() { return numChannels; }
+  virtual const AudioSamples* GetSamples() { return &samples; }
+
+private:
+  friend class ClickBank;
+
+  char name[CLICKBANK_MAX_NAME];
+  AudioSamples samples;
+  uint32_t sampleRate;
+  uint16_t numChannels;
+  uint16_t bitsPerSample;  // 16, or ADPCM_BITS_PER_SAMPLE
+  uint32_t numFrames;      // Of ADPCM, whole blocks
+  uint32_t trimmedFrames;
+};
+
+
+// Every click sound in a directory, loaded once at boot into one block of memory
+// (PSRAM, when there is some), converted to 16-bit at the output rate and kept
+// mono where it can be. Each one is trimmed, normalized and faded out on the way
+// in (see ClickPrep). Songs pick their sounds by name, so changing them is only
+// a lookup, with nothing read from the card.
+//
+// Long sounds are kept as ADPCM (see CLICKBANK_ADPCM_MIN_MS). Files can be ADPCM
+// too, but they're decoded for ClickPrep, and encoded again if they're long.
+//
+// A voice called "woodblock" is woodblock.wav, with woodblock-accent.wav on the
+// downbeat and woodblock-subdivision.wav between beats, if they're there. The
+// CLICKBANK_SYNTH_VOICE voice is always there, whatever is in the directory.
+class ClickBank {
+public:
+  ClickBank();
+  virtual ~ClickBank();
+
+  // Loads every .wav file in dirName, and synthesizes the built-in voice. Files
+  // that can't be loaded, or a directory that can't be read, are skipped. False
+  // only if there wasn't the memory for any of it. Nothing may be playing from the
+  // bank, since whatever was loaded before is freed.
+  bool LoadDir(const char *dirName, uint32_t outputRate);
+
+  // NULL if there's no sound by that name. Case doesn't matter.
+  ClickSample* Find(const char *name);
+
+  // Largest 16-bit sound in the bank, in samples, which is the most baking one
+  // can take
+  uint32_t GetMaxSamples() const { return maxSamples; }
+  uint32_t GetNumSamples() const { return entries.size(); }
+  uint32_t GetArenaSize() const { return arenaSize; }
+
+  // Memory ADPCM saved, against keeping every sound 16-bit
+  uint32_t GetBytesSaved() const { return bytesSaved; }
+  bool InPsram() const { return inPsram; }
+
+private:
+  class LoadInfo {
+  public:
+    char fileName[CLICKBANK_MAX_NAME + 4];
+    uint32_t numSamples;  // Most it can take once it's converted
+  };
+
+  void clear();
+  bool listDir(const char *dirName, uint32_t outputRate, std::vector<LoadInfo>& files);
+  bool allocArena(uint32_t numSamples);
+  uint32_t synthesize(uint32_t outputRate, uint32_t used, std::vector<uint32_t>& offsets);
+  void compress(ClickSample& entry, int16_t *pcm);
+
+  int16_t *arena;
+  uint32_t arenaSize;  // In bytes
+  bool inPsram;
+  uint32_t maxSamples;
+  uint32_t bytesSaved;
+
+  std::vector<ClickSample> entries;  // Sorted by name
+};
+
+
+} // namespace AudioLib
+
+#endif
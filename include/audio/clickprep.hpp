@@ -0,0 +1,56 @@
+#ifndef __CLICKPREP_HPP___
+#define __CLICKPREP_HPP___
+
+#include <stdint.h>
+
+
+// Anything this far below the loudest sample (-40 dB) counts as silence at the
+// ends of a click.
+#define CLICKPREP_SILENCE_RATIO 100
+
+// Kept ahead of the first sound, and faded in, so the attack isn't chopped. Under
+// half a millisecond at 44.1 kHz.
+#define CLICKPREP_PREROLL_FRAMES 16
+
+// Peaks are brought to -1 dBFS
+#define CLICKPREP_TARGET_PEAK 29205
+
+// Most a quiet click is turned up by (+24 dB), so a file that's nearly silent
+// doesn't come out as loud hiss.
+#define CLICKPREP_MAX_GAIN 16.0f
+
+// Length of the fade at the end, about 2 ms at 44.1 kHz
+#define CLICKPREP_FADE_FRAMES 88
+
+
+namespace AudioLib {
+namespace ClickPrep {
+
+// What Process() did to a click
+class Result {
+public:
+  Result():
+    leadingFrames(0),
+    trailingFrames(0),
+    truncatedFrames(0),
+    peak(0),
+    gain(1) {}
+
+  uint32_t leadingFrames;    // Silence trimmed from the start. Latency that's gone.
+  uint32_t trailingFrames;   // Silence trimmed from the end
+  uint32_t truncatedFrames;  // Cut off past maxFrames
+  int32_t peak;              // Before normalizing
+  float gain;
+};
+
+// Gets a click ready to be played, once, as it's loaded: trims the silence off
+// both ends, brings the peak up (or down) to CLICKPREP_TARGET_PEAK, cuts it to
+// maxFrames if it's longer (0 for no limit), and fades the end out so it
+// doesn't stop on a step. The click is left at the start of samples, and the
+// new number of frames is returned. A silent click is left as it is.
+uint32_t Process(int16_t *samples, uint32_t numFrames, uint8_t numChannels, uint32_t maxFrames, Result *result);
+
+} // namespace ClickPrep
+} // namespace AudioLib
+
+#endif
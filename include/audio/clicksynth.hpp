@@ -0,0 +1,61 @@
+#ifndef __CLICKSYNTH_HPP___
+#define __CLICKSYNTH_HPP___
+
+#include <stdint.h>
+
+
+// Sounds are rendered until the envelope has fallen this many time constants
+// (-43 dB), which ClickPrep trims and fades the rest of the way.
+#define CLICKSYNTH_DECAY_LENGTHS 5
+
+// Rise at the start, so a ping doesn't start on a step. About 0.3 ms.
+#define CLICKSYNTH_ATTACK_US 300
+
+// Longest decay a voice can have, which keeps a sound to under 25 KB at 48 kHz
+#define CLICKSYNTH_MAX_DECAY_MS 50
+
+// Width of the band a noise burst is filtered to, as the filter's Q
+#define CLICKSYNTH_NOISE_Q 2.0f
+
+
+namespace AudioLib {
+
+enum ClickSynthShape_t {
+  CS_Ping,   // A sine wave at the pitch
+  CS_Noise   // White noise, band-passed around the pitch
+};
+
+
+// One synthesized click sound
+class ClickSynthVoice {
+public:
+  ClickSynthVoice(ClickSynthShape_t _shape = CS_Ping, float _pitchHz = 1000, float _decayMs = 10):
+    shape(_shape),
+    pitchHz(_pitchHz),
+    decayMs(_decayMs) {}
+
+  ClickSynthShape_t shape;
+  float pitchHz;
+  float decayMs;  // For the envelope to fall to 1/e, about -9 dB
+};
+
+
+// Makes click sounds from nothing, for when there are no click files to load.
+// Each one is a ping or a burst of noise with an exponential decay, rendered
+// once, as 16-bit mono, into memory of the caller's. From then on it's a sample
+// like any other, so it costs no more to play. A few KB each.
+namespace ClickSynth {
+
+// Frames Render() will write for voice
+uint32_t GetNumFrames(const ClickSynthVoice& voice, uint32_t sampleRate);
+
+// Renders voice into out, which has room for GetNumFrames(). It isn't
+// normalized; that's left to ClickPrep, like any other click. Returns the number
+// of frames written, 0 if the voice makes no sense (no pitch, or one above
+// Nyquist).
+uint32_t Render(const ClickSynthVoice& voice, uint32_t sampleRate, int16_t *out);
+
+} // namespace ClickSynth
+} // namespace AudioLib
+
+#endif
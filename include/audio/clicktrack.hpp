@@ -0,0 +1,163 @@
+#ifndef __CLICKTRACK_HPP___
+#define __CLICKTRACK_HPP___
+
+#include <stdint.h>
+
+#include "audio/tempomap.hpp"
+
+
+// 4/4 unless told otherwise
+#define CLICKTRACK_DEFAULT_BEATS_PER_BAR 4
+
+// Straight eighths. 66 is a triplet feel, 75 is a dotted-eighth/sixteenth feel.
+#define CLICKTRACK_DEFAULT_SWING 50
+#define CLICKTRACK_MIN_SWING 50
+#define CLICKTRACK_MAX_SWING 75
+
+#define CLICKTRACK_MAX_EVENTS_PER_BEAT 4
+
+// Level 0 is the beat itself, level 1 is eighths/triplets, level 2 is sixteenths.
+#define CLICKTRACK_NUM_LEVELS 3
+
+// Subdivisions are quieter than the beat unless a song says otherwise. In percent
+// of the beat's level.
+#define CLICKTRACK_DEFAULT_LEVEL_1_PERCENT 70
+#define CLICKTRACK_DEFAULT_LEVEL_2_PERCENT 50
+
+
+namespace AudioLib {
+
+enum Subdivision_t {
+  SD_None,
+  SD_Eighths,
+  SD_Triplets,
+  SD_Sixteenths,
+};
+
+
+// One click to be played, as handed back by ClickTrack::NextEventInBlock().
+class ClickEvent {
+public:
+  ClickEvent():
+    frameOffset(0),
+    beatInBar(0),
+    level(0),
+    gain(1) {}
+
+  uint32_t frameOffset;  // Offset within the block
+  uint8_t beatInBar;     // 0 is the downbeat
+  uint8_t level;         // 0 is the beat, higher levels are finer subdivisions
+  float gain;
+};
+
+
+// Works out where each click lands in the output stream. Everything is done in
+// frames (one sample per channel) rather than milliseconds. The beat period is
+// held as a 32.32 fixed-point frame count and accumulated into a 64-bit phase,
+// so fractional tempos (e.g. 128.5 BPM) are exact to within 2^-32 frames per
+// beat. That's well under a frame of drift over days of playback.
+//
+// Subdivisions come from a small table of offsets within the beat, built when
+// the tempo or pattern changes. Playback just walks the table.
+//
+// A TempoMap can supply the beat length (and meter) beat by beat instead, for
+// songs that change tempo part way through.
+class ClickTrack {
+public:
+  ClickTrack();
+  virtual ~ClickTrack() {}
+
+  // Start clicking at the given tempo. The first beat is at startFrame. If there's
+  // a tempo map, it's followed from its first bar instead.
+  void Start(float _bpm, uint64_t startFrame);
+  void Stop();
+
+  // Change the tempo without moving the current beat or restarting the bar. The
+  // next beat comes one new beat length after the current one started. Stops
+  // following the tempo map. Starts the click if it isn't running.
+  void ChangeTempo(float _bpm, uint64_t frame);
+
+  // Re-anchor the beat grid on a beat that has already happened (e.g. a trigger
+  // hit). The anchor is treated as a downbeat, and the next click will be the
+  // first subdivision (or beat) after it. A tempo map goes back to its first bar.
+  void Restart(uint64_t anchor);
+
+  // Takes effect on the next Start() or Restart(). Until then the current tempo
+  // holds. The map isn't copied, so it has to stay put until it's replaced. NULL
+  // goes back to a steady tempo.
+  void SetTempoMap(const TempoMap *_tempoMap);
+
+  // The next beat will be treated as a downbeat.
+  void SetBeatsPerBar(uint8_t _beatsPerBar);
+  uint8_t GetBeatsPerBar() const { return beatsPerBar; }
+
+  // Rebuilds the event table. swing is the percentage of the beat (or of each
+  // half beat, for sixteenths) before the off-beat click, and only applies to
+  // eighths and sixteenths. Takes effect at the start of the next beat.
+  void SetPattern(Subdivision_t _subdivision, uint8_t _swing);
+  Subdivision_t GetSubdivision() const { return subdivision; }
+
+  // Gain for every click at level. The beat (level 0) is 1 unless it's changed.
+  // Takes effect from the next click.
+  void SetLevelGain(uint8_t level, float gain);
+
+  bool Running() const { return beatIncrement != 0; }
+  float GetBPM() const { return bpm; }
+
+  // If a click falls within [blockStart, blockStart + blockFrames), returns true
+  // and fills in *event. Call repeatedly until it returns false to collect every
+  // click in the block.
+  bool NextEventInBlock(uint64_t blockStart, uint32_t blockFrames, ClickEvent *event);
+
+  // Clicks NextEventInBlock() passed over because they were already due, since
+  // the track was made
+  uint32_t GetSkippedEvents() const { return skippedEvents; }
+
+  // Fractions of a beat at which the pattern's clicks fall, and their levels.
+  // Returns the number of clicks per beat. Exposed so the timing can be checked
+  // independently of the table.
+  static uint8_t GetPatternFractions(Subdivision_t _subdivision, uint8_t _swing, double *fractions, uint8_t *levels);
+
+private:
+  class PatternEvent {
+  public:
+    uint32_t fraction;    // Of the beat, 0.32 fixed point
+    uint64_t phaseOffset; // From the start of the beat, 32.32 fixed point
+    uint8_t level;
+  };
+
+  uint64_t nextEventFrame() const;
+  void advanceEvent();
+  void buildEventTable();
+  void updateEventOffsets();
+  void startSegment(uint32_t idx);
+
+  float bpm;
+  uint64_t anchorFrame;
+
+  // Frames per beat, and the start of the current beat relative to anchorFrame,
+  // both in 32.32 fixed point.
+  uint64_t beatIncrement;
+  uint64_t beatPhase;
+
+  uint8_t beatsPerBar;
+  uint8_t beatInBar;
+
+  Subdivision_t subdivision;
+  uint8_t swing;
+  float levelGains[CLICKTRACK_NUM_LEVELS];
+
+  PatternEvent events[CLICKTRACK_MAX_EVENTS_PER_BEAT];
+  uint8_t numEvents;
+  uint8_t nextEvent;
+
+  const TempoMap *tempoMap;
+  uint32_t segmentIdx;
+  uint32_t segmentBeatsLeft; // 0 in the last segment
+
+  uint32_t skippedEvents;
+};
+
+} // namespace AudioLib
+
+#endif
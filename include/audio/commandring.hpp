@@ -0,0 +1,110 @@
+#ifndef __COMMANDRING_HPP___
+#define __COMMANDRING_HPP___
+
+#include <atomic>
+#include <stdint.h>
+
+
+namespace AudioLib {
+
+// A fixed-capacity, lock-free queue for passing commands to the audio task.
+// Any number of tasks may push; only one task (the audio task) may pop.
+// Commands are copied in and out by value, so the sender's stack can go away
+// as soon as Push() returns. Push() never blocks: if the ring is full the
+// command is dropped and counted.
+//
+// This is the bounded queue from Dmitry Vyukov: every cell carries a sequence
+// number that tells producers and the consumer whose turn it is to use it.
+template <class T, uint32_t capacity>
+class CommandRing {
+  static_assert(capacity >= 2 && (capacity & (capacity - 1)) == 0, "CommandRing capacity must be a power of two");
+
+public:
+  CommandRing():
+    enqueuePos(0),
+    dequeuePos(0),
+    highWater(0),
+    dropped(0) {
+    for (uint32_t i = 0; i < capacity; i++) {
+      cells[i].sequence.store(i, std::memory_order_relaxed);
+    }
+  }
+
+  virtual ~CommandRing() {}
+
+  bool Push(const T& item) {
+    Cell *cell;
+    uint32_t pos = enqueuePos.load(std::memory_order_relaxed);
+    while (true) {
+      cell = &cells[pos & mask];
+      uint32_t seq = cell->sequence.load(std::memory_order_acquire);
+      int32_t diff = static_cast<int32_t>(seq - pos);
+      if (diff == 0) {
+        // The cell is free. Try to claim it.
+        if (enqueuePos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+          break;
+        }
+      } else if (diff < 0) {
+        // The consumer hasn't freed this cell yet, so we're full.
+        dropped.fetch_add(1, std::memory_order_relaxed);
+        return false;
+      } else {
+        // Another producer got here first.
+        pos = enqueuePos.load(std::memory_order_relaxed);
+      }
+    }
+
+    cell->data = item;
+    cell->sequence.store(pos + 1, std::memory_order_release);
+
+    // Racy when two producers push at once, but it's only a statistic.
+    uint32_t depth = GetDepth();
+    if (depth > highWater.load(std::memory_order_relaxed)) {
+      highWater.store(depth, std::memory_order_relaxed);
+    }
+
+    return true;
+  }
+
+  // Only to be called from the consumer task.
+  bool Pop(T *item) {
+    uint32_t pos = dequeuePos.load(std::memory_order_relaxed);
+    Cell *cell = &cells[pos & mask];
+    uint32_t seq = cell->sequence.load(std::memory_order_acquire);
+    if (static_cast<int32_t>(seq - (pos + 1)) < 0) {
+      // Empty, or a producer has claimed the cell but not finished writing it.
+      return false;
+    }
+
+    *item = cell->data;
+    cell->sequence.store(pos + capacity, std::memory_order_release);
+    dequeuePos.store(pos + 1, std::memory_order_relaxed);
+    return true;
+  }
+
+  uint32_t GetCapacity() const { return capacity; }
+  uint32_t GetDepth() const { return enqueuePos.load(std::memory_order_relaxed) - dequeuePos.load(std::memory_order_relaxed); }
+  uint32_t GetHighWater() const { return highWater.load(std::memory_order_relaxed); }
+  uint32_t GetDropped() const { return dropped.load(std::memory_order_relaxed); }
+
+private:
+  class Cell {
+  public:
+    std::atomic<uint32_t> sequence;
+    T data;
+  };
+
+  static const uint32_t mask = capacity - 1;
+
+  Cell cells[capacity];
+
+  std::atomic<uint32_t> enqueuePos;
+  std::atomic<uint32_t> dequeuePos;
+
+  std::atomic<uint32_t> highWater;
+  std::atomic<uint32_t> dropped;
+};
+
+} // namespace AudioLib
+
+#endif
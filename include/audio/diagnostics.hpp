@@ -0,0 +1,90 @@
+#ifndef __DIAGNOSTICS_HPP___
+#define __DIAGNOSTICS_HPP___
+
+namespace AudioLib {
+
+class StreamWav;
+
+// Checks and benchmarks for the audio code, which log what they find. Some take
+// many seconds, so they're only run when asked for, from the console (see
+// AudioComp::RunDiagnostics()), never at boot.
+namespace Diagnostics {
+
+// Runs the click scheduler against a simulated output stream for tempos from
+// 30 to 300 BPM (including fractional ones), with and without subdivisions, and
+// logs how far any click landed from its ideal frame position. Also checks the
+// drift over a five minute song, and that a tempo map with a ramp and a meter
+// change is followed beat for beat. Pure arithmetic; no audio is produced.
+void MeasureClickJitter();
+
+// Feeds recorded tap sequences (steady, with flams and missed beats, with beats
+// tapped at half time, and speeding up) to TapTempo, and checks the tempo it
+// comes up with.
+void CheckTapTempo();
+
+// Times the mixer kernel on 1 to 4 voices at 44.1 kHz stereo, and logs how much of
+// each block's real time it takes, next to the float volume loop it replaced.
+// Also checks the kernel in use against the portable one, that it clips rather
+// than wrapping at high gain, and that the volume curve only ever goes up. Then
+// plays a click through eighths and sixteenths, and checks it's only baked once
+// for each gain it's played at.
+void BenchmarkMixer();
+
+// Converts tones from 22.05 and 48 kHz to the output rate, and checks the
+// result against the ideal tone: its length, level, and the noise and distortion
+// that came with it. Then times how long a second of each takes to convert.
+void CheckResampler();
+
+// Runs the .wav parser over a corpus of files built in memory: every format it
+// takes, the extra chunks DAWs add, and broken and cut-off files it has to turn
+// down. Then damages thousands of copies at random, checking that whatever it
+// accepts stays inside the file, and times parsing and conversion.
+void CheckWavParser();
+
+// Trims, normalizes and fades made-up clicks (mono, stereo, quiet, full scale,
+// too long and silent), and checks where they start and end and how loud they
+// come out.
+void CheckClickPrep();
+
+// Synthesizes pings and noise bursts, and checks their length, pitch and decay,
+// that nothing is rendered for a pitch the output rate can't carry, and that a
+// bank loaded from a directory with no files in it still has the built-in voice,
+// in a few KB.
+void CheckClickSynth();
+
+// Writes more click files into dirName than the SD card can have open at once,
+// loads them through a ClickBank, and checks every one of them made it in and
+// that a file can still be opened afterwards. Then deletes them, and dirName.
+void CheckClickBankFiles(const char *dirName);
+
+// Records a steady run of clicks, swinging either side of the beat, into
+// LatencyStats, and checks they land in the right buckets, that the windows
+// roll over, and that it costs well under 1% of the audio task's time.
+void CheckLatencyStats();
+
+// Renders a short set (a count-in, subdivisions, and a tempo map with a meter
+// change and a ramp) with OfflineRenderer, and checks it against a stored render
+// of it: the number of clicks, the frame each one starts at, and every sample.
+// Also checks it's at least 20 times faster than real time.
+void CheckOfflineRender();
+
+// Encodes a run of clicks, mono and stereo, as IMA ADPCM, and checks how much
+// is lost against how much memory is saved. Times decoding a block, and mixing
+// ADPCM against 16-bit. Then checks that the same ADPCM read from a .wav file
+// decodes the same, and that the mixer plays it on two voices at once exactly
+// as it plays the decoded samples.
+void CheckAdpcm();
+
+// Plays fileName all the way through stream the way the player would, one block at
+// a time but at twice real time, and checks that every frame arrived with no
+// underruns and that the audio task never had to wait. Meant for a long file
+// (60 MB is about six minutes), so it takes a while. It opens the file and plays
+// it on the calling task, which it has to itself the whole time. Run from the
+// audio task, that means no click, and file I/O on that task. Nothing else may
+// open or play stream while this runs.
+void CheckStreamWav(StreamWav *stream, const char *fileName);
+
+} // namespace Diagnostics
+} // namespace AudioLib
+
+#endif
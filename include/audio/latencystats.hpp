@@ -0,0 +1,124 @@
+#ifndef __LATENCYSTATS_HPP___
+#define __LATENCYSTATS_HPP___
+
+#include <atomic>
+#include <stdint.h>
+
+
+// Buckets in each histogram. The first and last also take everything below and
+// above the range.
+#define HISTOGRAM_BUCKETS 32
+
+// Histograms cover the last 30 to 60 seconds. Each window is started afresh
+// when the one before it is this old.
+#define LATENCYSTATS_WINDOW_SECONDS 30
+
+// Clicks kept, newest first, with all their times
+#define LATENCYSTATS_RECENT_CLICKS 16
+
+
+namespace AudioLib {
+
+// Counts of values in equal-width buckets, starting from low.
+class Histogram {
+public:
+  Histogram(int32_t _low = 0, int32_t _bucketWidth = 1);
+
+  void Add(int32_t value);
+  void Add(const Histogram& other);
+  void Clear();
+
+  int32_t GetBucketLow(uint8_t bucket) const { return low + bucket * bucketWidth; }
+  int32_t GetBucketWidth() const { return bucketWidth; }
+  uint32_t GetCount(uint8_t bucket) const { return counts[bucket]; }
+  uint32_t GetTotal() const;
+
+  // Top of the bucket that fraction (0 to 1) of the values are in or below
+  int32_t GetPercentile(float fraction) const;
+
+private:
+  int32_t low;
+  int32_t bucketWidth;
+  uint32_t counts[HISTOGRAM_BUCKETS];
+};
+
+
+// When one click was meant to be heard, went to the DMA, and was heard. Times
+// are the low 32 bits of esp_timer_get_time().
+class ClickTiming {
+public:
+  ClickTiming():
+    scheduledUs(0),
+    submittedUs(0),
+    heardUs(0) {}
+
+  uint32_t scheduledUs;  // Where it falls on the beat grid
+  uint32_t submittedUs;  // When its block was handed to the driver
+  uint32_t heardUs;      // As worked out from where the DMA had got to
+};
+
+
+// How well the clicks are landing, for finding out after a gig whether any were
+// late. The audio task records every click and every block, which costs a few
+// adds. Any task can read the results, or have them written out as CSV. They're
+// only statistics, so a reader may catch a histogram part way through a block.
+class LatencyStats {
+public:
+  enum Histogram_t {
+    LH_Jitter,      // Change in lateness from one click to the next, us
+    LH_Lateness,    // Heard less scheduled, us
+    LH_QueueDepth,  // Frames waiting in the DMA after each block was written
+    LH_NumHistograms
+  };
+
+  LatencyStats();
+  virtual ~LatencyStats() {}
+
+  // From the audio task only
+  void RecordClick(const ClickTiming& timing);
+  void RecordMissedClicks(uint32_t count);
+  void RecordBlock(uint64_t framePosition, uint32_t queuedFrames);
+
+  // The next click's lateness is measured against a new grid, so it isn't jitter.
+  void Reanchor() { reanchored = true; }
+
+  // From any task. The audio task does the clearing, at its next block.
+  void Clear() { clearRequested.store(true, std::memory_order_relaxed); }
+
+  // Both windows added together
+  void GetHistogram(Histogram_t histogram, Histogram *out) const;
+  static const char* GetHistogramName(Histogram_t histogram);
+
+  uint32_t GetClicks() const { return clicks.load(std::memory_order_relaxed); }
+  uint32_t GetMissedClicks() const { return missedClicks.load(std::memory_order_relaxed); }
+  int32_t GetMaxLatenessUs() const { return maxLatenessUs.load(std::memory_order_relaxed); }
+
+  // Newest first. Returns how many there are, up to LATENCYSTATS_RECENT_CLICKS.
+  uint8_t GetRecentClicks(ClickTiming *out) const;
+
+  // One line at a time, without the newline: every histogram bucket, then the
+  // counters passed in with ours, then the recent clicks.
+  typedef void (*LineWriter)(const char *line);
+  void WriteCsv(LineWriter writeLine, uint32_t underruns, uint32_t queueOverflows) const;
+
+private:
+  static Histogram makeHistogram(Histogram_t histogram);
+  void clear();
+
+  Histogram windows[2][LH_NumHistograms];
+  uint8_t window;           // Being added to. The other is the one before.
+  uint64_t windowEndFrame;
+
+  ClickTiming recent[LATENCYSTATS_RECENT_CLICKS];
+  std::atomic<uint32_t> clicks;
+  std::atomic<uint32_t> missedClicks;
+  std::atomic<int32_t> maxLatenessUs;
+  int32_t lastLatenessUs;
+  bool reanchored;
+  std::atomic<bool> clearRequested;
+};
+
+
+} // namespace AudioLib
+
+#endif
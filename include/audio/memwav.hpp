@@ -10,13 +10,18 @@
 namespace AudioLib {
 
 // This class keeps a small .wav file in memory for quick
-// repeated playback. It's used for the click sound.
+// repeated playback. It's used for the click sound. Whatever format the file
+// is in, it's turned into 16-bit at the output rate as it's loaded. Mono stays
+// mono, and so does stereo with the same thing in both channels, since the
+// player can spread it to both sides for free.
 class MemWav : public AudioDataInterface {
 public:
   MemWav();
   virtual ~MemWav();
 
-  bool InitFromFile(const char *fileName);
+  // A file at another rate than outputRate is resampled to it here, once, so it
+  // plays at the right pitch. 0 leaves it at its own rate.
+  bool InitFromFile(const char *fileName, uint32_t outputRate);
   bool Valid() { return valid; }
 
   // AudioDataInterface methods
@@ -24,16 +29,26 @@ public:
   virtual void Restart() {} // Nothing to do, since we always return the entire set of samples
   virtual uint32_t GetSampleRate();
   virtual uint16_t GetBitsPerSample();
+  virtual uint16_t GetNumChannels() { return numChannels; }
   virtual const AudioSamples* GetSamples();
 
 private:
   bool readFromFile(const char *fileName);
+  int16_t* convert(uint32_t numFrames);
+  bool resample(uint32_t outputRate);
 
   std::unique_ptr<uint8_t[]> wavBuf;
   uint32_t wavBufLen;
+  uint32_t wavBufSize;  // Allocated. Kept for the next file, if it fits.
+
+  std::unique_ptr<int16_t[]> canonical;  // The samples as 16-bit, if the file wasn't
+  uint32_t canonicalSize;                // In samples, allocated
+  std::unique_ptr<int16_t[]> converted;  // The samples, at the output rate
+  uint32_t convertedSize;                // In samples, allocated
+  uint32_t sampleRate;
+  uint16_t numChannels;                  // As played: 1 or 2
 
   WavHeader wavHeader;
-  WavData wavData;
 
   bool valid;
 
@@ -0,0 +1,227 @@
+#ifndef __MIXER_HPP___
+#define __MIXER_HPP___
+
+#include <atomic>
+#include <memory>
+#include <stdint.h>
+
+#include "audio/adpcm.hpp"
+#include "audio/audiodata.hpp"
+#include "audio/mixkernel.hpp"
+
+
+// Everything is mixed at a single rate, one block at a time, which is what the
+// I2S bus is fed.
+#define PLAYER_SAMPLE_RATE 44100
+#define PLAYER_CHANNELS 2
+#define PLAYER_BLOCK_FRAMES 256
+
+// Max number of sources that can be started within a single block
+#define PLAYER_MAX_PENDING_STARTS 4
+
+// Copies of sources that can be kept with their gain already applied (see
+// Mixer::Bake()). A click standing in for every level of the click track needs
+// one for each level.
+#define PLAYER_MAX_BAKED_COPIES 6
+
+
+namespace AudioLib {
+
+// Each voice plays one source at a time, and all of them are mixed together.
+// Starting a source on a voice cuts off whatever that voice was playing.
+enum MixerVoice_t {
+  MV_Click,
+  MV_Accent,
+  MV_Backing,
+  MV_Cue,
+  MV_NumVoices
+};
+
+
+// Mixes the voices into blocks of 16-bit stereo. It knows nothing about where the
+// blocks go: Player sends them to the I2S bus, and OfflineRenderer to a file or
+// memory, so both sound exactly the same. Nothing here touches the hardware.
+//
+// Sources can also be IMA ADPCM, in blocks of ADPCM_BLOCK_BYTES_PER_CHANNEL per
+// channel (see ImaAdpcm), which take a quarter of the memory. Each voice decodes
+// the next block as it gets to it, into a buffer of its own, so the same source
+// can be playing on more than one voice.
+class Mixer {
+public:
+  Mixer();
+  virtual ~Mixer();
+
+  // Start playing playThis on the given voice, frameOffset frames into the next
+  // block rendered. gain is applied on top of the voice's gain and the volume.
+  bool Play(AudioDataInterface* _playThis, uint32_t frameOffset = 0, float gain = 1, MixerVoice_t voice = MV_Click);
+
+  // Start over playing the last source started
+  bool Replay(uint32_t frameOffset = 0);
+
+  // Silence a voice, from the start of the next block.
+  void Stop(MixerVoice_t voice);
+
+  // Silence every voice playing source. Has to be done before a source's samples
+  // are freed or reloaded, since they're played in place.
+  void Stop(AudioDataInterface *source);
+
+  // Check that source can be played. Sources are mixed straight out of their own
+  // memory, so there's nothing to allocate. Call once when the source is loaded.
+  // Mono sources are kept mono, and spread to both channels as they're mixed.
+  // ADPCM has to be in memory, in a single chunk of whole blocks.
+  bool Prepare(AudioDataInterface* source);
+
+  // Keep copies of source with its gain applied, and play whichever one has the
+  // gain wanted, so starting it is just pointing a voice at it. For short sources
+  // played over and over, like clicks. numGains is how many different gains it's
+  // played at (a click standing in for the subdivisions too has one per level),
+  // since with too few copies it would be baked again every time the gain
+  // changed. source has to be 16-bit, in memory, in a single chunk, so not ADPCM.
+  //
+  // This allocates, so call it when source is loaded. If source already has
+  // numGains copies it does nothing, so it's fine to call it again while source
+  // is playing. Otherwise source is stopped. Call it again if source is
+  // reloaded. A mono source stays mono, so it only plays baked while it's panned
+  // to the centre. reserveSamples makes room for at least that many in each copy,
+  // so whatever is baked in its place later doesn't have to allocate if it's no
+  // bigger.
+  bool Bake(AudioDataInterface* source, uint32_t reserveSamples = 0, uint8_t numGains = 1);
+
+  // Stop keeping baked copies of source. Their memory is kept for the next
+  // Bake(). source has to be stopped first.
+  void Unbake(AudioDataInterface* source);
+
+  // Times a baked copy has had its gain applied. That happens the first time
+  // it's played at a gain, and again after the volume changes.
+  uint32_t GetBakeCount() const { return bakeCount.load(std::memory_order_relaxed); }
+
+  // 0 to 1. This is a position on the volume curve (see volumecurve.hpp), so
+  // equal changes sound equally loud anywhere on the scale.
+  float GetVolume() const { return volume; }
+  float SetVolume(float _volume);
+
+  // Level and stereo position of a voice. pan is -1 (left) to 1 (right).
+  void SetVoiceGain(MixerVoice_t voice, float gain);
+  void SetVoicePan(MixerVoice_t voice, float pan);
+
+  // Frame number of the first frame in the next block to be rendered. This is
+  // the clock everything else schedules against.
+  uint64_t GetFramePosition() const { return framePosition; }
+
+  // Mixes the next block, PLAYER_BLOCK_FRAMES frames of interleaved stereo, and
+  // moves the frame position on. The block is ours, and good until the next call.
+  // Silence when nothing is playing. Call it from the one task.
+  const int16_t* RenderBlock();
+
+private:
+  class PendingStart {
+  public:
+    AudioDataInterface *source;
+    uint32_t frameOffset;
+    float gain;
+    MixerVoice_t voice;
+  };
+
+  class BakedSource {
+  public:
+    BakedSource():
+      source(NULL),
+      original(NULL),
+      numFrames(0),
+      numChannels(2),
+      capacitySamples(0),
+      gainL(0),
+      gainR(0),
+      baked(false),
+      lastUsed(0) {}
+
+    AudioDataInterface *source;
+    const int16_t *original;   // The source's own samples
+    std::unique_ptr<int16_t[]> samples;
+    uint32_t numFrames;
+    uint8_t numChannels;
+    uint32_t capacitySamples;  // Allocated. Kept for whatever is baked next.
+    int16_t gainL;            // Applied to samples
+    int16_t gainR;
+    bool baked;
+    uint32_t lastUsed;         // When it was last started, in Mixer::bakedStarts
+  };
+
+  class Voice {
+  public:
+    Voice():
+      source(NULL),
+      baked(NULL),
+      samples(NULL),
+      numFrames(0),
+      position(0),
+      numChannels(2),
+      startGain(1),
+      gain(1),
+      pan(0),
+      waiting(false),
+      encoded(NULL),
+      numBlocks(0),
+      nextBlock(0) {}
+
+    bool Playing() const { return position < numFrames; }
+
+    AudioDataInterface *source;
+    BakedSource *baked;  // Playing from this, at unity gain
+    const int16_t *samples;
+    uint32_t numFrames;
+    uint32_t position;   // Next frame to be mixed
+    uint8_t numChannels; // Of samples
+
+    float startGain;    // From Play()
+    float gain;         // From SetVoiceGain()
+    float pan;
+
+    // The source has more to come, but it isn't ready yet. The voice is silent
+    // until it is, and picks up where it left off.
+    bool waiting;
+
+    // An ADPCM source, and where the voice has got to in it. samples points at
+    // decoded, which holds the block being played.
+    const uint8_t *encoded;
+    uint32_t numBlocks;
+    uint32_t nextBlock;
+    int16_t decoded[ADPCM_FRAMES_PER_BLOCK * PLAYER_CHANNELS];
+  };
+
+  void renderFrames(int16_t *out, uint32_t numFrames);
+  bool startSource(const PendingStart& start);
+  void nextChunk(Voice& voice);
+  bool takeChunk(Voice& voice);
+  static bool decodeBlock(Voice& voice);
+  void updateGains();
+  static int16_t applyMasterGain(int16_t gain, int32_t masterGain);
+  uint8_t countBaked(AudioDataInterface *source, const int16_t *original, uint32_t numFrames, uint8_t numChannels) const;
+  BakedSource* findFreeBaked(uint32_t numSamples);
+  bool bakedPlaying(const BakedSource *baked) const;
+  void useBaked(MixerVoice_t v);
+  void logBakes();
+
+  Voice voices[MV_NumVoices];
+  MixSource mixSources[MV_NumVoices];
+  MixSource voiceGains[MV_NumVoices];  // Gains mixSources would have without baking
+  MixerVoice_t lastVoice;
+  float volume;
+  int16_t volumeGain;  // Q15, from the volume curve
+
+  BakedSource bakedSources[PLAYER_MAX_BAKED_COPIES];
+  uint32_t bakedStarts;
+  std::atomic<uint32_t> bakeCount;
+  uint32_t loggedBakeCount;
+  uint64_t nextBakeLogFrame;
+
+  PendingStart pendingStarts[PLAYER_MAX_PENDING_STARTS];
+  uint8_t numPendingStarts;
+
+  int16_t block[PLAYER_BLOCK_FRAMES * PLAYER_CHANNELS] __attribute__((aligned(16)));
+  uint64_t framePosition;
+};
+
+} // namespace AudioLib
+
+#endif
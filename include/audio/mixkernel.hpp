@@ -0,0 +1,69 @@
+#ifndef __MIXKERNEL_HPP___
+#define __MIXKERNEL_HPP___
+
+#include <stdint.h>
+
+
+// Gains are 4.12 fixed point. Capping them at 4.0 means the sum of
+// MIXKERNEL_MAX_SOURCES full-scale products always fits in 32 bits, so the
+// accumulator never wraps and only the final conversion has to saturate.
+#define MIXKERNEL_MAX_SOURCES 4
+#define MIXKERNEL_GAIN_BITS 12
+#define MIXKERNEL_UNITY_GAIN (1 << MIXKERNEL_GAIN_BITS)
+#define MIXKERNEL_MAX_GAIN (4 << MIXKERNEL_GAIN_BITS)
+
+// The ESP32-S3 PIE (SIMD) kernel is opt-in. Build with -DMIXKERNEL_USE_PIE=1 to
+// use it, and check it against the portable one with the mixer benchmark.
+#ifndef MIXKERNEL_USE_PIE
+#define MIXKERNEL_USE_PIE 0
+#endif
+
+
+namespace AudioLib {
+
+// One input to the mixer: 16-bit mono, or interleaved stereo, with a gain per
+// output channel. Mono goes to both sides, so it only needs half the memory.
+class MixSource {
+public:
+  MixSource():
+    samples(0),
+    gainL(0),
+    gainR(0),
+    numChannels(2) {}
+
+  const int16_t *samples;
+  int16_t gainL;
+  int16_t gainR;
+  uint8_t numChannels;  // 1 or 2
+};
+
+
+namespace MixKernel {
+
+// Sums numSources sources into out, numFrames stereo frames long. Every source
+// has to have at least numFrames frames left. Products are summed at 32 bits and
+// saturated back to 16 bits once, at the end. Mono sources are spread to both
+// channels here, rather than being stored twice.
+void Mix(int16_t *out, const MixSource *sources, uint8_t numSources, uint32_t numFrames);
+
+// Plain C version. Mix() uses this when there's no SIMD kernel, and for any
+// frames left over at the end of a SIMD block.
+void MixPortable(int16_t *out, const MixSource *sources, uint8_t numSources, uint32_t numFrames);
+
+// Copies numFrames of mono into both channels of out, which has to be frame (4
+// byte) aligned. What Mix() comes to for one mono source at unity gain.
+void ExpandMono(int16_t *out, const int16_t *in, uint32_t numFrames);
+
+// Applies gain to numSamples samples, with no mixing, saturating.
+void Scale(int16_t *out, const int16_t *in, int16_t gain, uint32_t numSamples);
+
+// For logging
+const char* GetName();
+
+// Float gain to 4.12, clamped to [0, MIXKERNEL_MAX_GAIN].
+int16_t GainToFixed(float gain);
+
+} // namespace MixKernel
+} // namespace AudioLib
+
+#endif
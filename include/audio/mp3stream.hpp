@@ -0,0 +1,129 @@
+#ifndef __MP3STREAM_HPP___
+#define __MP3STREAM_HPP___
+
+#include <atomic>
+#include <memory>
+#include <stdio.h>
+
+#include <freertos/FreeRTOS.h>
+#include <freertos/semphr.h>
+#include <freertos/task.h>
+
+#include "audio/audiodata.hpp"
+#include "audio/pcmring.hpp"
+#include "audio/resampler.hpp"
+
+
+// Decoded audio waiting to be played. ~370 ms at 44.1 kHz.
+#define MP3STREAM_RING_FRAMES 16384
+
+// Compressed data read from the card at a time. Comfortably more than the largest
+// MP3 frame (1441 bytes at 320 kbps).
+#define MP3STREAM_INPUT_BUFFER_SIZE 4096
+
+// An MPEG-1 Layer III frame decodes to 1152 samples per channel.
+#define MP3STREAM_MAX_FRAME_SAMPLES 1152
+
+// Most handed to the player at a time. The decoder can't refill the part of the
+// ring the player is holding, so keep it small.
+#define MP3STREAM_CHUNK_FRAMES 1024
+
+
+namespace AudioLib {
+
+// Plays an MP3 file off the SD card. A decoder task on core 0 reads and decodes it
+// into a PcmRing, and the audio task on core 1 mixes straight out of the ring, so
+// all it ever does is move a read position. Mono files are spread to both
+// channels as they're decoded, and files at another rate are resampled.
+//
+// The decoder keeps its state in globals, so there can only be one of these.
+class Mp3Stream : public AudioStreamInterface {
+public:
+  Mp3Stream();
+  virtual ~Mp3Stream();
+
+  // Opens fileName and decodes enough to fill the ring. Not for the audio task,
+  // and the stream mustn't be playing.
+  virtual bool Open(const char *fileName, uint32_t outputRate);
+  bool Valid() { return valid; }
+
+  virtual StreamStats GetStats() const;
+
+  // AudioDataInterface methods. These are for the audio task, and never block.
+  virtual bool HasMoreData();
+  virtual void Restart();
+  virtual uint32_t GetSampleRate();
+  virtual uint16_t GetBitsPerSample() { return 16; }
+  virtual uint16_t GetNumChannels() { return 2; }
+  virtual const AudioSamples* GetSamples();
+
+private:
+  bool allocate();
+  bool openFile(const char *fileName);
+  void closeFile();
+  bool resetDecoder();
+
+  static void decoderTaskInit(void *param);
+  void decoderTask();
+  void decode();
+  bool decodeFrame();
+  bool setRate(uint32_t fileRate);
+  void writeFrames(const int16_t *pcm, uint32_t numFrames);
+  void drain();
+  bool fillInput();
+  void logStats();
+
+  bool takeChunk();
+  bool atEnd() const;
+
+  PcmRing ring;
+
+  // Restart() bumps restartSeq. When the decoder sees it, it starts over from the
+  // top of the file, and publishes where in the ring the new audio begins along
+  // with the restartSeq it's for. The audio task skips ahead to there.
+  std::atomic<uint32_t> restartSeq;
+  std::atomic<uint32_t> flushSeq;
+  std::atomic<uint32_t> flushPos;
+  std::atomic<uint32_t> endSeq;  // restartSeq when the decoder hit the end of the file
+
+  // Audio task only
+  uint32_t holdingFrames;  // Handed to the player by GetSamples()
+  bool flushed;            // Skipped ahead for the current restartSeq
+  bool playedSinceRestart;
+  bool starved;
+  AudioSamples samples;
+
+  // Decoder task only (and Open(), under the lock)
+  FILE *file;
+  uint32_t dataStart;  // After any ID3 tag
+  std::unique_ptr<uint8_t[]> input;
+  uint32_t inputPos;
+  uint32_t inputLen;
+  bool endOfFile;
+  std::unique_ptr<int16_t[]> decoded;
+  std::unique_ptr<int16_t[]> resampled;
+  Resampler resampler;
+  uint32_t outputRate;
+  uint32_t decoderSeq;
+  uint32_t nextStatsFrames;
+
+  std::atomic<uint32_t> sampleRate;
+  bool valid;
+
+  std::atomic<uint32_t> underruns;
+  std::atomic<uint32_t> starvedBlocks;
+  std::atomic<uint32_t> minBuffered;
+  std::atomic<uint32_t> workUs;
+  std::atomic<uint32_t> framesDecoded;
+  std::atomic<uint32_t> maxDecodeUs;
+  std::atomic<uint32_t> decodeErrors;
+  uint32_t loggedUnderruns;
+
+  SemaphoreHandle_t fileLock;
+  TaskHandle_t decoderTaskHandle;
+};
+
+
+} // namespace AudioLib
+
+#endif
@@ -0,0 +1,149 @@
+#ifndef __OFFLINERENDERER_HPP___
+#define __OFFLINERENDERER_HPP___
+
+#include <stdint.h>
+#include <stdio.h>
+#include <vector>
+
+#include "audio/audiodata.hpp"
+#include "audio/clicktrack.hpp"
+#include "audio/mixer.hpp"
+#include "audio/tempomap.hpp"
+
+
+// Silence after each song, for the last click to ring out into
+#define OFFLINERENDER_SONG_GAP_MS 2000
+
+// stdio buffer for .wav files. The card is much happier with big writes.
+#define OFFLINERENDER_FILE_BUFFER 16384
+
+
+namespace AudioLib {
+
+// Which of a song's sounds a click gets, like the live click.
+enum RenderClick_t {
+  RC_Normal,
+  RC_Accent,       // The downbeat of each bar
+  RC_Subdivision,  // Between beats
+  RC_NumClicks
+};
+
+
+// One song of a click track to be rendered.
+class RenderSong {
+public:
+  RenderSong():
+    bpm(0),
+    beatsPerBar(CLICKTRACK_DEFAULT_BEATS_PER_BAR),
+    subdivision(SD_None),
+    swing(CLICKTRACK_DEFAULT_SWING),
+    bars(0),
+    countInBars(0) {
+    subdivisionLevels[0] = CLICKTRACK_DEFAULT_LEVEL_1_PERCENT;
+    subdivisionLevels[1] = CLICKTRACK_DEFAULT_LEVEL_2_PERCENT;
+    for (uint8_t c = 0; c < RC_NumClicks; c++) {
+      clicks[c] = NULL;
+    }
+  }
+
+  float bpm;
+  uint8_t beatsPerBar;
+  Subdivision_t subdivision;
+  uint8_t swing;
+
+  // How loud levels 1 and 2 are, in percent of the beat
+  uint8_t subdivisionLevels[CLICKTRACK_NUM_LEVELS - 1];
+  TempoMap tempoMap;   // Empty for a steady tempo
+  uint16_t bars;       // Length of the song, not counting the count-in
+
+  // Bars of beats alone, at bpm, before the song's first bar
+  uint8_t countInBars;
+
+  // In memory, in one chunk. Any but RC_Normal can be NULL, and RC_Normal is
+  // played instead.
+  AudioDataInterface *clicks[RC_NumClicks];
+};
+
+
+// Where rendered audio goes, a block at a time: interleaved 16-bit stereo at
+// PLAYER_SAMPLE_RATE.
+class RenderOutputInterface {
+public:
+  virtual bool Write(const int16_t *frames, uint32_t numFrames) = 0;
+};
+
+
+// All of it kept in memory, for comparing against a known good render.
+class MemoryRenderOutput : public RenderOutputInterface {
+public:
+  MemoryRenderOutput() {}
+  virtual ~MemoryRenderOutput() {}
+
+  const std::vector<int16_t>& GetSamples() const { return samples; }
+  uint32_t GetNumFrames() const { return samples.size() / PLAYER_CHANNELS; }
+
+  virtual bool Write(const int16_t *frames, uint32_t numFrames);
+
+private:
+  std::vector<int16_t> samples;
+};
+
+
+// A 16-bit stereo .wav file. The sizes in the header are filled in by Close().
+class WavFileRenderOutput : public RenderOutputInterface {
+public:
+  WavFileRenderOutput();
+  virtual ~WavFileRenderOutput();
+
+  bool Open(const char *fileName);
+  bool Close();
+
+  virtual bool Write(const int16_t *frames, uint32_t numFrames);
+
+private:
+  bool writeHeader();
+
+  FILE *file;
+  uint32_t dataLen;
+};
+
+
+// Renders click tracks faster than real time, through a Mixer of its own, so it
+// sounds exactly like the live click without getting in the way of it. The
+// ClickTrack places every click, as it does live, so tempo maps, meters and
+// subdivisions come out the same. Every block goes through the same mixing as a
+// block sent to the I2S bus.
+//
+// Nothing here touches the hardware, so it runs on a host as well as on the
+// device. It allocates (for baking each song's clicks), so not from the audio
+// task.
+class OfflineRenderer {
+public:
+  OfflineRenderer() {}
+  virtual ~OfflineRenderer() {}
+
+  void SetVolume(float volume) { mixer.SetVolume(volume); }
+
+  // Each song, count-in and all, followed by OFFLINERENDER_SONG_GAP_MS of
+  // silence. False if output couldn't take it.
+  bool Render(const std::vector<RenderSong>& songs, RenderOutputInterface *output);
+
+  // Rendered so far
+  uint64_t GetNumFrames() const { return mixer.GetFramePosition(); }
+
+private:
+  bool renderSong(const RenderSong& song, RenderOutputInterface *output);
+  bool renderSilence(uint32_t numFrames, RenderOutputInterface *output);
+  void startClick(const RenderSong& song, uint64_t frame, bool countIn);
+  void playClick(const RenderSong& song, const ClickEvent& event);
+  void prepareClicks(const RenderSong& song);
+  void releaseClicks(const RenderSong& song);
+
+  Mixer mixer;
+  ClickTrack clickTrack;
+};
+
+
+} // namespace AudioLib
+
+#endif
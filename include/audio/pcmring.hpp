@@ -0,0 +1,122 @@
+#ifndef __PCMRING_HPP___
+#define __PCMRING_HPP___
+
+#include <atomic>
+#include <memory>
+#include <stdint.h>
+#include <string.h>
+
+
+namespace AudioLib {
+
+// A lock-free ring of interleaved 16-bit stereo frames, for one task producing
+// audio and another playing it. The consumer reads frames in place: it gets a
+// pointer to the next run of frames that don't wrap, and only hands them back
+// once it's done with them. Neither side ever waits on the other.
+//
+// Positions count frames forever and wrap at 2^32, so the capacity has to be a
+// power of two.
+class PcmRing {
+public:
+  PcmRing():
+    capacity(0),
+    mask(0),
+    writePos(0),
+    readPos(0) {}
+
+  virtual ~PcmRing() {}
+
+  // False if the capacity isn't a power of two. May throw std::bad_alloc. Only
+  // while neither side is using the ring.
+  bool Allocate(uint32_t capacityFrames) {
+    if (capacityFrames < 2 || (capacityFrames & (capacityFrames - 1)) != 0) {
+      return false;
+    }
+
+    frames = std::unique_ptr<int16_t[]>(new int16_t[capacityFrames * 2]);
+    capacity = capacityFrames;
+    mask = capacityFrames - 1;
+    Reset();
+    return true;
+  }
+
+  // Empties the ring. Only while neither side is using it.
+  void Reset() {
+    writePos.store(0, std::memory_order_relaxed);
+    readPos.store(0, std::memory_order_relaxed);
+  }
+
+  uint32_t GetCapacity() const { return capacity; }
+
+  // From either side. Exact from the consumer's point of view, and never more
+  // than there really is from the producer's.
+  uint32_t GetReadable() const {
+    return writePos.load(std::memory_order_acquire) - readPos.load(std::memory_order_acquire);
+  }
+
+  // Producer only
+  uint32_t GetWritable() const {
+    return capacity - (writePos.load(std::memory_order_relaxed) - readPos.load(std::memory_order_acquire));
+  }
+
+  // Producer only. Copies in as many frames as there's room for, and publishes
+  // them. Returns how many that was.
+  uint32_t Write(const int16_t *in, uint32_t numFrames) {
+    uint32_t writable = GetWritable();
+    if (numFrames > writable) {
+      numFrames = writable;
+    }
+
+    uint32_t pos = writePos.load(std::memory_order_relaxed);
+    uint32_t start = pos & mask;
+    uint32_t firstPart = capacity - start;
+    if (firstPart > numFrames) {
+      firstPart = numFrames;
+    }
+
+    memcpy(frames.get() + start * 2, in, firstPart * 2 * sizeof(int16_t));
+    memcpy(frames.get(), in + firstPart * 2, (numFrames - firstPart) * 2 * sizeof(int16_t));
+
+    writePos.store(pos + numFrames, std::memory_order_release);
+    return numFrames;
+  }
+
+  // Producer only. Where the next frame written will go, for marking a point in
+  // the stream (see SkipTo()).
+  uint32_t GetWritePos() const { return writePos.load(std::memory_order_relaxed); }
+
+  // Consumer only. The next run of frames, up to the end of the ring. They stay
+  // put until Consume() is called.
+  const int16_t* Peek(uint32_t *numFrames) const {
+    uint32_t pos = readPos.load(std::memory_order_relaxed);
+    uint32_t readable = writePos.load(std::memory_order_acquire) - pos;
+    uint32_t start = pos & mask;
+    uint32_t toEnd = capacity - start;
+
+    *numFrames = readable < toEnd ? readable : toEnd;
+    return frames.get() + start * 2;
+  }
+
+  // Consumer only. Hands numFrames back to the producer.
+  void Consume(uint32_t numFrames) {
+    readPos.store(readPos.load(std::memory_order_relaxed) + numFrames, std::memory_order_release);
+  }
+
+  // Consumer only. Throws away everything before pos, which the producer got
+  // from GetWritePos().
+  void SkipTo(uint32_t pos) {
+    readPos.store(pos, std::memory_order_release);
+  }
+
+private:
+  std::unique_ptr<int16_t[]> frames;
+  uint32_t capacity;
+  uint32_t mask;
+
+  std::atomic<uint32_t> writePos;
+  std::atomic<uint32_t> readPos;
+};
+
+} // namespace AudioLib
+
+#endif
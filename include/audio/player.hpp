@@ -1,49 +1,118 @@
 #ifndef __PLAYER_HPP___
 #define __PLAYER_HPP___
 
-#include <memory>
+#include <atomic>
+
+#include <driver/i2s_types.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
+
+#include "audio/mixer.hpp"
+
+
+// I2S DMA queue. Buffer length is in frames. Everything in the queue is latency,
+// and it's all that stands between the audio task and an underrun. With
+// PLAYER_LOW_LATENCY, which platformio.ini builds with, it holds under 9 ms (15 ms
+// counting the block being rendered), and the audio task has to be back at
+// WriteToDevice() within that. Without it, it holds about 186 ms. The player
+// logs underruns once a minute; if they show up, build without it.
+#ifdef PLAYER_LOW_LATENCY
+#define PLAYER_DMA_BUF_COUNT 3
+#define PLAYER_DMA_BUF_LEN 128
+#else
+#define PLAYER_DMA_BUF_COUNT 8
+#define PLAYER_DMA_BUF_LEN 1024
+#endif
 
-#include "audio/audiodata.hpp"
+// From a frame being rendered to it being heard: a full DMA queue, plus the block
+// being rendered. This is what it should be. The player measures what it is.
+#define PLAYER_OUTPUT_LATENCY_FRAMES (PLAYER_DMA_BUF_COUNT * PLAYER_DMA_BUF_LEN + PLAYER_BLOCK_FRAMES)
 
 
 namespace AudioLib {
 
-class Player {
+// The mixer, feeding the I2S bus. There's just the one, and the audio task is
+// the only one that renders with it.
+class Player : public Mixer {
 private:
   Player();
 
 public:
   virtual ~Player();
 
-  // Start playing the file specified by playThis.
-  bool Play(AudioDataInterface* _playThis);
+  // The frame that was (or will be) coming out of the speaker at timeUs, which is
+  // the low 32 bits of esp_timer_get_time(). Good for times within a half hour
+  // or so of now.
+  uint64_t GetFrameAtTime(uint32_t timeUs) const;
+
+  // And the other way: when frame will be heard, in the same terms.
+  uint32_t GetTimeOfFrame(uint64_t frame) const;
+
+  // From the next frame rendered to it being heard, as measured from the DMA.
+  // PLAYER_OUTPUT_LATENCY_FRAMES until it's measured.
+  static uint32_t GetOutputLatencyUs();
+  uint32_t GetOutputLatencyFrames() const;
+
+  // Times the DMA ran out and played silence, since the first block. A long gap
+  // is one underrun.
+  uint32_t GetUnderruns() const { return underruns.load(std::memory_order_relaxed); }
 
-  // Start over playing the current sample
-  bool Replay();
+  // Buffers of silence the DMA played because nothing was written in time
+  uint32_t GetQueueOverflows() const { return queueOverflows.load(std::memory_order_relaxed); }
 
-  float GetVolume() const { return volume; }
-  float SetVolume(float _volume);
+  // When the last block was handed to the driver, in the same terms as
+  // GetFrameAtTime()
+  uint32_t GetWriteTimeUs() const { return writeTimeUs; }
 
-  // Update the device with more data from playThis. Should be called 
-  // frequently in a loop.
+  // Render the next block and hand it to the I2S driver. Blocks until the DMA
+  // has room for it, which is what paces the audio task. Silence is written when
+  // nothing is playing, so the stream never stops. Call it from the one task.
   bool WriteToDevice();
 
   static void Init(uint8_t bckPin, uint8_t wsPin, uint8_t dataOutPin);
   static Player& GetPlayer();
 
 private:
-  bool processSamples();
-
-  AudioDataInterface *playThis;
-  const AudioSamples *samples;
-
-  std::unique_ptr<uint8_t[]> processedSamples;
-  uint32_t processedSamplesLen;
-  uint32_t processedSamplesTotalLen;
-
-  bool playing;
-  uint32_t samplesIdx;
-  float volume;
+  static int64_t nextBufferFrame(uint64_t written);
+  bool writeBlock(const int16_t *block);
+  void calibrateOutput();
+  void measureOutput(uint64_t writtenBefore, int64_t nowUs);
+  void logOutput();
+
+  static bool onSent(i2s_chan_handle_t channel, i2s_event_data_t *event, void *context);
+  static bool onSendQueueOverflow(i2s_chan_handle_t channel, i2s_event_data_t *event, void *context);
+
+  uint64_t nextOutputLogFrame;
+
+  // When the last block was handed to the driver
+  uint32_t writeTimeUs;
+
+  // What the DMA callbacks have seen. They run in the I2S interrupt, so all they
+  // do is count, note the time, and wake the task that's writing.
+  i2s_chan_handle_t txChannel;
+  std::atomic<TaskHandle_t> writerTask;
+  std::atomic<uint32_t> buffersSent;
+  std::atomic<uint32_t> lastSentUs;      // When the last one finished
+  std::atomic<uint32_t> queueOverflows;  // Each one is a buffer of silence
+  std::atomic<uint32_t> sentAtOverflow;
+
+  // Where the DMA has got to. anchorFrame (on the same scale as GetFramePosition())
+  // starts playing once anchorSent buffers have been sent. It moves at each
+  // underrun, since what was written before then has gone.
+  bool calibrated;
+  uint32_t anchorSent;
+  int64_t anchorFrame;
+  uint32_t seenOverflows;
+  std::atomic<uint32_t> queuedFrames;  // After the last write
+  uint32_t minQueuedFrames;            // Since the last log
+  uint32_t maxQueuedFrames;
+  std::atomic<uint32_t> underruns;
+  uint32_t loggedUnderruns;
+
+  // Time spent waiting on the DMA, against the time since the last log, is how
+  // busy the audio task is.
+  int64_t waitUs;
+  int64_t loadSinceUs;
 };
 
 }
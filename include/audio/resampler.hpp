@@ -0,0 +1,91 @@
+#ifndef __RESAMPLER_HPP___
+#define __RESAMPLER_HPP___
+
+#include <memory>
+#include <stdint.h>
+
+
+// Filter length, in input frames. Enough for about 70 dB of rejection, with the
+// cutoff a little under the lower of the two Nyquist frequencies.
+#define RESAMPLER_TAPS 32
+
+// Filter phases per input frame. Coefficients are interpolated between them, so
+// an output frame can land anywhere between two input frames.
+#define RESAMPLER_PHASE_BITS 7
+#define RESAMPLER_PHASES (1 << RESAMPLER_PHASE_BITS)
+
+// Coefficients are Q14, so the centre tap (1.0 when upsampling) fits in 16 bits.
+#define RESAMPLER_COEF_BITS 14
+
+// Rates further apart than this aren't supported. 8 kHz to 48 kHz is 6.
+#define RESAMPLER_MAX_RATIO 8
+
+
+namespace AudioLib {
+
+// Converts 16-bit mono or interleaved stereo from one sample rate to another
+// with a windowed sinc filter. It keeps the last few input frames from one call to the
+// next, so a stream can be fed through in whatever pieces it comes in. Output
+// frame n is input time n * inRate / outRate, so there's no delay to make up.
+//
+// This is for loading and for reader tasks. It's far too slow for the audio task.
+class Resampler {
+public:
+  Resampler();
+  virtual ~Resampler() {}
+
+  // Sets up for converting inRate to outRate, and resets. False if either rate is
+  // 0 or they're too far apart. The filter is only rebuilt when the rates change,
+  // and takes a millisecond or so. May throw std::bad_alloc the first time.
+  bool Init(uint32_t inRate, uint32_t outRate, uint8_t numChannels = 2);
+
+  // Forgets the input so far, to start a stream over at the same rates.
+  void Reset();
+
+  // False until Init(), and when the rates are the same.
+  bool Active() const { return inRate != outRate; }
+
+  uint32_t GetInputRate() const { return inRate; }
+  uint32_t GetOutputRate() const { return outRate; }
+
+  // Converts frames from in until either all *inFrames have been taken or
+  // outFrames have been written. Sets *inFrames to how many were taken, and
+  // returns how many were written.
+  uint32_t Process(const int16_t *in, uint32_t *inFrames, int16_t *out, uint32_t outFrames);
+
+  // At the end of the stream, runs the last of the input through the filter with
+  // silence behind it. Call until Drained().
+  uint32_t Drain(int16_t *out, uint32_t outFrames);
+  bool Drained() const { return drainFrames == 0; }
+
+  // The most Process() can write for inFrames, with Drain() on top.
+  uint32_t GetMaxOutputFrames(uint32_t inFrames) const;
+
+  // What a whole stream of inFrames comes out as, drained.
+  uint32_t GetOutputFrames(uint32_t inFrames) const;
+
+private:
+  void buildFilter();
+  void push(const int16_t *frame);
+
+  std::unique_ptr<int16_t[]> coefs;  // RESAMPLER_PHASES + 1 rows of RESAMPLER_TAPS
+  uint32_t inRate;
+  uint32_t outRate;
+  uint8_t numChannels;
+  uint32_t filterInRate;             // What coefs was built for
+  uint32_t filterOutRate;
+
+  uint64_t step;         // Input frames per output frame, 32.32
+  uint32_t phase;        // Where the next output frame lands past the centre of the window, 0.32
+  uint32_t pending;      // Input frames to take before the next output frame
+  uint32_t drainFrames;  // Silence still to go in at the end
+
+  // Each channel's last RESAMPLER_TAPS frames, written twice, so the whole window
+  // is always in a row starting at head. Mono goes in both.
+  int16_t history[2][RESAMPLER_TAPS * 2];
+  uint32_t head;
+};
+
+} // namespace AudioLib
+
+#endif
@@ -0,0 +1,141 @@
+#ifndef __STREAMWAV_HPP___
+#define __STREAMWAV_HPP___
+
+#include <atomic>
+#include <memory>
+#include <stdio.h>
+
+#include <freertos/FreeRTOS.h>
+#include <freertos/semphr.h>
+#include <freertos/task.h>
+
+#include "audio/audiodata.hpp"
+#include "audio/resampler.hpp"
+#include "audio/wav.hpp"
+
+
+// Buffers read ahead of the audio task. Each one is ~186 ms of 44.1 kHz stereo,
+// so with one being played there's up to ~370 ms of cover for a slow SD read.
+#define STREAMWAV_NUM_BUFFERS 3
+#define STREAMWAV_BUFFER_FRAMES 8192
+
+// 16-bit stereo
+#define STREAMWAV_BYTES_PER_FRAME 4
+
+// Read at a time from a file that has to be converted or resampled. Files with
+// big frames are read fewer frames at a time, to fit.
+#define STREAMWAV_RAW_FRAMES 2048
+#define STREAMWAV_FILE_BUFFER_BYTES 8192
+
+
+namespace AudioLib {
+
+// Plays a .wav file of any length by streaming it off the SD card. A reader task
+// keeps the next few buffers full, and the audio task only ever swaps between
+// buffers that are already there, so it never touches the filesystem or waits.
+// If the reader falls behind, GetSamples() comes back empty until it catches up,
+// and the gap is counted as an underrun. Files in any other format than 16-bit
+// stereo are converted, and files at another rate resampled, by the reader.
+class StreamWav : public AudioStreamInterface {
+public:
+  StreamWav();
+  virtual ~StreamWav();
+
+  // Opens fileName and fills the buffers. This reads from the card, so it isn't
+  // for the audio task once it's playing, and the stream mustn't be playing.
+  virtual bool Open(const char *fileName, uint32_t outputRate);
+  bool Valid() { return valid; }
+
+  // As played, after any resampling
+  uint32_t GetNumFrames() const;
+
+  virtual StreamStats GetStats() const;
+
+  // AudioDataInterface methods. These are for the audio task, and never block.
+  virtual bool HasMoreData();
+  virtual void Restart();
+  virtual uint32_t GetSampleRate();
+  virtual uint16_t GetBitsPerSample();
+  virtual uint16_t GetNumChannels() { return 2; }
+  virtual const AudioSamples* GetSamples();
+
+private:
+  class Buffer {
+  public:
+    Buffer():
+      len(0),
+      restartSeq(0) {}
+
+    std::unique_ptr<uint8_t[]> data;
+    uint32_t len;
+    uint32_t restartSeq;  // The Restart() this was read after
+  };
+
+  bool allocate();
+  bool openFile(const char *fileName);
+  bool setupResampler(uint32_t outputRate);
+  void closeFile();
+
+  static void readerTaskInit(void *param);
+  void readerTask();
+  void fill();
+  uint32_t readData(uint8_t *dest, uint32_t maxLen);
+  uint32_t readConverted(int16_t *dest);
+  uint32_t readRaw();
+
+  bool takeBuffer();
+  void releaseBuffer();
+
+  Buffer buffers[STREAMWAV_NUM_BUFFERS];
+
+  // Buffers are filled and released in order, so these two counts are all the
+  // reader and the audio task need to share. The reader only bumps filled, and
+  // the audio task only bumps released.
+  std::atomic<uint32_t> filled;
+  std::atomic<uint32_t> released;
+
+  // Restart() bumps restartSeq. The reader starts over from the top when it sees
+  // it change, and buffers read before that are thrown away unplayed.
+  std::atomic<uint32_t> restartSeq;
+  std::atomic<uint32_t> endSeq;  // restartSeq when the reader hit the end of the data
+
+  // Audio task only
+  bool holding;         // Buffer number released is being played
+  bool playedSinceRestart;
+  bool starved;
+  AudioSamples samples;
+
+  // Reader task only (and Open(), under the lock)
+  FILE *file;
+  uint32_t dataStart;
+  uint32_t dataLen;
+  uint32_t dataRead;
+  uint32_t readerSeq;
+
+  Resampler resampler;
+  bool converting;                     // Not 16-bit stereo, or resampling
+  std::unique_ptr<uint8_t[]> fileBuf;  // As read from the file, waiting to be converted
+  std::unique_ptr<int16_t[]> raw;      // 16-bit stereo, waiting to be resampled
+  uint32_t rawPos;
+  uint32_t rawLen;
+
+  WavHeader wavHeader;
+  bool valid;
+
+  std::atomic<uint32_t> underruns;
+  std::atomic<uint32_t> starvedBlocks;
+  std::atomic<uint32_t> minBuffered;  // In buffers
+  std::atomic<uint32_t> workUs;
+  std::atomic<uint32_t> framesRead;
+  std::atomic<uint32_t> maxReadUs;
+  std::atomic<uint32_t> readErrors;
+  uint32_t loggedUnderruns;
+
+  SemaphoreHandle_t fileLock;
+  TaskHandle_t readerTaskHandle;
+};
+
+
+} // namespace AudioLib
+
+#endif
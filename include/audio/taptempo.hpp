@@ -0,0 +1,75 @@
+#ifndef __TAPTEMPO_HPP___
+#define __TAPTEMPO_HPP___
+
+#include <stdint.h>
+
+
+// Intervals kept for the estimate
+#define TAPTEMPO_MAX_INTERVALS 8
+
+// Intervals needed before there's an estimate at all
+#define TAPTEMPO_MIN_INTERVALS 3
+
+// Inliers needed for full confidence
+#define TAPTEMPO_FULL_CONFIDENCE_INTERVALS 5
+
+// Longer than this (30 BPM) starts a new run of taps
+#define TAPTEMPO_TIMEOUT_US 2000000
+
+// Shorter than this (300 BPM) is a double hit, and is ignored
+#define TAPTEMPO_MIN_INTERVAL_US 200000
+
+// Intervals further than this from the median are thrown out
+#define TAPTEMPO_OUTLIER_PERCENT 20
+
+// How far each new estimate moves the tempo, out of 1
+#define TAPTEMPO_SMOOTHING 0.5f
+
+
+namespace AudioLib {
+
+// Works out a tempo from a run of taps. Keeps the last few intervals between taps,
+// throws out the ones that are too far from the median (a flam, a missed beat),
+// and averages the rest. Each new estimate is blended into the last one so the
+// tempo doesn't jump around from tap to tap.
+//
+// Pure arithmetic on timestamps, with no hardware access, so it can be fed
+// recorded hit sequences.
+class TapTempo {
+public:
+  TapTempo();
+  virtual ~TapTempo() {}
+
+  void Reset();
+
+  // timeUs is from a free-running microsecond clock, and may wrap. Returns true if
+  // there's a new estimate.
+  bool AddTap(uint32_t timeUs);
+
+  // True if a run of taps is under way, i.e. the last tap was recent enough that
+  // one at nowUs would count towards it.
+  bool Active(uint32_t nowUs) const;
+
+  float GetBPM() const { return bpm; }
+
+  // 0 to 100. Low with only a few taps, or when they're all over the place.
+  uint8_t GetConfidence() const { return confidence; }
+
+private:
+  bool estimate();
+
+  uint32_t intervals[TAPTEMPO_MAX_INTERVALS];
+  uint8_t numIntervals;
+  uint8_t nextInterval;
+
+  uint32_t lastTapUs;
+  bool haveLastTap;
+
+  float periodUs;
+  float bpm;
+  uint8_t confidence;
+};
+
+} // namespace AudioLib
+
+#endif
@@ -0,0 +1,74 @@
+#ifndef __TEMPOMAP_HPP___
+#define __TEMPOMAP_HPP___
+
+#include <stdint.h>
+#include <vector>
+
+
+// Ramps take a segment per beat, so this is what bounds the memory a song can use.
+#define TEMPOMAP_MAX_SEGMENTS 512
+
+
+namespace AudioLib {
+
+// A tempo and/or meter change, as written in the set list.
+class TempoChange {
+public:
+  TempoChange():
+    bar(1),
+    bpm(0),
+    beatsPerBar(0),
+    rampBars(0) {}
+
+  uint16_t bar;         // Bar the change starts at. The first bar is 1.
+  float bpm;            // New tempo
+  uint8_t beatsPerBar;  // New meter, or 0 to keep the current one
+  uint16_t rampBars;    // 0 to jump straight to bpm, otherwise reach it this many bars later
+};
+
+
+// A run of beats that all have the same length.
+class TempoSegment {
+public:
+  TempoSegment():
+    beatIncrement(0),
+    numBeats(0),
+    beatsPerBar(0) {}
+
+  uint64_t beatIncrement;  // Frames per beat, 32.32 fixed point
+  uint32_t numBeats;       // 0 for the last segment, which goes on forever
+  uint8_t beatsPerBar;
+};
+
+
+// A song's tempo changes, compiled into a timeline of beat lengths. All of the
+// floating point work (and the division to turn BPM into frames per beat) is done
+// by Compile(), on the UI task. The audio task just steps through the segments,
+// which is O(1) per beat.
+//
+// Ramps are linear in BPM. Each beat in a ramp gets its own segment, at the
+// tempo halfway through that beat.
+class TempoMap {
+public:
+  TempoMap() {}
+  virtual ~TempoMap() {}
+
+  bool Compile(float bpm, uint8_t beatsPerBar, const std::vector<TempoChange>& changes);
+  void Clear() { segments.clear(); }
+
+  bool Empty() const { return segments.empty(); }
+  uint32_t GetNumSegments() const { return segments.size(); }
+  const TempoSegment& GetSegment(uint32_t idx) const { return segments[idx]; }
+
+  // Frames per beat at the given tempo, in 32.32 fixed point.
+  static uint64_t BPMToBeatIncrement(float bpm);
+
+private:
+  bool addSegment(float bpm, uint32_t numBeats, uint8_t beatsPerBar);
+
+  std::vector<TempoSegment> segments;
+};
+
+} // namespace AudioLib
+
+#endif
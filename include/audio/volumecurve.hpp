@@ -0,0 +1,30 @@
+#ifndef __VOLUMECURVE_HPP___
+#define __VOLUMECURVE_HPP___
+
+#include <stdint.h>
+
+
+// Volume positions run from 0 (silent) to VOLUME_CURVE_STEPS, and each step is the
+// same number of dB, from VOLUME_CURVE_MIN_DB up to 0 dB. That way a press of
+// the volume button sounds like the same change anywhere on the scale, rather
+// than nearly all of it happening at the bottom.
+#define VOLUME_CURVE_STEPS 100
+#define VOLUME_CURVE_MIN_DB -40
+
+// Gains are Q15: 32767 is (just short of) unity.
+#define VOLUME_CURVE_GAIN_BITS 15
+
+
+namespace AudioLib {
+namespace VolumeCurve {
+
+// position is 0 to 1, and is rounded to the nearest step.
+int16_t PositionToGain(float position);
+
+// Step 0 is silence.
+int16_t StepToGain(uint8_t step);
+
+} // namespace VolumeCurve
+} // namespace AudioLib
+
+#endif
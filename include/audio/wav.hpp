@@ -1,64 +1,79 @@
 #ifndef __WAV_HPP___
 #define __WAV_HPP___
 
+#include <stdint.h>
+#include <stdio.h>
+
 namespace AudioLib {
 
 // https://www.mmsp.ece.mcgill.ca/Documents/AudioFormats/WAVE/WAVE.html
 
+// How the samples in a file are stored
+typedef enum {
+  WS_None = 0,
+  WS_Unsigned8,
+  WS_Signed16,
+  WS_Signed24,
+  WS_Signed32,
+  WS_Float32,
+  WS_ImaAdpcm,
+} WavSampleType_t;
+
+
+// Finds the fmt and data chunks of a .wav file, skipping whatever else is in
+// there (LIST, fact, cue, ...). PCM of 8 to 32 bits, 32-bit float, any number
+// of channels and WAVE_FORMAT_EXTENSIBLE are all accepted, and so is mono or
+// stereo IMA ADPCM. Whatever the file holds, ToCanonical() turns it into the
+// 16-bit stereo the player mixes, so that's done once, as it's loaded, and never
+// while playing.
 class WavHeader {
 public:
   WavHeader();
   virtual ~WavHeader() {}
 
+  // Walks the chunks of a whole file in memory. False if it isn't a .wav file
+  // that can be played, with the reason in GetError().
   bool ReadFromBuffer(const uint8_t *buf, uint32_t len);
-  void Dump();
-
-  uint32_t GetSize();
 
-  char riff[4]; // Expected to be "RIFF"
-  uint32_t size;
-  char waveId[4]; // Expected to be "WAVE"
+  // The same, reading the chunk headers from an open file. Leaves the file
+  // positioned somewhere in the middle.
+  bool ReadFromFile(FILE *file);
 
-  // fmt chunk
-  char fmtId[4];     // Expected to be "fmt "
-  uint32_t fmtSize;  // Size of the rest the chunk (after this field). Expected to be 18.
-  
-  uint16_t fmtTag; // 1 for PCM
-  uint16_t numChannels;
-  uint32_t samplesPerSecond;
-  uint32_t bytesPerSecond;
-  uint16_t blockAlign;
-  uint16_t bitsPerSample;
+  void Dump();
+  const char* GetError() const { return error; }
 
-  // Not present with PCM
-  //uint16_t extensionSize;
-  //uint16_t validBitsPerSample;
-  //uint32_t channelMask; // Speaker position mask according to the link above
-};
+  // Already 16-bit stereo, so the data can be played as it is
+  bool IsCanonical() const;
 
+  // Converts numFrames frames from in to interleaved 16-bit stereo. Mono is
+  // copied to both channels, and past the first two channels is dropped. ADPCM
+  // has to start at a block.
+  void ToCanonical(const uint8_t *in, uint32_t numFrames, int16_t *out) const;
 
-class WavData {
-public:
-  WavData();
-  virtual ~WavData() {}
+  // The same, to 16-bit mono, for files that are. Takes the first channel.
+  void ToMono(const uint8_t *in, uint32_t numFrames, int16_t *out) const;
 
-  // To be called when first reading data from WAV file. This call
-  // will validate the data header.
-  bool Init(uint8_t *_buf, uint32_t _bufLen);
+  uint32_t GetNumFrames() const { return blockAlign ? dataLen / blockAlign * framesPerBlock : 0; }
 
-  // For subsequent calls on the same WAV file - for updating with
-  // chunks of data which follow the data provided in Init().
-  bool Update(uint8_t *_buf, uint32_t _bufLen);
+  uint16_t fmtTag;         // PCM or float, after looking through WAVE_FORMAT_EXTENSIBLE
+  uint16_t numChannels;
+  uint32_t samplesPerSecond;
+  uint32_t bytesPerSecond;
+  uint16_t blockAlign;     // Bytes per frame, or per block of ADPCM
+  uint16_t bitsPerSample;  // Of the container. Valid bits are left-justified in it.
+  WavSampleType_t sampleType;
 
-  const uint8_t* GetData() { return buf; }
-  uint32_t GetDataLen() { return bufLen; }
+  uint32_t dataStart;  // Where the samples start, from the top of the file
+  uint32_t dataLen;    // Whole frames only, and no further than the end of the file
+  uint32_t framesPerBlock;  // 1, except for ADPCM
 
 private:
-  char id[4]; // Expected to be "data"
-  
+  template<class Reader> bool walk(Reader& reader);
+  template<uint8_t outChannels> void convert(const uint8_t *in, uint32_t numFrames, int16_t *out) const;
+  bool parseFmt(const uint8_t *fmt, uint32_t len);
+  bool fail(const char *reason);
 
-  uint8_t *buf; // Pointer to the actual data samples - caller owns this buffer
-  uint32_t bufLen;
+  const char *error;
 };
 
 
@@ -0,0 +1,25 @@
+#ifndef __CONSOLE_HPP___
+#define __CONSOLE_HPP___
+
+// Commands typed into the serial monitor, one per line:
+//
+//   latency        Click timing histograms and counters, as CSV
+//   latency clear  Starts them again
+//   stream         The backing track's underruns, and what reading or decoding it
+//                  costs
+//   commands       How full the audio task's command ring is, and has been, and
+//                  how many commands it's had to drop
+//   diag           Runs the audio diagnostics, which stops the click for a while
+//   diag stream    Streams the long test .wav through, which takes minutes, with
+//                  no click
+//   export         Renders the setlist on the screen's click to a .wav file
+//
+// Never waits for input, so it can be polled from the component loop. Diagnostics
+// and exports hold up the loop until they're done, though.
+namespace Console {
+
+void Poll();
+
+} // namespace Console
+
+#endif
@@ -3,6 +3,7 @@
 
 #include <vector>
 
+#include "audio/taptempo.hpp"
 #include "components/componentpanel.hpp"
 #include "components/componentselector.hpp"
 #include "components/gridlistbox.hpp"
@@ -22,6 +23,7 @@ class ClickOnOffButton;
 
 class TempoUpButton;
 class TempoDownButton;
+class TapTempoButton;
 
 class SetlistSong {
 public:
@@ -59,11 +61,19 @@ public:
   bool NextPage();
   bool PrevPage();
 
-  uint16_t GetTempo() { return curTempo; }
-  void SetTempo(uint16_t newTempo);
+  float GetTempo() { return curTempo; }
+  void SetTempo(float newTempo);
+
+  // A tap on the Tap button, or a hit on the pad. Pad hits only count once tapping
+  // has been started from the screen.
+  void Tap(uint32_t timeUs, bool fromTrigger);
 
   bool SwapGridArea();
 
+  // Renders the click for the whole setlist, with a count-in before each song,
+  // to EXPORT_DIR/<setlist name>.wav. Takes a while for a long set.
+  bool ExportSetlist();
+
   static SetlistScreen* GetSetlistScreen();
 
 private:
@@ -89,6 +99,7 @@ private:
 
   TempoUpButton *tempoUpButton;
   TempoDownButton *tempoDownButton;
+  TapTempoButton *tapTempoButton;
   TextBox *tempoTextBox;
 
   Serializable::Setlist *setlist;
@@ -101,7 +112,12 @@ private:
   int16_t nextPageIdx;
   int16_t prevPageIdx;
 
-  uint16_t curTempo;
+  float curTempo;
+
+  // The selected song has tempo changes, and the click is following them
+  bool tempoMapActive;
+
+  AudioLib::TapTempo tapTempo;
 };
 
 #endif
@@ -3,9 +3,13 @@
 
 #include <list>
 #include <string>
+#include <vector>
 
 #include <ArduinoJson.hpp>
 
+#include "audio/clickbank.hpp"
+#include "audio/clicktrack.hpp"
+#include "audio/tempomap.hpp"
 #include <serializable/serializable-object.hpp>
 
 namespace Serializable {
@@ -19,9 +23,24 @@ namespace Serializable {
           },
           {
             "name": "Song 2",
-            "BPM": 150,
+            "BPM": 128.5,
+            "timeSignature": "6/8",
+            "subdivision": "16th",
+            "swing": 60,
+            "subdivisionLevels": [80, 60],
+            "click": "woodblock",
+            "bars": 96,
             "MP3": "mp3-file.mp3"
           },
+          {
+            "name": "Song with tempo changes",
+            "BPM": 100,
+            "tempoMap": [
+              { "bar": 17, "BPM": 120 },
+              { "bar": 33, "BPM": 90, "timeSignature": "3/4" },
+              { "bar": 49, "BPM": 140, "rampBars": 4 }
+            ]
+          },
           {
             "name": "Another Song",
             "BPM": 95
@@ -32,19 +51,60 @@ namespace Serializable {
 
 class Song : public SerializableObject {
 public:
-  Song(): bpm(0) {}
+  Song(): bpm(0), beatsPerBar(4), beatUnit(4), subdivision(AudioLib::SD_None), swing(CLICKTRACK_DEFAULT_SWING), clickVoice(CLICKBANK_DEFAULT_VOICE), bars(0) {
+    subdivisionLevels[0] = CLICKTRACK_DEFAULT_LEVEL_1_PERCENT;
+    subdivisionLevels[1] = CLICKTRACK_DEFAULT_LEVEL_2_PERCENT;
+  }
   virtual ~Song() {}
 
   const std::string& GetName() const { return name; };
-  uint16_t GetBPM() const { return bpm; }
+  float GetBPM() const { return bpm; }
+  uint8_t GetBeatsPerBar() const { return beatsPerBar; }
+  uint8_t GetBeatUnit() const { return beatUnit; }
+  AudioLib::Subdivision_t GetSubdivision() const { return subdivision; }
+  uint8_t GetSwing() const { return swing; }
+
+  // How loud clicks at level (1 for 8ths or triplets, 2 for 16ths) are, in percent
+  // of the beat
+  uint8_t GetSubdivisionLevel(uint8_t level) const { return subdivisionLevels[level - 1]; }
+
+  // Name of the click sound, from the ClickBank
+  const std::string& GetClickVoice() const { return clickVoice; }
+
+  // Changes are at the given bar (counting from 1), in order. With "rampBars",
+  // the tempo changes smoothly from the bar given, reaching the new BPM that many
+  // bars later. Empty if the tempo doesn't change.
+  const std::vector<AudioLib::TempoChange>& GetTempoChanges() const { return tempoChanges; }
   const std::string& GetMp3File() const { return mp3File; }
 
+  // Length of the song, for exporting its click. 0 if it wasn't given.
+  uint16_t GetBars() const { return bars; }
+
   virtual bool DeserializeSelf(const ArduinoJson::JsonObject& obj);
 
+  // Formats a tempo for display, to one decimal place. Whole tempos don't get the
+  // decimal point (i.e. "120" and "128.5").
+  static std::string BPMToString(float bpm);
+
 private:
+  bool parseTimeSignature(const char *timeSignature);
+  bool parseSubdivision(const char *subdivisionName);
+  bool parseSubdivisionLevels(const ArduinoJson::JsonArray& jsonLevels);
+  bool parseTempoMap(const ArduinoJson::JsonArray& jsonTempoMap);
+
+  static bool parseTimeSignature(const char *timeSignature, uint8_t *top, uint8_t *bottom);
+
   std::string name;
-  uint16_t bpm;
+  float bpm;
+  uint8_t beatsPerBar;
+  uint8_t beatUnit;
+  AudioLib::Subdivision_t subdivision;
+  uint8_t swing;
+  uint8_t subdivisionLevels[CLICKTRACK_NUM_LEVELS - 1];
+  std::string clickVoice;
+  std::vector<AudioLib::TempoChange> tempoChanges;
   std::string mp3File;
+  uint16_t bars;
 };
 
 typedef std::list<Song*> Songs;
@@ -69,6 +69,9 @@ namespace TftManager {
 
   // Returns true if the screen was touched.
   bool GetTouchCoords(TSPoint *coords);
+
+  // When GetTouchCoords() last found a touch. The low 32 bits of esp_timer_get_time().
+  uint32_t GetTouchTimeUs();
 }
 
 #endif
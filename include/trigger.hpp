@@ -5,6 +5,12 @@ namespace Trigger {
 
 void Init();
 
+// For anything that wants to follow the pad without being on the hit path (e.g. tap
+// tempo). Lock-free. The count goes up by one for each hit, and the time is the
+// low 32 bits of esp_timer_get_time() when the latest one happened.
+uint32_t GetHitCount();
+uint32_t GetLastHitTimeUs();
+
 } // namespace Trigger
 
 #endif
@@ -1,76 +1,108 @@
+#include <atomic>
 #include <memory>
 
-#include <FS.h>
-
-#include "audio/memwav.hpp"
+#include <Arduino.h>
+#include <esp_heap_caps.h>
+#include <esp_timer.h>
+
+#include "audio/clickbank.hpp"
+#include "audio/clicktrack.hpp"
+#include "audio/commandring.hpp"
+#include "audio/diagnostics.hpp"
+#include "audio/latencystats.hpp"
+#include "audio/mp3stream.hpp"
+#include "audio/offlinerenderer.hpp"
 #include "audio/player.hpp"
+#include "audio/streamwav.hpp"
+#include "audio/tempomap.hpp"
 #include "audio.hpp"
 #include "log.hpp"
-#include "storage/sdcard-mem-fs.hpp"
+#include "storage/sdcard.hpp"
 
 
 #define I2S_DOUT   6 /* Data out */
 #define I2S_BCLK  18 /* Clock */
 #define I2S_WS     7 /* Word Select (LRC) */
 
-// Flasher gets triggered from audio thread so they can stay in sync
+// Flasher gets triggered from audio thread so they can stay in sync. The audio
+// thread knows when each click will be heard, so the light waits for it.
 #define FLASHER_PIN 47
-#define FLASHER_DEFAULT_DELAY 1000
 #define FLASHER_DEFAULT_FLASH_DURATION 25
 
-#define TIME_TYPE unsigned long
-
-
-// The message passing implementation here may be a bit naieve. Since there's
-// only one task receiving messages and interacting with the audio object,
-// it assumes that incoming threads will receive responses in the same order
-// they were sent.
-//
-// While I think that's LIKELY to happen in all cases, I don't think it's 
-// guaranteed currently. (What I'm really looking for here is semantics 
-// similar to CK_SendMessage, but I don't think FreeRTOS has an exact
-// equivilent. Bummer. Might have to roll my own.)
 
-
-enum AudioMessage_t {
-  AM_NoOp,
-  AM_PlayFile,
-  AM_SetClickFile,
-  AM_StartClick,
-  AM_RestartClick,
-  AM_PlayClick,
+// Commands go to the audio task through a lock-free ring, copied by value. Senders
+// never wait on the audio loop unless they ask to: realtime commands (tempo
+// changes, trigger hits) are fire-and-forget, and commands that need an answer
+// (like starting a backing track) set replyTo and wait for a task notification.
+#define AUDIO_COMMAND_RING_SIZE 16
+
+// Put a long .wav here to have it streamed through by RunStreamCheck()
+#define AUDIO_STREAM_CHECK_FILE "/diag/stream-check.wav"
+
+// Made, filled with click files, and deleted again by the diagnostics
+#define AUDIO_CLICKBANK_CHECK_DIR "/diag-clicks"
+
+// Clicks in one block whose timing is followed. More than this at once (only
+// possible at silly tempos) aren't counted.
+#define AUDIO_MAX_CLICKS_PER_BLOCK 4
+
+// Task notification values sent back to a waiting sender
+#define AUDIO_REPLY_SUCCESS 1
+#define AUDIO_REPLY_FAILURE 2
+
+
+enum AudioCommand_t {
+  AC_NoOp,
+  AC_PlayFile,
+  AC_StopFile,
+  AC_SelectClicks,
+  AC_SetTimeSignature,
+  AC_SetClickPattern,
+  AC_SetSubdivisionLevels,
+  AC_SetTempoMap,
+  AC_StartClick,
+  AC_ChangeTempo,
+  AC_RestartClick,
+  AC_RunDiagnostics,
+  AC_RunStreamCheck,
 };
 
 
 ///////////////////////////////////////////////////////////////////////////////
-// class AudioMessage
+// class AudioCommand
 ///////////////////////////////////////////////////////////////////////////////
-class AudioMessage {
+class AudioCommand {
 public:
-  AudioMessage():
-    data(NULL) {}
-
-  AudioMessage(AudioMessage_t _message, void *_data):
-    message(_message),
-    data(_data) {}
-
-  virtual ~AudioMessage() {}
-
-  AudioMessage_t message;
-  void *data;
+  AudioCommand():
+    command(AC_NoOp),
+    replyTo(NULL) {}
+
+  AudioCommand(AudioCommand_t _command):
+    command(_command),
+    replyTo(NULL) {}
+
+  AudioCommand_t command;
+
+  // Task to notify when the command has been handled, or NULL for fire-and-forget.
+  TaskHandle_t replyTo;
+
+  union {
+    float bpm;
+    uint32_t startTime;
+    uint8_t beatsPerBar;
+    const AudioLib::TempoMap *tempoMap;
+    AudioLib::AudioStreamInterface *stream;
+    struct {
+      AudioLib::Subdivision_t subdivision;
+      uint8_t swing;
+    } pattern;
+    uint8_t subdivisionLevels[CLICKTRACK_NUM_LEVELS - 1];
+    AudioLib::ClickSample *clicks[AudioComp::CV_NumVoices];
+  } param;
 };
 
 
-template <class T> 
-class AmSingleTypeMessage {
-public:
-  AmSingleTypeMessage(T _message): 
-    message(_message) {}
-
-  static T As(void *param) { return reinterpret_cast<AmSingleTypeMessage<T>*>(param)->message; }
-
-  T message;
-};
+typedef AudioLib::CommandRing<AudioCommand, AUDIO_COMMAND_RING_SIZE> AudioCommandRing;
 
 
 ///////////////////////////////////////////////////////////////////////////////
@@ -78,41 +110,70 @@ public:
 ///////////////////////////////////////////////////////////////////////////////
 class Flasher {
 public:
-  Flasher(): ledOnTime(0) {}
+  Flasher():
+    onTimer(NULL),
+    offTimer(NULL) {}
   virtual ~Flasher() {}
 
-  void TurnOn();
-  void TurnOffAfterDelay();
-
-  bool LedIsOn();
+  bool Init();
 
-  static void Init();
+  // Flashes at timeUs (the low 32 bits of esp_timer_get_time()), which should be
+  // when the click is heard. A flash that's still waiting is moved, not doubled.
+  void FlashAt(uint32_t timeUs);
 
 private:
-  TIME_TYPE ledOnTime;
+  static void turnOn(void *arg);
+  static void turnOff(void *arg);
+
+  esp_timer_handle_t onTimer;
+  esp_timer_handle_t offTimer;
 };
 
 
-void Flasher::Init() {
+bool Flasher::Init() {
   pinMode(FLASHER_PIN, OUTPUT);
+
+  esp_timer_create_args_t args = {};
+  args.callback = turnOn;
+  args.arg = this;
+  args.name = "FlashOn";
+  esp_err_t err = esp_timer_create(&args, &onTimer);
+  if (err == ESP_OK) {
+    args.callback = turnOff;
+    args.name = "FlashOff";
+    err = esp_timer_create(&args, &offTimer);
+  }
+
+  if (err != ESP_OK) {
+    logPrintf(LOG_COMP_AUDIO, LOG_SEV_ERROR, "*** Error creating the flasher timers: %d\n", err);
+    return false;
+  }
+
+  return true;
 }
 
 
-bool Flasher::LedIsOn() { return ledOnTime != 0; }
+void Flasher::FlashAt(uint32_t timeUs) {
+  if (!onTimer) {
+    return;
+  }
+
+  int32_t delayUs = static_cast<int32_t>(timeUs - static_cast<uint32_t>(esp_timer_get_time()));
+  esp_timer_stop(onTimer);
+  esp_timer_start_once(onTimer, delayUs > 0 ? delayUs : 0);
+}
 
 
-void Flasher::TurnOn() {
+void Flasher::turnOn(void *arg) {
+  Flasher *flasher = static_cast<Flasher*>(arg);
   digitalWrite(FLASHER_PIN, HIGH);
-  ledOnTime = millis();
+  esp_timer_stop(flasher->offTimer);
+  esp_timer_start_once(flasher->offTimer, FLASHER_DEFAULT_FLASH_DURATION * 1000);
 }
 
 
-void Flasher::TurnOffAfterDelay() {
-  TIME_TYPE now = millis();
-  if (ledOnTime != 0 && ledOnTime + FLASHER_DEFAULT_FLASH_DURATION < now) {
-    digitalWrite(FLASHER_PIN, LOW);
-    ledOnTime = 0;    
-  }
+void Flasher::turnOff(void *arg) {
+  digitalWrite(FLASHER_PIN, LOW);
 }
 
 
@@ -128,46 +189,111 @@ public:
   bool OnAudioPlayerThread();
 
   bool PlayAudioFile(const char *fileName);
-
-  bool SetClickFile(const char *fileName);
-  bool StartClick(uint16_t bpm);
+  bool StopAudioFile();
+
+  bool LoadClickBank(const char *dirName);
+  bool SetClickVoice(const char *name);
+  bool SetTimeSignature(uint8_t beatsPerBar);
+  bool SetClickPattern(AudioLib::Subdivision_t subdivision, uint8_t swing);
+  bool SetSubdivisionLevels(uint8_t level1Percent, uint8_t level2Percent);
+  bool SetTempoMap(const AudioLib::TempoMap& tempoMap);
+  bool StartClick(float bpm);
+  bool ChangeTempo(float bpm);
   bool RestartClick(uint32_t startTime);
+  void ResetClickPhase(uint32_t hitTimeUs);
+  AudioComp::TriggerLatency GetTriggerLatency() const;
+  AudioLib::StreamStats GetBackingTrackStats() const;
+  void WriteLatencyCsv(AudioLib::LatencyStats::LineWriter writeLine) const;
+  void ClearLatencyStats() { latencyStats.Clear(); }
+  bool ExportClickTrack(const char *fileName, const std::vector<AudioComp::ExportSong>& songs);
+  bool RunDiagnostics();
+  bool RunStreamCheck();
 
   void StartClick() { clickOn = true; }
   void StopClick() { clickOn = false; }
   void StartFlash() { flashOn = true; }
   void StopFlash() { flashOn = false; }
 
+  const AudioCommandRing& GetCommandRing() const { return commands; }
+
 private:
   static void audioPlayerTaskInit(void *param);
   void audioPlayerTask();
 
-  AudioMessage_t waitForMessage(AudioMessage *inMessage);
+  void processCommands();
+  void completeCommand(const AudioCommand& command, bool success);
 
-  bool sendMessage(QueueHandle_t queue, AudioMessage *message);
-  bool receiveMessageFromAudioThread(AudioMessage_t expectedResponseType, AudioMessage *message);
+  bool sendCommand(const AudioCommand& command);
+  bool sendCommandAndWait(AudioCommand& command);
 
-  void playAudioFile(const char *fileName);
+  bool playAudioFile(AudioLib::AudioStreamInterface *stream);
+  bool stopAudioFileAndWait();
 
-  void setClickFile(const char *fileName);
-  void startClick(uint16_t bpm);
+  bool findClicks(const char *name, AudioLib::ClickSample **found);
+  bool selectClicks(AudioLib::ClickSample* const *newClicks);
+  void startClick(float bpm);
   void restartClick(uint32_t startTime);
-  void playClick();
+  void applyPhaseReset();
+  void scheduleClicks();
+  void playClick(const AudioLib::ClickEvent& event);
+  void setGridOrigin(uint64_t frame, uint32_t timeUs);
+  void recordLatency();
+  void runDiagnostics();
+
+  static void logHeapUse(const char *when);
 
   TaskHandle_t audioTask;
-  QueueHandle_t inMessages;
-  QueueHandle_t outMessages;
+  AudioCommandRing commands;
 
-  AudioLib::MemWav clickWav;
-  bool playingClick;
+  // Every click sound, loaded once at boot. Each voice points at one of them, so
+  // changing sounds between songs, or picking one per beat, is just a pointer.
+  AudioLib::ClickBank clickBank;
+  AudioLib::ClickSample *clicks[AudioComp::CV_NumVoices];
+  AudioLib::ClickTrack clickTrack;
   Flasher flasher;
 
-  std::shared_ptr<fs::FS> clickFs;
-  fs::FSImplPtr clickFsImpl;
-
-  std::string clickFile;
-  uint32_t clickDelay;
-  uint32_t lastClickPlayed;
+  // The click track follows one of these while the other is filled in by
+  // SetTempoMap(). The copy (and any allocation) happens on the caller's task.
+  AudioLib::TempoMap tempoMaps[2];
+  uint8_t nextTempoMap;
+
+  // Same again for .wav backing tracks. The next one is opened (and starts reading
+  // ahead) on the caller's task, while the audio task is still playing the other.
+  // There's only the one MP3 decoder, so that has to be stopped before it's reopened.
+  AudioLib::StreamWav backingTracks[2];
+  uint8_t nextBackingTrack;
+  AudioLib::Mp3Stream mp3Track;
+  std::atomic<AudioLib::AudioStreamInterface*> backingTrack;
+
+  // RunStreamCheck() has one of its own, so it can't be opened under the check
+  // by PlayAudioFile(). Nothing is allocated for it unless the check is run.
+  AudioLib::StreamWav streamCheckTrack;
+
+  // Whether one has been started and not stopped since. Only the caller's task
+  // looks at it.
+  bool backingTrackOn;
+
+  // Trigger hits skip the command ring. The time is written first, then the
+  // sequence number is bumped to publish it. If two hits land before the audio task
+  // looks, it just sees the newer one.
+  std::atomic<uint32_t> phaseResetTimeUs;
+  std::atomic<uint32_t> phaseResetSeq;
+  uint32_t appliedPhaseResetSeq;
+
+  std::atomic<uint32_t> phaseResets;
+  std::atomic<uint32_t> lastHandoffUs;
+  std::atomic<uint32_t> maxHandoffUs;
+
+  // Each click is scheduled on a beat grid that started at gridOriginUs, which is
+  // when gridOriginFrame was (or was meant to be) heard. Clicks in the block being
+  // rendered wait here until it's been written.
+  AudioLib::LatencyStats latencyStats;
+  uint64_t gridOriginFrame;
+  uint32_t gridOriginUs;
+  AudioLib::ClickTiming blockClicks[AUDIO_MAX_CLICKS_PER_BLOCK];
+  uint64_t blockClickFrames[AUDIO_MAX_CLICKS_PER_BLOCK];
+  uint8_t numBlockClicks;
+  uint32_t skippedClicks;
 
   bool clickOn;
   bool flashOn;
@@ -176,14 +302,24 @@ private:
 
 AudioPlayer::AudioPlayer():
   audioTask(NULL),
-  inMessages(NULL),
-  outMessages(NULL),
-  playingClick(false),
-  clickFsImpl(NULL),
-  clickDelay(0),
-  lastClickPlayed(0),
+  nextTempoMap(0),
+  nextBackingTrack(0),
+  backingTrack(NULL),
+  backingTrackOn(false),
+  phaseResetTimeUs(0),
+  phaseResetSeq(0),
+  appliedPhaseResetSeq(0),
+  phaseResets(0),
+  lastHandoffUs(0),
+  maxHandoffUs(0),
+  gridOriginFrame(0),
+  gridOriginUs(0),
+  numBlockClicks(0),
+  skippedClicks(0),
   clickOn(true),
-  flashOn(true) {}
+  flashOn(true) {
+  memset(clicks, 0, sizeof(clicks));
+}
 
 
 AudioPlayer::~AudioPlayer() {
@@ -191,9 +327,6 @@ AudioPlayer::~AudioPlayer() {
   // different than it does now. 
   // 
   // I still feel the urge to clean stuff up here, anyway. Huh.
-
-  if (inMessages) { vQueueDelete(inMessages); }
-  if (outMessages) { vQueueDelete(outMessages); }
 }
 
 
@@ -202,51 +335,58 @@ bool AudioPlayer::OnAudioPlayerThread() {
 }
 
 
-bool AudioPlayer::sendMessage(QueueHandle_t queue, AudioMessage *message) {
-  bool success = false;
-
-  if (queue) {
-    BaseType_t ret = xQueueSend(queue, message, portMAX_DELAY);
-    if (ret == pdTRUE) {
-      success = true;
-    } else {
-      logPrintf(LOG_COMP_AUDIO, LOG_SEV_ERROR, "Unable to send message. AudioThread: %s, message: %d\n", 
-        OnAudioPlayerThread() ? "True" : "False",
-        message->message);
-    }
-  } else {
+bool AudioPlayer::sendCommand(const AudioCommand& command) {
+  if (!audioTask) {
     // This can happen if the trigger is being hit during startup. 
-    logPrintf(LOG_COMP_AUDIO, LOG_SEV_WARN, "Attempt to send message to the audio component before the message queue has been initialized.\n")
+    logPrintf(LOG_COMP_AUDIO, LOG_SEV_WARN, "Attempt to send command to the audio component before it has been initialized.\n");
+    return false;
   }
 
-  return success;
+  if (!commands.Push(command)) {
+    logPrintf(LOG_COMP_AUDIO, LOG_SEV_ERROR, "Audio command ring full. Dropped command: %d, total dropped: %d\n",
+      command.command, commands.GetDropped());
+    return false;
+  }
+
+  return true;
 }
 
 
-bool AudioPlayer::receiveMessageFromAudioThread(AudioMessage_t expectedResponseType, AudioMessage *message) {
-  bool success = false;
+bool AudioPlayer::sendCommandAndWait(AudioCommand& command) {
+  if (OnAudioPlayerThread()) {
+    // We'd be waiting on ourselves.
+    logPrintf(LOG_COMP_AUDIO, LOG_SEV_ERROR, "BUG: sendCommandAndWait called from the audio task. Command: %d\n", command.command);
+    return false;
+  }
 
-  BaseType_t ret = xQueueReceive(outMessages, message, portMAX_DELAY);
-  if (ret == pdPASS) {
-    if (expectedResponseType == message->message) {
-      success = true;
-    } else {
-      logPrintf(LOG_COMP_AUDIO, LOG_SEV_WARN, "receiveMessageFromAudioThread: Expected response: %d, but got: %d\n", 
-        expectedResponseType, message->message);  
-    }
-  } else {
-    logPrintf(LOG_COMP_AUDIO, LOG_SEV_ERROR, "receiveMessageFromAudioThread: Error reading response: %d\n", ret);
+  command.replyTo = xTaskGetCurrentTaskHandle();
+
+  // Make sure a stale notification isn't mistaken for our reply.
+  xTaskNotifyStateClear(NULL);
+
+  if (!sendCommand(command)) {
+    return false;
   }
 
-  return success;
+  uint32_t reply = 0;
+  if (xTaskNotifyWait(0, ULONG_MAX, &reply, portMAX_DELAY) != pdTRUE) {
+    logPrintf(LOG_COMP_AUDIO, LOG_SEV_ERROR, "Error waiting for audio command reply. Command: %d\n", command.command);
+    return false;
+  }
+
+  return reply == AUDIO_REPLY_SUCCESS;
 }
 
 
-void AudioPlayer::Init() {
-  Flasher::Init();
+void AudioPlayer::completeCommand(const AudioCommand& command, bool success) {
+  if (command.replyTo) {
+    xTaskNotify(command.replyTo, success ? AUDIO_REPLY_SUCCESS : AUDIO_REPLY_FAILURE, eSetValueWithOverwrite);
+  }
+}
 
-  inMessages = xQueueCreate(10, sizeof(AudioMessage));
-  outMessages = xQueueCreate(10, sizeof(AudioMessage));
+
+void AudioPlayer::Init() {
+  flasher.Init();
 
   BaseType_t ret = xTaskCreatePinnedToCore(
     AudioPlayer::audioPlayerTaskInit,
@@ -271,253 +411,633 @@ void AudioPlayer::audioPlayerTaskInit(void *param) {
 }
 
 
-AudioMessage_t AudioPlayer::waitForMessage(AudioMessage *inMessage) {
-  if (clickDelay == 0) {
-    if (xQueueReceive(inMessages, inMessage, 1) == pdPASS) {
-      return inMessage->message;
-    } else {
-      return AM_NoOp;
-    }
-  }
+void AudioPlayer::processCommands() {
+  // Never block here. The task is paced by the I2S driver in WriteToDevice(), and
+  // clicks are placed by frame position rather than by waking up on time.
+  AudioCommand command;
+  while (commands.Pop(&command)) {
+    bool success = true;
 
-  // If we're here, then we're playing the click sound. We want to see if there's
-  // a message waiting, but we only want to wait until it's time to play the next
-  // click.
-
-  uint32_t curTime = millis();
-  uint32_t playTime = lastClickPlayed + clickDelay;
-  if (curTime < playTime) {
-    TickType_t ticksToWait = 0;
-    if (flasher.LedIsOn()) {
-      // Wait until it's time to turn off the LED
-      ticksToWait = FLASHER_DEFAULT_FLASH_DURATION * portTICK_PERIOD_MS;
-    } else {
-      // Wait until the next click
-      ticksToWait = (playTime - curTime) * portTICK_PERIOD_MS; 
-    }
+    switch(command.command) {
+    case AC_PlayFile:
+      success = playAudioFile(command.param.stream);
+      break;
 
-    if (xQueueReceive(inMessages, inMessage, ticksToWait) == pdPASS) {
-      // There's a message waiting. Process it.
-      return inMessage->message;
-    } else {
-      // Timer expired without a message. Play the click.
-      curTime = millis();
-      if (curTime >= playTime) {
-        return AM_PlayClick;
-      } else {
-        return AM_NoOp;
-      }
-    }
-  }
+    case AC_StopFile:
+      AudioLib::Player::GetPlayer().Stop(AudioLib::MV_Backing);
+      break;
 
-  // It's probably slightly past time to play the click.
-  return AM_PlayClick;
-}
+    case AC_SelectClicks:
+      success = selectClicks(command.param.clicks);
+      break;
 
+    case AC_SetTimeSignature:
+      clickTrack.SetBeatsPerBar(command.param.beatsPerBar);
+      break;
 
-void AudioPlayer::audioPlayerTask() {
-  AudioLib::Player::Init(I2S_BCLK, I2S_WS, I2S_DOUT);
+    case AC_SetClickPattern:
+      // Builds the event table. Nothing is computed per click beyond walking it.
+      clickTrack.SetPattern(command.param.pattern.subdivision, command.param.pattern.swing);
+      break;
 
-  AudioMessage inMessage;
+    case AC_SetSubdivisionLevels:
+      for (uint8_t level = 1; level < CLICKTRACK_NUM_LEVELS; level++) {
+        clickTrack.SetLevelGain(level, command.param.subdivisionLevels[level - 1] / 100.0f);
+      }
+      break;
 
-  while (true) {
-    switch(waitForMessage(&inMessage)) {
-    case AM_NoOp:
-      // There were no messages in the queue. Allow the audio component to run, then
-      // check again.
+    case AC_SetTempoMap:
+      clickTrack.SetTempoMap(command.param.tempoMap);
       break;
 
-    case AM_PlayFile:
-      playAudioFile(AmSingleTypeMessage<const char*>::As(inMessage.data));
+    case AC_StartClick:
+      startClick(command.param.bpm);
       break;
 
-    case AM_SetClickFile:
-      setClickFile(AmSingleTypeMessage<const char*>::As(inMessage.data));
+    case AC_ChangeTempo:
+      clickTrack.ChangeTempo(command.param.bpm, AudioLib::Player::GetPlayer().GetFramePosition());
       break;
 
-    case AM_StartClick:
-      startClick(AmSingleTypeMessage<uint16_t>::As(inMessage.data));
+    case AC_RestartClick:
+      restartClick(command.param.startTime);
       break;
 
-    case AM_RestartClick:
-      restartClick(AmSingleTypeMessage<uint32_t>::As(inMessage.data));
+    case AC_RunDiagnostics:
+      runDiagnostics();
       break;
 
-    case AM_PlayClick:
-      playClick();
+    case AC_RunStreamCheck:
+      // Plays the whole file, so it can take minutes.
+      AudioLib::Diagnostics::CheckStreamWav(&streamCheckTrack, SDCARD_ROOT AUDIO_STREAM_CHECK_FILE);
       break;
 
     default:
         // Should not get here
-        logPrintf(LOG_COMP_AUDIO, LOG_SEV_ERROR, "AUDIO: BUG: Unknown message: %d\n", inMessage.message);
+        logPrintf(LOG_COMP_AUDIO, LOG_SEV_ERROR, "AUDIO: BUG: Unknown command: %d\n", command.command);
+        success = false;
     }
 
-    flasher.TurnOffAfterDelay();
+    completeCommand(command, success);
+  }
+}
+
+
+void AudioPlayer::audioPlayerTask() {
+  logHeapUse("before audio init");
+  AudioLib::Player::Init(I2S_BCLK, I2S_WS, I2S_DOUT);
+
+  // Nothing in the loop below allocates, apart from the first click sounds baked,
+  // and diagnostics when they're asked for.
+  logHeapUse("after audio init");
+
+  while (true) {
+    processCommands();
+    applyPhaseReset();
+    scheduleClicks();
     AudioLib::Player::GetPlayer().WriteToDevice();
+    recordLatency();
   }
 }
 
 
-void AudioPlayer::playClick() {
-  lastClickPlayed = millis();
+bool AudioPlayer::RunDiagnostics() {
+  // On the audio task, which they were written for, so the click stops until
+  // they're done.
+  AudioCommand command(AC_RunDiagnostics);
+  return sendCommandAndWait(command);
+}
+
+
+bool AudioPlayer::RunStreamCheck() {
+  // The same. It has a stream of its own, so backing tracks can still be opened
+  // from other tasks while it runs.
+  AudioCommand command(AC_RunStreamCheck);
+  return sendCommandAndWait(command);
+}
+
+
+void AudioPlayer::runDiagnostics() {
+  logPrintf(LOG_COMP_AUDIO, LOG_SEV_INFO, "AUDIO: Running diagnostics. The click will stop until they're done.\n");
 
-  if (flashOn) {
-    flasher.TurnOn();
+  AudioLib::Diagnostics::MeasureClickJitter();
+  AudioLib::Diagnostics::CheckTapTempo();
+  AudioLib::Diagnostics::BenchmarkMixer();
+  AudioLib::Diagnostics::CheckResampler();
+  AudioLib::Diagnostics::CheckWavParser();
+  AudioLib::Diagnostics::CheckClickPrep();
+  AudioLib::Diagnostics::CheckClickSynth();
+  AudioLib::Diagnostics::CheckClickBankFiles(SDCARD_ROOT AUDIO_CLICKBANK_CHECK_DIR);
+  AudioLib::Diagnostics::CheckLatencyStats();
+  AudioLib::Diagnostics::CheckOfflineRender();
+  AudioLib::Diagnostics::CheckAdpcm();
+
+  logHeapUse("after diagnostics");
+}
+
+
+void AudioPlayer::scheduleClicks() {
+  AudioLib::Player& player = AudioLib::Player::GetPlayer();
+
+  AudioLib::ClickEvent event;
+  while (clickTrack.NextEventInBlock(player.GetFramePosition(), PLAYER_BLOCK_FRAMES, &event)) {
+    playClick(event);
   }
+}
 
-  if (!clickOn || !clickWav.Valid()) {
+
+void AudioPlayer::playClick(const AudioLib::ClickEvent& event) {
+  AudioComp::ClickVoice_t voice;
+  if (event.level != 0) {
+    voice = AudioComp::CV_Subdivision;
+  } else if (event.beatInBar == 0) {
+    voice = AudioComp::CV_Accent;
+  } else {
+    voice = AudioComp::CV_Normal;
+  }
+
+  // The light only flashes on the beat, when it's heard, which is the output
+  // latency after it's rendered.
+  if (flashOn && event.level == 0) {
+    AudioLib::Player& player = AudioLib::Player::GetPlayer();
+    flasher.FlashAt(player.GetTimeOfFrame(player.GetFramePosition() + event.frameOffset));
+  }
+
+  AudioLib::ClickSample *click = clicks[voice];
+  if (!click) {
+    click = clicks[AudioComp::CV_Normal];
+  }
+
+  if (!clickOn || !click) {
     return;
   }
 
-  // An assumption is made that we'll always get here after the previous click has stopped playing. (In other 
-  // words, click sounds are expected to be short.) I should probably be ensuring that really is the case when 
-  // we get here, though. It might also make sense to enforce a click time length limit in setClickFile().
-  if (!playingClick) {
-    if (AudioLib::Player::GetPlayer().Play(&clickWav)) {
-      playingClick = true;
-    }
-  } else {
-    AudioLib::Player::GetPlayer().Replay();
+  // The click is mixed in at its exact frame within the next block. Downbeats get
+  // their own mixer voice, so they can ring over the previous beat. Otherwise, if
+  // the previous click is still sounding, it gets cut off at that point.
+  AudioLib::MixerVoice_t mixerVoice = voice == AudioComp::CV_Accent ? AudioLib::MV_Accent : AudioLib::MV_Click;
+  AudioLib::Player& player = AudioLib::Player::GetPlayer();
+  player.Play(click, event.frameOffset, event.gain, mixerVoice);
+
+  if (numBlockClicks < AUDIO_MAX_CLICKS_PER_BLOCK) {
+    uint64_t frame = player.GetFramePosition() + event.frameOffset;
+    int64_t sinceOriginUs = static_cast<int64_t>(frame - gridOriginFrame) * 1000000 / PLAYER_SAMPLE_RATE;
+    blockClicks[numBlockClicks].scheduledUs = gridOriginUs + static_cast<uint32_t>(sinceOriginUs);
+    blockClickFrames[numBlockClicks] = frame;
+    numBlockClicks++;
+  }
+}
+
+
+void AudioPlayer::setGridOrigin(uint64_t frame, uint32_t timeUs) {
+  gridOriginFrame = frame;
+  gridOriginUs = timeUs;
+  latencyStats.Reanchor();
+}
+
+
+void AudioPlayer::recordLatency() {
+  // Only now that the block's gone to the driver do we know when it'll be heard.
+  AudioLib::Player& player = AudioLib::Player::GetPlayer();
+  for (uint8_t i = 0; i < numBlockClicks; i++) {
+    blockClicks[i].submittedUs = player.GetWriteTimeUs();
+    blockClicks[i].heardUs = player.GetTimeOfFrame(blockClickFrames[i]);
+    latencyStats.RecordClick(blockClicks[i]);
   }
+
+  numBlockClicks = 0;
+
+  uint32_t skipped = clickTrack.GetSkippedEvents();
+  if (skipped != skippedClicks) {
+    latencyStats.RecordMissedClicks(skipped - skippedClicks);
+    skippedClicks = skipped;
+  }
+
+  latencyStats.RecordBlock(player.GetFramePosition(), player.GetOutputLatencyFrames() - PLAYER_BLOCK_FRAMES);
 }
 
 
-void AudioPlayer::playAudioFile(const char *fileName) {
-  //bool ret = audio.connecttoFS(SDCard::GetFS(), fileName);
-  //bool ret = audio.connecttoSD(fileName);
-  //logPrintf(LOG_COMP_AUDIO, LOG_SEV_INFO, "AUDIO: Start playing from FS. Name: %s, result: %s\n", fileName, ret ? "True" : "False");
+void AudioPlayer::WriteLatencyCsv(AudioLib::LatencyStats::LineWriter writeLine) const {
+  AudioLib::Player& player = AudioLib::Player::GetPlayer();
+  latencyStats.WriteCsv(writeLine, player.GetUnderruns(), player.GetQueueOverflows());
+}
 
-  //AmSingleTypeMessage<bool> retMessage(ret);
-  //AudioMessage audioMessage(AM_PlayFile, &retMessage);
-  //sendMessage(outMessages, &audioMessage);
+
+bool AudioPlayer::playAudioFile(AudioLib::AudioStreamInterface *stream) {
+  // Cuts off the track that was playing, if there was one.
+  return AudioLib::Player::GetPlayer().Play(stream, 0, 1, AudioLib::MV_Backing);
 }
 
 
 bool AudioPlayer::PlayAudioFile(const char *fileName) {
-  bool success = false;
+  size_t len = strlen(fileName);
+  bool isMp3 = len > 4 && strcasecmp(fileName + len - 4, ".mp3") == 0;
+
+  AudioLib::AudioStreamInterface *stream = &backingTracks[nextBackingTrack];
+  if (isMp3) {
+    // It might be the one playing, or be about to be let go by a stop that hasn't
+    // been handled yet.
+    if (backingTrack.load() == &mp3Track && !stopAudioFileAndWait()) {
+      return false;
+    }
+
+    stream = &mp3Track;
+  }
+
+  // The audio task isn't playing this one, so it's safe to open it from here. It
+  // starts reading ahead straight away.
+  if (!stream->Open(fileName, PLAYER_SAMPLE_RATE) || !AudioLib::Player::GetPlayer().Prepare(stream)) {
+    logPrintf(LOG_COMP_AUDIO, LOG_SEV_ERROR, "AUDIO: Unable to play audio file %s\n", fileName);
+    return false;
+  }
+
+  AudioCommand command(AC_PlayFile);
+  command.param.stream = stream;
+
+  // Wait, so we know the audio task has let go of the other one before it's reopened.
+  if (!sendCommandAndWait(command)) {
+    return false;
+  }
+
+  backingTrack = stream;
+  backingTrackOn = true;
+  if (!isMp3) {
+    nextBackingTrack ^= 1;
+  }
+
+  return true;
+}
+
+
+bool AudioPlayer::StopAudioFile() {
+  // Called on every song change, so it's only sent when there's something to
+  // stop, and never waited for. PlayAudioFile() waits if it has to.
+  if (!backingTrackOn) {
+    return true;
+  }
+
+  AudioCommand command(AC_StopFile);
+  if (!sendCommand(command)) {
+    return false;
+  }
+
+  backingTrackOn = false;
+  return true;
+}
+
+
+bool AudioPlayer::stopAudioFileAndWait() {
+  AudioCommand command(AC_StopFile);
+  if (!sendCommandAndWait(command)) {
+    return false;
+  }
+
+  backingTrackOn = false;
+  return true;
+}
+
+
+AudioLib::StreamStats AudioPlayer::GetBackingTrackStats() const {
+  const AudioLib::AudioStreamInterface *stream = backingTrack.load();
+  return stream ? stream->GetStats() : AudioLib::StreamStats();
+}
 
-  AmSingleTypeMessage<const char*> message(fileName);
-  AudioMessage send(AM_PlayFile, &message);
-  if (sendMessage(inMessages, &send)) {
-    logPrintf(LOG_COMP_AUDIO, LOG_SEV_VERBOSE, "AUDIO: Sent play message. Waiting for response...\n");
 
-    AudioMessage response;
-    if (receiveMessageFromAudioThread(AM_PlayFile, &response)) {
-      logPrintf(LOG_COMP_AUDIO, LOG_SEV_VERBOSE, "AUDIO: Play message response received.\n");
-      success = true;
+static bool clickIn(const AudioLib::ClickSample *click, AudioLib::ClickSample* const *set) {
+  for (uint8_t v = 0; v < AudioComp::CV_NumVoices; v++) {
+    if (set[v] == click) {
+      return true;
     }
   }
 
-  return success;
+  return false;
 }
 
 
-void AudioPlayer::setClickFile(const char *fileName) {
-  try {
-    logPrintf(LOG_COMP_AUDIO, LOG_SEV_VERBOSE, "AUDIO: Begin set click file name to %s\n", clickFile.c_str());
-
-    bool success = clickWav.InitFromFile(fileName);
-    if (success) {
-      clickFile = fileName;
-      logPrintf(LOG_COMP_AUDIO, LOG_SEV_INFO, "AUDIO: SUCCESS: Set click file name to %s\n", clickFile.c_str());
-    } else {
-      logPrintf(LOG_COMP_AUDIO, LOG_SEV_ERROR, "AUDIO: Failed to set click file to %s\n", fileName);  
+bool AudioPlayer::selectClicks(AudioLib::ClickSample* const *newClicks) {
+  AudioLib::Player& player = AudioLib::Player::GetPlayer();
+
+  // Sounds that are going are let go first, so the new ones can be baked into
+  // their space. The bank keeps the samples, so there's nothing to load.
+  for (uint8_t v = 0; v < AudioComp::CV_NumVoices; v++) {
+    if (clicks[v] && !clickIn(clicks[v], newClicks)) {
+      player.Stop(clicks[v]);
+      player.Unbake(clicks[v]);
     }
+  }
 
-    AmSingleTypeMessage<bool> retMessage(success);
-    AudioMessage audioMessage(AM_SetClickFile, &retMessage);
-    sendMessage(outMessages, &audioMessage);
+  bool success = true;
+  memcpy(clicks, newClicks, sizeof(clicks));
 
-  } catch (std::bad_alloc&) {
-    logPrintf(LOG_COMP_AUDIO, LOG_SEV_ERROR, "AUDIO: Unable to allocate space for click file name.\n");
+  for (uint8_t v = 0; v < AudioComp::CV_NumVoices; v++) {
+    AudioLib::ClickSample *click = clicks[v];
+    bool seen = false;
+    for (uint8_t other = 0; other < v && !seen; other++) {
+      seen = clicks[other] == click;
+    }
+
+    if (!click || seen) {
+      continue;
+    }
+
+    // A copy for each gain it's played at: one on the beat, and one for each
+    // level of subdivision, where it stands in for the subdivision sound too.
+    bool onBeat = clicks[AudioComp::CV_Normal] == click || clicks[AudioComp::CV_Accent] == click;
+    bool between = clicks[AudioComp::CV_Subdivision] == click ||
+      (!clicks[AudioComp::CV_Subdivision] && clicks[AudioComp::CV_Normal] == click);
+    uint8_t numGains = (onBeat ? 1 : 0) + (between ? CLICKTRACK_NUM_LEVELS - 1 : 0);
+
+    // Room is made for the biggest sound in the bank, so after the first song,
+    // switching sounds never goes to the heap. A sound that's kept between songs
+    // keeps its copies. ADPCM is decoded as it plays, so there's no baking it.
+    if (!player.Prepare(click) || (!click->IsCompressed() && !player.Bake(click, clickBank.GetMaxSamples(), numGains))) {
+      logPrintf(LOG_COMP_AUDIO, LOG_SEV_ERROR, "AUDIO: Unable to bake click sound %s\n", click->GetName());
+      success = false;
+    }
+  }
+
+  // How much sooner each voice sounds than the file it came from would have
+  for (uint8_t v = 0; v < AudioComp::CV_NumVoices; v++) {
+    if (clicks[v]) {
+      logPrintf(LOG_COMP_AUDIO, LOG_SEV_INFO, "AUDIO: Click voice %d is %s, with %d frames of silence trimmed\n",
+        v, clicks[v]->GetName(), clicks[v]->GetTrimmedFrames());
+    }
+  }
+
+  return success;
+}
+
+
+bool AudioPlayer::LoadClickBank(const char *dirName) {
+  // The audio task might be playing out of the old bank. Have it let go first.
+  AudioCommand command(AC_SelectClicks);
+  memset(command.param.clicks, 0, sizeof(command.param.clicks));
+  if (!sendCommandAndWait(command)) {
+    return false;
   }
+
+  bool success = clickBank.LoadDir(dirName, PLAYER_SAMPLE_RATE);
+  logHeapUse("after loading the click sounds");
+  return success;
 }
 
 
-bool AudioPlayer::SetClickFile(const char *fileName) {
-  bool success = false;
+bool AudioPlayer::findClicks(const char *name, AudioLib::ClickSample **found) {
+  // Suffixes for the other voices, after the name of the normal click
+  static const char *voiceSuffixes[AudioComp::CV_NumVoices] = { "", "-accent", "-subdivision" };
 
-  AmSingleTypeMessage<const char*> message(fileName);
-  AudioMessage send(AM_SetClickFile, &message);
-  if (sendMessage(inMessages, &send)) {
-    logPrintf(LOG_COMP_AUDIO, LOG_SEV_VERBOSE, "AUDIO: Sent SetClickFile message. Waiting for response...\n");
+  // Before there were voices to choose from, the default one was click.wav,
+  // accent.wav and subdivision.wav.
+  static const char *defaultNames[AudioComp::CV_NumVoices] = { CLICKBANK_DEFAULT_VOICE, "accent", "subdivision" };
 
-    AudioMessage response;
-    if (receiveMessageFromAudioThread(AM_SetClickFile, &response)) {
-      logPrintf(LOG_COMP_AUDIO, LOG_SEV_VERBOSE, "AUDIO: SetClickFile message response received.\n");
-      success = true;
+  // With no click.wav either, the built-in voice is the one that's always there.
+  if (!clickBank.Find(name)) {
+    const char *fallback = clickBank.Find(CLICKBANK_DEFAULT_VOICE) ? CLICKBANK_DEFAULT_VOICE : CLICKBANK_SYNTH_VOICE;
+    logPrintf(LOG_COMP_AUDIO, LOG_SEV_WARN, "AUDIO: No click sound called %s. Using %s.\n", name, fallback);
+    name = fallback;
+  }
+
+  for (uint8_t v = 0; v < AudioComp::CV_NumVoices; v++) {
+    char voiceName[CLICKBANK_MAX_NAME];
+    snprintf(voiceName, sizeof(voiceName), "%s%s", name, voiceSuffixes[v]);
+    found[v] = clickBank.Find(voiceName);
+    if (!found[v] && strcasecmp(name, CLICKBANK_DEFAULT_VOICE) == 0) {
+      found[v] = clickBank.Find(defaultNames[v]);
     }
   }
 
-  return success;
+  if (!found[AudioComp::CV_Normal]) {
+    logPrintf(LOG_COMP_AUDIO, LOG_SEV_ERROR, "AUDIO: No click sound called %s\n", name);
+    return false;
+  }
+
+  return true;
 }
 
 
-bool AudioPlayer::StartClick(uint16_t bpm) {
-  bool success = false;
+bool AudioPlayer::SetClickVoice(const char *name) {
+  // Looked up here, on the caller's task. All the audio task does is swap pointers.
+  AudioCommand command(AC_SelectClicks);
+  if (!findClicks(name, command.param.clicks)) {
+    return false;
+  }
 
-  AmSingleTypeMessage<uint16_t> message(bpm);
-  AudioMessage send(AM_StartClick, &message);
-  if (sendMessage(inMessages, &send)) {
-    logPrintf(LOG_COMP_AUDIO, LOG_SEV_VERBOSE, "AUDIO: Sent StartClick message. Waiting for response...\n");
+  return sendCommand(command);
+}
 
-    AudioMessage response;
-    if (receiveMessageFromAudioThread(AM_StartClick, &response)) {
-      logPrintf(LOG_COMP_AUDIO, LOG_SEV_VERBOSE, "AUDIO: StartClick message response received.\n");
-      success = true;
+
+bool AudioPlayer::ExportClickTrack(const char *fileName, const std::vector<AudioComp::ExportSong>& songs) {
+  // The renderer has a mixer of its own, and only reads the click sounds, so the
+  // live click doesn't notice.
+  std::vector<AudioLib::RenderSong> renderSongs;
+  std::unique_ptr<AudioLib::OfflineRenderer> renderer;
+  try {
+    renderSongs.reserve(songs.size());
+    for (const AudioComp::ExportSong& exportSong : songs) {
+      AudioLib::ClickSample *found[AudioComp::CV_NumVoices];
+      if (!findClicks(exportSong.clickVoice.c_str(), found)) {
+        return false;
+      }
+
+      renderSongs.push_back(exportSong.song);
+      renderSongs.back().clicks[AudioLib::RC_Normal] = found[AudioComp::CV_Normal];
+      renderSongs.back().clicks[AudioLib::RC_Accent] = found[AudioComp::CV_Accent];
+      renderSongs.back().clicks[AudioLib::RC_Subdivision] = found[AudioComp::CV_Subdivision];
     }
+
+    renderer = std::unique_ptr<AudioLib::OfflineRenderer>(new AudioLib::OfflineRenderer());
+  } catch (std::bad_alloc&) {
+    logPrintf(LOG_COMP_AUDIO, LOG_SEV_ERROR, "AUDIO: Out of memory setting up the export of %s\n", fileName);
+    return false;
   }
 
+  AudioLib::WavFileRenderOutput output;
+  if (!output.Open(fileName)) {
+    return false;
+  }
+
+  renderer->SetVolume(AudioLib::Player::GetPlayer().GetVolume());
+  int64_t startUs = esp_timer_get_time();
+  bool success = renderer->Render(renderSongs, &output);
+  success = output.Close() && success;
+  int64_t elapsedUs = esp_timer_get_time() - startUs;
+
+  // Includes writing to the card, which is usually what's slowest.
+  uint32_t audioMs = static_cast<uint32_t>(renderer->GetNumFrames() * 1000 / PLAYER_SAMPLE_RATE);
+  logPrintf(LOG_COMP_AUDIO, success ? LOG_SEV_INFO : LOG_SEV_ERROR,
+    "AUDIO: Exported %d songs, %d s of click, to %s in %d ms (%dx real time)%s\n", static_cast<int>(songs.size()), audioMs / 1000, fileName,
+    static_cast<int>(elapsedUs / 1000), elapsedUs > 0 ? static_cast<int>(static_cast<int64_t>(audioMs) * 1000 / elapsedUs) : 0,
+    success ? "" : ". It failed part way through.");
   return success;
 }
 
 
-void AudioPlayer::startClick(uint16_t bpm) {
-  // If BPM is zero, then we're restarting the click *NOW* at the same speed.
-  // (This feature is used when out of sync with the click. It allows the user
-  // to hit a trigger to restart the click on the downbeat.)
+bool AudioPlayer::SetTimeSignature(uint8_t beatsPerBar) {
+  AudioCommand command(AC_SetTimeSignature);
+  command.param.beatsPerBar = beatsPerBar;
+  return sendCommand(command);
+}
+
+
+bool AudioPlayer::SetClickPattern(AudioLib::Subdivision_t subdivision, uint8_t swing) {
+  AudioCommand command(AC_SetClickPattern);
+  command.param.pattern.subdivision = subdivision;
+  command.param.pattern.swing = swing;
+  return sendCommand(command);
+}
+
+
+bool AudioPlayer::SetSubdivisionLevels(uint8_t level1Percent, uint8_t level2Percent) {
+  AudioCommand command(AC_SetSubdivisionLevels);
+  command.param.subdivisionLevels[0] = level1Percent;
+  command.param.subdivisionLevels[1] = level2Percent;
+  return sendCommand(command);
+}
+
+
+bool AudioPlayer::SetTempoMap(const AudioLib::TempoMap& tempoMap) {
+  AudioCommand command(AC_SetTempoMap);
+  command.param.tempoMap = NULL;
+
+  if (!tempoMap.Empty()) {
+    // The audio task isn't looking at this one. It's only switched over once the
+    // command below has been handled.
+    AudioLib::TempoMap *slot = &tempoMaps[nextTempoMap];
+    try {
+      *slot = tempoMap;
+    } catch (std::bad_alloc&) {
+      logPrintf(LOG_COMP_AUDIO, LOG_SEV_ERROR, "AUDIO: Unable to allocate space for tempo map.\n");
+      slot->Clear();
+      return false;
+    }
+
+    command.param.tempoMap = slot;
+  }
+
+  // Wait, so we know the audio task is done with the other slot before it gets reused.
+  if (!sendCommandAndWait(command)) {
+    return false;
+  }
+
+  if (command.param.tempoMap) {
+    nextTempoMap ^= 1;
+  }
+
+  return true;
+}
+
+
+bool AudioPlayer::StartClick(float bpm) {
+  AudioCommand command(AC_StartClick);
+  command.param.bpm = bpm;
+  return sendCommand(command);
+}
+
+
+void AudioPlayer::logHeapUse(const char *when) {
+  // Peak use is the total less the low water mark of free space, since boot.
+  size_t total = heap_caps_get_total_size(MALLOC_CAP_INTERNAL);
+  size_t freeBytes = heap_caps_get_free_size(MALLOC_CAP_INTERNAL);
+  size_t minFree = heap_caps_get_minimum_free_size(MALLOC_CAP_INTERNAL);
+  logPrintf(LOG_COMP_AUDIO, LOG_SEV_INFO, "AUDIO: Internal heap %s: %u bytes in use, peak %u, of %u\n", when,
+    static_cast<unsigned>(total - freeBytes), static_cast<unsigned>(total - minFree), static_cast<unsigned>(total));
+
+  total = heap_caps_get_total_size(MALLOC_CAP_SPIRAM);
+  if (total) {
+    freeBytes = heap_caps_get_free_size(MALLOC_CAP_SPIRAM);
+    minFree = heap_caps_get_minimum_free_size(MALLOC_CAP_SPIRAM);
+    logPrintf(LOG_COMP_AUDIO, LOG_SEV_INFO, "AUDIO: PSRAM heap %s: %u bytes in use, peak %u, of %u\n", when,
+      static_cast<unsigned>(total - freeBytes), static_cast<unsigned>(total - minFree), static_cast<unsigned>(total));
+  }
+}
+
+
+void AudioPlayer::startClick(float bpm) {
+  // If BPM is zero, then the click keeps going at the same speed.
   if (bpm != 0) {
-    // Figure out the number of milliseconds between flashes
-    clickDelay = (((float)60) / bpm) * 1000;
-    lastClickPlayed = 0;
+    // First beat goes out at the start of the next block.
+    AudioLib::Player& player = AudioLib::Player::GetPlayer();
+    clickTrack.Start(bpm, player.GetFramePosition());
+    setGridOrigin(player.GetFramePosition(), player.GetTimeOfFrame(player.GetFramePosition()));
   }
+}
 
-  AmSingleTypeMessage<bool> retMessage(true);
-  AudioMessage audioMessage(AM_StartClick, &retMessage);
-  sendMessage(outMessages, &audioMessage);
+
+bool AudioPlayer::ChangeTempo(float bpm) {
+  AudioCommand command(AC_ChangeTempo);
+  command.param.bpm = bpm;
+  return sendCommand(command);
 }
 
 
 bool AudioPlayer::RestartClick(uint32_t startTime) {
-  bool success = false;
-
   if (startTime == 0) {
     startTime = millis();
   }
 
-  AmSingleTypeMessage<uint32_t> message(startTime);
-  AudioMessage send(AM_RestartClick, &message);
-  if (sendMessage(inMessages, &send)) {
-    logPrintf(LOG_COMP_AUDIO, LOG_SEV_VERBOSE, "AUDIO: Sent RetartClick message. Waiting for response...\n");
+  AudioCommand command(AC_RestartClick);
+  command.param.startTime = startTime;
+  return sendCommand(command);
+}
 
-    AudioMessage response;
-    if (receiveMessageFromAudioThread(AM_RestartClick, &response)) {
-      logPrintf(LOG_COMP_AUDIO, LOG_SEV_VERBOSE, "AUDIO: RetartClick message response received.\n");
-      success = true;
-    }
-  }
 
-  return success;
+void AudioPlayer::restartClick(uint32_t startTime) {
+  // startTime is when the trigger was hit, which was a little while ago by the time
+  // we get the message. Anchor the beat grid on that moment so the following
+  // clicks land where they should.
+  uint32_t elapsedMs = millis() - startTime;
+  uint64_t elapsedFrames = static_cast<uint64_t>(elapsedMs) * PLAYER_SAMPLE_RATE / 1000;
+  AudioLib::Player& player = AudioLib::Player::GetPlayer();
+  uint64_t framePosition = player.GetFramePosition();
+  uint64_t anchor = framePosition > elapsedFrames ? framePosition - elapsedFrames : 0;
+
+  clickTrack.Restart(anchor);
+  setGridOrigin(anchor, player.GetTimeOfFrame(anchor));
+  clickOn = true;
 }
 
 
-void AudioPlayer::restartClick(uint32_t startTime) {
-  lastClickPlayed = startTime;
+void AudioPlayer::ResetClickPhase(uint32_t hitTimeUs) {
+  phaseResetTimeUs.store(hitTimeUs, std::memory_order_relaxed);
+  phaseResetSeq.fetch_add(1, std::memory_order_release);
+}
+
+
+void AudioPlayer::applyPhaseReset() {
+  uint32_t seq = phaseResetSeq.load(std::memory_order_acquire);
+  if (seq == appliedPhaseResetSeq) {
+    return;
+  }
+
+  appliedPhaseResetSeq = seq;
+  uint32_t hitTimeUs = phaseResetTimeUs.load(std::memory_order_relaxed);
+
+  // The hit is anchored on the frame that was being heard when it happened, not
+  // on the block we're about to render, so the grid stays locked to the drummer no
+  // matter how long the hit took to get here. It only matters that it got here
+  // before the next click was due to be rendered.
+  AudioLib::Player& player = AudioLib::Player::GetPlayer();
+  uint64_t anchor = player.GetFrameAtTime(hitTimeUs);
+  clickTrack.Restart(anchor);
+  setGridOrigin(anchor, hitTimeUs);
   clickOn = true;
 
-  AmSingleTypeMessage<bool> retMessage(true);
-  AudioMessage audioMessage(AM_RestartClick, &retMessage);
-  sendMessage(outMessages, &audioMessage);
+  uint32_t handoffUs = static_cast<uint32_t>(esp_timer_get_time()) - hitTimeUs;
+  lastHandoffUs.store(handoffUs, std::memory_order_relaxed);
+  if (handoffUs > maxHandoffUs.load(std::memory_order_relaxed)) {
+    maxHandoffUs.store(handoffUs, std::memory_order_relaxed);
+  }
+
+  phaseResets.fetch_add(1, std::memory_order_relaxed);
+}
+
+
+AudioComp::TriggerLatency AudioPlayer::GetTriggerLatency() const {
+  AudioComp::TriggerLatency latency;
+  latency.hits = phaseResets.load(std::memory_order_relaxed);
+  latency.handoffUs = lastHandoffUs.load(std::memory_order_relaxed);
+  latency.maxHandoffUs = maxHandoffUs.load(std::memory_order_relaxed);
+  latency.outputUs = AudioLib::Player::GetOutputLatencyUs();
+  return latency;
 }
 
 
@@ -538,21 +1058,96 @@ bool AudioComp::PlayAudioFile(const char *fileName) {
 }
 
 
-bool AudioComp::SetClickFile(const char *fileName) {
-  return audioPlayer.SetClickFile(fileName);
+bool AudioComp::StopAudioFile() {
+  return audioPlayer.StopAudioFile();
 }
 
 
-bool AudioComp::StartClick(uint16_t bpm) {
+bool AudioComp::LoadClickBank(const char *dirName) {
+  return audioPlayer.LoadClickBank(dirName);
+}
+
+
+bool AudioComp::SetClickVoice(const char *name) {
+  return audioPlayer.SetClickVoice(name);
+}
+
+
+bool AudioComp::SetTimeSignature(uint8_t beatsPerBar) {
+  return audioPlayer.SetTimeSignature(beatsPerBar);
+}
+
+
+bool AudioComp::SetClickPattern(AudioLib::Subdivision_t subdivision, uint8_t swing) {
+  return audioPlayer.SetClickPattern(subdivision, swing);
+}
+
+
+bool AudioComp::SetSubdivisionLevels(uint8_t level1Percent, uint8_t level2Percent) {
+  return audioPlayer.SetSubdivisionLevels(level1Percent, level2Percent);
+}
+
+
+bool AudioComp::SetTempoMap(const AudioLib::TempoMap& tempoMap) {
+  return audioPlayer.SetTempoMap(tempoMap);
+}
+
+
+bool AudioComp::StartClick(float bpm) {
   return audioPlayer.StartClick(bpm);
 }
 
 
+bool AudioComp::ChangeTempo(float bpm) {
+  return audioPlayer.ChangeTempo(bpm);
+}
+
+
 bool AudioComp::RestartClick(uint32_t startTime) {
   return audioPlayer.RestartClick(startTime);
 }
 
 
+void AudioComp::ResetClickPhase(uint32_t hitTimeUs) {
+  audioPlayer.ResetClickPhase(hitTimeUs);
+}
+
+
+AudioComp::TriggerLatency AudioComp::GetTriggerLatency() {
+  return audioPlayer.GetTriggerLatency();
+}
+
+
+void AudioComp::WriteLatencyCsv(AudioLib::LatencyStats::LineWriter writeLine) {
+  audioPlayer.WriteLatencyCsv(writeLine);
+}
+
+
+void AudioComp::ClearLatencyStats() {
+  audioPlayer.ClearLatencyStats();
+}
+
+
+bool AudioComp::ExportClickTrack(const char *fileName, const std::vector<ExportSong>& songs) {
+  return audioPlayer.ExportClickTrack(fileName, songs);
+}
+
+
+AudioLib::StreamStats AudioComp::GetBackingTrackStats() {
+  return audioPlayer.GetBackingTrackStats();
+}
+
+
+bool AudioComp::RunDiagnostics() {
+  return audioPlayer.RunDiagnostics();
+}
+
+
+bool AudioComp::RunStreamCheck() {
+  return audioPlayer.RunStreamCheck();
+}
+
+
 bool AudioComp::StopClick() {
   audioPlayer.StopClick();
   return true;
@@ -569,3 +1164,18 @@ bool AudioComp::StopFlash() {
   audioPlayer.StopFlash();
   return true;
 }
+
+
+uint32_t AudioComp::GetCommandQueueDepth() {
+  return audioPlayer.GetCommandRing().GetDepth();
+}
+
+
+uint32_t AudioComp::GetCommandQueueHighWater() {
+  return audioPlayer.GetCommandRing().GetHighWater();
+}
+
+
+uint32_t AudioComp::GetCommandsDropped() {
+  return audioPlayer.GetCommandRing().GetDropped();
+}
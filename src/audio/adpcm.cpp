@@ -0,0 +1,213 @@
+#include <string.h>
+
+#include "audio/adpcm.hpp"
+
+
+namespace AudioLib {
+
+// Each channel's header: the first sample, the step index, and a spare byte
+#define ADPCM_HEADER_BYTES 4
+
+// The channels take turns in groups of this many bytes (8 samples)
+#define ADPCM_GROUP_BYTES 4
+
+#define ADPCM_MAX_STEP_INDEX 88
+
+
+static const int16_t stepTable[ADPCM_MAX_STEP_INDEX + 1] = {
+  7, 8, 9, 10, 11, 12, 13, 14, 16, 17, 19, 21, 23, 25, 28, 31, 34, 37, 41, 45,
+  50, 55, 60, 66, 73, 80, 88, 97, 107, 118, 130, 143, 157, 173, 190, 209, 230,
+  253, 279, 307, 337, 371, 408, 449, 494, 544, 598, 658, 724, 796, 876, 963,
+  1060, 1166, 1282, 1411, 1552, 1707, 1878, 2066, 2272, 2499, 2749, 3024, 3327,
+  3660, 4026, 4428, 4871, 5358, 5894, 6484, 7132, 7845, 8630, 9493, 10442, 11487,
+  12635, 13899, 15289, 16818, 18500, 20350, 22385, 24623, 27086, 29794, 32767
+};
+
+static const int8_t indexTable[16] = {
+  -1, -1, -1, -1, 2, 4, 6, 8,
+  -1, -1, -1, -1, 2, 4, 6, 8
+};
+
+
+// Where one channel has got to. The encoder keeps exactly the decoder's state, so
+// it's working from what will be heard rather than from what it was given.
+class AdpcmChannel {
+public:
+  AdpcmChannel():
+    predictor(0),
+    index(0) {}
+
+  int16_t Decode(uint8_t nibble) {
+    int32_t step = stepTable[index];
+    int32_t delta = step >> 3;
+    if (nibble & 4) {
+      delta += step;
+    }
+    if (nibble & 2) {
+      delta += step >> 1;
+    }
+    if (nibble & 1) {
+      delta += step >> 2;
+    }
+
+    advance(nibble, delta);
+    return predictor;
+  }
+
+  uint8_t Encode(int16_t sample) {
+    int32_t step = stepTable[index];
+    int32_t diff = sample - predictor;
+    uint8_t nibble = 0;
+    if (diff < 0) {
+      nibble = 8;
+      diff = -diff;
+    }
+
+    // The same sum as Decode(), a bit at a time
+    int32_t delta = step >> 3;
+    for (uint8_t bit = 4; bit; bit >>= 1) {
+      if (diff >= step) {
+        nibble |= bit;
+        diff -= step;
+        delta += step;
+      }
+
+      step >>= 1;
+    }
+
+    advance(nibble, delta);
+    return nibble;
+  }
+
+  int16_t GetPredictor() const { return predictor; }
+
+  void ReadHeader(const uint8_t *header) {
+    predictor = static_cast<int16_t>(header[0] | (header[1] << 8));
+    index = header[2] > ADPCM_MAX_STEP_INDEX ? ADPCM_MAX_STEP_INDEX : header[2];
+  }
+
+  void WriteHeader(uint8_t *header, int16_t first) {
+    predictor = first;
+    header[0] = static_cast<uint8_t>(first);
+    header[1] = static_cast<uint8_t>(static_cast<uint16_t>(first) >> 8);
+    header[2] = index;
+    header[3] = 0;
+  }
+
+private:
+  void advance(uint8_t nibble, int32_t delta) {
+    int32_t val = (nibble & 8) ? predictor - delta : predictor + delta;
+    predictor = static_cast<int16_t>(val > INT16_MAX ? INT16_MAX : (val < INT16_MIN ? INT16_MIN : val));
+
+    int32_t next = index + indexTable[nibble];
+    index = static_cast<uint8_t>(next < 0 ? 0 : (next > ADPCM_MAX_STEP_INDEX ? ADPCM_MAX_STEP_INDEX : next));
+  }
+
+  int16_t predictor;
+  uint8_t index;
+};
+
+
+///////////////////////////////////////////////////////////////////////////////
+// namespace ImaAdpcm
+///////////////////////////////////////////////////////////////////////////////
+uint32_t ImaAdpcm::GetFramesPerBlock(uint32_t blockAlign, uint16_t numChannels) {
+  if ((numChannels != 1 && numChannels != 2) || blockAlign <= ADPCM_HEADER_BYTES * numChannels ||
+      (blockAlign - ADPCM_HEADER_BYTES * numChannels) % (ADPCM_GROUP_BYTES * numChannels) != 0) {
+    return 0;
+  }
+
+  return (blockAlign / numChannels - ADPCM_HEADER_BYTES) * 2 + 1;
+}
+
+
+uint32_t ImaAdpcm::GetEncodedBytes(uint32_t numFrames, uint16_t numChannels) {
+  uint32_t numBlocks = (numFrames + ADPCM_FRAMES_PER_BLOCK - 1) / ADPCM_FRAMES_PER_BLOCK;
+  return numBlocks * ADPCM_BLOCK_BYTES_PER_CHANNEL * numChannels;
+}
+
+
+uint32_t ImaAdpcm::DecodeBlock(const uint8_t *in, uint32_t blockAlign, uint16_t numChannels, int16_t *out, uint16_t outChannels,
+    uint32_t maxFrames) {
+  uint32_t numFrames = GetFramesPerBlock(blockAlign, numChannels);
+  if (numFrames > maxFrames) {
+    numFrames = maxFrames;
+  }
+
+  if (!numFrames) {
+    return 0;
+  }
+
+  const uint8_t *data = in + ADPCM_HEADER_BYTES * numChannels;
+  uint16_t decodeChannels = numChannels < outChannels ? numChannels : outChannels;
+  for (uint16_t c = 0; c < decodeChannels; c++) {
+    AdpcmChannel channel;
+    channel.ReadHeader(in + ADPCM_HEADER_BYTES * c);
+    out[c] = channel.GetPredictor();
+
+    // After the header, 8 samples at a time, 2 to a byte, low nibble first.
+    const uint8_t *group = data + ADPCM_GROUP_BYTES * c;
+    int16_t *sample = out + outChannels + c;
+    for (uint32_t frame = 1; frame < numFrames; group += ADPCM_GROUP_BYTES * numChannels) {
+      for (uint8_t i = 0; i < ADPCM_GROUP_BYTES && frame < numFrames; i++) {
+        *sample = channel.Decode(group[i] & 0x0f);
+        sample += outChannels;
+        if (++frame < numFrames) {
+          *sample = channel.Decode(group[i] >> 4);
+          sample += outChannels;
+          frame++;
+        }
+      }
+    }
+  }
+
+  if (outChannels > numChannels) {
+    for (uint32_t frame = 0; frame < numFrames; frame++) {
+      out[frame * 2 + 1] = out[frame * 2];
+    }
+  }
+
+  return numFrames;
+}
+
+
+uint32_t ImaAdpcm::Encode(const int16_t *in, uint32_t numFrames, uint16_t numChannels, uint8_t *out) {
+  if (numChannels != 1 && numChannels != 2) {
+    return 0;
+  }
+
+  AdpcmChannel channels[2];
+  uint32_t blockBytes = ADPCM_BLOCK_BYTES_PER_CHANNEL * numChannels;
+  uint32_t written = 0;
+
+  for (uint32_t start = 0; start < numFrames; start += ADPCM_FRAMES_PER_BLOCK) {
+    // Built up on the side, since in place it would overwrite what it's reading.
+    uint8_t block[ADPCM_BLOCK_BYTES_PER_CHANNEL * 2];
+    memset(block, 0, blockBytes);
+
+    uint32_t blockFrames = numFrames - start < ADPCM_FRAMES_PER_BLOCK ? numFrames - start : ADPCM_FRAMES_PER_BLOCK;
+    const int16_t *blockIn = in + start * numChannels;
+    uint8_t *data = block + ADPCM_HEADER_BYTES * numChannels;
+    for (uint16_t c = 0; c < numChannels; c++) {
+      channels[c].WriteHeader(block + ADPCM_HEADER_BYTES * c, blockIn[c]);
+
+      for (uint32_t frame = 1; frame < ADPCM_FRAMES_PER_BLOCK; frame++) {
+        int16_t sample = frame < blockFrames ? blockIn[frame * numChannels + c] : 0;
+        uint8_t nibble = channels[c].Encode(sample);
+
+        // Frame 1 is the first nibble of the channel's first group.
+        uint32_t pos = frame - 1;
+        uint8_t *byte = data + (pos / 8) * ADPCM_GROUP_BYTES * numChannels + ADPCM_GROUP_BYTES * c + (pos % 8) / 2;
+        *byte |= (pos & 1) ? nibble << 4 : nibble;
+      }
+    }
+
+    memcpy(out + written, block, blockBytes);
+    written += blockBytes;
+  }
+
+  return written;
+}
+
+
+} // namespace AudioLib
@@ -0,0 +1,354 @@
+#include <algorithm>
+#include <dirent.h>
+#include <stdio.h>
+#include <string>
+#include <string.h>
+#include <strings.h>
+
+#include <esp_heap_caps.h>
+
+#include "audio/adpcm.hpp"
+#include "audio/clickbank.hpp"
+#include "audio/clickprep.hpp"
+#include "audio/clicksynth.hpp"
+#include "audio/memwav.hpp"
+#include "audio/resampler.hpp"
+#include "audio/wav.hpp"
+#include "log.hpp"
+
+
+namespace AudioLib {
+
+// Directory plus file name
+#define CLICKBANK_MAX_PATH 128
+
+
+// The sounds of the built-in voice: a ping, a higher and slightly longer one on
+// the downbeat, and a short tick of noise between beats. About 8 KB in all.
+class SynthSound {
+public:
+  const char *name;
+  ClickSynthVoice voice;
+};
+
+static const SynthSound synthSounds[] = {
+  { CLICKBANK_SYNTH_VOICE, ClickSynthVoice(CS_Ping, 1500, 6) },
+  { CLICKBANK_SYNTH_VOICE "-accent", ClickSynthVoice(CS_Ping, 2500, 8) },
+  { CLICKBANK_SYNTH_VOICE "-subdivision", ClickSynthVoice(CS_Noise, 4000, 3) }
+};
+
+
+static bool isWavFile(const char *fileName) {
+  size_t len = strlen(fileName);
+  return len > 4 && strcasecmp(fileName + len - 4, ".wav") == 0;
+}
+
+
+///////////////////////////////////////////////////////////////////////////////
+// class ClickBank
+///////////////////////////////////////////////////////////////////////////////
+ClickBank::ClickBank():
+  arena(NULL),
+  arenaSize(0),
+  inPsram(false),
+  maxSamples(0),
+  bytesSaved(0) {}
+
+
+ClickBank::~ClickBank() {
+  clear();
+}
+
+
+void ClickBank::clear() {
+  entries.clear();
+  if (arena) {
+    heap_caps_free(arena);
+    arena = NULL;
+  }
+
+  arenaSize = 0;
+  inPsram = false;
+  maxSamples = 0;
+  bytesSaved = 0;
+}
+
+
+bool ClickBank::listDir(const char *dirName, uint32_t outputRate, std::vector<LoadInfo>& files) {
+  DIR *dp = opendir(dirName);
+  if (!dp) {
+    logPrintf(LOG_COMP_AUDIO, LOG_SEV_ERROR, "ClickBank: Unable to open directory %s\n", dirName);
+    return false;
+  }
+
+  // Only the headers are read here, to find out how much room everything needs
+  // once it's converted. Mono files stay mono, and anything else might not.
+  Resampler resampler;
+  struct dirent *ep;
+  while ((ep = readdir(dp)) != NULL && files.size() < CLICKBANK_MAX_SAMPLES) {
+    if (!isWavFile(ep->d_name)) {
+      continue;
+    }
+
+    if (strlen(ep->d_name) - 4 >= CLICKBANK_MAX_NAME) {
+      logPrintf(LOG_COMP_AUDIO, LOG_SEV_WARN, "ClickBank: Skipping %s. The name is too long.\n", ep->d_name);
+      continue;
+    }
+
+    char path[CLICKBANK_MAX_PATH];
+    snprintf(path, sizeof(path), "%s/%s", dirName, ep->d_name);
+    FILE *file = fopen(path, "r");
+    if (!file) {
+      logPrintf(LOG_COMP_AUDIO, LOG_SEV_WARN, "ClickBank: Unable to open %s\n", path);
+      continue;
+    }
+
+    WavHeader header;
+    bool valid = header.ReadFromFile(file);
+    fclose(file);
+    if (!valid) {
+      logPrintf(LOG_COMP_AUDIO, LOG_SEV_WARN, "ClickBank: Skipping %s: %s\n", path, header.GetError());
+      continue;
+    }
+
+    uint8_t numChannels = header.numChannels == 1 ? 1 : 2;
+    uint32_t numFrames = header.GetNumFrames();
+    if (header.samplesPerSecond != outputRate) {
+      if (!resampler.Init(header.samplesPerSecond, outputRate, numChannels)) {
+        logPrintf(LOG_COMP_AUDIO, LOG_SEV_WARN, "ClickBank: Skipping %s. Can't resample from %d.\n", path, header.samplesPerSecond);
+        continue;
+      }
+
+      numFrames = resampler.GetMaxOutputFrames(numFrames);
+    }
+
+    LoadInfo info;
+    strcpy(info.fileName, ep->d_name);
+    info.numSamples = numFrames * numChannels;
+    files.push_back(info);
+  }
+
+  closedir(dp);
+  return true;
+}
+
+
+bool ClickBank::allocArena(uint32_t numSamples) {
+  uint32_t size = numSamples * sizeof(int16_t);
+  uint32_t caps = MALLOC_CAP_SPIRAM;
+  arena = static_cast<int16_t*>(heap_caps_malloc(size, caps | MALLOC_CAP_8BIT));
+  if (!arena) {
+    // Boards without PSRAM still get a bank, if the clicks are small enough.
+    caps = MALLOC_CAP_INTERNAL;
+    arena = static_cast<int16_t*>(heap_caps_malloc(size, caps | MALLOC_CAP_8BIT));
+    if (!arena) {
+      logPrintf(LOG_COMP_AUDIO, LOG_SEV_ERROR, "ClickBank: Unable to allocate %u bytes\n", static_cast<unsigned>(size));
+      return false;
+    }
+  }
+
+  inPsram = caps == MALLOC_CAP_SPIRAM;
+  arenaSize = size;
+  return true;
+}
+
+
+bool ClickBank::LoadDir(const char *dirName, uint32_t outputRate) {
+  clear();
+
+  std::vector<LoadInfo> files;
+  try {
+    files.reserve(CLICKBANK_MAX_SAMPLES);
+    if (listDir(dirName, outputRate, files) && files.empty()) {
+      logPrintf(LOG_COMP_AUDIO, LOG_SEV_WARN, "ClickBank: No click files in %s. Only the built-in clicks will be there.\n", dirName);
+    }
+
+    uint32_t totalSamples = 0;
+    for (const LoadInfo& info : files) {
+      totalSamples += info.numSamples;
+    }
+
+    uint8_t numSynthSounds = sizeof(synthSounds) / sizeof(synthSounds[0]);
+    for (uint8_t s = 0; s < numSynthSounds; s++) {
+      totalSamples += ClickSynth::GetNumFrames(synthSounds[s].voice, outputRate);
+    }
+
+    if (!allocArena(totalSamples)) {
+      return false;
+    }
+
+    entries.reserve(files.size() + numSynthSounds);
+    std::vector<uint32_t> offsets;
+    offsets.reserve(files.size() + numSynthSounds);
+
+    // Each file goes through the one MemWav, which converts and resamples it, and
+    // is copied into the arena from there. The MemWav's buffers go when we return.
+    MemWav loader;
+    uint32_t used = 0;
+    for (const LoadInfo& info : files) {
+      char path[CLICKBANK_MAX_PATH];
+      snprintf(path, sizeof(path), "%s/%s", dirName, info.fileName);
+      if (!loader.InitFromFile(path, outputRate)) {
+        logPrintf(LOG_COMP_AUDIO, LOG_SEV_WARN, "ClickBank: Skipping %s\n", path);
+        continue;
+      }
+
+      const AudioSamples *samples = loader.GetSamples();
+      uint32_t numSamples = samples->len / sizeof(int16_t);
+      if (numSamples > info.numSamples) {
+        // Can't happen, unless the file changed under us.
+        logPrintf(LOG_COMP_AUDIO, LOG_SEV_WARN, "ClickBank: Skipping %s. It's bigger than its header said.\n", path);
+        continue;
+      }
+
+      memcpy(arena + used, samples->samples, samples->len);
+
+      // Trimming only ever makes it shorter, so it's done in place.
+      uint8_t numChannels = loader.GetNumChannels();
+      ClickPrep::Result prep;
+      uint32_t numFrames = ClickPrep::Process(arena + used, numSamples / numChannels, numChannels,
+        outputRate * CLICKBANK_MAX_CLICK_MS / 1000, &prep);
+      numSamples = numFrames * numChannels;
+
+      ClickSample entry;
+      size_t nameLen = strlen(info.fileName) - 4;
+      memcpy(entry.name, info.fileName, nameLen);
+      entry.name[nameLen] = '\0';
+      entry.samples.len = numSamples * sizeof(int16_t);
+      entry.sampleRate = loader.GetSampleRate();
+      entry.numChannels = numChannels;
+      entry.numFrames = numFrames;
+      entry.trimmedFrames = prep.leadingFrames;
+
+      logPrintf(LOG_COMP_AUDIO, LOG_SEV_INFO, "ClickBank: %s: Trimmed %d frames (%d us) from the start and %d from the end, cut %d, gain %s\n",
+        entry.name, prep.leadingFrames, static_cast<int>(static_cast<uint64_t>(prep.leadingFrames) * 1000000 / outputRate),
+        prep.trailingFrames, prep.truncatedFrames, std::to_string(prep.gain).c_str());
+
+      if (numFrames >= outputRate * CLICKBANK_ADPCM_MIN_MS / 1000) {
+        compress(entry, arena + used);
+      }
+
+      offsets.push_back(used);
+      used += entry.samples.len / sizeof(int16_t);
+      if (!entry.IsCompressed() && numSamples > maxSamples) {
+        maxSamples = numSamples;
+      }
+
+      entries.push_back(entry);
+    }
+
+    if (entries.empty() && !files.empty()) {
+      logPrintf(LOG_COMP_AUDIO, LOG_SEV_ERROR, "ClickBank: None of the click files in %s could be loaded\n", dirName);
+    }
+
+    used = synthesize(outputRate, used, offsets);
+    if (entries.empty()) {
+      clear();
+      return false;
+    }
+
+    // Stereo that turned out to be mono, and headroom left for resampling, comes
+    // back off the end. The arena might move, so nothing points into it until now.
+    uint32_t caps = (inPsram ? MALLOC_CAP_SPIRAM : MALLOC_CAP_INTERNAL) | MALLOC_CAP_8BIT;
+    void *shrunk = heap_caps_realloc(arena, used * sizeof(int16_t), caps);
+    if (shrunk) {
+      arena = static_cast<int16_t*>(shrunk);
+      arenaSize = used * sizeof(int16_t);
+    }
+
+    for (uint32_t i = 0; i < entries.size(); i++) {
+      entries[i].samples.samples = reinterpret_cast<const uint8_t*>(arena + offsets[i]);
+    }
+
+    std::sort(entries.begin(), entries.end(), [](const ClickSample& a, const ClickSample& b) {
+      return strcasecmp(a.name, b.name) < 0;
+    });
+  } catch (std::bad_alloc&) {
+    logPrintf(LOG_COMP_AUDIO, LOG_SEV_ERROR, "ClickBank: Out of memory loading %s\n", dirName);
+    clear();
+    return false;
+  }
+
+  logPrintf(LOG_COMP_AUDIO, LOG_SEV_INFO, "ClickBank: Loaded %d click sounds from %s, %u bytes in %s (%u saved by ADPCM)\n",
+    static_cast<int>(entries.size()), dirName, static_cast<unsigned>(arenaSize), inPsram ? "PSRAM" : "internal RAM",
+    static_cast<unsigned>(bytesSaved));
+
+  for (const ClickSample& entry : entries) {
+    logPrintf(LOG_COMP_AUDIO, LOG_SEV_VERBOSE, "ClickBank: %s: %d samples, %d channels, %d bits\n", entry.name, entry.GetNumSamples(),
+      entry.numChannels, entry.bitsPerSample);
+  }
+
+  return true;
+}
+
+
+uint32_t ClickBank::synthesize(uint32_t outputRate, uint32_t used, std::vector<uint32_t>& offsets) {
+  // Rendered straight into the arena, after the files, and prepared the same way.
+  for (const SynthSound& sound : synthSounds) {
+    bool replaced = false;
+    for (const ClickSample& entry : entries) {
+      replaced = replaced || strcasecmp(entry.name, sound.name) == 0;
+    }
+
+    if (replaced) {
+      logPrintf(LOG_COMP_AUDIO, LOG_SEV_INFO, "ClickBank: Using %s.wav rather than the built-in sound\n", sound.name);
+      continue;
+    }
+
+    uint32_t numFrames = ClickSynth::Render(sound.voice, outputRate, arena + used);
+    ClickPrep::Result prep;
+    numFrames = ClickPrep::Process(arena + used, numFrames, 1, 0, &prep);
+    if (!numFrames) {
+      continue;
+    }
+
+    ClickSample entry;
+    strcpy(entry.name, sound.name);
+    entry.samples.len = numFrames * sizeof(int16_t);
+    entry.sampleRate = outputRate;
+    entry.numChannels = 1;
+    entry.numFrames = numFrames;
+    entry.trimmedFrames = prep.leadingFrames;
+    entries.push_back(entry);
+
+    offsets.push_back(used);
+    used += numFrames;
+    if (numFrames > maxSamples) {
+      maxSamples = numFrames;
+    }
+  }
+
+  return used;
+}
+
+
+void ClickBank::compress(ClickSample& entry, int16_t *pcm) {
+  // The ADPCM is never bigger than the samples, so it's written over them. The
+  // last block is padded out with silence, which a faded click ends in anyway.
+  uint32_t pcmBytes = entry.samples.len;
+  uint32_t adpcmBytes = ImaAdpcm::Encode(pcm, entry.numFrames, entry.numChannels, reinterpret_cast<uint8_t*>(pcm));
+  entry.samples.len = adpcmBytes;
+  entry.bitsPerSample = ADPCM_BITS_PER_SAMPLE;
+  entry.numFrames = adpcmBytes / (ADPCM_BLOCK_BYTES_PER_CHANNEL * entry.numChannels) * ADPCM_FRAMES_PER_BLOCK;
+  bytesSaved += pcmBytes - adpcmBytes;
+
+  logPrintf(LOG_COMP_AUDIO, LOG_SEV_INFO, "ClickBank: %s: Kept as ADPCM, %u bytes rather than %u\n", entry.name,
+    static_cast<unsigned>(adpcmBytes), static_cast<unsigned>(pcmBytes));
+}
+
+
+ClickSample* ClickBank::Find(const char *name) {
+  std::vector<ClickSample>::iterator it = std::lower_bound(entries.begin(), entries.end(), name,
+    [](const ClickSample& entry, const char *key) {
+      return strcasecmp(entry.name, key) < 0;
+    });
+
+  if (it == entries.end() || strcasecmp(it->name, name) != 0) {
+    return NULL;
+  }
+
+  return &*it;
+}
+
+
+} // namespace AudioLib
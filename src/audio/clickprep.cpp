@@ -0,0 +1,105 @@
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "audio/clickprep.hpp"
+
+
+namespace AudioLib {
+
+static int32_t framePeak(const int16_t *frame, uint8_t numChannels) {
+  int32_t peak = 0;
+  for (uint8_t c = 0; c < numChannels; c++) {
+    int32_t level = abs(frame[c]);
+    if (level > peak) {
+      peak = level;
+    }
+  }
+
+  return peak;
+}
+
+
+static int16_t scaleSample(int16_t sample, float gain) {
+  long val = lroundf(sample * gain);
+  if (val > INT16_MAX) {
+    return INT16_MAX;
+  } else if (val < INT16_MIN) {
+    return INT16_MIN;
+  }
+
+  return static_cast<int16_t>(val);
+}
+
+
+///////////////////////////////////////////////////////////////////////////////
+// namespace ClickPrep
+///////////////////////////////////////////////////////////////////////////////
+uint32_t ClickPrep::Process(int16_t *samples, uint32_t numFrames, uint8_t numChannels, uint32_t maxFrames, Result *result) {
+  *result = Result();
+
+  for (uint32_t frame = 0; frame < numFrames; frame++) {
+    int32_t peak = framePeak(samples + frame * numChannels, numChannels);
+    if (peak > result->peak) {
+      result->peak = peak;
+    }
+  }
+
+  if (result->peak == 0) {
+    return numFrames;
+  }
+
+  int32_t threshold = result->peak / CLICKPREP_SILENCE_RATIO;
+  uint32_t first = 0;
+  while (framePeak(samples + first * numChannels, numChannels) <= threshold) {
+    first++;
+  }
+
+  uint32_t end = numFrames;
+  while (framePeak(samples + (end - 1) * numChannels, numChannels) <= threshold) {
+    end--;
+  }
+
+  uint32_t start = first > CLICKPREP_PREROLL_FRAMES ? first - CLICKPREP_PREROLL_FRAMES : 0;
+  uint32_t fadeInFrames = first - start;
+  result->leadingFrames = start;
+  result->trailingFrames = numFrames - end;
+
+  uint32_t length = end - start;
+  if (maxFrames && length > maxFrames) {
+    result->truncatedFrames = length - maxFrames;
+    length = maxFrames;
+  }
+
+  if (start) {
+    memmove(samples, samples + start * numChannels, length * numChannels * sizeof(int16_t));
+  }
+
+  result->gain = static_cast<float>(CLICKPREP_TARGET_PEAK) / result->peak;
+  if (result->gain > CLICKPREP_MAX_GAIN) {
+    result->gain = CLICKPREP_MAX_GAIN;
+  }
+
+  uint32_t fadeOutFrames = length / 2 < CLICKPREP_FADE_FRAMES ? length / 2 : CLICKPREP_FADE_FRAMES;
+  for (uint32_t frame = 0; frame < length; frame++) {
+    // The gain and both fades in one go. The last frame comes out at zero.
+    float gain = result->gain;
+    if (frame < fadeInFrames) {
+      gain *= static_cast<float>(frame) / fadeInFrames;
+    }
+
+    if (frame >= length - fadeOutFrames) {
+      gain *= static_cast<float>(length - 1 - frame) / fadeOutFrames;
+    }
+
+    int16_t *out = samples + frame * numChannels;
+    for (uint8_t c = 0; c < numChannels; c++) {
+      out[c] = scaleSample(out[c], gain);
+    }
+  }
+
+  return length;
+}
+
+
+} // namespace AudioLib
@@ -0,0 +1,87 @@
+#include <math.h>
+
+#include "audio/clicksynth.hpp"
+
+
+namespace AudioLib {
+
+// Any seed will do. A fixed one means the noise is the same every boot.
+#define CLICKSYNTH_NOISE_SEED 0x9e3779b9u
+
+
+// xorshift32, scaled to -1 to 1
+static float nextNoise(uint32_t *state) {
+  uint32_t x = *state;
+  x ^= x << 13;
+  x ^= x >> 17;
+  x ^= x << 5;
+  *state = x;
+  return static_cast<int32_t>(x) / 2147483648.0f;
+}
+
+
+///////////////////////////////////////////////////////////////////////////////
+// namespace ClickSynth
+///////////////////////////////////////////////////////////////////////////////
+uint32_t ClickSynth::GetNumFrames(const ClickSynthVoice& voice, uint32_t sampleRate) {
+  float decayMs = voice.decayMs < CLICKSYNTH_MAX_DECAY_MS ? voice.decayMs : CLICKSYNTH_MAX_DECAY_MS;
+  if (decayMs < 0) {
+    decayMs = 0;
+  }
+
+  uint32_t attackFrames = static_cast<uint32_t>(static_cast<uint64_t>(sampleRate) * CLICKSYNTH_ATTACK_US / 1000000);
+  return attackFrames + static_cast<uint32_t>(decayMs * CLICKSYNTH_DECAY_LENGTHS * sampleRate / 1000);
+}
+
+
+uint32_t ClickSynth::Render(const ClickSynthVoice& voice, uint32_t sampleRate, int16_t *out) {
+  if (voice.pitchHz <= 0 || voice.pitchHz >= sampleRate / 2 || voice.decayMs <= 0) {
+    return 0;
+  }
+
+  float decayMs = voice.decayMs < CLICKSYNTH_MAX_DECAY_MS ? voice.decayMs : CLICKSYNTH_MAX_DECAY_MS;
+  uint32_t numFrames = GetNumFrames(voice, sampleRate);
+  uint32_t attackFrames = static_cast<uint32_t>(static_cast<uint64_t>(sampleRate) * CLICKSYNTH_ATTACK_US / 1000000);
+  float decay = expf(-1000.0f / (decayMs * sampleRate));
+  float omega = 2 * static_cast<float>(M_PI) * voice.pitchHz / sampleRate;
+
+  // Band-pass for the noise, with 0 dB at the pitch (RBJ's cookbook), already
+  // divided through by a0.
+  float alpha = sinf(omega) / (2 * CLICKSYNTH_NOISE_Q);
+  float b0 = alpha / (1 + alpha);
+  float a1 = -2 * cosf(omega) / (1 + alpha);
+  float a2 = (1 - alpha) / (1 + alpha);
+  float x1 = 0, x2 = 0, y1 = 0, y2 = 0;
+  uint32_t noiseState = CLICKSYNTH_NOISE_SEED;
+
+  float envelope = 1;
+  for (uint32_t frame = 0; frame < numFrames; frame++) {
+    float sample;
+    if (voice.shape == CS_Noise) {
+      float x = nextNoise(&noiseState);
+      sample = b0 * (x - x2) - a1 * y1 - a2 * y2;
+      x2 = x1;
+      x1 = x;
+      y2 = y1;
+      y1 = sample;
+    } else {
+      sample = sinf(omega * frame);
+    }
+
+    float level = envelope;
+    if (frame < attackFrames) {
+      level *= static_cast<float>(frame) / attackFrames;
+    } else {
+      envelope *= decay;
+    }
+
+    // The filter can ring a little over 1, so there's headroom to spare.
+    long val = lroundf(sample * level * (INT16_MAX / 2));
+    out[frame] = static_cast<int16_t>(val > INT16_MAX ? INT16_MAX : (val < INT16_MIN ? INT16_MIN : val));
+  }
+
+  return numFrames;
+}
+
+
+} // namespace AudioLib
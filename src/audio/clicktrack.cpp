@@ -0,0 +1,269 @@
+#include "audio/clicktrack.hpp"
+#include "audio/mixer.hpp"
+
+
+namespace AudioLib {
+
+#define CLICKTRACK_PHASE_BITS 32
+#define CLICKTRACK_PHASE_ONE (static_cast<uint64_t>(1) << CLICKTRACK_PHASE_BITS)
+
+///////////////////////////////////////////////////////////////////////////////
+// class ClickTrack
+///////////////////////////////////////////////////////////////////////////////
+ClickTrack::ClickTrack():
+  bpm(0),
+  anchorFrame(0),
+  beatIncrement(0),
+  beatPhase(0),
+  beatsPerBar(CLICKTRACK_DEFAULT_BEATS_PER_BAR),
+  beatInBar(0),
+  subdivision(SD_None),
+  swing(CLICKTRACK_DEFAULT_SWING),
+  numEvents(0),
+  nextEvent(0),
+  tempoMap(NULL),
+  segmentIdx(0),
+  segmentBeatsLeft(0),
+  skippedEvents(0) {
+  levelGains[0] = 1;
+  levelGains[1] = CLICKTRACK_DEFAULT_LEVEL_1_PERCENT / 100.0f;
+  levelGains[2] = CLICKTRACK_DEFAULT_LEVEL_2_PERCENT / 100.0f;
+
+  buildEventTable();
+}
+
+
+void ClickTrack::Start(float _bpm, uint64_t startFrame) {
+  if (_bpm <= 0) {
+    Stop();
+    return;
+  }
+
+  bpm = _bpm;
+  anchorFrame = startFrame;
+  beatPhase = 0;
+  beatInBar = 0;
+  nextEvent = 0;
+
+  if (tempoMap && !tempoMap->Empty()) {
+    startSegment(0);
+  } else {
+    // Only done on a tempo change, so the division (and the double) is fine here.
+    beatIncrement = TempoMap::BPMToBeatIncrement(bpm);
+    updateEventOffsets();
+  }
+}
+
+
+void ClickTrack::ChangeTempo(float _bpm, uint64_t frame) {
+  if (!Running()) {
+    Start(_bpm, frame);
+    return;
+  }
+
+  if (_bpm <= 0) {
+    return;
+  }
+
+  bpm = _bpm;
+  beatIncrement = TempoMap::BPMToBeatIncrement(bpm);
+  segmentBeatsLeft = 0;
+
+  // Clicks in this beat that haven't happened yet move to suit the new length.
+  updateEventOffsets();
+}
+
+
+void ClickTrack::Stop() {
+  bpm = 0;
+  beatIncrement = 0;
+}
+
+
+void ClickTrack::Restart(uint64_t anchor) {
+  anchorFrame = anchor;
+  beatPhase = 0;
+  beatInBar = 0;
+  nextEvent = 0;
+
+  if (Running() && tempoMap && !tempoMap->Empty()) {
+    startSegment(0);
+  }
+
+  // The beat at the anchor has already been played by the drummer.
+  advanceEvent();
+}
+
+
+void ClickTrack::SetTempoMap(const TempoMap *_tempoMap) {
+  tempoMap = _tempoMap;
+  segmentIdx = 0;
+  segmentBeatsLeft = 0;
+}
+
+
+void ClickTrack::SetBeatsPerBar(uint8_t _beatsPerBar) {
+  beatsPerBar = _beatsPerBar ? _beatsPerBar : CLICKTRACK_DEFAULT_BEATS_PER_BAR;
+  beatInBar = 0;
+}
+
+
+void ClickTrack::SetPattern(Subdivision_t _subdivision, uint8_t _swing) {
+  subdivision = _subdivision;
+  swing = _swing;
+
+  // Finishing the current beat with the old table would be nicer, but then the
+  // indexes wouldn't line up. Start the new pattern on the next beat instead.
+  if (nextEvent != 0) {
+    nextEvent = numEvents - 1;
+    advanceEvent();
+  }
+
+  buildEventTable();
+}
+
+
+void ClickTrack::SetLevelGain(uint8_t level, float gain) {
+  if (level < CLICKTRACK_NUM_LEVELS) {
+    levelGains[level] = gain;
+  }
+}
+
+
+uint8_t ClickTrack::GetPatternFractions(Subdivision_t _subdivision, uint8_t _swing, double *fractions, uint8_t *levels) {
+  if (_swing < CLICKTRACK_MIN_SWING) {
+    _swing = CLICKTRACK_MIN_SWING;
+  } else if (_swing > CLICKTRACK_MAX_SWING) {
+    _swing = CLICKTRACK_MAX_SWING;
+  }
+
+  double swingFraction = _swing / 100.0;
+
+  fractions[0] = 0;
+  levels[0] = 0;
+
+  switch (_subdivision) {
+  case SD_Eighths:
+    fractions[1] = swingFraction;
+    levels[1] = 1;
+    return 2;
+
+  case SD_Triplets:
+    fractions[1] = 1.0 / 3;
+    fractions[2] = 2.0 / 3;
+    levels[1] = levels[2] = 1;
+    return 3;
+
+  case SD_Sixteenths:
+    // Swing applies within each half of the beat
+    fractions[1] = swingFraction / 2;
+    fractions[2] = 0.5;
+    fractions[3] = 0.5 + swingFraction / 2;
+    levels[1] = levels[3] = 2;
+    levels[2] = 1;
+    return 4;
+
+  case SD_None:
+  default:
+    return 1;
+  }
+}
+
+
+void ClickTrack::buildEventTable() {
+  double fractions[CLICKTRACK_MAX_EVENTS_PER_BEAT];
+  uint8_t levels[CLICKTRACK_MAX_EVENTS_PER_BEAT];
+  numEvents = GetPatternFractions(subdivision, swing, fractions, levels);
+
+  for (uint8_t i = 0; i < numEvents; i++) {
+    events[i].fraction = static_cast<uint32_t>(fractions[i] * CLICKTRACK_PHASE_ONE + 0.5);
+    events[i].level = levels[i];
+  }
+
+  if (nextEvent >= numEvents) {
+    nextEvent = 0;
+  }
+
+  updateEventOffsets();
+}
+
+
+void ClickTrack::updateEventOffsets() {
+  // Called whenever the beat length changes, which can be every beat in a ramp, so
+  // no floating point. beatIncrement * fraction is 32.32 * 0.32, done in two
+  // halves so it fits in 64 bits.
+  for (uint8_t i = 0; i < numEvents; i++) {
+    uint64_t fraction = events[i].fraction;
+    events[i].phaseOffset = (beatIncrement >> CLICKTRACK_PHASE_BITS) * fraction +
+      (((beatIncrement & (CLICKTRACK_PHASE_ONE - 1)) * fraction) >> CLICKTRACK_PHASE_BITS);
+  }
+}
+
+
+void ClickTrack::startSegment(uint32_t idx) {
+  const TempoSegment& segment = tempoMap->GetSegment(idx);
+  segmentIdx = idx;
+  segmentBeatsLeft = segment.numBeats;
+  beatIncrement = segment.beatIncrement;
+
+  // Segments always start on a bar line, so beatInBar has already wrapped.
+  beatsPerBar = segment.beatsPerBar;
+  updateEventOffsets();
+}
+
+
+uint64_t ClickTrack::nextEventFrame() const {
+  // Round to the nearest frame, so the error on any click is at most half a frame.
+  uint64_t phase = beatPhase + events[nextEvent].phaseOffset;
+  return anchorFrame + ((phase + CLICKTRACK_PHASE_ONE / 2) >> CLICKTRACK_PHASE_BITS);
+}
+
+
+void ClickTrack::advanceEvent() {
+  if (++nextEvent < numEvents) {
+    return;
+  }
+
+  nextEvent = 0;
+  beatPhase += beatIncrement;
+  if (++beatInBar >= beatsPerBar) {
+    beatInBar = 0;
+  }
+
+  if (tempoMap && segmentBeatsLeft && --segmentBeatsLeft == 0 && segmentIdx + 1 < tempoMap->GetNumSegments()) {
+    startSegment(segmentIdx + 1);
+  }
+}
+
+
+bool ClickTrack::NextEventInBlock(uint64_t blockStart, uint32_t blockFrames, ClickEvent *event) {
+  if (!Running()) {
+    return false;
+  }
+
+  uint64_t eventFrame = nextEventFrame();
+
+  // If we've fallen behind (e.g. the anchor was moved into the past), skip
+  // clicks that should already have been heard rather than playing them late.
+  while (eventFrame < blockStart) {
+    skippedEvents++;
+    advanceEvent();
+    eventFrame = nextEventFrame();
+  }
+
+  if (eventFrame >= blockStart + blockFrames) {
+    return false;
+  }
+
+  const PatternEvent& patternEvent = events[nextEvent];
+  event->frameOffset = static_cast<uint32_t>(eventFrame - blockStart);
+  event->beatInBar = beatInBar;
+  event->level = patternEvent.level;
+  event->gain = levelGains[patternEvent.level];
+
+  advanceEvent();
+  return true;
+}
+
+
+} // namespace AudioLib
@@ -0,0 +1,1936 @@
+#include <math.h>
+#include <memory>
+#include <stdio.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "audio/adpcm.hpp"
+#include "audio/clickbank.hpp"
+#include "audio/clickprep.hpp"
+#include "audio/clicksynth.hpp"
+#include "audio/clicktrack.hpp"
+#include "audio/diagnostics.hpp"
+#include "audio/latencystats.hpp"
+#include "audio/mixkernel.hpp"
+#include "audio/offlinerenderer.hpp"
+#include "audio/player.hpp"
+#include "audio/resampler.hpp"
+#include "audio/streamwav.hpp"
+#include "audio/taptempo.hpp"
+#include "audio/tempomap.hpp"
+#include "audio/volumecurve.hpp"
+#include "audio/wav.hpp"
+#include "log.hpp"
+
+
+namespace AudioLib {
+
+#define JITTER_MIN_BPM 30
+#define JITTER_MAX_BPM 300
+
+// Not a round number, so we get a good spread of fractional tempos
+#define JITTER_BPM_STEP 0.3f
+
+// Length of the simulated stream for each tempo
+#define JITTER_SIMULATED_SECONDS 60
+
+// Long-run drift check: a typical song, at a tempo that doesn't divide evenly
+// into milliseconds or frames.
+#define DRIFT_BPM 133.3f
+#define DRIFT_SIMULATED_SECONDS (5 * 60)
+
+// Subdivisions have more clicks to check, so use fewer tempos and a shorter stream.
+#define SUBDIVISION_BPM_STEP 2.7f
+#define SUBDIVISION_SIMULATED_SECONDS 30
+
+// Tempo map check: a jump, a meter change and a ramp, followed past the end.
+#define TEMPOMAP_START_BPM 100
+#define TEMPOMAP_BARS 40
+
+// Tap tempo estimates have to be at least this sure of themselves to be used
+#define TAPTEMPO_CHECK_MIN_CONFIDENCE 50
+
+// Mixer benchmark. Sources are short, and read from a different place each block.
+#define MIXER_BENCH_SOURCE_FRAMES 2048
+#define MIXER_BENCH_SECONDS 5
+
+// Over the top, for checking clipping. Whole, so it can be logged.
+#define MIXER_BENCH_LOUD_GAIN 3
+
+// The old default volume (0.3, times 3)
+#define MIXER_BENCH_LEGACY_VOLUME 0.9f
+
+// Baking check: a short mono click, played for every click of a fast pattern
+#define MIXER_BAKE_CHECK_FRAMES 400
+#define MIXER_BAKE_CHECK_BPM 180
+#define MIXER_BAKE_CHECK_SECONDS 10
+
+// Resampler check: a tone run through in one go, and compared to the ideal one.
+#define RESAMPLE_CHECK_FRAMES 4096
+#define RESAMPLE_CHECK_AMPLITUDE 16000
+#define RESAMPLE_CHECK_MIN_SNR 66
+#define RESAMPLE_BENCH_SECONDS 5
+
+// .wav parser check. Corpus files are short, and the truncated one loses a few
+// frames and a byte. Fuzzed copies are damaged near the top, where the chunk
+// headers are.
+#define WAV_CHECK_FRAMES 64
+#define WAV_CHECK_RATE 48000
+#define WAV_CHECK_TRUNCATED_FRAMES 5
+#define WAV_FUZZ_ROUNDS 3000
+#define WAV_FUZZ_HEADER_BYTES 96
+#define WAV_BENCH_PARSES 10000
+#define WAV_BENCH_FRAMES 4096
+#define WAV_BENCH_SECONDS 5
+
+// Clicks made up for ClickPrep to trim: silence, a ringing tone, then more silence
+#define CLICKPREP_CHECK_SILENCE_FRAMES 300
+#define CLICKPREP_CHECK_TONE_FRAMES 2000
+#define CLICKPREP_CHECK_TAIL_FRAMES 500
+#define CLICKPREP_CHECK_MAX_FRAMES 1000
+
+// Synthesized clicks: the pitch of a ping from its zero crossings, and the fall
+// over two time constants (-17.4 dB), have to be this close. Noise has no pitch
+// to speak of, and gets twice the room on its decay. The built-in voice has to
+// fit in the size.
+#define CLICKSYNTH_CHECK_PITCH_PERMILLE 20
+#define CLICKSYNTH_CHECK_DECAY_MDB 1500
+#define CLICKSYNTH_CHECK_MAX_BYTES 10240
+
+// Click bank file check: more click files than the SD card can have open at once
+// (it's mounted with room for 5), so one left open each would run out
+#define CLICKBANK_CHECK_FILES 8
+#define CLICKBANK_CHECK_MAX_PATH 128
+
+// Latency stats: clicks that swing 100 us either side of the grid, timed over
+// enough blocks for both windows to roll over. Has to stay under 1% of the
+// audio task's time.
+#define LATENCY_CHECK_SWING_US 100
+#define LATENCY_CHECK_SECONDS (LATENCYSTATS_WINDOW_SECONDS * 5 / 2)
+#define LATENCY_CHECK_MAX_PERMILLE 10
+
+// Offline render check: a short set with a count-in, a tempo map and a meter
+// change, which has to render at least this many times faster than real time.
+#define OFFLINE_CHECK_BARS 12
+#define OFFLINE_CHECK_MIN_SPEEDUP 20
+
+// Its clicks are shorter than the closest two clicks are apart, so they never
+// overlap, and each one starts after silence.
+#define OFFLINE_CHECK_CLICK_FRAMES 400
+#define OFFLINE_CHECK_CLICK_PEAK 16000
+
+// The set as it was rendered and checked, with every click the right distance
+// from the last: its length in frames, how many clicks there were, and FNV-1a
+// hashes of the frames they start at and of every sample. Everything past the
+// gains is integer arithmetic, so these come out the same on the host and the
+// board. If the sound of the click track is changed on purpose, render the set
+// again, check it, and update them from the log.
+#define OFFLINE_CHECK_GOLDEN_FRAMES 2162688u
+#define OFFLINE_CHECK_GOLDEN_CLICKS 252u
+#define OFFLINE_CHECK_GOLDEN_POSITIONS 0x95b50002u
+#define OFFLINE_CHECK_GOLDEN_SAMPLES 0x44f7612cu
+
+// ADPCM check: a quarter of a second of pings and noise, which has to come back
+// at least this far above the noise ADPCM adds, decoding in under 1% of the time
+// it takes to play. Decoding is timed over several rounds, and a second voice
+// starts this many blocks in.
+#define ADPCM_CHECK_FRAMES (PLAYER_SAMPLE_RATE / 4)
+#define ADPCM_CHECK_CLICK_FRAMES 4410
+#define ADPCM_CHECK_MIN_SNR_DB 20
+#define ADPCM_CHECK_MAX_PERMILLE 10
+#define ADPCM_CHECK_BENCH_ROUNDS 40
+#define ADPCM_CHECK_SECOND_VOICE_BLOCK 5
+
+// Streaming check. Run faster than real time, so passing leaves some margin.
+#define STREAM_CHECK_SPEEDUP 2
+#define STREAM_CHECK_PROGRESS_SECONDS 30
+
+
+class SimulationResult {
+public:
+  SimulationResult():
+    worstError(0),
+    events(0),
+    expectedEvents(0) {}
+
+  double worstError;  // In frames
+  uint32_t events;
+  uint32_t expectedEvents;
+};
+
+
+static uint32_t blocksForSeconds(uint32_t seconds) {
+  // Whole blocks only, so every click we expect is one the scheduler gets asked about.
+  return static_cast<uint32_t>(static_cast<uint64_t>(seconds) * PLAYER_SAMPLE_RATE / PLAYER_BLOCK_FRAMES);
+}
+
+
+// Runs a click track over numBlocks simulated blocks, and compares where each
+// click was placed with where it ideally belongs.
+static SimulationResult simulateClickTrack(float bpm, Subdivision_t subdivision, uint8_t swing, uint32_t numBlocks) {
+  SimulationResult result;
+
+  ClickTrack clickTrack;
+  clickTrack.SetPattern(subdivision, swing);
+  clickTrack.Start(bpm, 0);
+
+  double fractions[CLICKTRACK_MAX_EVENTS_PER_BEAT];
+  uint8_t levels[CLICKTRACK_MAX_EVENTS_PER_BEAT];
+  uint8_t eventsPerBeat = ClickTrack::GetPatternFractions(subdivision, swing, fractions, levels);
+
+  double framesPerBeat = (60.0 * PLAYER_SAMPLE_RATE) / bpm;
+  double simulatedFrames = static_cast<double>(numBlocks) * PLAYER_BLOCK_FRAMES;
+
+  for (uint32_t block = 0; block < numBlocks; block++) {
+    uint64_t blockStart = static_cast<uint64_t>(block) * PLAYER_BLOCK_FRAMES;
+
+    ClickEvent event;
+    while (clickTrack.NextEventInBlock(blockStart, PLAYER_BLOCK_FRAMES, &event)) {
+      uint32_t beat = result.events / eventsPerBeat;
+      uint8_t index = result.events % eventsPerBeat;
+      double ideal = (beat + fractions[index]) * framesPerBeat;
+
+      double error = static_cast<double>(blockStart + event.frameOffset) - ideal;
+      if (error < 0) {
+        error = -error;
+      }
+
+      if (error > result.worstError) {
+        result.worstError = error;
+      }
+
+      if (event.level != levels[index]) {
+        // Wrong click. Make sure it fails.
+        result.worstError = simulatedFrames;
+      }
+
+      result.events++;
+    }
+  }
+
+  // Every click in the simulated stream should have been placed exactly once. Click
+  // positions are rounded to the nearest frame, so count the ones that round to
+  // inside the stream.
+  for (uint32_t beat = 0; beat * framesPerBeat < simulatedFrames; beat++) {
+    for (uint8_t i = 0; i < eventsPerBeat; i++) {
+      if ((beat + fractions[i]) * framesPerBeat < simulatedFrames - 0.5) {
+        result.expectedEvents++;
+      }
+    }
+  }
+
+  return result;
+}
+
+
+// Sweeps the tempo range for one pattern. Returns true if every click landed
+// within maxError frames of where it belongs.
+static bool sweepTempos(const char *name, Subdivision_t subdivision, uint8_t swing, float bpmStep, uint32_t seconds, double maxError) {
+  uint32_t startTime = millis();
+  uint32_t numBlocks = blocksForSeconds(seconds);
+
+  double worstError = 0;
+  float worstBpm = 0;
+  bool missedEvents = false;
+
+  for (float bpm = JITTER_MIN_BPM; bpm <= JITTER_MAX_BPM; bpm += bpmStep) {
+    SimulationResult result = simulateClickTrack(bpm, subdivision, swing, numBlocks);
+    if (result.worstError > worstError) {
+      worstError = result.worstError;
+      worstBpm = bpm;
+    }
+
+    if (result.events != result.expectedEvents) {
+      missedEvents = true;
+      logPrintf(LOG_COMP_AUDIO, LOG_SEV_ERROR, "*** Click jitter (%s): %d/10 BPM placed %d clicks, expected %d\n",
+        name, static_cast<int>(bpm * 10), result.events, result.expectedEvents);
+    }
+  }
+
+  bool pass = worstError <= maxError && !missedEvents;
+
+  // logPrintf doesn't do floating point, so report in thousandths of a frame and in microseconds.
+  logPrintf(LOG_COMP_AUDIO, LOG_SEV_INFO, "Click jitter (%s): worst placement error %d/1000 frame (%d us) at %d/10 BPM. %s. Took %d ms.\n",
+    name,
+    static_cast<int>(worstError * 1000),
+    static_cast<int>(worstError * 1000000 / PLAYER_SAMPLE_RATE),
+    static_cast<int>(worstBpm * 10),
+    pass ? "PASS" : "FAIL",
+    millis() - startTime);
+
+  return pass;
+}
+
+
+// The ideal length (in frames) and meter of every beat in the test song, worked out
+// straight from the tempo changes rather than from the compiled map.
+static uint32_t idealBeats(const std::vector<TempoChange>& changes, double *beatFrames, uint8_t *beatsPerBar, uint32_t maxBeats) {
+  uint32_t numBeats = 0;
+  float bpm = TEMPOMAP_START_BPM;
+  uint8_t curBeatsPerBar = 4;
+  std::vector<TempoChange>::const_iterator change = changes.begin();
+  float rampFrom = 0;
+  uint32_t rampStartBar = 0;
+  uint32_t rampBars = 0;
+
+  for (uint32_t bar = 1; bar <= TEMPOMAP_BARS; bar++) {
+    if (change != changes.end() && change->bar == bar) {
+      if (change->beatsPerBar) {
+        curBeatsPerBar = change->beatsPerBar;
+      }
+
+      rampFrom = bpm;
+      rampStartBar = bar;
+      rampBars = change->rampBars;
+      bpm = change->bpm;
+      ++change;
+    }
+
+    for (uint8_t beat = 0; beat < curBeatsPerBar && numBeats < maxBeats; beat++) {
+      double beatBpm = bpm;
+      if (bar < rampStartBar + rampBars) {
+        double rampBeats = static_cast<double>(rampBars) * curBeatsPerBar;
+        double rampBeat = static_cast<double>(bar - rampStartBar) * curBeatsPerBar + beat;
+        beatBpm = rampFrom + (bpm - rampFrom) * (rampBeat + 0.5) / rampBeats;
+      }
+
+      beatFrames[numBeats] = (60.0 * PLAYER_SAMPLE_RATE) / beatBpm;
+      beatsPerBar[numBeats] = curBeatsPerBar;
+      numBeats++;
+    }
+  }
+
+  return numBeats;
+}
+
+
+// Follows a tempo map with a jump, a meter change and a ramp, and checks every
+// beat against where it belongs and which beat of the bar it is.
+static bool checkTempoMap() {
+  std::vector<TempoChange> changes(3);
+  changes[0].bar = 5;
+  changes[0].bpm = 120;
+  changes[1].bar = 9;
+  changes[1].bpm = 90;
+  changes[1].beatsPerBar = 3;
+  changes[2].bar = 13;
+  changes[2].bpm = 140.5f;
+  changes[2].rampBars = 8;
+
+  TempoMap tempoMap;
+  if (!tempoMap.Compile(TEMPOMAP_START_BPM, 4, changes)) {
+    logPrintf(LOG_COMP_AUDIO, LOG_SEV_ERROR, "Tempo map: Unable to compile test map. FAIL.\n");
+    return false;
+  }
+
+  const uint32_t maxBeats = TEMPOMAP_BARS * 4;
+  std::unique_ptr<double[]> beatFrames(new double[maxBeats]);
+  std::unique_ptr<uint8_t[]> beatsPerBar(new uint8_t[maxBeats]);
+  uint32_t numBeats = idealBeats(changes, beatFrames.get(), beatsPerBar.get(), maxBeats);
+
+  ClickTrack clickTrack;
+  clickTrack.SetTempoMap(&tempoMap);
+  clickTrack.Start(TEMPOMAP_START_BPM, 0);
+
+  double ideal = 0;
+  double worstError = 0;
+  uint32_t beat = 0;
+  uint8_t expectedBeatInBar = 0;
+  bool wrongBeat = false;
+
+  for (uint64_t blockStart = 0; beat < numBeats; blockStart += PLAYER_BLOCK_FRAMES) {
+    ClickEvent event;
+    while (beat < numBeats && clickTrack.NextEventInBlock(blockStart, PLAYER_BLOCK_FRAMES, &event)) {
+      double error = static_cast<double>(blockStart + event.frameOffset) - ideal;
+      if (error < 0) {
+        error = -error;
+      }
+
+      if (error > worstError) {
+        worstError = error;
+      }
+
+      if (event.beatInBar != expectedBeatInBar) {
+        wrongBeat = true;
+      }
+
+      ideal += beatFrames[beat];
+      if (++expectedBeatInBar >= beatsPerBar[beat]) {
+        expectedBeatInBar = 0;
+      }
+
+      beat++;
+    }
+  }
+
+  bool pass = worstError <= 0.5 && !wrongBeat;
+  logPrintf(LOG_COMP_AUDIO, LOG_SEV_INFO, "Tempo map: %d beats in %d segments, worst error %d/1000 frame%s. %s.\n",
+    numBeats,
+    tempoMap.GetNumSegments(),
+    static_cast<int>(worstError * 1000),
+    wrongBeat ? ", wrong beat in bar" : "",
+    pass ? "PASS" : "FAIL");
+
+  return pass;
+}
+
+
+// Tap times in ms, as played by a person rather than a machine.
+static const uint32_t tapsSteady120[] = { 0, 497, 1004, 1498, 2006, 2499, 3003, 3497, 4002, 4500 };
+
+// A flam at 1290, and a missed beat between 2502 and 3751.
+static const uint32_t tapsFlamAndMiss96[] = { 0, 628, 1249, 1290, 1877, 2502, 3751, 4373, 5002, 5624 };
+
+// At 120, with two beats tapped at half time. At one point that leaves two
+// intervals of each, and none of them near the median.
+static const uint32_t tapsHalfTime120[] = { 0, 500, 1000, 2000, 3000, 3500, 4000 };
+
+// Starts at 100, then pushes on to 110.
+static const uint32_t tapsPush100To110[] = { 0, 600, 1200, 1800, 2400, 2945, 3490, 4036, 4581, 5126, 5672, 6217, 6763, 7308 };
+
+
+static bool checkTapSequence(const char *name, const uint32_t *tapsMs, uint8_t numTaps, float expectedBpm, float maxError) {
+  TapTempo tapTempo;
+
+  // Start near where the microsecond clock wraps, to make sure that's handled.
+  uint32_t startUs = 0xffffffff - 1000000;
+  for (uint8_t i = 0; i < numTaps; i++) {
+    tapTempo.AddTap(startUs + tapsMs[i] * 1000);
+  }
+
+  // NaN fails, and is logged as 0.
+  float bpm = isnan(tapTempo.GetBPM()) ? 0 : tapTempo.GetBPM();
+  float error = bpm - expectedBpm;
+  if (error < 0) {
+    error = -error;
+  }
+
+  bool pass = error <= maxError && tapTempo.GetConfidence() >= TAPTEMPO_CHECK_MIN_CONFIDENCE;
+  logPrintf(LOG_COMP_AUDIO, LOG_SEV_INFO, "Tap tempo (%s): %d/10 BPM, expected %d/10, confidence %d. %s.\n",
+    name,
+    static_cast<int>(bpm * 10 + 0.5f),
+    static_cast<int>(expectedBpm * 10 + 0.5f),
+    tapTempo.GetConfidence(),
+    pass ? "PASS" : "FAIL");
+
+  return pass;
+}
+
+
+void Diagnostics::CheckTapTempo() {
+  checkTapSequence("steady", tapsSteady120, sizeof(tapsSteady120) / sizeof(tapsSteady120[0]), 120, 1);
+  checkTapSequence("flam and miss", tapsFlamAndMiss96, sizeof(tapsFlamAndMiss96) / sizeof(tapsFlamAndMiss96[0]), 96, 1);
+  checkTapSequence("half time", tapsHalfTime120, sizeof(tapsHalfTime120) / sizeof(tapsHalfTime120[0]), 120, 1);
+  checkTapSequence("push", tapsPush100To110, sizeof(tapsPush100To110) / sizeof(tapsPush100To110[0]), 110, 1.5f);
+}
+
+
+// A 16-bit or ADPCM sound in memory, in one chunk
+class CheckSource : public AudioDataInterface {
+public:
+  CheckSource(const void *data, uint32_t len, uint16_t _numChannels, uint16_t _bitsPerSample):
+    numChannels(_numChannels),
+    bitsPerSample(_bitsPerSample) {
+    samples.samples = static_cast<const uint8_t*>(data);
+    samples.len = len;
+  }
+  virtual ~CheckSource() {}
+
+  virtual bool HasMoreData() { return false; }
+  virtual void Restart() {}
+  virtual uint32_t GetSampleRate() { return PLAYER_SAMPLE_RATE; }
+  virtual uint16_t GetBitsPerSample() { return bitsPerSample; }
+  virtual uint16_t GetNumChannels() { return numChannels; }
+  virtual const AudioSamples* GetSamples() { return &samples; }
+
+private:
+  AudioSamples samples;
+  uint16_t numChannels;
+  uint16_t bitsPerSample;
+};
+
+
+// The loop the player ran on every sample before there was a mixer: a float
+// multiply, with no clamping. Kept for comparison.
+static void legacyVolumeLoop(int16_t *out, const int16_t *in, uint32_t numSamples, float volume) {
+  for (uint32_t i = 0; i < numSamples; i++) {
+    out[i] = static_cast<int16_t>(static_cast<int32_t>(in[i] * volume));
+  }
+}
+
+
+// Counts samples that came out with the opposite sign to the input, which is what
+// wrapping around looks like.
+static uint32_t countWrapped(const int16_t *in, const int16_t *out, uint32_t numSamples) {
+  uint32_t wrapped = 0;
+  for (uint32_t i = 0; i < numSamples; i++) {
+    if ((in[i] > 0 && out[i] < 0) || (in[i] < 0 && out[i] > 0)) {
+      wrapped++;
+    }
+  }
+
+  return wrapped;
+}
+
+
+// Plays a click through a mixer for every event in a run of eighths, then of
+// sixteenths, as the click standing in for the subdivisions too. Each gain it's
+// played at should be baked once, the first time it comes up, and never again.
+static void checkBaking(const int16_t *samples) {
+  std::unique_ptr<Mixer> mixer;
+  try {
+    mixer = std::unique_ptr<Mixer>(new Mixer());
+  } catch (std::bad_alloc&) {
+    logPrintf(LOG_COMP_AUDIO, LOG_SEV_ERROR, "Mixer baking check: Unable to allocate the mixer\n");
+    return;
+  }
+
+  CheckSource click(samples, MIXER_BAKE_CHECK_FRAMES * sizeof(int16_t), 1, 16);
+  if (!mixer->Prepare(&click) || !mixer->Bake(&click, 0, CLICKTRACK_NUM_LEVELS)) {
+    logPrintf(LOG_COMP_AUDIO, LOG_SEV_ERROR, "Mixer baking check: Unable to bake the click\n");
+    return;
+  }
+
+  static const Subdivision_t patterns[] = { SD_Eighths, SD_Sixteenths };
+  static const uint8_t newGains[] = { 2, 1 };  // Sixteenths add the finest level
+  uint32_t numBlocks = blocksForSeconds(MIXER_BAKE_CHECK_SECONDS);
+
+  for (uint8_t p = 0; p < sizeof(patterns) / sizeof(patterns[0]); p++) {
+    ClickTrack clickTrack;
+    clickTrack.SetPattern(patterns[p], 0);
+    clickTrack.Start(MIXER_BAKE_CHECK_BPM, mixer->GetFramePosition());
+
+    uint32_t bakesBefore = mixer->GetBakeCount();
+    uint32_t numClicks = 0;
+    for (uint32_t block = 0; block < numBlocks; block++) {
+      ClickEvent event;
+      while (clickTrack.NextEventInBlock(mixer->GetFramePosition(), PLAYER_BLOCK_FRAMES, &event)) {
+        mixer->Play(&click, event.frameOffset, event.gain, MV_Click);
+        numClicks++;
+      }
+
+      mixer->RenderBlock();
+    }
+
+    uint32_t bakes = mixer->GetBakeCount() - bakesBefore;
+    logPrintf(LOG_COMP_AUDIO, LOG_SEV_INFO, "Mixer baking (%s): %d clicks, %d baked (expected %d). %s.\n",
+      patterns[p] == SD_Eighths ? "eighths" : "sixteenths", numClicks, bakes, newGains[p], bakes == newGains[p] ? "PASS" : "FAIL");
+  }
+
+  mixer->Stop(&click);
+  mixer->Unbake(&click);
+}
+
+
+void Diagnostics::BenchmarkMixer() {
+  std::unique_ptr<int16_t[]> sourceBuf;
+  std::unique_ptr<int16_t[]> checkBuf;
+  try {
+    sourceBuf = std::unique_ptr<int16_t[]>(new int16_t[MIXKERNEL_MAX_SOURCES * MIXER_BENCH_SOURCE_FRAMES * PLAYER_CHANNELS]);
+    checkBuf = std::unique_ptr<int16_t[]>(new int16_t[PLAYER_BLOCK_FRAMES * PLAYER_CHANNELS]);
+  } catch (std::bad_alloc&) {
+    logPrintf(LOG_COMP_AUDIO, LOG_SEV_ERROR, "Mixer benchmark: Unable to allocate buffers\n");
+    return;
+  }
+
+  // Noise, so nothing is conveniently zero.
+  uint32_t seed = 12345;
+  for (uint32_t i = 0; i < MIXKERNEL_MAX_SOURCES * MIXER_BENCH_SOURCE_FRAMES * PLAYER_CHANNELS; i++) {
+    seed = seed * 1664525 + 1013904223;
+    sourceBuf[i] = static_cast<int16_t>(seed >> 16);
+  }
+
+  int16_t block[PLAYER_BLOCK_FRAMES * PLAYER_CHANNELS] __attribute__((aligned(16)));
+  MixSource sources[MIXKERNEL_MAX_SOURCES];
+
+  // Same answer as the portable kernel, even when the gains are cranked up. Start
+  // at an odd frame, so the sources aren't aligned.
+  for (uint8_t i = 0; i < MIXKERNEL_MAX_SOURCES; i++) {
+    sources[i].samples = sourceBuf.get() + (i * MIXER_BENCH_SOURCE_FRAMES + 1) * PLAYER_CHANNELS;
+    sources[i].gainL = MixKernel::GainToFixed(0.5f + i);
+    sources[i].gainR = MixKernel::GainToFixed(4 - i);
+  }
+
+  MixKernel::Mix(block, sources, MIXKERNEL_MAX_SOURCES, PLAYER_BLOCK_FRAMES - 3);
+  MixKernel::MixPortable(checkBuf.get(), sources, MIXKERNEL_MAX_SOURCES, PLAYER_BLOCK_FRAMES - 3);
+
+  uint32_t mismatches = 0;
+  for (uint32_t i = 0; i < (PLAYER_BLOCK_FRAMES - 3) * PLAYER_CHANNELS; i++) {
+    if (block[i] != checkBuf[i]) {
+      mismatches++;
+    }
+  }
+
+  logPrintf(LOG_COMP_AUDIO, LOG_SEV_INFO, "Mixer (%s): %d samples differ from the portable kernel. %s.\n",
+    MixKernel::GetName(), mismatches, mismatches ? "FAIL" : "PASS");
+
+  // A mono source has to come out the same as its samples doubled up into stereo,
+  // which are written over the last source's.
+  const int16_t *monoSamples = sourceBuf.get() + 1;
+  int16_t *doubled = sourceBuf.get() + (MIXKERNEL_MAX_SOURCES - 1) * MIXER_BENCH_SOURCE_FRAMES * PLAYER_CHANNELS;
+  for (uint32_t i = 0; i < PLAYER_BLOCK_FRAMES; i++) {
+    doubled[i * 2] = doubled[i * 2 + 1] = monoSamples[i];
+  }
+
+  sources[0].samples = monoSamples;
+  sources[0].numChannels = 1;
+  MixKernel::Mix(block, sources, 1, PLAYER_BLOCK_FRAMES - 3);
+  sources[0].samples = doubled;
+  sources[0].numChannels = 2;
+  MixKernel::Mix(checkBuf.get(), sources, 1, PLAYER_BLOCK_FRAMES - 3);
+
+  mismatches = 0;
+  for (uint32_t i = 0; i < (PLAYER_BLOCK_FRAMES - 3) * PLAYER_CHANNELS; i++) {
+    if (block[i] != checkBuf[i]) {
+      mismatches++;
+    }
+  }
+
+  MixKernel::ExpandMono(block, monoSamples, PLAYER_BLOCK_FRAMES);
+  for (uint32_t i = 0; i < PLAYER_BLOCK_FRAMES * PLAYER_CHANNELS; i++) {
+    if (block[i] != doubled[i]) {
+      mismatches++;
+    }
+  }
+
+  logPrintf(LOG_COMP_AUDIO, LOG_SEV_INFO, "Mixer (%s): %d samples differ between mono and the same samples in stereo. %s.\n",
+    MixKernel::GetName(), mismatches, mismatches ? "FAIL" : "PASS");
+
+  // Loud enough that the old loop wraps around. The kernel has to clip instead.
+  sources[0].samples = sourceBuf.get();
+  sources[0].gainL = sources[0].gainR = MixKernel::GainToFixed(MIXER_BENCH_LOUD_GAIN);
+  MixKernel::Mix(block, sources, 1, PLAYER_BLOCK_FRAMES);
+  uint32_t kernelWrapped = countWrapped(sourceBuf.get(), block, PLAYER_BLOCK_FRAMES * PLAYER_CHANNELS);
+  legacyVolumeLoop(checkBuf.get(), sourceBuf.get(), PLAYER_BLOCK_FRAMES * PLAYER_CHANNELS, MIXER_BENCH_LOUD_GAIN);
+  uint32_t legacyWrapped = countWrapped(sourceBuf.get(), checkBuf.get(), PLAYER_BLOCK_FRAMES * PLAYER_CHANNELS);
+
+  logPrintf(LOG_COMP_AUDIO, LOG_SEV_INFO, "Mixer (%s): At a gain of %d, %d of %d samples wrapped (the old volume loop wrapped %d). %s.\n",
+    MixKernel::GetName(), MIXER_BENCH_LOUD_GAIN, kernelWrapped, PLAYER_BLOCK_FRAMES * PLAYER_CHANNELS, legacyWrapped, kernelWrapped ? "FAIL" : "PASS");
+
+  // Every step up the volume curve has to be louder than the last.
+  uint32_t curveErrors = 0;
+  for (uint8_t step = 1; step <= VOLUME_CURVE_STEPS; step++) {
+    if (VolumeCurve::StepToGain(step) <= VolumeCurve::StepToGain(step - 1)) {
+      curveErrors++;
+    }
+  }
+
+  logPrintf(LOG_COMP_AUDIO, LOG_SEV_INFO, "Volume curve: %d steps from %d dB, %d out of order. %s.\n",
+    VOLUME_CURVE_STEPS, VOLUME_CURVE_MIN_DB, curveErrors, curveErrors ? "FAIL" : "PASS");
+
+  checkBaking(sourceBuf.get());
+
+  uint32_t numBlocks = blocksForSeconds(MIXER_BENCH_SECONDS);
+  uint32_t blockBudgetUs = static_cast<uint32_t>(static_cast<uint64_t>(PLAYER_BLOCK_FRAMES) * 1000000 / PLAYER_SAMPLE_RATE);
+  uint32_t oneVoiceNs = 0;
+
+  for (uint8_t numSources = 1; numSources <= MIXKERNEL_MAX_SOURCES; numSources++) {
+    uint32_t startTime = micros();
+
+    for (uint32_t blockNum = 0; blockNum < numBlocks; blockNum++) {
+      uint32_t position = (blockNum * PLAYER_BLOCK_FRAMES) % (MIXER_BENCH_SOURCE_FRAMES - PLAYER_BLOCK_FRAMES);
+      for (uint8_t i = 0; i < numSources; i++) {
+        sources[i].samples = sourceBuf.get() + (i * MIXER_BENCH_SOURCE_FRAMES + position) * PLAYER_CHANNELS;
+      }
+
+      MixKernel::Mix(block, sources, numSources, PLAYER_BLOCK_FRAMES);
+    }
+
+    uint32_t elapsedUs = micros() - startTime;
+    uint32_t perBlockNs = static_cast<uint32_t>(static_cast<uint64_t>(elapsedUs) * 1000 / numBlocks);
+    if (numSources == 1) {
+      oneVoiceNs = perBlockNs;
+    }
+
+    // Real time is the length of audio mixed, so this is the share of the audio task's time the mixer needs.
+    logPrintf(LOG_COMP_AUDIO, LOG_SEV_INFO, "Mixer (%s): %d voices, %d ns per %d frame block (budget %d us), %d/1000 of real time, %d frames/s.\n",
+      MixKernel::GetName(),
+      numSources,
+      perBlockNs,
+      PLAYER_BLOCK_FRAMES,
+      blockBudgetUs,
+      static_cast<uint32_t>(static_cast<uint64_t>(perBlockNs) / blockBudgetUs),
+      static_cast<uint32_t>(elapsedUs ? static_cast<uint64_t>(numBlocks) * PLAYER_BLOCK_FRAMES * 1000000 / elapsedUs : 0));
+  }
+
+  // The same work for one voice, done the old way.
+  uint32_t startTime = micros();
+  for (uint32_t blockNum = 0; blockNum < numBlocks; blockNum++) {
+    uint32_t position = (blockNum * PLAYER_BLOCK_FRAMES) % (MIXER_BENCH_SOURCE_FRAMES - PLAYER_BLOCK_FRAMES);
+    legacyVolumeLoop(block, sourceBuf.get() + position * PLAYER_CHANNELS, PLAYER_BLOCK_FRAMES * PLAYER_CHANNELS, MIXER_BENCH_LEGACY_VOLUME);
+  }
+
+  uint32_t legacyNs = static_cast<uint32_t>(static_cast<uint64_t>(micros() - startTime) * 1000 / numBlocks);
+  logPrintf(LOG_COMP_AUDIO, LOG_SEV_INFO, "Mixer: The old float volume loop takes %d ns per block, against %d ns for one voice in the %s kernel.\n",
+    legacyNs, oneVoiceNs, MixKernel::GetName());
+}
+
+
+static bool checkResampledTone(uint32_t inRate, uint32_t toneHz) {
+  Resampler resampler;
+  std::unique_ptr<int16_t[]> in;
+  std::unique_ptr<int16_t[]> out;
+  uint32_t maxFrames = 0;
+
+  try {
+    if (!resampler.Init(inRate, PLAYER_SAMPLE_RATE)) {
+      logPrintf(LOG_COMP_AUDIO, LOG_SEV_ERROR, "Resampler: Can't convert from %d. FAIL.\n", inRate);
+      return false;
+    }
+
+    maxFrames = resampler.GetMaxOutputFrames(RESAMPLE_CHECK_FRAMES);
+    in = std::unique_ptr<int16_t[]>(new int16_t[RESAMPLE_CHECK_FRAMES * PLAYER_CHANNELS]);
+    out = std::unique_ptr<int16_t[]>(new int16_t[maxFrames * PLAYER_CHANNELS]);
+  } catch (std::bad_alloc&) {
+    logPrintf(LOG_COMP_AUDIO, LOG_SEV_ERROR, "Resampler check: Unable to allocate buffers\n");
+    return false;
+  }
+
+  // The right channel is upside down, so a mix-up between them would show.
+  for (uint32_t i = 0; i < RESAMPLE_CHECK_FRAMES; i++) {
+    int16_t sample = static_cast<int16_t>(lroundf(RESAMPLE_CHECK_AMPLITUDE * sinf(2 * static_cast<float>(M_PI) * toneHz * i / inRate)));
+    in[i * 2] = sample;
+    in[i * 2 + 1] = -sample;
+  }
+
+  uint32_t inFrames = RESAMPLE_CHECK_FRAMES;
+  uint32_t written = resampler.Process(in.get(), &inFrames, out.get(), maxFrames);
+  while (!resampler.Drained() && written < maxFrames) {
+    written += resampler.Drain(out.get() + written * 2, maxFrames - written);
+  }
+
+  // Fit the best sine at the tone's frequency, away from the ends, and count
+  // everything else as noise. That leaves out any change in level, which is
+  // checked separately.
+  double ss = 0, cc = 0, sc = 0, ys = 0, yc = 0;
+  uint32_t first = RESAMPLER_TAPS;
+  uint32_t last = written > 2 * RESAMPLER_TAPS ? written - RESAMPLER_TAPS : first;
+  for (uint32_t i = first; i < last; i++) {
+    double angle = 2 * M_PI * toneHz * i / PLAYER_SAMPLE_RATE;
+    double s = sin(angle), c = cos(angle);
+    ss += s * s;
+    cc += c * c;
+    sc += s * c;
+    ys += out[i * 2] * s;
+    yc += out[i * 2] * c;
+  }
+
+  double det = ss * cc - sc * sc;
+  double a = det ? (ys * cc - yc * sc) / det : 0;
+  double b = det ? (yc * ss - ys * sc) / det : 0;
+
+  double signal = 0, noise = 0;
+  uint32_t swapped = 0;
+  for (uint32_t i = first; i < last; i++) {
+    double angle = 2 * M_PI * toneHz * i / PLAYER_SAMPLE_RATE;
+    double fit = a * sin(angle) + b * cos(angle);
+    double error = out[i * 2] - fit;
+    signal += fit * fit;
+    noise += error * error;
+    if (out[i * 2 + 1] != -out[i * 2] && out[i * 2 + 1] != -out[i * 2] - 1) {
+      swapped++;
+    }
+  }
+
+  int32_t snr = noise > 0 ? static_cast<int32_t>(10 * log10(signal / noise)) : 999;
+  int32_t levelMilliDb = static_cast<int32_t>(lround(20000 * log10(sqrt(a * a + b * b) / RESAMPLE_CHECK_AMPLITUDE)));
+  uint32_t expectedFrames = resampler.GetOutputFrames(RESAMPLE_CHECK_FRAMES);
+  bool pass = snr >= RESAMPLE_CHECK_MIN_SNR && written == expectedFrames && swapped == 0 && levelMilliDb > -100 && levelMilliDb < 100;
+
+  logPrintf(LOG_COMP_AUDIO, LOG_SEV_INFO, "Resampler: %d Hz tone from %d to %d Hz: %d of %d frames, SNR %d dB, level %d mdB, %d channel errors. %s.\n",
+    toneHz, inRate, PLAYER_SAMPLE_RATE, written, expectedFrames, snr, levelMilliDb, swapped, pass ? "PASS" : "FAIL");
+
+  return pass;
+}
+
+
+static void benchmarkResampler(uint32_t inRate) {
+  Resampler resampler;
+  std::unique_ptr<int16_t[]> in;
+  std::unique_ptr<int16_t[]> out;
+  uint32_t maxFrames = 0;
+
+  try {
+    resampler.Init(inRate, PLAYER_SAMPLE_RATE);
+    maxFrames = resampler.GetMaxOutputFrames(RESAMPLE_CHECK_FRAMES);
+    in = std::unique_ptr<int16_t[]>(new int16_t[RESAMPLE_CHECK_FRAMES * PLAYER_CHANNELS]);
+    out = std::unique_ptr<int16_t[]>(new int16_t[maxFrames * PLAYER_CHANNELS]);
+  } catch (std::bad_alloc&) {
+    logPrintf(LOG_COMP_AUDIO, LOG_SEV_ERROR, "Resampler benchmark: Unable to allocate buffers\n");
+    return;
+  }
+
+  uint32_t seed = 12345;
+  for (uint32_t i = 0; i < RESAMPLE_CHECK_FRAMES * PLAYER_CHANNELS; i++) {
+    seed = seed * 1664525 + 1013904223;
+    in[i] = static_cast<int16_t>(seed >> 16);
+  }
+
+  // Pieces the size the reader hands over, as a stream would.
+  uint32_t framesOut = 0;
+  uint32_t startTime = micros();
+  while (framesOut < RESAMPLE_BENCH_SECONDS * PLAYER_SAMPLE_RATE) {
+    uint32_t inFrames = RESAMPLE_CHECK_FRAMES;
+    framesOut += resampler.Process(in.get(), &inFrames, out.get(), maxFrames);
+  }
+
+  uint32_t elapsedUs = micros() - startTime;
+  logPrintf(LOG_COMP_AUDIO, LOG_SEV_INFO, "Resampler: %d to %d Hz takes %d us per second of audio, %d/1000 of a core.\n",
+    inRate, PLAYER_SAMPLE_RATE, elapsedUs / RESAMPLE_BENCH_SECONDS, elapsedUs / RESAMPLE_BENCH_SECONDS / 1000);
+}
+
+
+void Diagnostics::CheckResampler() {
+  checkResampledTone(22050, 1000);
+  checkResampledTone(22050, 8000);
+  checkResampledTone(48000, 1000);
+  checkResampledTone(48000, 16000);
+  benchmarkResampler(22050);
+  benchmarkResampler(48000);
+}
+
+
+// How each .wav file in the parser's corpus is put together
+#define WCF_LIST_BEFORE    0x0001  // Odd-sized LIST and a fact chunk before the data
+#define WCF_CHUNK_AFTER    0x0002  // Another chunk after the data
+#define WCF_DATA_FIRST     0x0004  // data before fmt
+#define WCF_NO_DATA        0x0008
+#define WCF_EMPTY_DATA     0x0010
+#define WCF_TRUNCATED      0x0020  // Cut off partway through the data
+#define WCF_DATA_SIZE_MAX  0x0040  // data size 0xffffffff, as left by some recorders
+#define WCF_BAD_RIFF_SIZE  0x0080
+#define WCF_NOT_RIFF       0x0100
+#define WCF_TOO_SHORT      0x0200
+#define WCF_FMT_PAST_END   0x0400
+#define WCF_BAD_ALIGN      0x0800
+#define WCF_BAD_GUID       0x1000
+#define WCF_HUGE_CHUNK     0x2000  // A chunk whose size runs off the end of the file
+
+#define WAV_TAG_PCM 1
+#define WAV_TAG_ADPCM 2
+#define WAV_TAG_FLOAT 3
+#define WAV_TAG_EXTENSIBLE 0xfffe
+
+class WavCase {
+public:
+  const char *name;
+  bool valid;
+  uint16_t fmtTag;
+  uint16_t subTag;  // For WAVE_FORMAT_EXTENSIBLE
+  uint16_t numChannels;
+  uint16_t bitsPerSample;
+  uint16_t fmtLen;
+  uint16_t flags;
+};
+
+static const WavCase wavCorpus[] = {
+  { "16-bit stereo",                 true,  WAV_TAG_PCM,        0,             2, 16, 16, 0 },
+  { "16-bit mono",                   true,  WAV_TAG_PCM,        0,             1, 16, 16, 0 },
+  { "8-bit stereo",                  true,  WAV_TAG_PCM,        0,             2, 8,  16, 0 },
+  { "24-bit stereo",                 true,  WAV_TAG_PCM,        0,             2, 24, 16, 0 },
+  { "32-bit mono",                   true,  WAV_TAG_PCM,        0,             1, 32, 16, 0 },
+  { "float stereo",                  true,  WAV_TAG_FLOAT,      0,             2, 32, 18, 0 },
+  { "fmt with cbSize",               true,  WAV_TAG_PCM,        0,             2, 16, 18, 0 },
+  { "extensible 24-bit 4 channels",  true,  WAV_TAG_EXTENSIBLE, WAV_TAG_PCM,   4, 24, 40, 0 },
+  { "extensible float mono",         true,  WAV_TAG_EXTENSIBLE, WAV_TAG_FLOAT, 1, 32, 40, 0 },
+  { "LIST and fact before data",     true,  WAV_TAG_PCM,        0,             2, 24, 16, WCF_LIST_BEFORE },
+  { "chunk after data",              true,  WAV_TAG_PCM,        0,             1, 16, 16, WCF_CHUNK_AFTER },
+  { "truncated",                     true,  WAV_TAG_PCM,        0,             2, 24, 16, WCF_TRUNCATED },
+  { "data size 0xffffffff",          true,  WAV_TAG_PCM,        0,             2, 16, 16, WCF_DATA_SIZE_MAX },
+  { "wrong RIFF size",               true,  WAV_TAG_PCM,        0,             2, 16, 16, WCF_BAD_RIFF_SIZE },
+  { "not RIFF",                      false, WAV_TAG_PCM,        0,             2, 16, 16, WCF_NOT_RIFF },
+  { "too short",                     false, WAV_TAG_PCM,        0,             2, 16, 16, WCF_TOO_SHORT },
+  { "data before fmt",               false, WAV_TAG_PCM,        0,             2, 16, 16, WCF_DATA_FIRST },
+  { "no data",                       false, WAV_TAG_PCM,        0,             2, 16, 16, WCF_NO_DATA | WCF_CHUNK_AFTER },
+  { "empty data",                    false, WAV_TAG_PCM,        0,             2, 16, 16, WCF_EMPTY_DATA },
+  { "fmt too short",                 false, WAV_TAG_PCM,        0,             2, 16, 14, 0 },
+  { "fmt past end of file",          false, WAV_TAG_PCM,        0,             2, 16, 16, WCF_FMT_PAST_END },
+  { "MS ADPCM",                      false, WAV_TAG_ADPCM,      0,             2, 4,  20, 0 },
+  { "no channels",                   false, WAV_TAG_PCM,        0,             0, 16, 16, 0 },
+  { "12-bit",                        false, WAV_TAG_PCM,        0,             2, 12, 16, 0 },
+  { "block align mismatch",          false, WAV_TAG_PCM,        0,             2, 16, 16, WCF_BAD_ALIGN },
+  { "extensible unknown sub-format", false, WAV_TAG_EXTENSIBLE, WAV_TAG_PCM,   2, 16, 40, WCF_BAD_GUID },
+  { "extensible fmt too short",      false, WAV_TAG_EXTENSIBLE, WAV_TAG_PCM,   2, 16, 18, 0 },
+  { "chunk size past end of file",   false, WAV_TAG_PCM,        0,             2, 16, 16, WCF_HUGE_CHUNK },
+};
+
+static const uint8_t wavSubFormatGuidTail[14] = {
+  0x00, 0x00, 0x00, 0x00, 0x10, 0x00, 0x80, 0x00, 0x00, 0xaa, 0x00, 0x38, 0x9b, 0x71
+};
+
+
+// What frame i of channel c holds in the corpus. The right channel is the
+// inverse of the left, so a mix-up between them would show, and anything past
+// those two should be dropped.
+static int16_t wavCheckSample(uint32_t frame, uint16_t channel) {
+  int16_t left = static_cast<int16_t>(static_cast<uint16_t>(frame * 1031 + 0x8000));
+  if (channel == 0) {
+    return left;
+  } else if (channel == 1) {
+    return static_cast<int16_t>(~left);
+  }
+
+  return 0x1234;
+}
+
+
+// Writes a .wav file for the parser check, a field at a time.
+class WavWriter {
+public:
+  WavWriter(std::vector<uint8_t>& _bytes):
+    bytes(_bytes) {
+    bytes.clear();
+  }
+
+  void Put8(uint8_t val) { bytes.push_back(val); }
+  void Put16(uint16_t val) { Put8(val & 0xff); Put8(val >> 8); }
+  void Put32(uint32_t val) { Put16(val & 0xffff); Put16(val >> 16); }
+  void PutId(const char *id) { bytes.insert(bytes.end(), id, id + 4); }
+
+  void Pad() {
+    if (bytes.size() & 1) {
+      Put8(0);
+    }
+  }
+
+  void Chunk(const char *id, uint32_t len) {
+    PutId(id);
+    Put32(len);
+    for (uint32_t i = 0; i < len; i++) {
+      Put8(static_cast<uint8_t>(i));
+    }
+    Pad();
+  }
+
+  void Fmt(const WavCase& wc) {
+    uint16_t blockAlign = wc.numChannels * (wc.bitsPerSample / 8);
+    if (wc.flags & WCF_BAD_ALIGN) {
+      blockAlign++;
+    }
+
+    size_t start = bytes.size() + 8;
+    PutId("fmt ");
+    Put32(wc.fmtLen);
+    Put16(wc.fmtTag);
+    Put16(wc.numChannels);
+    Put32(WAV_CHECK_RATE);
+    Put32(WAV_CHECK_RATE * blockAlign);
+    Put16(blockAlign);
+    Put16(wc.bitsPerSample);
+    if (wc.fmtLen >= 18) {
+      Put16(wc.fmtLen - 18);
+    }
+
+    if (wc.fmtLen >= 40) {
+      Put16(wc.bitsPerSample);
+      Put32(wc.numChannels == 1 ? 0x4 : 0x3);
+      Put16(wc.subTag);
+      bytes.insert(bytes.end(), wavSubFormatGuidTail, wavSubFormatGuidTail + sizeof(wavSubFormatGuidTail));
+      if (wc.flags & WCF_BAD_GUID) {
+        bytes.back() ^= 0xff;
+      }
+    }
+
+    // Short or odd chunks are cut or filled out to the size they claim.
+    bytes.resize(start + wc.fmtLen);
+    Pad();
+  }
+
+  void Data(const WavCase& wc, uint32_t numFrames, uint32_t declaredLen) {
+    PutId("data");
+    Put32(declaredLen);
+
+    // Whatever's below 16 bits is less than half, so it should round away.
+    for (uint32_t i = 0; i < numFrames; i++) {
+      for (uint16_t c = 0; c < wc.numChannels; c++) {
+        int16_t sample = wavCheckSample(i, c);
+        if (wc.fmtTag == WAV_TAG_FLOAT || wc.subTag == WAV_TAG_FLOAT) {
+          float val = sample / 32768.0f;
+          uint32_t bits;
+          memcpy(&bits, &val, sizeof(bits));
+          Put32(bits);
+        } else if (wc.bitsPerSample == 8) {
+          Put8(static_cast<uint8_t>((sample >> 8) + 128));
+        } else if (wc.bitsPerSample == 24) {
+          Put8(0x5a);
+          Put16(sample);
+        } else if (wc.bitsPerSample == 32) {
+          Put16(0x1234);
+          Put16(sample);
+        } else {
+          Put16(sample);
+        }
+      }
+    }
+    Pad();
+  }
+
+  void Finish(bool badSize) {
+    uint32_t size = badSize ? 12345678 : static_cast<uint32_t>(bytes.size() - 8);
+    for (uint8_t i = 0; i < 4; i++) {
+      bytes[4 + i] = static_cast<uint8_t>(size >> (8 * i));
+    }
+  }
+
+private:
+  std::vector<uint8_t>& bytes;
+};
+
+
+// Returns the frames that should come out of it
+static uint32_t buildWav(const WavCase& wc, std::vector<uint8_t>& bytes) {
+  WavWriter writer(bytes);
+  uint32_t blockAlign = wc.numChannels * (wc.bitsPerSample / 8);
+  uint32_t numFrames = (wc.flags & WCF_EMPTY_DATA) ? 0 : WAV_CHECK_FRAMES;
+  uint32_t dataLen = (wc.flags & WCF_DATA_SIZE_MAX) ? 0xffffffff : numFrames * blockAlign;
+
+  writer.PutId((wc.flags & WCF_NOT_RIFF) ? "RIFX" : "RIFF");
+  writer.Put32(0);
+  writer.PutId("WAVE");
+
+  if (wc.flags & WCF_HUGE_CHUNK) {
+    writer.PutId("LIST");
+    writer.Put32(0xfffffff0);
+  }
+
+  if (wc.flags & WCF_LIST_BEFORE) {
+    writer.Chunk("LIST", 27);
+    writer.Chunk("fact", 4);
+  }
+
+  if (wc.flags & WCF_DATA_FIRST) {
+    writer.Data(wc, numFrames, dataLen);
+  }
+
+  writer.Fmt(wc);
+
+  if (!(wc.flags & (WCF_DATA_FIRST | WCF_NO_DATA))) {
+    writer.Data(wc, numFrames, dataLen);
+  }
+
+  if (wc.flags & WCF_CHUNK_AFTER) {
+    writer.Chunk("LIST", 9);
+  }
+
+  writer.Finish(wc.flags & WCF_BAD_RIFF_SIZE);
+
+  if (wc.flags & WCF_TRUNCATED) {
+    bytes.resize(bytes.size() - WAV_CHECK_TRUNCATED_FRAMES * blockAlign - 1);
+    numFrames -= WAV_CHECK_TRUNCATED_FRAMES + 1;
+  } else if (wc.flags & WCF_TOO_SHORT) {
+    bytes.resize(10);
+  } else if (wc.flags & WCF_FMT_PAST_END) {
+    bytes.resize(30);
+  }
+
+  return numFrames;
+}
+
+
+// Whatever the parser accepts has to stay inside the file.
+static bool wavHeaderSane(const WavHeader& header, uint32_t len) {
+  return header.numChannels && header.blockAlign && header.sampleType != WS_None &&
+    header.dataLen && header.dataLen % header.blockAlign == 0 &&
+    header.dataStart <= len && header.dataLen <= len - header.dataStart;
+}
+
+
+static bool checkWavCase(const WavCase& wc, std::vector<uint8_t>& bytes, std::vector<int16_t>& out) {
+  uint32_t expectedFrames = buildWav(wc, bytes);
+
+  WavHeader header;
+  bool parsed = header.ReadFromBuffer(bytes.data(), bytes.size());
+  bool pass = parsed == wc.valid;
+  uint32_t errors = 0;
+
+  if (parsed) {
+    pass = pass && wavHeaderSane(header, bytes.size()) && header.GetNumFrames() == expectedFrames;
+  }
+
+  if (pass && parsed) {
+    out.resize(expectedFrames * 2);
+    header.ToCanonical(bytes.data() + header.dataStart, expectedFrames, out.data());
+
+    for (uint32_t i = 0; i < expectedFrames; i++) {
+      int16_t left = wavCheckSample(i, 0);
+      int16_t right = wc.numChannels > 1 ? wavCheckSample(i, 1) : left;
+      if (wc.bitsPerSample == 8) {
+        left &= ~0xff;
+        right &= ~0xff;
+      }
+
+      if (out[i * 2] != left || out[i * 2 + 1] != right) {
+        errors++;
+      }
+    }
+
+    pass = errors == 0;
+  }
+
+  logPrintf(LOG_COMP_AUDIO, LOG_SEV_INFO, "WAV parser: %s: %s, %d frames, %d sample errors. %s.\n", wc.name,
+    parsed ? "accepted" : header.GetError(), parsed ? header.GetNumFrames() : 0, errors, pass ? "PASS" : "FAIL");
+
+  return pass;
+}
+
+
+// Damages copies of the good files at random, and checks that nothing the parser
+// accepts points outside the file, or converts to anything but whole frames.
+static bool fuzzWavParser(std::vector<uint8_t>& bytes, std::vector<int16_t>& out) {
+  std::vector<uint8_t> fuzzed;
+  uint32_t seed = 20240601;
+  uint32_t accepted = 0;
+  uint32_t insane = 0;
+  uint32_t rounds = 0;
+
+  for (size_t c = 0; c < sizeof(wavCorpus) / sizeof(wavCorpus[0]); c++) {
+    if (!wavCorpus[c].valid) {
+      continue;
+    }
+
+    buildWav(wavCorpus[c], bytes);
+
+    for (uint32_t r = 0; r < WAV_FUZZ_ROUNDS; r++) {
+      fuzzed = bytes;
+      seed = seed * 1664525 + 1013904223;
+      uint32_t mutations = 1 + (seed >> 30);
+
+      for (uint32_t m = 0; m < mutations && !fuzzed.empty(); m++) {
+        seed = seed * 1664525 + 1013904223;
+        uint32_t headerBytes = fuzzed.size() < WAV_FUZZ_HEADER_BYTES ? fuzzed.size() : WAV_FUZZ_HEADER_BYTES;
+        uint32_t pos = (seed >> 8) % headerBytes;
+
+        switch (seed & 3) {
+          case 0:
+            fuzzed[pos] = static_cast<uint8_t>(seed >> 24);
+            break;
+          case 1: {
+            // A size or rate that's out of range
+            static const uint32_t extremes[] = { 0, 1, 0x7fffffff, 0x80000000, 0xfffffff8, 0xffffffff };
+            uint32_t val = extremes[(seed >> 24) % (sizeof(extremes) / sizeof(extremes[0]))];
+            for (uint32_t i = 0; i < 4 && pos + i < fuzzed.size(); i++) {
+              fuzzed[pos + i] = static_cast<uint8_t>(val >> (8 * i));
+            }
+            break;
+          }
+          case 2:
+            fuzzed.resize((seed >> 8) % fuzzed.size());
+            break;
+          default:
+            fuzzed[pos] ^= static_cast<uint8_t>(1 << ((seed >> 24) & 7));
+            break;
+        }
+      }
+
+      WavHeader header;
+      rounds++;
+      if (!header.ReadFromBuffer(fuzzed.data(), fuzzed.size())) {
+        continue;
+      }
+
+      accepted++;
+      if (!wavHeaderSane(header, fuzzed.size())) {
+        insane++;
+        continue;
+      }
+
+      out.resize(header.GetNumFrames() * 2);
+      header.ToCanonical(fuzzed.data() + header.dataStart, header.GetNumFrames(), out.data());
+    }
+  }
+
+  bool pass = insane == 0;
+  logPrintf(LOG_COMP_AUDIO, LOG_SEV_INFO, "WAV parser: %d damaged files, %d accepted, %d out of bounds. %s.\n",
+    rounds, accepted, insane, pass ? "PASS" : "FAIL");
+
+  return pass;
+}
+
+
+static void benchmarkWavParse(const WavCase& wc, std::vector<uint8_t>& bytes) {
+  buildWav(wc, bytes);
+
+  WavHeader header;
+  uint32_t startTime = micros();
+  for (uint32_t i = 0; i < WAV_BENCH_PARSES; i++) {
+    header.ReadFromBuffer(bytes.data(), bytes.size());
+  }
+
+  uint32_t elapsedUs = micros() - startTime;
+  logPrintf(LOG_COMP_AUDIO, LOG_SEV_INFO, "WAV parser: Parsing %s takes %d ns.\n", wc.name,
+    static_cast<uint32_t>(static_cast<uint64_t>(elapsedUs) * 1000 / WAV_BENCH_PARSES));
+}
+
+
+static void benchmarkWavConversion(const char *name, WavSampleType_t sampleType, uint16_t numChannels, uint16_t bitsPerSample,
+  std::vector<uint8_t>& bytes, std::vector<int16_t>& out) {
+  WavHeader header;
+  header.sampleType = sampleType;
+  header.numChannels = numChannels;
+  header.bitsPerSample = bitsPerSample;
+  header.blockAlign = numChannels * (bitsPerSample / 8);
+
+  bytes.resize(WAV_BENCH_FRAMES * header.blockAlign);
+  out.resize(WAV_BENCH_FRAMES * 2);
+  uint32_t seed = 12345;
+  for (size_t i = 0; i < bytes.size(); i++) {
+    seed = seed * 1664525 + 1013904223;
+    bytes[i] = static_cast<uint8_t>(seed >> 24);
+  }
+
+  uint32_t frames = 0;
+  uint32_t startTime = micros();
+  while (frames < WAV_BENCH_SECONDS * PLAYER_SAMPLE_RATE) {
+    header.ToCanonical(bytes.data(), WAV_BENCH_FRAMES, out.data());
+    frames += WAV_BENCH_FRAMES;
+  }
+
+  uint32_t elapsedUs = micros() - startTime;
+  logPrintf(LOG_COMP_AUDIO, LOG_SEV_INFO, "WAV parser: Converting %s takes %d us per second of audio.\n",
+    name, elapsedUs / WAV_BENCH_SECONDS);
+}
+
+
+void Diagnostics::CheckWavParser() {
+  std::vector<uint8_t> bytes;
+  std::vector<int16_t> out;
+  uint32_t failed = 0;
+
+  try {
+    for (size_t c = 0; c < sizeof(wavCorpus) / sizeof(wavCorpus[0]); c++) {
+      if (!checkWavCase(wavCorpus[c], bytes, out)) {
+        failed++;
+      }
+    }
+
+    if (!fuzzWavParser(bytes, out)) {
+      failed++;
+    }
+
+    // A plain file, and one with chunks to skip
+    for (size_t c = 0; c < sizeof(wavCorpus) / sizeof(wavCorpus[0]); c++) {
+      if (c == 0 || (wavCorpus[c].flags & WCF_LIST_BEFORE)) {
+        benchmarkWavParse(wavCorpus[c], bytes);
+      }
+    }
+
+    benchmarkWavConversion("8-bit stereo", WS_Unsigned8, 2, 8, bytes, out);
+    benchmarkWavConversion("16-bit mono", WS_Signed16, 1, 16, bytes, out);
+    benchmarkWavConversion("24-bit stereo", WS_Signed24, 2, 24, bytes, out);
+    benchmarkWavConversion("float stereo", WS_Float32, 2, 32, bytes, out);
+  } catch (std::bad_alloc&) {
+    logPrintf(LOG_COMP_AUDIO, LOG_SEV_ERROR, "WAV parser check: Unable to allocate buffers\n");
+    return;
+  }
+
+  logPrintf(LOG_COMP_AUDIO, LOG_SEV_INFO, "WAV parser: %d checks failed. %s.\n", failed, failed ? "FAIL" : "PASS");
+}
+
+
+void Diagnostics::CheckStreamWav(StreamWav *stream, const char *fileName) {
+  FILE *testFile = fopen(fileName, "r");
+  if (!testFile) {
+    logPrintf(LOG_COMP_AUDIO, LOG_SEV_INFO, "Stream check: No test file at %s. Skipping.\n", fileName);
+    return;
+  }
+
+  fclose(testFile);
+
+  if (!stream->Open(fileName, PLAYER_SAMPLE_RATE)) {
+    logPrintf(LOG_COMP_AUDIO, LOG_SEV_ERROR, "Stream check: Unable to open %s. FAIL.\n", fileName);
+    return;
+  }
+
+  uint32_t expectedFrames = stream->GetNumFrames();
+  logPrintf(LOG_COMP_AUDIO, LOG_SEV_INFO, "Stream check: Playing %d frames from %s at %dx real time...\n", 
+    expectedFrames, fileName, STREAM_CHECK_SPEEDUP);
+
+  uint32_t blockUs = static_cast<uint32_t>(static_cast<uint64_t>(PLAYER_BLOCK_FRAMES) * 1000000 / PLAYER_SAMPLE_RATE / STREAM_CHECK_SPEEDUP);
+  uint32_t progressBlocks = blocksForSeconds(STREAM_CHECK_PROGRESS_SECONDS);
+
+  // The same calls the player makes, in the same order: a block's worth of frames
+  // at a time, moving on to the next chunk whenever one runs out.
+  stream->Restart();
+  const AudioSamples *samples = stream->GetSamples();
+  uint32_t position = 0;
+  uint32_t framesPlayed = 0;
+  uint32_t blocks = 0;
+  uint32_t maxCallUs = 0;
+  uint32_t nextBlockTime = micros();
+
+  while (samples) {
+    if (!samples->len) {
+      // Starved last time. The player tries again at the start of each block.
+      samples = stream->GetSamples();
+    }
+
+    uint32_t blockFrames = 0;
+    while (samples && blockFrames < PLAYER_BLOCK_FRAMES) {
+      uint32_t chunkFrames = samples->len / PLAYER_CHANNELS / sizeof(int16_t);
+      if (!chunkFrames) {
+        // The player plays silence for the rest of the block.
+        break;
+      }
+
+      uint32_t frames = chunkFrames - position;
+      if (frames > PLAYER_BLOCK_FRAMES - blockFrames) {
+        frames = PLAYER_BLOCK_FRAMES - blockFrames;
+      }
+
+      position += frames;
+      blockFrames += frames;
+
+      if (position == chunkFrames) {
+        uint32_t callStart = micros();
+        samples = stream->HasMoreData() ? stream->GetSamples() : NULL;
+        uint32_t callUs = micros() - callStart;
+        if (callUs > maxCallUs) {
+          maxCallUs = callUs;
+        }
+
+        position = 0;
+      }
+    }
+
+    framesPlayed += blockFrames;
+    blocks++;
+    if (blocks % progressBlocks == 0) {
+      logPrintf(LOG_COMP_AUDIO, LOG_SEV_INFO, "Stream check: %d of %d frames, %d underruns so far\n", 
+        framesPlayed, expectedFrames, stream->GetStats().underruns);
+    }
+
+    // Wait for the next block to be due, like the I2S driver would make us.
+    nextBlockTime += blockUs;
+    while (static_cast<int32_t>(nextBlockTime - micros()) > 0) {
+      vTaskDelay(1);
+    }
+  }
+
+  StreamStats stats = stream->GetStats();
+  bool pass = framesPlayed == expectedFrames && stats.underruns == 0 && stats.errors == 0;
+
+  logPrintf(LOG_COMP_AUDIO, LOG_SEV_INFO, "Stream check: %d of %d frames, %d underruns (%d blocks), %d read errors, fewest frames ready: %d, reading: %d us per second, longest read: %d us, longest audio task call: %d us. %s.\n",
+    framesPlayed,
+    expectedFrames,
+    stats.underruns,
+    stats.starvedBlocks,
+    stats.errors,
+    stats.minBufferedFrames,
+    stats.workUsPerSecond,
+    stats.maxWorkUs,
+    maxCallUs,
+    pass ? "PASS" : "FAIL");
+}
+
+
+// Fills in a click: silence, then a decaying 2 kHz tone that starts on the right
+// channel a little before the left, then silence again.
+static uint32_t buildClick(int16_t *samples, uint8_t numChannels, int16_t peak) {
+  uint32_t numFrames = CLICKPREP_CHECK_SILENCE_FRAMES + CLICKPREP_CHECK_TONE_FRAMES + CLICKPREP_CHECK_TAIL_FRAMES;
+  memset(samples, 0, numFrames * numChannels * sizeof(int16_t));
+  for (uint32_t i = 0; i < CLICKPREP_CHECK_TONE_FRAMES; i++) {
+    float level = peak * expf(-4.0f * i / CLICKPREP_CHECK_TONE_FRAMES);
+    int16_t *frame = samples + (CLICKPREP_CHECK_SILENCE_FRAMES + i) * numChannels;
+    frame[numChannels - 1] = static_cast<int16_t>(lroundf(level * cosf(2 * static_cast<float>(M_PI) * 2000 * i / PLAYER_SAMPLE_RATE)));
+    if (numChannels == 2 && i >= 10) {
+      frame[0] = frame[1] / 2;
+    }
+  }
+
+  return numFrames;
+}
+
+
+static bool checkClickPrep(const char *name, uint8_t numChannels, int16_t inPeak, uint32_t maxFrames) {
+  uint32_t maxSamples = (CLICKPREP_CHECK_SILENCE_FRAMES + CLICKPREP_CHECK_TONE_FRAMES + CLICKPREP_CHECK_TAIL_FRAMES) * numChannels;
+  std::unique_ptr<int16_t[]> samples;
+  try {
+    samples = std::unique_ptr<int16_t[]>(new int16_t[maxSamples]);
+  } catch (std::bad_alloc&) {
+    logPrintf(LOG_COMP_AUDIO, LOG_SEV_ERROR, "ClickPrep check: Unable to allocate buffer\n");
+    return false;
+  }
+
+  uint32_t numFrames = buildClick(samples.get(), numChannels, inPeak);
+
+  // Where the sound starts and stops, worked out the long way
+  int32_t threshold = inPeak / CLICKPREP_SILENCE_RATIO;
+  uint32_t firstLoud = numFrames, lastLoud = 0;
+  for (uint32_t i = 0; i < numFrames * numChannels; i++) {
+    if (abs(samples[i]) > threshold) {
+      firstLoud = i / numChannels < firstLoud ? i / numChannels : firstLoud;
+      lastLoud = i / numChannels;
+    }
+  }
+
+  ClickPrep::Result result;
+  uint32_t length = ClickPrep::Process(samples.get(), numFrames, numChannels, maxFrames, &result);
+
+  float expectedGain = static_cast<float>(CLICKPREP_TARGET_PEAK) / inPeak;
+  if (expectedGain > CLICKPREP_MAX_GAIN) {
+    expectedGain = CLICKPREP_MAX_GAIN;
+  }
+
+  uint32_t expectedLength = lastLoud + 1 - (firstLoud - CLICKPREP_PREROLL_FRAMES);
+  if (maxFrames && expectedLength > maxFrames) {
+    expectedLength = maxFrames;
+  }
+
+  int32_t outPeak = 0;
+  for (uint32_t i = 0; i < length * numChannels; i++) {
+    outPeak = abs(samples[i]) > outPeak ? abs(samples[i]) : outPeak;
+  }
+
+  int32_t expectedPeak = static_cast<int32_t>(lroundf(inPeak * expectedGain));
+  bool pass = result.leadingFrames == firstLoud - CLICKPREP_PREROLL_FRAMES && length == expectedLength &&
+    outPeak >= expectedPeak - 1 && outPeak <= expectedPeak + 1 &&
+    samples[0] == 0 && samples[length * numChannels - 1] == 0 && samples[(length - 1) * numChannels] == 0;
+
+  logPrintf(LOG_COMP_AUDIO, LOG_SEV_INFO, "ClickPrep: %s: trimmed %d frames, %d frames left of %d, peak %d to %d. %s.\n",
+    name, result.leadingFrames, length, numFrames, inPeak, outPeak, pass ? "PASS" : "FAIL");
+
+  return pass;
+}
+
+
+void Diagnostics::CheckClickPrep() {
+  checkClickPrep("mono", 1, 8000, 0);
+  checkClickPrep("stereo", 2, 8000, 0);
+  checkClickPrep("full scale", 1, INT16_MAX, 0);
+  checkClickPrep("nearly silent", 2, 200, 0);
+  checkClickPrep("cut short", 2, 8000, CLICKPREP_CHECK_MAX_FRAMES);
+
+  // Silence is left alone, rather than being trimmed to nothing.
+  int16_t silence[64] = {};
+  ClickPrep::Result result;
+  uint32_t length = ClickPrep::Process(silence, 32, 2, 0, &result);
+  logPrintf(LOG_COMP_AUDIO, LOG_SEV_INFO, "ClickPrep: silence: %d frames left of 32. %s.\n", length, length == 32 ? "PASS" : "FAIL");
+}
+
+
+static float rms(const int16_t *samples, uint32_t numSamples) {
+  double sum = 0;
+  for (uint32_t i = 0; i < numSamples; i++) {
+    sum += static_cast<double>(samples[i]) * samples[i];
+  }
+
+  return numSamples ? sqrtf(static_cast<float>(sum / numSamples)) : 0;
+}
+
+
+static bool checkClickSynth(const char *name, const ClickSynthVoice& voice, float expectedDecayMs) {
+  uint32_t maxFrames = ClickSynth::GetNumFrames(voice, PLAYER_SAMPLE_RATE);
+  std::unique_ptr<int16_t[]> samples;
+  try {
+    samples = std::unique_ptr<int16_t[]>(new int16_t[maxFrames]);
+  } catch (std::bad_alloc&) {
+    logPrintf(LOG_COMP_AUDIO, LOG_SEV_ERROR, "ClickSynth check: Unable to allocate buffer\n");
+    return false;
+  }
+
+  uint32_t startTime = micros();
+  uint32_t numFrames = ClickSynth::Render(voice, PLAYER_SAMPLE_RATE, samples.get());
+  uint32_t elapsedUs = micros() - startTime;
+
+  // Everything is measured from the end of the attack, over the first three time
+  // constants, where it's still well clear of the noise floor.
+  uint32_t attackFrames = PLAYER_SAMPLE_RATE * CLICKSYNTH_ATTACK_US / 1000000;
+  uint32_t decayFrames = static_cast<uint32_t>(expectedDecayMs * PLAYER_SAMPLE_RATE / 1000);
+  uint32_t crossings = 0;
+  for (uint32_t i = attackFrames + 1; i < attackFrames + 3 * decayFrames && i < numFrames; i++) {
+    crossings += (samples[i - 1] < 0) != (samples[i] < 0);
+  }
+
+  float pitchHz = crossings * 0.5f * PLAYER_SAMPLE_RATE / (3 * decayFrames);
+  float firstRms = rms(samples.get() + attackFrames, decayFrames);
+  float thirdRms = rms(samples.get() + attackFrames + 2 * decayFrames, decayFrames);
+  float decayDb = firstRms > 0 && thirdRms > 0 ? 20 * log10f(thirdRms / firstRms) : 0;
+
+  int32_t pitchPermille = static_cast<int32_t>(lroundf(1000 * (pitchHz - voice.pitchHz) / voice.pitchHz));
+  int32_t decayErrorMdb = static_cast<int32_t>(lroundf(1000 * (decayDb + 20 * 2 / logf(10))));
+  bool noise = voice.shape == CS_Noise;
+  bool pass = numFrames == maxFrames && samples[0] == 0 &&
+    (noise || abs(pitchPermille) <= CLICKSYNTH_CHECK_PITCH_PERMILLE) &&
+    abs(decayErrorMdb) <= (noise ? 2 : 1) * CLICKSYNTH_CHECK_DECAY_MDB;
+
+  logPrintf(LOG_COMP_AUDIO, LOG_SEV_INFO, "ClickSynth: %s: %d frames (%d bytes) in %d us, pitch %d Hz, %d mdB over two time constants. %s.\n",
+    name, numFrames, static_cast<int>(numFrames * sizeof(int16_t)), elapsedUs, static_cast<int>(lroundf(pitchHz)),
+    static_cast<int>(lroundf(decayDb * 1000)), pass ? "PASS" : "FAIL");
+
+  return pass;
+}
+
+
+void Diagnostics::CheckClickSynth() {
+  checkClickSynth("ping", ClickSynthVoice(CS_Ping, 1500, 6), 6);
+  checkClickSynth("high ping", ClickSynthVoice(CS_Ping, 6000, 10), 10);
+  checkClickSynth("noise", ClickSynthVoice(CS_Noise, 4000, 3), 3);
+  checkClickSynth("too long", ClickSynthVoice(CS_Ping, 400, 1000), CLICKSYNTH_MAX_DECAY_MS);
+
+  int16_t unused[1];
+  uint32_t numFrames = ClickSynth::Render(ClickSynthVoice(CS_Ping, PLAYER_SAMPLE_RATE / 2, 5), PLAYER_SAMPLE_RATE, unused);
+  logPrintf(LOG_COMP_AUDIO, LOG_SEV_INFO, "ClickSynth: at Nyquist: %d frames. %s.\n", numFrames, numFrames == 0 ? "PASS" : "FAIL");
+
+  // A bank with no files gets the built-in voice, mono, and starting straight away.
+  ClickBank bank;
+  bool loaded = bank.LoadDir("/nonexistent", PLAYER_SAMPLE_RATE);
+  const char *names[] = { CLICKBANK_SYNTH_VOICE, CLICKBANK_SYNTH_VOICE "-accent", CLICKBANK_SYNTH_VOICE "-subdivision" };
+  bool pass = loaded && bank.GetNumSamples() == sizeof(names) / sizeof(names[0]) && bank.GetArenaSize() <= CLICKSYNTH_CHECK_MAX_BYTES;
+  for (const char *name : names) {
+    ClickSample *sample = bank.Find(name);
+    pass = pass && sample && sample->GetNumChannels() == 1 && sample->GetTrimmedFrames() == 0;
+  }
+
+  logPrintf(LOG_COMP_AUDIO, LOG_SEV_INFO, "ClickSynth: built-in voice with no click files: %d sounds, %d bytes. %s.\n",
+    bank.GetNumSamples(), bank.GetArenaSize(), pass ? "PASS" : "FAIL");
+}
+
+
+void Diagnostics::CheckClickBankFiles(const char *dirName) {
+  static const WavCase clickFile = { "16-bit mono", true, WAV_TAG_PCM, 0, 1, 16, 16, 0 };
+  std::vector<uint8_t> bytes;
+  try {
+    buildWav(clickFile, bytes);
+  } catch (std::bad_alloc&) {
+    logPrintf(LOG_COMP_AUDIO, LOG_SEV_ERROR, "Click bank file check: Unable to allocate the file\n");
+    return;
+  }
+
+  // It might be left over from a check that didn't finish.
+  mkdir(dirName, 0777);
+
+  char path[CLICKBANK_CHECK_MAX_PATH];
+  uint8_t written = 0;
+  for (uint8_t f = 0; f < CLICKBANK_CHECK_FILES; f++) {
+    snprintf(path, sizeof(path), "%s/check%d.wav", dirName, f);
+    FILE *file = fopen(path, "wb");
+    if (file) {
+      bool wrote = fwrite(bytes.data(), bytes.size(), 1, file) == 1;
+      if (fclose(file) == 0 && wrote) {
+        written++;
+      }
+    }
+  }
+
+  uint8_t loaded = 0;
+  bool canOpen = false;
+  {
+    ClickBank bank;
+    bank.LoadDir(dirName, PLAYER_SAMPLE_RATE);
+    for (uint8_t f = 0; f < CLICKBANK_CHECK_FILES; f++) {
+      char name[CLICKBANK_MAX_NAME];
+      snprintf(name, sizeof(name), "check%d", f);
+      if (bank.Find(name)) {
+        loaded++;
+      }
+    }
+
+    // Everything the bank opened has to have been closed again.
+    snprintf(path, sizeof(path), "%s/check0.wav", dirName);
+    FILE *file = fopen(path, "r");
+    canOpen = file != NULL;
+    if (file) {
+      fclose(file);
+    }
+  }
+
+  for (uint8_t f = 0; f < CLICKBANK_CHECK_FILES; f++) {
+    snprintf(path, sizeof(path), "%s/check%d.wav", dirName, f);
+    remove(path);
+  }
+
+  rmdir(dirName);
+
+  logPrintf(LOG_COMP_AUDIO, LOG_SEV_INFO, "ClickBank: %d of %d click files written, %d loaded, and a file can be opened after: %s. %s.\n",
+    written, CLICKBANK_CHECK_FILES, loaded, canOpen ? "yes" : "no",
+    written == CLICKBANK_CHECK_FILES && loaded == CLICKBANK_CHECK_FILES && canOpen ? "PASS" : "FAIL");
+}
+
+
+// A click built with integer arithmetic alone, so it comes out the same on any
+// machine: a square wave at about 2 kHz, fading to a quarter of its peak and
+// then stopping dead. None of its samples is zero, so the renderer's output
+// shows exactly where each one starts. In stereo, the left is half the right,
+// upside down.
+class CheckClick : public AudioDataInterface {
+public:
+  CheckClick(uint8_t _numChannels):
+    numChannels(_numChannels) {
+    for (uint32_t i = 0; i < OFFLINE_CHECK_CLICK_FRAMES; i++) {
+      int32_t level = OFFLINE_CHECK_CLICK_PEAK - OFFLINE_CHECK_CLICK_PEAK * 3 * static_cast<int32_t>(i) / (4 * OFFLINE_CHECK_CLICK_FRAMES);
+      int16_t *frame = samples + i * numChannels;
+      frame[numChannels - 1] = static_cast<int16_t>((i / 11) % 2 ? -level : level);
+      if (numChannels == 2) {
+        frame[0] = static_cast<int16_t>(-frame[1] / 2);
+      }
+    }
+
+    audioSamples.samples = reinterpret_cast<const uint8_t*>(samples);
+    audioSamples.len = OFFLINE_CHECK_CLICK_FRAMES * numChannels * sizeof(int16_t);
+  }
+  virtual ~CheckClick() {}
+
+  virtual bool HasMoreData() { return false; }
+  virtual void Restart() {}
+  virtual uint32_t GetSampleRate() { return PLAYER_SAMPLE_RATE; }
+  virtual uint16_t GetBitsPerSample() { return 16; }
+  virtual uint16_t GetNumChannels() { return numChannels; }
+  virtual const AudioSamples* GetSamples() { return &audioSamples; }
+
+private:
+  int16_t samples[OFFLINE_CHECK_CLICK_FRAMES * 2];
+  AudioSamples audioSamples;
+  uint8_t numChannels;
+};
+
+
+// Keeps a hash of everything rendered, and of the frame each click starts at,
+// rather than the audio itself
+class ChecksumOutput : public RenderOutputInterface {
+public:
+  ChecksumOutput():
+    numFrames(0),
+    numClicks(0),
+    positionHash(2166136261u),
+    sampleHash(2166136261u),
+    silent(true) {}
+  virtual ~ChecksumOutput() {}
+
+  virtual bool Write(const int16_t *frames, uint32_t count) {
+    for (uint32_t frame = 0; frame < count; frame++) {
+      const int16_t *samples = frames + frame * PLAYER_CHANNELS;
+      bool sound = false;
+      for (uint8_t channel = 0; channel < PLAYER_CHANNELS; channel++) {
+        sound = sound || samples[channel];
+        sampleHash = (sampleHash ^ static_cast<uint16_t>(samples[channel])) * 16777619u;
+      }
+
+      if (sound && silent) {
+        positionHash = (positionHash ^ (numFrames + frame)) * 16777619u;
+        numClicks++;
+      }
+
+      silent = !sound;
+    }
+
+    numFrames += count;
+    return true;
+  }
+
+  uint32_t numFrames;
+  uint32_t numClicks;
+  uint32_t positionHash;  // FNV-1a, a frame number at a time
+  uint32_t sampleHash;    // FNV-1a, a sample at a time
+
+private:
+  bool silent;
+};
+
+
+void Diagnostics::CheckOfflineRender() {
+  std::unique_ptr<CheckClick> normal, accent;
+  std::vector<RenderSong> songs;
+  try {
+    normal = std::unique_ptr<CheckClick>(new CheckClick(1));
+    accent = std::unique_ptr<CheckClick>(new CheckClick(2));
+    songs.resize(2);
+
+    std::vector<TempoChange> changes(2);
+    changes[0].bar = 3;
+    changes[0].bpm = 110;
+    changes[0].beatsPerBar = 3;
+    changes[1].bar = 6;
+    changes[1].bpm = 140;
+    changes[1].rampBars = 2;
+    songs[1].tempoMap.Compile(TEMPOMAP_START_BPM, CLICKTRACK_DEFAULT_BEATS_PER_BAR, changes);
+  } catch (std::bad_alloc&) {
+    logPrintf(LOG_COMP_AUDIO, LOG_SEV_ERROR, "Offline render check: Unable to allocate the songs\n");
+    return;
+  }
+
+  songs[0].bpm = 120;
+  songs[0].subdivision = SD_Eighths;
+  songs[0].countInBars = 1;
+  songs[1].bpm = TEMPOMAP_START_BPM;
+  songs[1].subdivision = SD_Sixteenths;
+  for (RenderSong& song : songs) {
+    song.bars = OFFLINE_CHECK_BARS;
+    song.clicks[RC_Normal] = normal.get();
+    song.clicks[RC_Accent] = accent.get();
+  }
+
+  // Has to match the stored render, click by click and sample by sample. The
+  // renderer has a whole mixer in it, which is too much for
+  // the audio task's stack.
+  std::unique_ptr<OfflineRenderer> renderer;
+  try {
+    renderer = std::unique_ptr<OfflineRenderer>(new OfflineRenderer());
+  } catch (std::bad_alloc&) {
+    logPrintf(LOG_COMP_AUDIO, LOG_SEV_ERROR, "Offline render check: Unable to allocate the renderer\n");
+    return;
+  }
+
+  ChecksumOutput output;
+  uint32_t startTime = micros();
+  renderer->Render(songs, &output);
+  uint32_t elapsedUs = micros() - startTime;
+
+  uint32_t audioMs = static_cast<uint32_t>(static_cast<uint64_t>(output.numFrames) * 1000 / PLAYER_SAMPLE_RATE);
+  uint32_t speedup = elapsedUs ? static_cast<uint32_t>(static_cast<uint64_t>(audioMs) * 1000 / elapsedUs) : UINT32_MAX;
+  bool matches = output.numFrames == OFFLINE_CHECK_GOLDEN_FRAMES && output.numClicks == OFFLINE_CHECK_GOLDEN_CLICKS &&
+    output.positionHash == OFFLINE_CHECK_GOLDEN_POSITIONS && output.sampleHash == OFFLINE_CHECK_GOLDEN_SAMPLES;
+  logPrintf(LOG_COMP_AUDIO, LOG_SEV_INFO, "Offline render: %d ms of audio in %d us, %dx real time. %u frames, %u clicks, positions %08x, samples %08x (expected %u, %u, %08x, %08x). %s.\n",
+    audioMs, elapsedUs, speedup, output.numFrames, output.numClicks, output.positionHash, output.sampleHash,
+    OFFLINE_CHECK_GOLDEN_FRAMES, OFFLINE_CHECK_GOLDEN_CLICKS, OFFLINE_CHECK_GOLDEN_POSITIONS, OFFLINE_CHECK_GOLDEN_SAMPLES,
+    matches && speedup >= OFFLINE_CHECK_MIN_SPEEDUP ? "PASS" : "FAIL");
+}
+
+
+// A click every ADPCM_CHECK_CLICK_FRAMES: a ping on the left, and a burst of noise
+// on the right, or both together in mono. clicks has room for two of them, and
+// is silent.
+static void buildAdpcmSound(int16_t *samples, uint32_t numFrames, uint16_t numChannels, int16_t *clicks) {
+  ClickSynthVoice voices[2] = { ClickSynthVoice(CS_Ping, 1500, 10), ClickSynthVoice(CS_Noise, 3000, 5) };
+  int16_t *click[2] = { clicks, clicks + ADPCM_CHECK_CLICK_FRAMES };
+  for (uint8_t c = 0; c < 2; c++) {
+    ClickSynth::Render(voices[c], PLAYER_SAMPLE_RATE, click[c]);
+  }
+
+  for (uint32_t frame = 0; frame < numFrames; frame++) {
+    uint32_t pos = frame % ADPCM_CHECK_CLICK_FRAMES;
+    if (numChannels == 1) {
+      samples[frame] = static_cast<int16_t>((click[0][pos] + click[1][pos]) / 2);
+    } else {
+      samples[frame * 2] = click[0][pos];
+      samples[frame * 2 + 1] = click[1][pos];
+    }
+  }
+}
+
+
+// samples as a WAVE_FORMAT_IMA_ADPCM file
+static void buildAdpcmWav(const std::vector<uint8_t>& adpcm, uint16_t numChannels, std::vector<uint8_t>& bytes) {
+  uint32_t blockBytes = ADPCM_BLOCK_BYTES_PER_CHANNEL * numChannels;
+  WavWriter writer(bytes);
+  writer.PutId("RIFF");
+  writer.Put32(4 + 8 + 20 + 8 + adpcm.size());
+  writer.PutId("WAVE");
+  writer.PutId("fmt ");
+  writer.Put32(20);
+  writer.Put16(0x11);
+  writer.Put16(numChannels);
+  writer.Put32(PLAYER_SAMPLE_RATE);
+  writer.Put32(PLAYER_SAMPLE_RATE * blockBytes / ADPCM_FRAMES_PER_BLOCK);
+  writer.Put16(blockBytes);
+  writer.Put16(ADPCM_BITS_PER_SAMPLE);
+  writer.Put16(2);
+  writer.Put16(ADPCM_FRAMES_PER_BLOCK);
+  writer.PutId("data");
+  writer.Put32(adpcm.size());
+  bytes.insert(bytes.end(), adpcm.begin(), adpcm.end());
+}
+
+
+static bool checkAdpcm(const char *name, uint16_t numChannels) {
+  // What's played back is whole blocks, the last padded out with silence.
+  uint32_t blockBytes = ADPCM_BLOCK_BYTES_PER_CHANNEL * numChannels;
+  uint32_t adpcmBytes = ImaAdpcm::GetEncodedBytes(ADPCM_CHECK_FRAMES, numChannels);
+  uint32_t numBlocks = adpcmBytes / blockBytes;
+  uint32_t numFrames = numBlocks * ADPCM_FRAMES_PER_BLOCK;
+  std::vector<int16_t> clicks, pcm, decoded, converted;
+  std::vector<uint8_t> adpcm, wav;
+  std::unique_ptr<Mixer> mixers[2];
+  try {
+    clicks.assign(2 * ADPCM_CHECK_CLICK_FRAMES, 0);
+    pcm.assign(numFrames * numChannels, 0);
+    decoded.resize(numFrames * numChannels);
+    converted.resize(numFrames * numChannels);
+    adpcm.resize(adpcmBytes);
+    mixers[0] = std::unique_ptr<Mixer>(new Mixer());
+    mixers[1] = std::unique_ptr<Mixer>(new Mixer());
+  } catch (std::bad_alloc&) {
+    logPrintf(LOG_COMP_AUDIO, LOG_SEV_ERROR, "ADPCM check: Unable to allocate buffers\n");
+    return false;
+  }
+
+  buildAdpcmSound(pcm.data(), ADPCM_CHECK_FRAMES, numChannels, clicks.data());
+  uint32_t written = ImaAdpcm::Encode(pcm.data(), ADPCM_CHECK_FRAMES, numChannels, adpcm.data());
+
+  uint32_t startTime = micros();
+  for (uint32_t round = 0; round < ADPCM_CHECK_BENCH_ROUNDS; round++) {
+    for (uint32_t b = 0; b < numBlocks; b++) {
+      ImaAdpcm::DecodeBlock(adpcm.data() + b * blockBytes, blockBytes, numChannels,
+        decoded.data() + b * ADPCM_FRAMES_PER_BLOCK * numChannels, numChannels, ADPCM_FRAMES_PER_BLOCK);
+    }
+  }
+  uint32_t elapsedUs = micros() - startTime;
+
+  uint32_t blockNs = static_cast<uint32_t>(static_cast<uint64_t>(elapsedUs) * 1000 / (ADPCM_CHECK_BENCH_ROUNDS * numBlocks));
+  uint32_t blockUs = static_cast<uint32_t>(static_cast<uint64_t>(ADPCM_FRAMES_PER_BLOCK) * 1000000 / PLAYER_SAMPLE_RATE);
+  uint32_t permille = blockNs / blockUs;
+
+  double signal = 0, noise = 0;
+  for (uint32_t i = 0; i < numFrames * numChannels; i++) {
+    double error = decoded[i] - pcm[i];
+    signal += static_cast<double>(pcm[i]) * pcm[i];
+    noise += error * error;
+  }
+
+  int32_t snrDb = noise > 0 ? static_cast<int32_t>(10 * log10(signal / noise)) : INT32_MAX;
+
+  // The same, read back as a file
+  WavHeader header;
+  bool wavSame = false;
+  try {
+    buildAdpcmWav(adpcm, numChannels, wav);
+  } catch (std::bad_alloc&) {
+    logPrintf(LOG_COMP_AUDIO, LOG_SEV_ERROR, "ADPCM check: Unable to allocate the .wav file\n");
+    return false;
+  }
+
+  if (header.ReadFromBuffer(wav.data(), wav.size()) && header.GetNumFrames() == numFrames) {
+    if (numChannels == 1) {
+      header.ToMono(wav.data() + header.dataStart, numFrames, converted.data());
+    } else {
+      header.ToCanonical(wav.data() + header.dataStart, numFrames, converted.data());
+    }
+
+    wavSame = converted == decoded;
+  }
+
+  // Through the mixer, on two voices at once, against the decoded samples as 16-bit
+  CheckSource encodedSource(adpcm.data(), adpcmBytes, numChannels, ADPCM_BITS_PER_SAMPLE);
+  CheckSource pcmSource(decoded.data(), numFrames * numChannels * sizeof(int16_t), numChannels, 16);
+  AudioDataInterface *sources[2] = { &encodedSource, &pcmSource };
+  uint32_t mixUs[2] = { 0, 0 };
+  uint32_t diffs = 0;
+  uint32_t numMixBlocks = (numFrames + ADPCM_CHECK_SECOND_VOICE_BLOCK * PLAYER_BLOCK_FRAMES) / PLAYER_BLOCK_FRAMES + 1;
+  bool prepared = mixers[0]->Prepare(sources[0]) && mixers[1]->Prepare(sources[1]);
+  for (uint32_t b = 0; b < numMixBlocks && prepared; b++) {
+    const int16_t *blocks[2];
+    for (uint8_t m = 0; m < 2; m++) {
+      if (b == 0) {
+        mixers[m]->Play(sources[m], 0, 1, MV_Click);
+      } else if (b == ADPCM_CHECK_SECOND_VOICE_BLOCK) {
+        mixers[m]->Play(sources[m], PLAYER_BLOCK_FRAMES / 3, 0.5f, MV_Cue);
+      }
+
+      uint32_t blockStart = micros();
+      blocks[m] = mixers[m]->RenderBlock();
+      mixUs[m] += micros() - blockStart;
+    }
+
+    for (uint32_t i = 0; i < PLAYER_BLOCK_FRAMES * PLAYER_CHANNELS; i++) {
+      diffs += blocks[0][i] != blocks[1][i];
+    }
+  }
+
+  uint32_t pcmBytes = ADPCM_CHECK_FRAMES * numChannels * sizeof(int16_t);
+  bool pass = written == adpcmBytes && snrDb >= ADPCM_CHECK_MIN_SNR_DB && permille <= ADPCM_CHECK_MAX_PERMILLE &&
+    wavSame && prepared && diffs == 0;
+
+  logPrintf(LOG_COMP_AUDIO, LOG_SEV_INFO, "ADPCM (%s): %d frames in %u bytes rather than %u, %d%% saved, SNR %d dB\n",
+    name, ADPCM_CHECK_FRAMES, static_cast<unsigned>(written), static_cast<unsigned>(pcmBytes),
+    static_cast<int>(100 - static_cast<uint64_t>(written) * 100 / pcmBytes), snrDb);
+  logPrintf(LOG_COMP_AUDIO, LOG_SEV_INFO, "ADPCM (%s): %d ns to decode a %d frame block, %d/1000 of its real time. Mixing: %d ns a block, %d ns for 16-bit.\n",
+    name, blockNs, ADPCM_FRAMES_PER_BLOCK, permille, static_cast<int>(static_cast<uint64_t>(mixUs[0]) * 1000 / numMixBlocks),
+    static_cast<int>(static_cast<uint64_t>(mixUs[1]) * 1000 / numMixBlocks));
+  logPrintf(LOG_COMP_AUDIO, LOG_SEV_INFO, "ADPCM (%s): the same from a .wav file: %s, %d samples differ through the mixer. %s.\n",
+    name, wavSame ? "yes" : "no", diffs, pass ? "PASS" : "FAIL");
+
+  return pass;
+}
+
+
+void Diagnostics::CheckAdpcm() {
+  checkAdpcm("mono", 1);
+  checkAdpcm("stereo", 2);
+}
+
+
+void Diagnostics::CheckLatencyStats() {
+  std::unique_ptr<LatencyStats> stats;
+  try {
+    stats = std::unique_ptr<LatencyStats>(new LatencyStats());
+  } catch (std::bad_alloc&) {
+    logPrintf(LOG_COMP_AUDIO, LOG_SEV_ERROR, "Latency stats check: Unable to allocate stats\n");
+    return;
+  }
+
+  // A click on every block, alternately early and late, so every one after the
+  // first is 200 us of jitter. The queue is always full.
+  uint32_t numBlocks = blocksForSeconds(LATENCY_CHECK_SECONDS);
+  uint32_t queuedFrames = PLAYER_DMA_BUF_COUNT * PLAYER_DMA_BUF_LEN;
+  uint32_t blockUs = static_cast<uint32_t>(static_cast<uint64_t>(PLAYER_BLOCK_FRAMES) * 1000000 / PLAYER_SAMPLE_RATE);
+  ClickTiming timing;
+
+  uint32_t startTime = micros();
+  for (uint32_t blockNum = 0; blockNum < numBlocks; blockNum++) {
+    timing.scheduledUs = blockNum * blockUs;
+    timing.submittedUs = timing.scheduledUs - blockUs;
+    timing.heardUs = timing.scheduledUs + (blockNum & 1 ? LATENCY_CHECK_SWING_US : -LATENCY_CHECK_SWING_US);
+    stats->RecordClick(timing);
+    stats->RecordBlock(static_cast<uint64_t>(blockNum + 1) * PLAYER_BLOCK_FRAMES, queuedFrames);
+  }
+
+  uint32_t elapsedUs = micros() - startTime;
+  uint32_t permille = static_cast<uint32_t>(static_cast<uint64_t>(elapsedUs) * 1000 / (static_cast<uint64_t>(numBlocks) * blockUs));
+  logPrintf(LOG_COMP_AUDIO, LOG_SEV_INFO, "Latency stats: %d ns per block with a click, %d/1000 of real time. %s.\n",
+    static_cast<int>(static_cast<uint64_t>(elapsedUs) * 1000 / numBlocks), permille, permille < LATENCY_CHECK_MAX_PERMILLE ? "PASS" : "FAIL");
+
+  // Only the last one or two windows are left, and everything in them is where it
+  // should be.
+  Histogram jitter, lateness, queue;
+  stats->GetHistogram(LatencyStats::LH_Jitter, &jitter);
+  stats->GetHistogram(LatencyStats::LH_Lateness, &lateness);
+  stats->GetHistogram(LatencyStats::LH_QueueDepth, &queue);
+
+  uint32_t windowBlocks = blocksForSeconds(LATENCYSTATS_WINDOW_SECONDS);
+  bool rolled = queue.GetTotal() <= 2 * windowBlocks && queue.GetTotal() >= windowBlocks;
+  bool placed = jitter.GetPercentile(0.0f) == jitter.GetPercentile(1.0f) &&
+    jitter.GetPercentile(1.0f) - jitter.GetBucketWidth() <= 2 * LATENCY_CHECK_SWING_US &&
+    jitter.GetPercentile(1.0f) > 2 * LATENCY_CHECK_SWING_US &&
+    lateness.GetPercentile(0.4f) <= 0 && lateness.GetPercentile(0.6f) > LATENCY_CHECK_SWING_US &&
+    stats->GetMaxLatenessUs() == LATENCY_CHECK_SWING_US;
+  logPrintf(LOG_COMP_AUDIO, LOG_SEV_INFO, "Latency stats: %d of %d blocks in the histograms, jitter up to %d us, lateness %d to %d us. %s.\n",
+    queue.GetTotal(), numBlocks, jitter.GetPercentile(1.0f), lateness.GetPercentile(0.0f) - lateness.GetBucketWidth(), lateness.GetPercentile(1.0f),
+    rolled && placed ? "PASS" : "FAIL");
+
+  // A clear is picked up at the next block.
+  stats->Clear();
+  stats->RecordBlock(static_cast<uint64_t>(numBlocks + 1) * PLAYER_BLOCK_FRAMES, queuedFrames);
+  stats->GetHistogram(LatencyStats::LH_QueueDepth, &queue);
+  bool cleared = queue.GetTotal() == 1 && stats->GetClicks() == 0;
+  logPrintf(LOG_COMP_AUDIO, LOG_SEV_INFO, "Latency stats: Cleared, %d blocks and %d clicks left. %s.\n",
+    queue.GetTotal(), stats->GetClicks(), cleared ? "PASS" : "FAIL");
+}
+
+
+void Diagnostics::MeasureClickJitter() {
+  logPrintf(LOG_COMP_AUDIO, LOG_SEV_INFO, "Measuring click placement from %d to %d BPM...\n", JITTER_MIN_BPM, JITTER_MAX_BPM);
+
+  // Beats alone should never be more than half a frame out, since that's just rounding.
+  sweepTempos("beats", SD_None, CLICKTRACK_DEFAULT_SWING, JITTER_BPM_STEP, JITTER_SIMULATED_SECONDS, 0.5);
+
+  // Subdivisions go through a second fixed-point offset, so allow up to (but not
+  // including) a full frame.
+  sweepTempos("8ths", SD_Eighths, 50, SUBDIVISION_BPM_STEP, SUBDIVISION_SIMULATED_SECONDS, 0.999);
+  sweepTempos("swung 8ths", SD_Eighths, 66, SUBDIVISION_BPM_STEP, SUBDIVISION_SIMULATED_SECONDS, 0.999);
+  sweepTempos("triplets", SD_Triplets, 50, SUBDIVISION_BPM_STEP, SUBDIVISION_SIMULATED_SECONDS, 0.999);
+  sweepTempos("16ths", SD_Sixteenths, 50, SUBDIVISION_BPM_STEP, SUBDIVISION_SIMULATED_SECONDS, 0.999);
+  sweepTempos("swung 16ths", SD_Sixteenths, 60, SUBDIVISION_BPM_STEP, SUBDIVISION_SIMULATED_SECONDS, 0.999);
+
+  // Drift shows up as placement error that grows with the beat number. Over a long
+  // song it should still be no worse than the rounding to the nearest frame.
+  SimulationResult drift = simulateClickTrack(DRIFT_BPM, SD_None, CLICKTRACK_DEFAULT_SWING, blocksForSeconds(DRIFT_SIMULATED_SECONDS));
+  logPrintf(LOG_COMP_AUDIO, LOG_SEV_INFO, "Click drift: %d beats at %d/10 BPM, worst error %d/1000 frame. %s.\n",
+    drift.events,
+    static_cast<int>(DRIFT_BPM * 10),
+    static_cast<int>(drift.worstError * 1000),
+    drift.worstError <= 0.5 ? "PASS" : "FAIL");
+
+  checkTempoMap();
+}
+
+
+} // namespace AudioLib
@@ -0,0 +1,251 @@
+#include <stdio.h>
+#include <string.h>
+
+#include "audio/latencystats.hpp"
+#include "audio/player.hpp"
+
+
+namespace AudioLib {
+
+// Jitter from 0 to 1.5 ms in 50 us steps
+#define LATENCYSTATS_JITTER_LOW_US 0
+#define LATENCYSTATS_JITTER_STEP_US 50
+
+// Lateness from 3 ms early to 3 ms late in 200 us steps
+#define LATENCYSTATS_LATENESS_LOW_US -3000
+#define LATENCYSTATS_LATENESS_STEP_US 200
+
+// The queue can hold the whole DMA ring and a block
+#define LATENCYSTATS_QUEUE_STEP_FRAMES \
+  ((PLAYER_DMA_BUF_COUNT * PLAYER_DMA_BUF_LEN + PLAYER_BLOCK_FRAMES) / (HISTOGRAM_BUCKETS - 2) + 1)
+
+#define LATENCYSTATS_CSV_LINE 96
+
+
+///////////////////////////////////////////////////////////////////////////////
+// class Histogram
+///////////////////////////////////////////////////////////////////////////////
+Histogram::Histogram(int32_t _low, int32_t _bucketWidth):
+  low(_low),
+  bucketWidth(_bucketWidth) {
+  Clear();
+}
+
+
+void Histogram::Add(int32_t value) {
+  int32_t bucket = value < low ? 0 : (value - low) / bucketWidth;
+  if (bucket >= HISTOGRAM_BUCKETS) {
+    bucket = HISTOGRAM_BUCKETS - 1;
+  }
+
+  counts[bucket]++;
+}
+
+
+void Histogram::Add(const Histogram& other) {
+  for (uint8_t i = 0; i < HISTOGRAM_BUCKETS; i++) {
+    counts[i] += other.counts[i];
+  }
+}
+
+
+void Histogram::Clear() {
+  memset(counts, 0, sizeof(counts));
+}
+
+
+uint32_t Histogram::GetTotal() const {
+  uint32_t total = 0;
+  for (uint8_t i = 0; i < HISTOGRAM_BUCKETS; i++) {
+    total += counts[i];
+  }
+
+  return total;
+}
+
+
+int32_t Histogram::GetPercentile(float fraction) const {
+  // The value at the target'th place, counting from 0
+  uint32_t total = GetTotal();
+  uint32_t target = static_cast<uint32_t>(total * fraction);
+  if (target && target >= total) {
+    target = total - 1;
+  }
+
+  uint32_t seen = 0;
+  for (uint8_t i = 0; i < HISTOGRAM_BUCKETS; i++) {
+    seen += counts[i];
+    if (seen > target) {
+      return GetBucketLow(i + 1);
+    }
+  }
+
+  return GetBucketLow(HISTOGRAM_BUCKETS);
+}
+
+
+///////////////////////////////////////////////////////////////////////////////
+// class LatencyStats
+///////////////////////////////////////////////////////////////////////////////
+LatencyStats::LatencyStats():
+  window(0),
+  windowEndFrame(static_cast<uint64_t>(LATENCYSTATS_WINDOW_SECONDS) * PLAYER_SAMPLE_RATE),
+  clicks(0),
+  missedClicks(0),
+  maxLatenessUs(INT32_MIN),
+  lastLatenessUs(0),
+  reanchored(true),
+  clearRequested(false) {
+  for (uint8_t w = 0; w < 2; w++) {
+    for (uint8_t h = 0; h < LH_NumHistograms; h++) {
+      windows[w][h] = makeHistogram(static_cast<Histogram_t>(h));
+    }
+  }
+}
+
+
+Histogram LatencyStats::makeHistogram(Histogram_t histogram) {
+  switch (histogram) {
+  case LH_Jitter:
+    return Histogram(LATENCYSTATS_JITTER_LOW_US, LATENCYSTATS_JITTER_STEP_US);
+  case LH_Lateness:
+    return Histogram(LATENCYSTATS_LATENESS_LOW_US, LATENCYSTATS_LATENESS_STEP_US);
+  default:
+    return Histogram(0, LATENCYSTATS_QUEUE_STEP_FRAMES);
+  }
+}
+
+
+const char* LatencyStats::GetHistogramName(Histogram_t histogram) {
+  switch (histogram) {
+  case LH_Jitter:
+    return "jitter_us";
+  case LH_Lateness:
+    return "lateness_us";
+  case LH_QueueDepth:
+    return "queue_frames";
+  default:
+    return "unknown";
+  }
+}
+
+
+void LatencyStats::clear() {
+  for (uint8_t w = 0; w < 2; w++) {
+    for (uint8_t h = 0; h < LH_NumHistograms; h++) {
+      windows[w][h].Clear();
+    }
+  }
+
+  for (uint8_t i = 0; i < LATENCYSTATS_RECENT_CLICKS; i++) {
+    recent[i] = ClickTiming();
+  }
+
+  clicks.store(0, std::memory_order_relaxed);
+  missedClicks.store(0, std::memory_order_relaxed);
+  maxLatenessUs.store(INT32_MIN, std::memory_order_relaxed);
+  reanchored = true;
+}
+
+
+void LatencyStats::RecordClick(const ClickTiming& timing) {
+  uint32_t count = clicks.load(std::memory_order_relaxed);
+  recent[count % LATENCYSTATS_RECENT_CLICKS] = timing;
+  clicks.store(count + 1, std::memory_order_relaxed);
+
+  int32_t latenessUs = static_cast<int32_t>(timing.heardUs - timing.scheduledUs);
+  windows[window][LH_Lateness].Add(latenessUs);
+  if (latenessUs > maxLatenessUs.load(std::memory_order_relaxed)) {
+    maxLatenessUs.store(latenessUs, std::memory_order_relaxed);
+  }
+
+  if (!reanchored) {
+    int32_t jitterUs = latenessUs - lastLatenessUs;
+    windows[window][LH_Jitter].Add(jitterUs < 0 ? -jitterUs : jitterUs);
+  }
+
+  lastLatenessUs = latenessUs;
+  reanchored = false;
+}
+
+
+void LatencyStats::RecordMissedClicks(uint32_t count) {
+  missedClicks.fetch_add(count, std::memory_order_relaxed);
+}
+
+
+void LatencyStats::RecordBlock(uint64_t framePosition, uint32_t queuedFrames) {
+  if (clearRequested.exchange(false, std::memory_order_relaxed)) {
+    clear();
+  }
+
+  if (framePosition >= windowEndFrame) {
+    windowEndFrame = framePosition + static_cast<uint64_t>(LATENCYSTATS_WINDOW_SECONDS) * PLAYER_SAMPLE_RATE;
+    window ^= 1;
+    for (uint8_t h = 0; h < LH_NumHistograms; h++) {
+      windows[window][h].Clear();
+    }
+  }
+
+  windows[window][LH_QueueDepth].Add(queuedFrames);
+}
+
+
+void LatencyStats::GetHistogram(Histogram_t histogram, Histogram *out) const {
+  *out = windows[0][histogram];
+  out->Add(windows[1][histogram]);
+}
+
+
+uint8_t LatencyStats::GetRecentClicks(ClickTiming *out) const {
+  uint32_t count = clicks.load(std::memory_order_relaxed);
+  uint8_t numRecent = count < LATENCYSTATS_RECENT_CLICKS ? count : LATENCYSTATS_RECENT_CLICKS;
+  for (uint8_t i = 0; i < numRecent; i++) {
+    out[i] = recent[(count - 1 - i) % LATENCYSTATS_RECENT_CLICKS];
+  }
+
+  return numRecent;
+}
+
+
+void LatencyStats::WriteCsv(LineWriter writeLine, uint32_t underruns, uint32_t queueOverflows) const {
+  // Sections are separated by a blank line, and each has its own header.
+  char line[LATENCYSTATS_CSV_LINE];
+  writeLine("histogram,bucket_low,bucket_width,count");
+  for (uint8_t h = 0; h < LH_NumHistograms; h++) {
+    Histogram histogram;
+    GetHistogram(static_cast<Histogram_t>(h), &histogram);
+    for (uint8_t i = 0; i < HISTOGRAM_BUCKETS; i++) {
+      snprintf(line, sizeof(line), "%s,%d,%d,%u", GetHistogramName(static_cast<Histogram_t>(h)),
+        static_cast<int>(histogram.GetBucketLow(i)), static_cast<int>(histogram.GetBucketWidth()), static_cast<unsigned>(histogram.GetCount(i)));
+      writeLine(line);
+    }
+  }
+
+  int32_t maxLateness = GetMaxLatenessUs();
+  writeLine("");
+  writeLine("counter,value");
+  snprintf(line, sizeof(line), "clicks,%u", static_cast<unsigned>(GetClicks()));
+  writeLine(line);
+  snprintf(line, sizeof(line), "missed_clicks,%u", static_cast<unsigned>(GetMissedClicks()));
+  writeLine(line);
+  snprintf(line, sizeof(line), "max_lateness_us,%d", static_cast<int>(maxLateness == INT32_MIN ? 0 : maxLateness));
+  writeLine(line);
+  snprintf(line, sizeof(line), "underruns,%u", static_cast<unsigned>(underruns));
+  writeLine(line);
+  snprintf(line, sizeof(line), "queue_overflows,%u", static_cast<unsigned>(queueOverflows));
+  writeLine(line);
+
+  ClickTiming timings[LATENCYSTATS_RECENT_CLICKS];
+  uint8_t numRecent = GetRecentClicks(timings);
+  writeLine("");
+  writeLine("click,scheduled_us,submitted_us,heard_us");
+  for (uint8_t i = 0; i < numRecent; i++) {
+    snprintf(line, sizeof(line), "%d,%u,%u,%u", -static_cast<int>(i), static_cast<unsigned>(timings[i].scheduledUs),
+      static_cast<unsigned>(timings[i].submittedUs), static_cast<unsigned>(timings[i].heardUs));
+    writeLine(line);
+  }
+}
+
+
+} // namespace AudioLib
@@ -1,6 +1,8 @@
+#include <new>
 #include <stdlib.h>
 
 #include "audio/memwav.hpp"
+#include "audio/resampler.hpp"
 #include "log.hpp"
 #include "storage/sdcard-fs.hpp"
 
@@ -18,6 +20,11 @@ namespace AudioLib {
 ///////////////////////////////////////////////////////////////////////////////
 MemWav::MemWav():
   wavBufLen(0),
+  wavBufSize(0),
+  canonicalSize(0),
+  convertedSize(0),
+  sampleRate(0),
+  numChannels(2),
   valid(false) {}
 
 
@@ -38,7 +45,19 @@ bool MemWav::readFromFile(const char *fileName) {
   size_t fileSize = ftell(theFile);
   if (fileSize <= MAX_MEMWAV_FILE_SIZE) {
       fseek(theFile, 0, SEEK_SET);
-      wavBuf = std::unique_ptr<uint8_t[]>(new uint8_t[fileSize]);
+
+      // Clicks get swapped from song to song, so don't go back to the heap each time.
+      if (fileSize > wavBufSize) {
+        wavBuf.reset();
+        wavBufSize = 0;
+        try {
+          wavBuf = std::unique_ptr<uint8_t[]>(new uint8_t[fileSize]);
+          wavBufSize = fileSize;
+        } catch (std::bad_alloc&) {
+          // Reported below
+        }
+      }
+
       if (wavBuf) {
         if (fread(wavBuf.get(), fileSize, 1, theFile) == 1) {
           logPrintf(LOG_COMP_SDCARD, LOG_SEV_VERBOSE, "MemWav::readFromFile: Read contents of file %s\n", fileName);
@@ -54,48 +73,130 @@ bool MemWav::readFromFile(const char *fileName) {
     logPrintf(LOG_COMP_SDCARD, LOG_SEV_ERROR, "*** MemWav::readFromFile: File exceeds max size of %d\n", MAX_MEMWAV_FILE_SIZE);
   }
 
+  // The card only has room for a few files open at once, and the click bank
+  // reads a whole directory of them.
+  fclose(theFile);
   return success;
 }
 
 
-bool MemWav::InitFromFile(const char *fileName) {
+bool MemWav::InitFromFile(const char *fileName, uint32_t outputRate) {
+  // If we're being reloaded, the old samples are about to be freed.
+  valid = false;
+
   if (!readFromFile(fileName)) {
     return false;
   }
 
   if (!wavHeader.ReadFromBuffer(wavBuf.get(), wavBufLen)) {
-    logPrintf(LOG_COMP_SDCARD, LOG_SEV_ERROR, "Failed to parse .wav header from file %s\n", fileName);
+    logPrintf(LOG_COMP_SDCARD, LOG_SEV_ERROR, "Failed to parse .wav file %s: %s\n", fileName, wavHeader.GetError());
     return false;
   }
 
-  uint32_t headerSize = wavHeader.GetSize();
-  if (wavBufLen <= headerSize) {
-    logPrintf(LOG_COMP_SDCARD, LOG_SEV_ERROR, "WAV file contains no samples! Header size: %d, total size: %d, file: %s\n", headerSize, wavBufLen, fileName);
+  wavHeader.Dump();
+
+  uint32_t numFrames = wavHeader.GetNumFrames();
+  sampleRate = wavHeader.samplesPerSecond;
+  numChannels = wavHeader.numChannels == 1 ? 1 : 2;
+
+  // 16-bit files are played from where they were read. Anything else is converted.
+  int16_t *pcm;
+  if (wavHeader.sampleType == WS_Signed16 && wavHeader.numChannels == numChannels) {
+    pcm = reinterpret_cast<int16_t*>(wavBuf.get() + wavHeader.dataStart);
+  } else {
+    pcm = convert(numFrames);
+  }
+
+  // Plenty of click files are stereo with the same thing on both sides. Keep one.
+  if (numChannels == 2) {
+    uint32_t frame = 0;
+    while (frame < numFrames && pcm[frame * 2] == pcm[frame * 2 + 1]) {
+      frame++;
+    }
+
+    if (frame == numFrames) {
+      for (frame = 0; frame < numFrames; frame++) {
+        pcm[frame] = pcm[frame * 2];
+      }
+
+      numChannels = 1;
+      logPrintf(LOG_COMP_SDCARD, LOG_SEV_VERBOSE, "MemWav: Both channels of %s are the same. Keeping it as mono.\n", fileName);
+    }
+  }
+
+  samples.samples = reinterpret_cast<const uint8_t*>(pcm);
+  samples.len = numFrames * numChannels * sizeof(int16_t);
+
+  if (outputRate && sampleRate != outputRate && !resample(outputRate)) {
+    logPrintf(LOG_COMP_SDCARD, LOG_SEV_ERROR, "Unable to resample %s from %d to %d\n", fileName, sampleRate, outputRate);
     return false;
   }
 
-  uint8_t *dataStart = wavBuf.get() + headerSize;
-  uint32_t dataLen = wavBufLen - headerSize;
-  if (!wavData.Init(dataStart, dataLen)) {
-    logPrintf(LOG_COMP_SDCARD, LOG_SEV_ERROR, "WAV data invalid. File %s\n", fileName);
+  valid = true;
+  return true;
+}
+
+
+int16_t* MemWav::convert(uint32_t numFrames) {
+  uint32_t numSamples = numFrames * numChannels;
+  if (numSamples > canonicalSize) {
+    canonical.reset();
+    canonicalSize = 0;
+    canonical = std::unique_ptr<int16_t[]>(new int16_t[numSamples]);
+    canonicalSize = numSamples;
+  }
+
+  const uint8_t *data = wavBuf.get() + wavHeader.dataStart;
+  if (numChannels == 1) {
+    wavHeader.ToMono(data, numFrames, canonical.get());
+  } else {
+    wavHeader.ToCanonical(data, numFrames, canonical.get());
+  }
+
+  logPrintf(LOG_COMP_SDCARD, LOG_SEV_VERBOSE, "MemWav: Converted %d frames of %d channels, %d bits to 16-bit\n",
+    numFrames, wavHeader.numChannels, wavHeader.bitsPerSample);
+
+  return canonical.get();
+}
+
+
+bool MemWav::resample(uint32_t outputRate) {
+  Resampler resampler;
+  if (!resampler.Init(sampleRate, outputRate, numChannels)) {
     return false;
   }
 
-  samples.samples = wavData.GetData();
-  samples.len = wavData.GetDataLen();
+  uint32_t inFrames = samples.len / (numChannels * sizeof(int16_t));
+  uint32_t outFrames = resampler.GetMaxOutputFrames(inFrames);
+  if (outFrames * numChannels > convertedSize) {
+    converted.reset();
+    convertedSize = 0;
+    converted = std::unique_ptr<int16_t[]>(new int16_t[outFrames * numChannels]);
+    convertedSize = outFrames * numChannels;
+  }
+
+  uint32_t numFrames = inFrames;
+  uint32_t written = resampler.Process(reinterpret_cast<const int16_t*>(samples.samples), &numFrames, converted.get(), outFrames);
+  while (!resampler.Drained() && written < outFrames) {
+    written += resampler.Drain(converted.get() + written * numChannels, outFrames - written);
+  }
+
+  logPrintf(LOG_COMP_SDCARD, LOG_SEV_VERBOSE, "MemWav: Resampled %d frames at %d to %d at %d\n", inFrames, sampleRate, written, outputRate);
 
-  valid = true;
+  samples.samples = reinterpret_cast<const uint8_t*>(converted.get());
+  samples.len = written * numChannels * sizeof(int16_t);
+  sampleRate = outputRate;
   return true;
 }
 
 
 uint32_t MemWav::GetSampleRate() {
-  return wavHeader.samplesPerSecond;
+  return sampleRate;
 }
 
 
 uint16_t MemWav::GetBitsPerSample() {
-  return wavHeader.bitsPerSample;
+  return 16;
 }
 
 
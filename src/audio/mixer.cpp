@@ -0,0 +1,592 @@
+#include <string.h>
+#include <string>
+
+#include "audio/mixer.hpp"
+#include "audio/volumecurve.hpp"
+#include "log.hpp"
+
+
+namespace AudioLib {
+
+#define PLAYER_BYTES_PER_FRAME (PLAYER_CHANNELS * sizeof(int16_t))
+
+// There's not a lot of gain in a click file, so give it some room. Full volume
+// is about +9.5 dB.
+#define PLAYER_VOLUME_BOOST 3
+
+// About -10 dB on the volume curve, which with the boost is close to unity.
+#define PLAYER_DEFAULT_VOLUME 0.75f
+
+// How often to log baking, if there was any
+#define MIXER_BAKE_LOG_FRAMES (PLAYER_SAMPLE_RATE * 60)
+
+
+///////////////////////////////////////////////////////////////////////////////
+// class Mixer
+///////////////////////////////////////////////////////////////////////////////
+Mixer::Mixer():
+  lastVoice(MV_Click),
+  volume(PLAYER_DEFAULT_VOLUME),
+  volumeGain(VolumeCurve::PositionToGain(PLAYER_DEFAULT_VOLUME)),
+  bakedStarts(0),
+  bakeCount(0),
+  loggedBakeCount(0),
+  nextBakeLogFrame(MIXER_BAKE_LOG_FRAMES),
+  numPendingStarts(0),
+  framePosition(0) {}
+
+
+Mixer::~Mixer() {}
+
+
+bool Mixer::Play(AudioDataInterface* _playThis, uint32_t frameOffset, float gain, MixerVoice_t voice) {
+  if (!_playThis) {
+    return false;
+  }
+
+  if (voice >= MV_NumVoices) {
+    logPrintf(LOG_COMP_AUDIO, LOG_SEV_ERROR, "Mixer::Play: invalid voice %d\n", voice);
+    return false;
+  }
+
+  if (frameOffset >= PLAYER_BLOCK_FRAMES) {
+    logPrintf(LOG_COMP_AUDIO, LOG_SEV_ERROR, "Mixer::Play: frame offset %d is outside the block\n", frameOffset);
+    return false;
+  }
+
+  if (numPendingStarts >= PLAYER_MAX_PENDING_STARTS) {
+    logPrintf(LOG_COMP_AUDIO, LOG_SEV_WARN, "Mixer::Play: too many sources started in one block. Dropping one.\n");
+    return false;
+  }
+
+  // Keep the list sorted by offset so renderBlock() can walk it in order.
+  uint8_t i = numPendingStarts;
+  while (i > 0 && pendingStarts[i - 1].frameOffset > frameOffset) {
+    pendingStarts[i] = pendingStarts[i - 1];
+    i--;
+  }
+
+  pendingStarts[i].source = _playThis;
+  pendingStarts[i].frameOffset = frameOffset;
+  pendingStarts[i].gain = gain;
+  pendingStarts[i].voice = voice;
+  numPendingStarts++;
+
+  return true;
+}
+
+
+bool Mixer::Replay(uint32_t frameOffset) {
+  const Voice& voice = voices[lastVoice];
+  if (!voice.source) {
+    logPrintf(LOG_COMP_AUDIO, LOG_SEV_ERROR, "Error: You must call Play() before you can call Replay()\n");
+    return false;
+  }
+
+  return Play(voice.source, frameOffset, voice.startGain, lastVoice);
+}
+
+
+void Mixer::Stop(MixerVoice_t voice) {
+  if (voice < MV_NumVoices) {
+    voices[voice].position = voices[voice].numFrames;
+    voices[voice].waiting = false;
+    voices[voice].encoded = NULL;
+  }
+}
+
+
+void Mixer::Stop(AudioDataInterface *source) {
+  for (uint8_t v = 0; v < MV_NumVoices; v++) {
+    if (voices[v].source == source) {
+      voices[v].position = voices[v].numFrames = 0;
+      voices[v].source = NULL;
+      voices[v].waiting = false;
+      voices[v].encoded = NULL;
+    }
+  }
+}
+
+
+bool Mixer::Prepare(AudioDataInterface* source) {
+  const AudioSamples *sourceSamples = source ? source->GetSamples() : NULL;
+  if (!sourceSamples) {
+    return false;
+  }
+
+  uint16_t bitsPerSample = source->GetBitsPerSample();
+  if (bitsPerSample != 16 && bitsPerSample != ADPCM_BITS_PER_SAMPLE) {
+    logPrintf(LOG_COMP_AUDIO, LOG_SEV_ERROR, "Unsupported bits per sample: %d\n", bitsPerSample);
+    return false;
+  }
+
+  if (source->GetNumChannels() != 1 && source->GetNumChannels() != 2) {
+    logPrintf(LOG_COMP_AUDIO, LOG_SEV_ERROR, "Unsupported number of channels: %d\n", source->GetNumChannels());
+    return false;
+  }
+
+  if (bitsPerSample == ADPCM_BITS_PER_SAMPLE && (source->HasMoreData() ||
+      sourceSamples->len % (ADPCM_BLOCK_BYTES_PER_CHANNEL * source->GetNumChannels()) != 0)) {
+    logPrintf(LOG_COMP_AUDIO, LOG_SEV_ERROR, "ADPCM sources have to be whole blocks, in a single chunk\n");
+    return false;
+  }
+
+  if (source->GetSampleRate() != PLAYER_SAMPLE_RATE) {
+    // The bus isn't reconfigured per source, since that would interrupt the stream.
+    // Sources are meant to have been resampled as they were loaded.
+    logPrintf(LOG_COMP_AUDIO, LOG_SEV_WARN, "Source sample rate %d doesn't match output rate %d. It will play at the wrong pitch.\n", 
+      source->GetSampleRate(), PLAYER_SAMPLE_RATE);
+  }
+
+  return true;
+}
+
+
+bool Mixer::Bake(AudioDataInterface* source, uint32_t reserveSamples, uint8_t numGains) {
+  const AudioSamples *sourceSamples = source ? source->GetSamples() : NULL;
+  if (!sourceSamples || source->HasMoreData() || source->GetBitsPerSample() != 16 ||
+      (source->GetNumChannels() != 1 && source->GetNumChannels() != 2)) {
+    logPrintf(LOG_COMP_AUDIO, LOG_SEV_ERROR, "Mixer::Bake: Only 16-bit mono or stereo sources in a single chunk can be baked\n");
+    return false;
+  }
+
+  uint8_t numChannels = static_cast<uint8_t>(source->GetNumChannels());
+  uint32_t numFrames = sourceSamples->len / (numChannels * sizeof(int16_t));
+  uint32_t numSamples = numFrames * numChannels;
+  const int16_t *original = reinterpret_cast<const int16_t*>(sourceSamples->samples);
+  if (numGains < 1) {
+    numGains = 1;
+  }
+
+  if (countBaked(source, original, numFrames, numChannels) == numGains) {
+    return true;
+  }
+
+  // Started over, since the copies might be of samples that have gone.
+  Stop(source);
+  Unbake(source);
+
+  if (reserveSamples < numSamples) {
+    reserveSamples = numSamples;
+  }
+
+  for (uint8_t copy = 0; copy < numGains; copy++) {
+    BakedSource *baked = findFreeBaked(numSamples);
+    if (!baked) {
+      logPrintf(LOG_COMP_AUDIO, LOG_SEV_WARN, "Mixer::Bake: Only room for %d of %d copies. It'll be baked again when its gain changes.\n",
+        copy, numGains);
+      return copy != 0;
+    }
+
+    try {
+      if (numSamples > baked->capacitySamples) {
+        baked->samples.reset();
+        baked->capacitySamples = 0;
+        baked->samples = std::unique_ptr<int16_t[]>(new int16_t[reserveSamples]);
+        baked->capacitySamples = reserveSamples;
+      }
+    } catch (std::bad_alloc&) {
+      logPrintf(LOG_COMP_AUDIO, LOG_SEV_ERROR, "Mixer::Bake: Unable to allocate %d frames\n", numFrames);
+      return copy != 0;
+    }
+
+    // Nothing is baked until it's first played, since the gain isn't known until then.
+    baked->source = source;
+    baked->original = original;
+    baked->numFrames = numFrames;
+    baked->numChannels = numChannels;
+    baked->baked = false;
+    baked->lastUsed = bakedStarts;
+  }
+
+  return true;
+}
+
+
+void Mixer::Unbake(AudioDataInterface* source) {
+  if (!source) {
+    return;
+  }
+
+  for (uint8_t i = 0; i < PLAYER_MAX_BAKED_COPIES; i++) {
+    BakedSource& baked = bakedSources[i];
+    if (baked.source == source) {
+      baked.source = NULL;
+      baked.original = NULL;
+      baked.baked = false;
+    }
+  }
+}
+
+
+float Mixer::SetVolume(float _volume) {
+  if (_volume > 1 ) {
+    _volume = 1;  
+  } else if (_volume < 0) {
+    _volume = 0;
+  }
+
+  volume = _volume;
+  volumeGain = VolumeCurve::PositionToGain(volume);
+
+  logPrintf(LOG_COMP_AUDIO, LOG_SEV_VERBOSE, "Set volume to %s\n", std::to_string(volume).c_str());
+
+  return volume;
+}
+
+
+void Mixer::SetVoiceGain(MixerVoice_t voice, float gain) {
+  if (voice < MV_NumVoices) {
+    voices[voice].gain = gain < 0 ? 0 : gain;
+  }
+}
+
+
+void Mixer::SetVoicePan(MixerVoice_t voice, float pan) {
+  if (voice < MV_NumVoices) {
+    voices[voice].pan = pan < -1 ? -1 : (pan > 1 ? 1 : pan);
+  }
+}
+
+const int16_t* Mixer::RenderBlock() {
+  // Volume and gains could be changed by the UI thread, but putting a lock around
+  // them seems unnecessary. They're picked up once per block.
+  updateGains();
+
+  if (framePosition >= nextBakeLogFrame) {
+    logBakes();
+  }
+
+  // Streams that ran dry get another go at each block.
+  for (uint8_t v = 0; v < MV_NumVoices; v++) {
+    if (voices[v].waiting) {
+      takeChunk(voices[v]);
+    }
+  }
+
+  uint32_t frame = 0;
+
+  for (uint8_t i = 0; i < numPendingStarts; i++) {
+    const PendingStart& start = pendingStarts[i];
+
+    // Play out whatever was already running up to the point the new source starts.
+    renderFrames(block + frame * PLAYER_CHANNELS, start.frameOffset - frame);
+    frame = start.frameOffset;
+
+    if (!startSource(start)) {
+      logPrintf(LOG_COMP_AUDIO, LOG_SEV_ERROR, "*** ERROR: Failed starting audio source\n");
+    }
+  }
+
+  numPendingStarts = 0;
+
+  renderFrames(block + frame * PLAYER_CHANNELS, PLAYER_BLOCK_FRAMES - frame);
+  framePosition += PLAYER_BLOCK_FRAMES;
+  return block;
+}
+
+
+void Mixer::renderFrames(int16_t *out, uint32_t numFrames) {
+  while (numFrames) {
+    // Mix in runs where the same voices are playing throughout, so the kernel
+    // never has to check for the end of a source.
+    MixSource active[MV_NumVoices];
+    uint8_t numActive = 0;
+    uint32_t runFrames = numFrames;
+
+    for (uint8_t v = 0; v < MV_NumVoices; v++) {
+      const Voice& voice = voices[v];
+      if (!voice.Playing()) {
+        continue;
+      }
+
+      active[numActive] = mixSources[v];
+      active[numActive].samples = voice.samples + voice.position * voice.numChannels;
+      active[numActive].numChannels = voice.numChannels;
+      numActive++;
+
+      uint32_t remaining = voice.numFrames - voice.position;
+      if (remaining < runFrames) {
+        runFrames = remaining;
+      }
+    }
+
+    if (!numActive) {
+      memset(out, 0, numFrames * PLAYER_BYTES_PER_FRAME);
+      return;
+    }
+
+    // A baked click on its own is already exactly what's wanted.
+    if (numActive == 1 && active[0].gainL == MIXKERNEL_UNITY_GAIN && active[0].gainR == MIXKERNEL_UNITY_GAIN) {
+      if (active[0].numChannels == 2) {
+        memcpy(out, active[0].samples, runFrames * PLAYER_BYTES_PER_FRAME);
+      } else {
+        MixKernel::ExpandMono(out, active[0].samples, runFrames);
+      }
+    } else {
+      MixKernel::Mix(out, active, numActive, runFrames);
+    }
+
+    for (uint8_t v = 0; v < MV_NumVoices; v++) {
+      Voice& voice = voices[v];
+      if (voice.Playing()) {
+        voice.position += runFrames;
+        if (!voice.Playing()) {
+          nextChunk(voice);
+        }
+      }
+    }
+
+    out += runFrames * PLAYER_CHANNELS;
+    numFrames -= runFrames;
+  }
+}
+
+
+bool Mixer::startSource(const PendingStart& start) {
+  // Kill off whatever the voice was playing. If the new source turns out to be
+  // bad, we'd rather play silence than the tail of the old one.
+  Voice& voice = voices[start.voice];
+  voice.position = voice.numFrames = 0;
+  voice.waiting = false;
+
+  uint16_t bitsPerSample = start.source->GetBitsPerSample();
+  if (bitsPerSample != 16 && bitsPerSample != ADPCM_BITS_PER_SAMPLE) {
+    logPrintf(LOG_COMP_AUDIO, LOG_SEV_ERROR, "Unsupported bits per sample: %d\n", bitsPerSample);
+    return false;
+  }
+
+  start.source->Restart();
+
+  voice.source = start.source;
+  voice.startGain = start.gain;
+  lastVoice = start.voice;
+
+  // The start gain is per source, so this voice's gains need redoing.
+  updateGains();
+
+  if (!takeChunk(voice) && !voice.waiting) {
+    // Data is likely invalid
+    voice.source = NULL;
+    return false;
+  }
+
+  useBaked(start.voice);
+  return true;
+}
+
+
+void Mixer::nextChunk(Voice& voice) {
+  if (voice.encoded) {
+    decodeBlock(voice);
+  } else if (voice.source && voice.source->HasMoreData()) {
+    takeChunk(voice);
+  }
+}
+
+
+bool Mixer::takeChunk(Voice& voice) {
+  voice.position = voice.numFrames = 0;
+  voice.waiting = false;
+  voice.baked = NULL;
+  voice.encoded = NULL;
+
+  const AudioSamples *samples = voice.source->GetSamples();
+  if (!samples) {
+    return false;
+  }
+
+  // Only whole frames are played, so a stray trailing byte can't swap the channels.
+  uint8_t numChannels = voice.source->GetNumChannels() == 1 ? 1 : 2;
+  if (voice.source->GetBitsPerSample() == ADPCM_BITS_PER_SAMPLE) {
+    voice.encoded = samples->samples;
+    voice.numBlocks = samples->len / (ADPCM_BLOCK_BYTES_PER_CHANNEL * numChannels);
+    voice.nextBlock = 0;
+    voice.numChannels = numChannels;
+    return decodeBlock(voice);
+  }
+  uint32_t numFrames = samples->len / (numChannels * sizeof(int16_t));
+  if (!numFrames) {
+    // Not ready yet. Try again next block.
+    voice.waiting = true;
+    return false;
+  }
+
+  voice.samples = reinterpret_cast<const int16_t*>(samples->samples);
+  voice.numFrames = numFrames;
+  voice.numChannels = numChannels;
+  return true;
+}
+
+
+bool Mixer::decodeBlock(Voice& voice) {
+  // Here, in the middle of mixing, rather than ahead of time, so only a block is
+  // ever decoded. Diagnostics::CheckAdpcm() times it.
+  if (voice.nextBlock >= voice.numBlocks) {
+    voice.encoded = NULL;
+    return false;
+  }
+
+  uint32_t blockBytes = ADPCM_BLOCK_BYTES_PER_CHANNEL * voice.numChannels;
+  voice.numFrames = ImaAdpcm::DecodeBlock(voice.encoded + voice.nextBlock * blockBytes, blockBytes, voice.numChannels,
+    voice.decoded, voice.numChannels, ADPCM_FRAMES_PER_BLOCK);
+  voice.samples = voice.decoded;
+  voice.position = 0;
+  voice.nextBlock++;
+  return true;
+}
+
+
+void Mixer::updateGains() {
+  // Q15, up to PLAYER_VOLUME_BOOST. Read once, since the UI thread can change it.
+  int32_t masterGain = static_cast<int32_t>(volumeGain) * PLAYER_VOLUME_BOOST;
+
+  for (uint8_t v = 0; v < MV_NumVoices; v++) {
+    Voice& voice = voices[v];
+    float gain = voice.gain * voice.startGain;
+
+    // Pan by turning down the other side, so the centre is at full level.
+    float left = voice.pan > 0 ? gain * (1 - voice.pan) : gain;
+    float right = voice.pan < 0 ? gain * (1 + voice.pan) : gain;
+
+    int16_t gainL = applyMasterGain(MixKernel::GainToFixed(left), masterGain);
+    int16_t gainR = applyMasterGain(MixKernel::GainToFixed(right), masterGain);
+    voiceGains[v].gainL = gainL;
+    voiceGains[v].gainR = gainR;
+
+    if (voice.baked && (voice.baked->gainL != gainL || voice.baked->gainR != gainR)) {
+      // Changed part way through. Finish it off the original samples, and it'll be
+      // baked again next time it starts.
+      voice.samples = voice.baked->original;
+      voice.baked = NULL;
+    }
+
+    mixSources[v].gainL = voice.baked ? MIXKERNEL_UNITY_GAIN : gainL;
+    mixSources[v].gainR = voice.baked ? MIXKERNEL_UNITY_GAIN : gainR;
+  }
+}
+
+
+int16_t Mixer::applyMasterGain(int16_t gain, int32_t masterGain) {
+  // 4.12 times Q15 is at most 2^14 * 3 * 2^15, so it fits, and rounds back to 4.12.
+  int32_t result = (static_cast<int32_t>(gain) * masterGain + (1 << (VOLUME_CURVE_GAIN_BITS - 1))) >> VOLUME_CURVE_GAIN_BITS;
+  return result > MIXKERNEL_MAX_GAIN ? MIXKERNEL_MAX_GAIN : static_cast<int16_t>(result);
+}
+
+
+uint8_t Mixer::countBaked(AudioDataInterface *source, const int16_t *original, uint32_t numFrames, uint8_t numChannels) const {
+  // Copies of samples that have since been reloaded don't count.
+  uint8_t count = 0;
+  for (uint8_t i = 0; i < PLAYER_MAX_BAKED_COPIES; i++) {
+    const BakedSource& baked = bakedSources[i];
+    if (baked.source == source && baked.original == original && baked.numFrames == numFrames && baked.numChannels == numChannels) {
+      count++;
+    }
+  }
+
+  return count;
+}
+
+
+Mixer::BakedSource* Mixer::findFreeBaked(uint32_t numSamples) {
+  // One that's already big enough, if there is one, so nothing is allocated.
+  BakedSource *found = NULL;
+  for (uint8_t i = 0; i < PLAYER_MAX_BAKED_COPIES; i++) {
+    BakedSource *baked = &bakedSources[i];
+    if (!baked->source && (!found || (found->capacitySamples < numSamples && baked->capacitySamples >= numSamples))) {
+      found = baked;
+    }
+  }
+
+  return found;
+}
+
+
+bool Mixer::bakedPlaying(const BakedSource *baked) const {
+  for (uint8_t v = 0; v < MV_NumVoices; v++) {
+    if (voices[v].baked == baked && voices[v].Playing()) {
+      return true;
+    }
+  }
+
+  return false;
+}
+
+
+void Mixer::useBaked(MixerVoice_t v) {
+  Voice& voice = voices[v];
+
+  // Mono has one gain for both sides, so a panned one has to be mixed as it goes.
+  int16_t gainL = voiceGains[v].gainL;
+  int16_t gainR = voiceGains[v].gainR;
+  if (voice.numChannels == 1 && gainL != gainR) {
+    return;
+  }
+
+  // The copy with this gain, or failing that the one that's gone longest without
+  // being played. Another voice might still be playing a copy, and redoing it
+  // under that one would jump its level.
+  BakedSource *baked = NULL;
+  BakedSource *oldest = NULL;
+  for (uint8_t i = 0; i < PLAYER_MAX_BAKED_COPIES && !baked; i++) {
+    BakedSource *copy = &bakedSources[i];
+    if (copy->source != voice.source) {
+      continue;
+    }
+
+    // A source that was reloaded without being baked again is played as it is.
+    if (copy->original != voice.samples || copy->numFrames != voice.numFrames || copy->numChannels != voice.numChannels) {
+      return;
+    }
+
+    if (copy->baked && copy->gainL == gainL && copy->gainR == gainR) {
+      baked = copy;
+    } else if (!bakedPlaying(copy) && (!oldest || (oldest->baked && (!copy->baked ||
+        static_cast<int32_t>(copy->lastUsed - oldest->lastUsed) < 0)))) {
+      oldest = copy;
+    }
+  }
+
+  if (!baked) {
+    if (!oldest) {
+      return;
+    }
+
+    baked = oldest;
+    if (baked->numChannels == 1) {
+      MixKernel::Scale(baked->samples.get(), baked->original, gainL, baked->numFrames);
+    } else {
+      MixSource source;
+      source.samples = baked->original;
+      source.gainL = gainL;
+      source.gainR = gainR;
+      MixKernel::Mix(baked->samples.get(), &source, 1, baked->numFrames);
+    }
+
+    baked->gainL = gainL;
+    baked->gainR = gainR;
+    baked->baked = true;
+    bakeCount.fetch_add(1, std::memory_order_relaxed);
+  }
+
+  baked->lastUsed = ++bakedStarts;
+  voice.samples = baked->samples.get();
+  voice.baked = baked;
+  mixSources[v].gainL = MIXKERNEL_UNITY_GAIN;
+  mixSources[v].gainR = MIXKERNEL_UNITY_GAIN;
+}
+
+
+void Mixer::logBakes() {
+  nextBakeLogFrame += MIXER_BAKE_LOG_FRAMES;
+
+  // Quiet unless something changed, since it's only the volume being moved.
+  uint32_t count = bakeCount.load(std::memory_order_relaxed);
+  if (count != loggedBakeCount) {
+    logPrintf(LOG_COMP_AUDIO, LOG_SEV_VERBOSE, "Mixer: Baked %d sources in the last minute (%d in all)\n", count - loggedBakeCount, count);
+    loggedBakeCount = count;
+  }
+}
+
+
+} // namespace AudioLib
@@ -0,0 +1,171 @@
+#include "audio/mixkernel.hpp"
+
+
+namespace AudioLib {
+
+// Four stereo frames fill a 128-bit PIE register
+#define MIXKERNEL_PIE_FRAMES 4
+
+
+static inline int16_t saturate16(int32_t val) {
+  if (val > INT16_MAX) {
+    return INT16_MAX;
+  } else if (val < INT16_MIN) {
+    return INT16_MIN;
+  }
+
+  return static_cast<int16_t>(val);
+}
+
+
+int16_t MixKernel::GainToFixed(float gain) {
+  if (gain <= 0) {
+    return 0;
+  }
+
+  float fixed = gain * MIXKERNEL_UNITY_GAIN + 0.5f;
+  if (fixed >= MIXKERNEL_MAX_GAIN) {
+    return MIXKERNEL_MAX_GAIN;
+  }
+
+  return static_cast<int16_t>(fixed);
+}
+
+
+void MixKernel::MixPortable(int16_t *out, const MixSource *sources, uint8_t numSources, uint32_t numFrames) {
+  for (uint32_t frame = 0; frame < numFrames; frame++) {
+    int32_t left = 0;
+    int32_t right = 0;
+
+    // A mono source's right channel is the same sample as its left.
+    for (uint8_t i = 0; i < numSources; i++) {
+      uint8_t numChannels = sources[i].numChannels;
+      const int16_t *in = sources[i].samples + frame * numChannels;
+      left += static_cast<int32_t>(in[0]) * sources[i].gainL;
+      right += static_cast<int32_t>(in[numChannels - 1]) * sources[i].gainR;
+    }
+
+    out[frame * 2] = saturate16(left >> MIXKERNEL_GAIN_BITS);
+    out[frame * 2 + 1] = saturate16(right >> MIXKERNEL_GAIN_BITS);
+  }
+}
+
+
+void MixKernel::ExpandMono(int16_t *out, const int16_t *in, uint32_t numFrames) {
+  uint32_t *out32 = reinterpret_cast<uint32_t*>(out);
+  for (uint32_t frame = 0; frame < numFrames; frame++) {
+    uint32_t sample = static_cast<uint16_t>(in[frame]);
+    out32[frame] = sample | (sample << 16);
+  }
+}
+
+
+void MixKernel::Scale(int16_t *out, const int16_t *in, int16_t gain, uint32_t numSamples) {
+  for (uint32_t i = 0; i < numSamples; i++) {
+    out[i] = saturate16((static_cast<int32_t>(in[i]) * gain) >> MIXKERNEL_GAIN_BITS);
+  }
+}
+
+
+#if MIXKERNEL_USE_PIE
+
+// QACC holds eight 40-bit accumulators, one per 16-bit lane. Each source is
+// multiplied into it lane by lane, and then it's shifted down and saturated to 16
+// bits in one go. Sources aren't 16-byte aligned, so they're loaded with the
+// USAR/SRC pair, which can read up to 15 bytes past the last sample used.
+static inline void pieMultiplyAccumulate(const int16_t *samples, const int16_t *gains) {
+  asm volatile(
+    "ee.ld.128.usar.ip q0, %0, 16\n"
+    "ee.ld.128.usar.ip q1, %0, 0\n"
+    "ee.src.q q0, q0, q1\n"
+    "ee.vld.128.ip q2, %1, 0\n"
+    "ee.vmulas.s16.qacc q0, q2\n"
+    : "+r"(samples), "+r"(gains)
+    :
+    : "memory");
+}
+
+
+static inline void pieStore(int16_t *alignedOut) {
+  uint32_t shift = MIXKERNEL_GAIN_BITS;
+  asm volatile(
+    "ee.srcmb.s16.qacc q3, %1, 0\n"
+    "ee.vst.128.ip q3, %0, 0\n"
+    : "+r"(alignedOut)
+    : "r"(shift)
+    : "memory");
+}
+
+
+void MixKernel::Mix(int16_t *out, const MixSource *sources, uint8_t numSources, uint32_t numFrames) {
+  // Each gain pair is repeated across a register.
+  int16_t gains[MIXKERNEL_MAX_SOURCES][MIXKERNEL_PIE_FRAMES * 2] __attribute__((aligned(16)));
+  int16_t mixed[MIXKERNEL_PIE_FRAMES * 2] __attribute__((aligned(16)));
+
+  if (numSources > MIXKERNEL_MAX_SOURCES) {
+    numSources = MIXKERNEL_MAX_SOURCES;
+  }
+
+  for (uint8_t i = 0; i < numSources; i++) {
+    for (uint8_t frame = 0; frame < MIXKERNEL_PIE_FRAMES; frame++) {
+      gains[i][frame * 2] = sources[i].gainL;
+      gains[i][frame * 2 + 1] = sources[i].gainR;
+    }
+  }
+
+  uint32_t frame = 0;
+  for (; frame + MIXKERNEL_PIE_FRAMES <= numFrames; frame += MIXKERNEL_PIE_FRAMES) {
+    asm volatile("ee.zero.qacc\n");
+    for (uint8_t i = 0; i < numSources; i++) {
+      if (sources[i].numChannels == 2) {
+        pieMultiplyAccumulate(sources[i].samples + frame * 2, gains[i]);
+        continue;
+      }
+
+      // Mono is spread into a register's worth of stereo first.
+      int16_t expanded[MIXKERNEL_PIE_FRAMES * 2] __attribute__((aligned(16)));
+      ExpandMono(expanded, sources[i].samples + frame, MIXKERNEL_PIE_FRAMES);
+      pieMultiplyAccumulate(expanded, gains[i]);
+    }
+
+    // out is only guaranteed to be frame (4 byte) aligned.
+    pieStore(mixed);
+    const uint32_t *mixed32 = reinterpret_cast<const uint32_t*>(mixed);
+    uint32_t *out32 = reinterpret_cast<uint32_t*>(out + frame * 2);
+    out32[0] = mixed32[0];
+    out32[1] = mixed32[1];
+    out32[2] = mixed32[2];
+    out32[3] = mixed32[3];
+  }
+
+  if (frame < numFrames) {
+    MixSource tail[MIXKERNEL_MAX_SOURCES];
+    for (uint8_t i = 0; i < numSources; i++) {
+      tail[i] = sources[i];
+      tail[i].samples += frame * sources[i].numChannels;
+    }
+
+    MixPortable(out + frame * 2, tail, numSources, numFrames - frame);
+  }
+}
+
+
+const char* MixKernel::GetName() {
+  return "PIE";
+}
+
+#else
+
+void MixKernel::Mix(int16_t *out, const MixSource *sources, uint8_t numSources, uint32_t numFrames) {
+  MixPortable(out, sources, numSources, numFrames);
+}
+
+
+const char* MixKernel::GetName() {
+  return "portable";
+}
+
+#endif
+
+
+} // namespace AudioLib
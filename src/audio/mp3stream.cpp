@@ -0,0 +1,625 @@
+#include <string.h>
+
+#include <mp3_decoder/mp3_decoder.h>
+
+#include "audio/mp3stream.hpp"
+#include "log.hpp"
+
+
+namespace AudioLib {
+
+#define MP3STREAM_BYTES_PER_FRAME 4
+
+// ID3v2 tags come before the audio, and have a 10 byte header. There's another 10
+// bytes of footer if the flag's set.
+#define MP3STREAM_ID3_HEADER_SIZE 10
+#define MP3STREAM_ID3_FOOTER_FLAG 0x10
+
+// endSeq before the decoder has hit the end of anything
+#define MP3STREAM_NO_END 0xffffffff
+
+// Task names may not be longer than 16 chars in FreeRTOS
+#define MP3STREAM_DECODER_THREAD_NAME "Mp3Decoder"
+
+// Above the UI, so a long redraw can't hold it up, on the core the audio task
+// isn't on. It needs only a fraction of the core, and waits the rest of the time.
+#define MP3STREAM_DECODER_PRIORITY 6
+#define MP3STREAM_DECODER_CORE 0
+#define MP3STREAM_DECODER_STACK_SIZE (1024 * 6)
+
+// The decoder is woken whenever the audio task frees up some of the ring, so this
+// is only a backstop.
+#define MP3STREAM_DECODER_POLL_MS 20
+
+// How often the decoder logs how it's doing, in seconds of audio
+#define MP3STREAM_STATS_SECONDS 10
+
+
+///////////////////////////////////////////////////////////////////////////////
+// class Mp3Stream
+///////////////////////////////////////////////////////////////////////////////
+Mp3Stream::Mp3Stream():
+  restartSeq(0),
+  flushSeq(0),
+  flushPos(0),
+  endSeq(MP3STREAM_NO_END),
+  holdingFrames(0),
+  flushed(true),
+  playedSinceRestart(false),
+  starved(false),
+  file(NULL),
+  dataStart(0),
+  inputPos(0),
+  inputLen(0),
+  endOfFile(false),
+  outputRate(0),
+  decoderSeq(0),
+  nextStatsFrames(0),
+  sampleRate(0),
+  valid(false),
+  underruns(0),
+  starvedBlocks(0),
+  minBuffered(MP3STREAM_RING_FRAMES),
+  workUs(0),
+  framesDecoded(0),
+  maxDecodeUs(0),
+  decodeErrors(0),
+  loggedUnderruns(0),
+  fileLock(NULL),
+  decoderTaskHandle(NULL) {}
+
+
+Mp3Stream::~Mp3Stream() {
+  // The decoder task lives as long as the program does, just like the audio task,
+  // so there's nothing sensible to tear down here.
+}
+
+
+bool Mp3Stream::allocate() {
+  if (decoderTaskHandle) {
+    return true;
+  }
+
+  // Done once, the first time a file is opened, and kept from then on.
+  try {
+    ring.Allocate(MP3STREAM_RING_FRAMES);
+    input = std::unique_ptr<uint8_t[]>(new uint8_t[MP3STREAM_INPUT_BUFFER_SIZE]);
+    decoded = std::unique_ptr<int16_t[]>(new int16_t[MP3STREAM_MAX_FRAME_SAMPLES * 2]);
+    resampled = std::unique_ptr<int16_t[]>(new int16_t[MP3STREAM_MAX_FRAME_SAMPLES * 2]);
+  } catch (std::bad_alloc&) {
+    logPrintf(LOG_COMP_AUDIO, LOG_SEV_ERROR, "Mp3Stream: Unable to allocate buffers\n");
+    return false;
+  }
+
+  fileLock = xSemaphoreCreateMutex();
+  if (!fileLock) {
+    logPrintf(LOG_COMP_AUDIO, LOG_SEV_ERROR, "Mp3Stream: Unable to create file lock\n");
+    return false;
+  }
+
+  BaseType_t ret = xTaskCreatePinnedToCore(
+    Mp3Stream::decoderTaskInit,
+    MP3STREAM_DECODER_THREAD_NAME,
+    MP3STREAM_DECODER_STACK_SIZE,
+    this,
+    MP3STREAM_DECODER_PRIORITY,
+    &decoderTaskHandle,
+    MP3STREAM_DECODER_CORE);
+
+  if (ret != pdPASS) {
+    logPrintf(LOG_COMP_AUDIO, LOG_SEV_ERROR, "***ERROR: Mp3Stream: Unable to create decoder task: %d\n", ret);
+    decoderTaskHandle = NULL;
+    return false;
+  }
+
+  return true;
+}
+
+
+bool Mp3Stream::Open(const char *fileName, uint32_t _outputRate) {
+  if (!allocate()) {
+    return false;
+  }
+
+  xSemaphoreTake(fileLock, portMAX_DELAY);
+
+  valid = false;
+  closeFile();
+
+  bool success = openFile(fileName) && resetDecoder();
+  if (success) {
+    ring.Reset();
+    restartSeq = 0;
+    flushSeq = 0;
+    flushPos = 0;
+    endSeq = MP3STREAM_NO_END;
+    holdingFrames = 0;
+    flushed = true;
+    playedSinceRestart = false;
+    starved = false;
+    inputPos = 0;
+    inputLen = 0;
+    endOfFile = false;
+    decoderSeq = 0;
+    sampleRate = 0;
+    outputRate = _outputRate;
+    resampler.Reset();
+
+    underruns = 0;
+    starvedBlocks = 0;
+    minBuffered = MP3STREAM_RING_FRAMES;
+    workUs = 0;
+    framesDecoded = 0;
+    maxDecodeUs = 0;
+    decodeErrors = 0;
+    loggedUnderruns = 0;
+    nextStatsFrames = 0;
+
+    // Fill the ring here, so playback can start straight away. It also tells us
+    // the sample rate.
+    decode();
+
+    if (sampleRate.load() == 0) {
+      logPrintf(LOG_COMP_AUDIO, LOG_SEV_ERROR, "Mp3Stream: No MP3 frames found in %s\n", fileName);
+      closeFile();
+      success = false;
+    } else {
+      valid = true;
+    }
+  }
+
+  xSemaphoreGive(fileLock);
+
+  return success;
+}
+
+
+bool Mp3Stream::openFile(const char *fileName) {
+  file = fopen(fileName, "r");
+  if (!file) {
+    logPrintf(LOG_COMP_SDCARD, LOG_SEV_ERROR, "*** Mp3Stream::openFile: Unable to open .mp3 file for reading. File: %s\n", fileName);
+    return false;
+  }
+
+  // Skip over an ID3v2 tag, if there is one. The decoder would find its way past
+  // it, but the tag can be big (cover art), and can contain things that look like
+  // a frame sync.
+  dataStart = 0;
+  uint8_t header[MP3STREAM_ID3_HEADER_SIZE];
+  if (fread(header, 1, MP3STREAM_ID3_HEADER_SIZE, file) == MP3STREAM_ID3_HEADER_SIZE && memcmp(header, "ID3", 3) == 0) {
+    // The size is "syncsafe": 7 bits per byte.
+    uint32_t tagSize = (header[6] & 0x7f) << 21 | (header[7] & 0x7f) << 14 | (header[8] & 0x7f) << 7 | (header[9] & 0x7f);
+    dataStart = MP3STREAM_ID3_HEADER_SIZE + tagSize;
+    if (header[5] & MP3STREAM_ID3_FOOTER_FLAG) {
+      dataStart += MP3STREAM_ID3_HEADER_SIZE;
+    }
+  }
+
+  fseek(file, dataStart, SEEK_SET);
+
+  logPrintf(LOG_COMP_AUDIO, LOG_SEV_INFO, "Mp3Stream: Opened %s, audio starts at byte %d\n", fileName, dataStart);
+  return true;
+}
+
+
+void Mp3Stream::closeFile() {
+  if (file) {
+    fclose(file);
+    file = NULL;
+  }
+}
+
+
+bool Mp3Stream::resetDecoder() {
+  // Freeing and allocating again is the only way the decoder has of clearing out
+  // the last file's state.
+  static bool decoderAllocated = false;
+  if (decoderAllocated) {
+    MP3Decoder_FreeBuffers();
+  }
+
+  decoderAllocated = MP3Decoder_AllocateBuffers();
+  if (!decoderAllocated) {
+    logPrintf(LOG_COMP_AUDIO, LOG_SEV_ERROR, "Mp3Stream: Unable to allocate decoder buffers\n");
+  }
+
+  return decoderAllocated;
+}
+
+
+void Mp3Stream::decoderTaskInit(void *param) {
+  Mp3Stream *stream = reinterpret_cast<Mp3Stream*>(param);
+  stream->decoderTask();
+}
+
+
+void Mp3Stream::decoderTask() {
+  while (true) {
+    ulTaskNotifyTake(pdTRUE, pdMS_TO_TICKS(MP3STREAM_DECODER_POLL_MS));
+
+    xSemaphoreTake(fileLock, portMAX_DELAY);
+    decode();
+    logStats();
+    xSemaphoreGive(fileLock);
+  }
+}
+
+
+void Mp3Stream::decode() {
+  if (!file) {
+    return;
+  }
+
+  uint32_t seq = restartSeq.load(std::memory_order_acquire);
+  if (seq != decoderSeq) {
+    fseek(file, dataStart, SEEK_SET);
+    inputPos = 0;
+    inputLen = 0;
+    endOfFile = false;
+    resetDecoder();
+    resampler.Reset();
+
+    // Whatever's in the ring from here on is from the top.
+    decoderSeq = seq;
+    flushPos.store(ring.GetWritePos(), std::memory_order_relaxed);
+    flushSeq.store(seq, std::memory_order_release);
+  }
+
+  if (endSeq.load(std::memory_order_relaxed) == decoderSeq) {
+    return;
+  }
+
+  // Only decode when there's room for a whole frame's worth, after resampling.
+  while (ring.GetWritable() >= resampler.GetMaxOutputFrames(MP3STREAM_MAX_FRAME_SAMPLES)) {
+    if (restartSeq.load(std::memory_order_relaxed) != decoderSeq) {
+      // We've been notified, so we'll be straight back.
+      return;
+    }
+
+    if (!decodeFrame()) {
+      drain();
+      endSeq.store(decoderSeq, std::memory_order_release);
+      return;
+    }
+  }
+}
+
+
+bool Mp3Stream::fillInput() {
+  // Top up when it gets down to half, so there's always a whole frame in there.
+  if (!endOfFile && inputLen < MP3STREAM_INPUT_BUFFER_SIZE / 2) {
+    memmove(input.get(), input.get() + inputPos, inputLen);
+    inputPos = 0;
+
+    size_t got = fread(input.get() + inputLen, 1, MP3STREAM_INPUT_BUFFER_SIZE - inputLen, file);
+    if (got == 0) {
+      if (ferror(file)) {
+        decodeErrors.fetch_add(1, std::memory_order_relaxed);
+        logPrintf(LOG_COMP_SDCARD, LOG_SEV_ERROR, "*** Mp3Stream: Error reading file. Ending here.\n");
+      }
+
+      endOfFile = true;
+    }
+
+    inputLen += got;
+  }
+
+  return inputLen > 0;
+}
+
+
+bool Mp3Stream::decodeFrame() {
+  uint32_t startTime = micros();
+
+  if (!fillInput()) {
+    return false;
+  }
+
+  int offset = MP3FindSyncWord(input.get() + inputPos, inputLen);
+  if (offset < 0) {
+    if (endOfFile) {
+      return false;
+    }
+
+    // Nothing here. Keep the last few bytes in case a sync word starts in them.
+    uint32_t keep = inputLen < 3 ? inputLen : 3;
+    inputPos += inputLen - keep;
+    inputLen = keep;
+    return true;
+  }
+
+  inputPos += offset;
+  inputLen -= offset;
+
+  int bytesLeft = inputLen;
+  int err = MP3Decode(input.get() + inputPos, &bytesLeft, decoded.get(), 0);
+
+  uint32_t used = inputLen - bytesLeft;
+  inputPos += used;
+  inputLen = bytesLeft;
+
+  if (err == ERR_MP3_INDATA_UNDERFLOW) {
+    // Part of a frame. There's more coming unless this is the end.
+    if (endOfFile) {
+      return false;
+    }
+
+    if (inputLen >= MP3STREAM_INPUT_BUFFER_SIZE / 2) {
+      // It's had plenty to go on, so it's junk. Skip past the sync word.
+      inputPos++;
+      inputLen--;
+    }
+
+    return true;
+  }
+
+  if (err == ERR_MP3_MAINDATA_UNDERFLOW) {
+    // The first frame or two lean on data from frames we haven't seen yet. Normal
+    // at the start, and after a restart.
+    return true;
+  }
+
+  if (err != ERR_MP3_NONE) {
+    decodeErrors.fetch_add(1, std::memory_order_relaxed);
+    if (used == 0 && inputLen) {
+      inputPos++;
+      inputLen--;
+    }
+
+    return true;
+  }
+
+  MP3GetLastFrameInfo();
+  int channels = MP3GetChannels();
+  uint32_t numFrames = MP3GetOutputSamps() / (channels > 0 ? channels : 1);
+  if (numFrames > MP3STREAM_MAX_FRAME_SAMPLES) {
+    numFrames = MP3STREAM_MAX_FRAME_SAMPLES;
+  }
+
+  if (channels == 1) {
+    // Spread to stereo in place, from the end so nothing's overwritten before it's read.
+    int16_t *pcm = decoded.get();
+    for (uint32_t i = numFrames; i > 0; i--) {
+      pcm[(i - 1) * 2] = pcm[(i - 1) * 2 + 1] = pcm[i - 1];
+    }
+  }
+
+  if (!setRate(MP3GetSampRate())) {
+    return false;
+  }
+
+  writeFrames(decoded.get(), numFrames);
+
+  uint32_t elapsedUs = micros() - startTime;
+  workUs.fetch_add(elapsedUs, std::memory_order_relaxed);
+  if (elapsedUs > maxDecodeUs.load(std::memory_order_relaxed)) {
+    maxDecodeUs.store(elapsedUs, std::memory_order_relaxed);
+  }
+
+  return true;
+}
+
+
+bool Mp3Stream::setRate(uint32_t fileRate) {
+  uint32_t rate = outputRate ? outputRate : fileRate;
+  if (fileRate == resampler.GetInputRate() && rate == resampler.GetOutputRate()) {
+    return true;
+  }
+
+  // Normally only for the first frame of a file. The filter's built here if it has to be.
+  try {
+    if (!resampler.Init(fileRate, rate)) {
+      decodeErrors.fetch_add(1, std::memory_order_relaxed);
+      logPrintf(LOG_COMP_AUDIO, LOG_SEV_ERROR, "Mp3Stream: Can't resample from %d to %d. Ending here.\n", fileRate, rate);
+      return false;
+    }
+  } catch (std::bad_alloc&) {
+    logPrintf(LOG_COMP_AUDIO, LOG_SEV_ERROR, "Mp3Stream: Unable to allocate the resampler\n");
+    return false;
+  }
+
+  if (resampler.Active()) {
+    logPrintf(LOG_COMP_AUDIO, LOG_SEV_INFO, "Mp3Stream: Resampling from %d to %d\n", fileRate, rate);
+  }
+
+  sampleRate.store(rate, std::memory_order_relaxed);
+  return true;
+}
+
+
+void Mp3Stream::writeFrames(const int16_t *pcm, uint32_t numFrames) {
+  // decode() made sure there's room for all of it.
+  if (!resampler.Active()) {
+    ring.Write(pcm, numFrames);
+    framesDecoded.fetch_add(numFrames, std::memory_order_relaxed);
+    return;
+  }
+
+  while (numFrames) {
+    uint32_t taken = numFrames;
+    uint32_t made = resampler.Process(pcm, &taken, resampled.get(), MP3STREAM_MAX_FRAME_SAMPLES);
+    ring.Write(resampled.get(), made);
+    framesDecoded.fetch_add(made, std::memory_order_relaxed);
+    pcm += taken * 2;
+    numFrames -= taken;
+  }
+}
+
+
+void Mp3Stream::drain() {
+  while (!resampler.Drained()) {
+    uint32_t made = resampler.Drain(resampled.get(), MP3STREAM_MAX_FRAME_SAMPLES);
+    ring.Write(resampled.get(), made);
+    framesDecoded.fetch_add(made, std::memory_order_relaxed);
+  }
+}
+
+
+void Mp3Stream::logStats() {
+  // The audio task can't log, so it's done from here.
+  uint32_t count = underruns.load(std::memory_order_relaxed);
+  if (count != loggedUnderruns) {
+    loggedUnderruns = count;
+    logPrintf(LOG_COMP_AUDIO, LOG_SEV_WARN, "Mp3Stream: Underrun. Total: %d, blocks missed: %d\n",
+      count, starvedBlocks.load(std::memory_order_relaxed));
+  }
+
+  uint32_t frames = framesDecoded.load(std::memory_order_relaxed);
+  if (frames < nextStatsFrames) {
+    return;
+  }
+
+  nextStatsFrames = frames + MP3STREAM_STATS_SECONDS * sampleRate.load(std::memory_order_relaxed);
+
+  StreamStats stats = GetStats();
+  logPrintf(LOG_COMP_AUDIO, LOG_SEV_INFO, "Mp3Stream: Decoding takes %d us per second of audio (longest frame %d us). Ring: %d of %d frames, fewest %d. Underruns: %d, errors: %d\n",
+    stats.workUsPerSecond,
+    stats.maxWorkUs,
+    stats.bufferedFrames,
+    stats.capacityFrames,
+    stats.minBufferedFrames,
+    stats.underruns,
+    stats.errors);
+}
+
+
+bool Mp3Stream::takeChunk() {
+  uint32_t seq = restartSeq.load(std::memory_order_relaxed);
+  if (!flushed) {
+    // Wait for the decoder to start over, then skip whatever it decoded before.
+    if (flushSeq.load(std::memory_order_acquire) != seq) {
+      return false;
+    }
+
+    ring.SkipTo(flushPos.load(std::memory_order_relaxed));
+    flushed = true;
+    xTaskNotifyGive(decoderTaskHandle);
+  }
+
+  uint32_t numFrames = 0;
+  const int16_t *pcm = ring.Peek(&numFrames);
+  if (!numFrames) {
+    return false;
+  }
+
+  if (numFrames > MP3STREAM_CHUNK_FRAMES) {
+    numFrames = MP3STREAM_CHUNK_FRAMES;
+  }
+
+  samples.samples = reinterpret_cast<const uint8_t*>(pcm);
+  samples.len = numFrames * MP3STREAM_BYTES_PER_FRAME;
+  holdingFrames = numFrames;
+  return true;
+}
+
+
+bool Mp3Stream::atEnd() const {
+  return flushed && endSeq.load(std::memory_order_acquire) == restartSeq.load(std::memory_order_relaxed);
+}
+
+
+bool Mp3Stream::HasMoreData() {
+  if (!valid) {
+    return false;
+  }
+
+  // The player is done with the current chunk.
+  if (holdingFrames) {
+    ring.Consume(holdingFrames);
+    holdingFrames = 0;
+    xTaskNotifyGive(decoderTaskHandle);
+
+    if (!atEnd()) {
+      uint32_t buffered = ring.GetReadable();
+      if (buffered < minBuffered.load(std::memory_order_relaxed)) {
+        minBuffered.store(buffered, std::memory_order_relaxed);
+      }
+    }
+  }
+
+  playedSinceRestart = true;
+
+  // There's more unless the decoder has hit the end, and we've had everything.
+  if (!atEnd()) {
+    return true;
+  }
+
+  return takeChunk();
+}
+
+
+void Mp3Stream::Restart() {
+  if (!valid || !playedSinceRestart) {
+    // Still at the top, which is also where Open() leaves us.
+    return;
+  }
+
+  holdingFrames = 0;
+  restartSeq.fetch_add(1, std::memory_order_release);
+  flushed = false;
+  playedSinceRestart = false;
+  starved = false;
+  xTaskNotifyGive(decoderTaskHandle);
+}
+
+
+uint32_t Mp3Stream::GetSampleRate() {
+  return sampleRate.load(std::memory_order_relaxed);
+}
+
+
+const AudioSamples* Mp3Stream::GetSamples() {
+  if (!valid) {
+    return NULL;
+  }
+
+  if (holdingFrames || takeChunk()) {
+    starved = false;
+    return &samples;
+  }
+
+  if (atEnd()) {
+    // Everything's been played. Check again, in case the last of it went in just
+    // after we looked.
+    if (!takeChunk()) {
+      return NULL;
+    }
+
+    starved = false;
+    return &samples;
+  }
+
+  // The decoder hasn't kept up. Nothing to play this time around.
+  if (!starved) {
+    starved = true;
+    underruns.fetch_add(1, std::memory_order_relaxed);
+  }
+
+  starvedBlocks.fetch_add(1, std::memory_order_relaxed);
+
+  samples.samples = NULL;
+  samples.len = 0;
+  return &samples;
+}
+
+
+StreamStats Mp3Stream::GetStats() const {
+  StreamStats stats;
+  stats.underruns = underruns.load(std::memory_order_relaxed);
+  stats.starvedBlocks = starvedBlocks.load(std::memory_order_relaxed);
+  stats.bufferedFrames = ring.GetReadable();
+  stats.minBufferedFrames = minBuffered.load(std::memory_order_relaxed);
+  stats.capacityFrames = ring.GetCapacity();
+  stats.maxWorkUs = maxDecodeUs.load(std::memory_order_relaxed);
+  stats.errors = decodeErrors.load(std::memory_order_relaxed);
+
+  uint32_t frames = framesDecoded.load(std::memory_order_relaxed);
+  if (frames) {
+    stats.workUsPerSecond = static_cast<uint32_t>(static_cast<uint64_t>(workUs.load(std::memory_order_relaxed)) * sampleRate.load(std::memory_order_relaxed) / frames);
+  }
+
+  return stats;
+}
+
+
+} // namespace AudioLib
@@ -0,0 +1,270 @@
+#include <new>
+#include <string.h>
+
+#include "audio/offlinerenderer.hpp"
+#include "log.hpp"
+
+
+namespace AudioLib {
+
+#define OFFLINERENDER_BYTES_PER_FRAME (PLAYER_CHANNELS * sizeof(int16_t))
+
+// A plain 16-bit PCM .wav header: RIFF, fmt and the start of the data chunk
+#define OFFLINERENDER_WAV_HEADER_BYTES 44
+#define OFFLINERENDER_WAV_FORMAT_PCM 1
+
+
+static void putLE16(uint8_t *out, uint16_t val) {
+  out[0] = static_cast<uint8_t>(val);
+  out[1] = static_cast<uint8_t>(val >> 8);
+}
+
+
+static void putLE32(uint8_t *out, uint32_t val) {
+  putLE16(out, static_cast<uint16_t>(val));
+  putLE16(out + 2, static_cast<uint16_t>(val >> 16));
+}
+
+
+///////////////////////////////////////////////////////////////////////////////
+// class MemoryRenderOutput
+///////////////////////////////////////////////////////////////////////////////
+bool MemoryRenderOutput::Write(const int16_t *frames, uint32_t numFrames) {
+  try {
+    samples.insert(samples.end(), frames, frames + numFrames * PLAYER_CHANNELS);
+  } catch (std::bad_alloc&) {
+    logPrintf(LOG_COMP_AUDIO, LOG_SEV_ERROR, "MemoryRenderOutput: Out of memory after %d frames\n", GetNumFrames());
+    return false;
+  }
+
+  return true;
+}
+
+
+///////////////////////////////////////////////////////////////////////////////
+// class WavFileRenderOutput
+///////////////////////////////////////////////////////////////////////////////
+WavFileRenderOutput::WavFileRenderOutput():
+  file(NULL),
+  dataLen(0) {}
+
+
+WavFileRenderOutput::~WavFileRenderOutput() {
+  if (file) {
+    Close();
+  }
+}
+
+
+bool WavFileRenderOutput::Open(const char *fileName) {
+  if (file) {
+    Close();
+  }
+
+  file = fopen(fileName, "wb");
+  if (!file) {
+    logPrintf(LOG_COMP_AUDIO, LOG_SEV_ERROR, "WavFileRenderOutput: Unable to create %s\n", fileName);
+    return false;
+  }
+
+  setvbuf(file, NULL, _IOFBF, OFFLINERENDER_FILE_BUFFER);
+  dataLen = 0;
+
+  // Written again with the sizes once we know them.
+  return writeHeader();
+}
+
+
+bool WavFileRenderOutput::Close() {
+  if (!file) {
+    return false;
+  }
+
+  bool success = fseek(file, 0, SEEK_SET) == 0 && writeHeader();
+  success = fclose(file) == 0 && success;
+  file = NULL;
+
+  if (!success) {
+    logPrintf(LOG_COMP_AUDIO, LOG_SEV_ERROR, "WavFileRenderOutput: Unable to finish the file\n");
+  }
+
+  return success;
+}
+
+
+bool WavFileRenderOutput::Write(const int16_t *frames, uint32_t numFrames) {
+  // Samples go out as they are, which is little-endian on the ESP32 and on any
+  // host we'd run this on.
+  if (!file || fwrite(frames, OFFLINERENDER_BYTES_PER_FRAME, numFrames, file) != numFrames) {
+    logPrintf(LOG_COMP_AUDIO, LOG_SEV_ERROR, "WavFileRenderOutput: Write failed after %u bytes\n", static_cast<unsigned>(dataLen));
+    return false;
+  }
+
+  dataLen += numFrames * OFFLINERENDER_BYTES_PER_FRAME;
+  return true;
+}
+
+
+bool WavFileRenderOutput::writeHeader() {
+  uint8_t header[OFFLINERENDER_WAV_HEADER_BYTES];
+  memcpy(header, "RIFF", 4);
+  putLE32(header + 4, OFFLINERENDER_WAV_HEADER_BYTES - 8 + dataLen);
+  memcpy(header + 8, "WAVEfmt ", 8);
+  putLE32(header + 16, 16);
+  putLE16(header + 20, OFFLINERENDER_WAV_FORMAT_PCM);
+  putLE16(header + 22, PLAYER_CHANNELS);
+  putLE32(header + 24, PLAYER_SAMPLE_RATE);
+  putLE32(header + 28, PLAYER_SAMPLE_RATE * OFFLINERENDER_BYTES_PER_FRAME);
+  putLE16(header + 32, OFFLINERENDER_BYTES_PER_FRAME);
+  putLE16(header + 34, 16);
+  memcpy(header + 36, "data", 4);
+  putLE32(header + 40, dataLen);
+
+  return fwrite(header, 1, sizeof(header), file) == sizeof(header);
+}
+
+
+///////////////////////////////////////////////////////////////////////////////
+// class OfflineRenderer
+///////////////////////////////////////////////////////////////////////////////
+bool OfflineRenderer::Render(const std::vector<RenderSong>& songs, RenderOutputInterface *output) {
+  for (const RenderSong& song : songs) {
+    if (!renderSong(song, output)) {
+      logPrintf(LOG_COMP_AUDIO, LOG_SEV_ERROR, "OfflineRenderer: Output failed after %d frames\n", static_cast<int>(GetNumFrames()));
+      return false;
+    }
+  }
+
+  return true;
+}
+
+
+bool OfflineRenderer::renderSong(const RenderSong& song, RenderOutputInterface *output) {
+  if (song.bpm <= 0 || !song.bars || !song.clicks[RC_Normal]) {
+    logPrintf(LOG_COMP_AUDIO, LOG_SEV_WARN, "OfflineRenderer: Skipping a song with no tempo, length or click\n");
+    return true;
+  }
+
+  prepareClicks(song);
+
+  // Bars are counted off at each downbeat. The song starts on the downbeat that
+  // would have followed the count-in, and stops at the one after its last bar.
+  bool countingIn = song.countInBars != 0;
+  uint32_t barsLeft = countingIn ? song.countInBars : song.bars;
+  startClick(song, mixer.GetFramePosition(), countingIn);
+
+  bool success = true;
+  while (clickTrack.Running() && success) {
+    uint64_t blockStart = mixer.GetFramePosition();
+    ClickEvent event;
+    while (clickTrack.NextEventInBlock(blockStart, PLAYER_BLOCK_FRAMES, &event)) {
+      if (event.level == 0 && event.beatInBar == 0) {
+        if (!barsLeft && countingIn) {
+          // The song's first click comes back from the next call.
+          countingIn = false;
+          barsLeft = song.bars;
+          startClick(song, blockStart + event.frameOffset, false);
+          continue;
+        }
+
+        if (!barsLeft) {
+          clickTrack.Stop();
+          break;
+        }
+
+        barsLeft--;
+      }
+
+      playClick(song, event);
+    }
+
+    success = output->Write(mixer.RenderBlock(), PLAYER_BLOCK_FRAMES);
+  }
+
+  success = success && renderSilence(static_cast<uint32_t>(static_cast<uint64_t>(OFFLINERENDER_SONG_GAP_MS) * PLAYER_SAMPLE_RATE / 1000), output);
+  releaseClicks(song);
+  return success;
+}
+
+
+bool OfflineRenderer::renderSilence(uint32_t numFrames, RenderOutputInterface *output) {
+  // Whatever is still ringing carries on into it.
+  for (uint32_t frame = 0; frame < numFrames; frame += PLAYER_BLOCK_FRAMES) {
+    if (!output->Write(mixer.RenderBlock(), PLAYER_BLOCK_FRAMES)) {
+      return false;
+    }
+  }
+
+  return true;
+}
+
+
+void OfflineRenderer::startClick(const RenderSong& song, uint64_t frame, bool countIn) {
+  // A new track each time, so nothing is left over from the last song. The
+  // count-in is beats alone, at the song's first tempo.
+  clickTrack = ClickTrack();
+  clickTrack.SetBeatsPerBar(song.beatsPerBar);
+  clickTrack.SetPattern(countIn ? SD_None : song.subdivision, song.swing);
+  for (uint8_t level = 1; level < CLICKTRACK_NUM_LEVELS; level++) {
+    clickTrack.SetLevelGain(level, song.subdivisionLevels[level - 1] / 100.0f);
+  }
+  clickTrack.SetTempoMap(countIn ? NULL : &song.tempoMap);
+  clickTrack.Start(song.bpm, frame);
+}
+
+
+void OfflineRenderer::playClick(const RenderSong& song, const ClickEvent& event) {
+  // The same choice of sound and mixer voice as the live click
+  RenderClick_t which;
+  if (event.level != 0) {
+    which = RC_Subdivision;
+  } else if (event.beatInBar == 0) {
+    which = RC_Accent;
+  } else {
+    which = RC_Normal;
+  }
+
+  AudioDataInterface *click = song.clicks[which] ? song.clicks[which] : song.clicks[RC_Normal];
+  mixer.Play(click, event.frameOffset, event.gain, which == RC_Accent ? MV_Accent : MV_Click);
+}
+
+
+void OfflineRenderer::prepareClicks(const RenderSong& song) {
+  // Baked, as the live clicks are, so they're mixed the same way. ADPCM isn't
+  // baked live either.
+  for (uint8_t c = 0; c < RC_NumClicks; c++) {
+    AudioDataInterface *click = song.clicks[c];
+    bool seen = false;
+    for (uint8_t other = 0; other < c && !seen; other++) {
+      seen = song.clicks[other] == click;
+    }
+
+    if (!click || seen) {
+      continue;
+    }
+
+    // A copy for each gain it's played at. RC_Normal stands in for a missing
+    // subdivision sound at each of the subdivision levels.
+    bool onBeat = song.clicks[RC_Normal] == click || song.clicks[RC_Accent] == click;
+    bool between = song.clicks[RC_Subdivision] == click ||
+      (!song.clicks[RC_Subdivision] && song.clicks[RC_Normal] == click);
+    uint8_t numGains = (onBeat ? 1 : 0) + (between ? CLICKTRACK_NUM_LEVELS - 1 : 0);
+
+    if (!mixer.Prepare(click) || (click->GetBitsPerSample() == 16 && !mixer.Bake(click, 0, numGains))) {
+      logPrintf(LOG_COMP_AUDIO, LOG_SEV_WARN, "OfflineRenderer: Unable to bake click %d. It'll be mixed as it goes.\n", c);
+    }
+  }
+}
+
+
+void OfflineRenderer::releaseClicks(const RenderSong& song) {
+  for (uint8_t c = 0; c < RC_NumClicks; c++) {
+    if (song.clicks[c]) {
+      mixer.Stop(song.clicks[c]);
+      mixer.Unbake(song.clicks[c]);
+    }
+  }
+}
+
+
+} // namespace AudioLib
@@ -1,4 +1,8 @@
-#include <driver/i2s.h>
+#include <string.h>
+
+#include <driver/i2s_std.h>
+#include <esp_attr.h>
+#include <esp_timer.h>
 
 #include "audio/player.hpp"
 #include "log.hpp"
@@ -6,233 +10,311 @@
 
 namespace AudioLib {
 
+#define PLAYER_BLOCK_BYTES (PLAYER_BLOCK_FRAMES * PLAYER_CHANNELS * sizeof(int16_t))
+
+// How often to log the output latency
+#define PLAYER_OUTPUT_LOG_FRAMES (PLAYER_SAMPLE_RATE * 60)
+
+// Longest to wait for the DMA to show where it is, before the first block
+#define PLAYER_CALIBRATE_TIMEOUT_MS 500
+
+// Longest to wait for the DMA to finish a buffer. It's a few ms at most, unless
+// it has stopped.
+#define PLAYER_WRITE_TIMEOUT_MS 100
+
 
 Player::Player():
-  playThis(NULL),
-  processedSamplesLen(0),
-  processedSamplesTotalLen(0),
-  playing(false),
-  samplesIdx(0),
-  volume(0.3) {}
+  nextOutputLogFrame(PLAYER_OUTPUT_LOG_FRAMES),
+  writeTimeUs(0),
+  txChannel(NULL),
+  writerTask(NULL),
+  buffersSent(0),
+  lastSentUs(0),
+  queueOverflows(0),
+  sentAtOverflow(0),
+  calibrated(false),
+  anchorSent(0),
+  anchorFrame(0),
+  seenOverflows(0),
+  queuedFrames(PLAYER_DMA_BUF_COUNT * PLAYER_DMA_BUF_LEN),
+  minQueuedFrames(UINT32_MAX),
+  maxQueuedFrames(0),
+  underruns(0),
+  loggedUnderruns(0),
+  waitUs(0),
+  loadSinceUs(0) {}
 
 
 Player::~Player() {}
 
 
-bool Player::Play(AudioDataInterface* _playThis) {
-  logPrintf(LOG_COMP_AUDIO, LOG_SEV_ERROR, "Setting sample rate to: %d\n", _playThis->GetSampleRate());
-  /*
-  esp_err_t err = i2s_set_sample_rates(I2S_NUM_0, _playThis->GetSampleRate());
-  if (err != ESP_OK) {
-    logPrintf(LOG_COMP_AUDIO, LOG_SEV_ERROR, "Error from i2s_set_sample_rates: %d\n", err);
-    return false;
+bool Player::WriteToDevice() {
+  uint64_t writtenBefore = GetFramePosition();
+  if (writtenBefore >= nextOutputLogFrame) {
+    nextOutputLogFrame += PLAYER_OUTPUT_LOG_FRAMES;
+    logOutput();
   }
-  */
 
-  esp_err_t err = i2s_set_clk(I2S_NUM_0, _playThis->GetSampleRate(), _playThis->GetBitsPerSample(), I2S_CHANNEL_STEREO);
-  if (err != ESP_OK) {
-    logPrintf(LOG_COMP_AUDIO, LOG_SEV_ERROR, "Error from i2s_set_sample_rates: %d\n", err);
-    return false;
+  const int16_t *block = RenderBlock();
+
+  if (!calibrated) {
+    calibrateOutput();
   }
 
-  playThis = _playThis;
+  if (!writeBlock(block)) {
+    return false;
+  }
 
-  playing = true;
+  int64_t nowUs = esp_timer_get_time();
+  writeTimeUs = static_cast<uint32_t>(nowUs);
+  measureOutput(writtenBefore, nowUs);
   return true;
 }
 
 
-bool Player::Replay() {
-  if (!playThis) {
-    logPrintf(LOG_COMP_AUDIO, LOG_SEV_ERROR, "Error: You must call Play() before you can call Replay()\n");
-    return false;
-  }
+bool Player::writeBlock(const int16_t *block) {
+  // The driver takes what it has room for without waiting, and the rest goes
+  // once the DMA has finished a buffer and onSent() wakes us. Waiting there is
+  // the only time the audio task isn't working.
+  const uint8_t *data = reinterpret_cast<const uint8_t*>(block);
+  size_t offset = 0;
+  while (true) {
+    size_t written = 0;
+    esp_err_t err = i2s_channel_write(txChannel, data + offset, PLAYER_BLOCK_BYTES - offset, &written, 0);
+    if (err != ESP_OK && err != ESP_ERR_TIMEOUT) {
+      logPrintf(LOG_COMP_AUDIO, LOG_SEV_ERROR, "*** Error from i2s_channel_write: %d\n", err);
+      return false;
+    }
 
-  samplesIdx = 0;
-  playing = true;
-  return true;
+    offset += written;
+    if (offset == PLAYER_BLOCK_BYTES) {
+      return true;
+    }
+
+    int64_t waitStartUs = esp_timer_get_time();
+    uint32_t woken = ulTaskNotifyTake(pdTRUE, pdMS_TO_TICKS(PLAYER_WRITE_TIMEOUT_MS));
+    waitUs += esp_timer_get_time() - waitStartUs;
+    if (!woken) {
+      logPrintf(LOG_COMP_AUDIO, LOG_SEV_ERROR, "*** The I2S DMA hasn't finished a buffer in %d ms\n", PLAYER_WRITE_TIMEOUT_MS);
+      return false;
+    }
+  }
 }
 
 
-float Player::SetVolume(float _volume) {
-  if (_volume > 1 ) {
-    _volume = 1;  
-  } else if (_volume < 0) {
-    _volume = 0;
+bool IRAM_ATTR Player::onSent(i2s_chan_handle_t channel, i2s_event_data_t *event, void *context) {
+  Player *player = static_cast<Player*>(context);
+  player->lastSentUs.store(static_cast<uint32_t>(esp_timer_get_time()), std::memory_order_relaxed);
+  player->buffersSent.fetch_add(1, std::memory_order_release);
+
+  BaseType_t woken = pdFALSE;
+  TaskHandle_t writer = player->writerTask.load(std::memory_order_relaxed);
+  if (writer) {
+    vTaskNotifyGiveFromISR(writer, &woken);
   }
 
-  volume = _volume;
+  return woken == pdTRUE;
+}
 
-  logPrintf(LOG_COMP_AUDIO, LOG_SEV_VERBOSE, "Set volume to %s\n", std::to_string(volume).c_str());
 
-  return volume;
+bool IRAM_ATTR Player::onSendQueueOverflow(i2s_chan_handle_t channel, i2s_event_data_t *event, void *context) {
+  // Comes right after onSent() for the same buffer, when nothing was written to
+  // follow it.
+  Player *player = static_cast<Player*>(context);
+  player->sentAtOverflow.store(player->buffersSent.load(std::memory_order_relaxed), std::memory_order_relaxed);
+  player->queueOverflows.fetch_add(1, std::memory_order_release);
+  return false;
 }
 
 
-bool Player::WriteToDevice() {
-  yield();
+int64_t Player::nextBufferFrame(uint64_t written) {
+  // The driver fills each DMA buffer before it takes the next, so a buffer only
+  // part written is finished off first. Wherever the DMA is by then, it's lost
+  // track of, and the next buffer taken is the one that follows on.
+  return static_cast<int64_t>((written + PLAYER_DMA_BUF_LEN - 1) / PLAYER_DMA_BUF_LEN * PLAYER_DMA_BUF_LEN);
+}
 
-  if (!playing) {
-    return true;
-  }
 
-  if (!playThis) {
-    // If we get here, it's a bug
-    logPrintf(LOG_COMP_AUDIO, LOG_SEV_ERROR, "*** ERROR: Playing audio: playing == true, but playThis == NULL\n");
-    return false;
+void Player::calibrateOutput() {
+  calibrated = true;
+  writerTask.store(xTaskGetCurrentTaskHandle(), std::memory_order_relaxed);
+  loadSinceUs = esp_timer_get_time();
+
+  // With nothing written yet, every buffer but the one playing is free, and the
+  // driver reports each one that finishes as an overflow. Right after one, the
+  // next free buffer is the one after the buffer now playing, so that's where the
+  // first block goes. There's one more buffer of silence ahead of it.
+  uint32_t overflows = queueOverflows.load(std::memory_order_acquire);
+  int64_t deadlineUs = loadSinceUs + PLAYER_CALIBRATE_TIMEOUT_MS * 1000;
+  while (queueOverflows.load(std::memory_order_acquire) == overflows && esp_timer_get_time() < deadlineUs) {
+    ulTaskNotifyTake(pdTRUE, pdMS_TO_TICKS(PLAYER_CALIBRATE_TIMEOUT_MS));
   }
 
-  if (samplesIdx == 0) {
-    samples = playThis->GetSamples();
-    if (!samples) {
-      // Data is likely invalid
-      return false;
-    }
+  seenOverflows = queueOverflows.load(std::memory_order_acquire);
+  anchorFrame = nextBufferFrame(GetFramePosition() - PLAYER_BLOCK_FRAMES);
+  if (seenOverflows != overflows) {
+    anchorSent = sentAtOverflow.load(std::memory_order_relaxed) + 1;
+    return;
+  }
 
-    if (samplesIdx == samples->len) {
-      if (!playThis->HasMoreData()) {
-        // Time to get some more data
-        // TODO: Implement!
-      } else {
-        // Nothing to do. We've played the entire set of samples.
-        return true;
-      }
-    }
+  // We'll find out where it is at the first underrun.
+  logPrintf(LOG_COMP_AUDIO, LOG_SEV_WARN, "Player: No word from the I2S DMA. The output latency is a guess until it underruns.\n");
+  anchorSent = buffersSent.load(std::memory_order_relaxed) + PLAYER_DMA_BUF_COUNT;
+}
 
-    if (samplesIdx > samples->len) {
-      // If we get here, it's a bug
-      logPrintf(LOG_COMP_AUDIO, LOG_SEV_ERROR, "*** ERROR: Playing audio: samplesIdx(%d) > samples.len(%d)\n", samplesIdx, samples->len);
-      return false;
-    }
 
-    if (!processSamples()) {
-      logPrintf(LOG_COMP_AUDIO, LOG_SEV_ERROR, "*** ERROR: Failed processing samples\n");
-      return false;
-    }
+void Player::measureOutput(uint64_t writtenBefore, int64_t nowUs) {
+  uint32_t overflows = queueOverflows.load(std::memory_order_acquire);
+  if (overflows != seenOverflows) {
+    // Everything written so far has played, and the DMA has moved on to silence,
+    // the same as when it was calibrated.
+    seenOverflows = overflows;
+    underruns.fetch_add(1, std::memory_order_relaxed);
+    anchorSent = sentAtOverflow.load(std::memory_order_relaxed) + 1;
+    anchorFrame = nextBufferFrame(writtenBefore);
   }
 
-  size_t written = 0;
-  esp_err_t err = i2s_write(I2S_NUM_0, processedSamples.get() + samplesIdx, processedSamplesLen - samplesIdx, &written, 1);
-  if (err != ESP_OK) {
-    logPrintf(LOG_COMP_AUDIO, LOG_SEV_ERROR, "*** Error from i2s_write: %d\n", err);
-    playing = false;
-    samplesIdx = 0;
-    return false;
+  // The count and the time have to be from the same buffer.
+  uint32_t sent;
+  uint32_t sentUs;
+  do {
+    sent = buffersSent.load(std::memory_order_acquire);
+    sentUs = lastSentUs.load(std::memory_order_relaxed);
+  } while (sent != buffersSent.load(std::memory_order_acquire));
+
+  // The buffer playing started when the last one finished.
+  int64_t intoBuffer = static_cast<int64_t>(static_cast<int32_t>(static_cast<uint32_t>(nowUs) - sentUs)) * PLAYER_SAMPLE_RATE / 1000000;
+  if (intoBuffer < 0) {
+    intoBuffer = 0;
+  } else if (intoBuffer > PLAYER_DMA_BUF_LEN) {
+    intoBuffer = PLAYER_DMA_BUF_LEN;
   }
 
-  samplesIdx = 0;
-  playing = false;
-/*
-  samplesIdx += written;
-  if (samplesIdx >= samples->len && !playThis->HasMoreData()) {
-    // We've played the whole thing
-    playing = false; // *** Is this correct for the MP3 case? Seems wrong...
-    samplesIdx = 0;
+  int64_t heard = anchorFrame + static_cast<int64_t>(static_cast<int32_t>(sent - anchorSent)) * PLAYER_DMA_BUF_LEN + intoBuffer;
+  int64_t queued = static_cast<int64_t>(GetFramePosition()) - heard;
+  if (queued < 0) {
+    queued = 0;
+  } else if (queued > PLAYER_DMA_BUF_COUNT * PLAYER_DMA_BUF_LEN + PLAYER_BLOCK_FRAMES) {
+    queued = PLAYER_DMA_BUF_COUNT * PLAYER_DMA_BUF_LEN + PLAYER_BLOCK_FRAMES;
   }
-*/
-  return true;
-}
-
 
-bool Player::processSamples() {
-  // Apply effects processing. Right now this is just a volume adjustment (and 
-  // it might stay that way).
-
-  try {
+  queuedFrames.store(static_cast<uint32_t>(queued), std::memory_order_relaxed);
+  if (queued < minQueuedFrames) {
+    minQueuedFrames = static_cast<uint32_t>(queued);
+  }
 
-    // Allocate a buffer for the processed samples, as we don't want to modify the
-    // buffer that was passed to us. For things like MemWav, that would change the
-    // original data and would be reflected on the next playthrough.
-    if (processedSamplesTotalLen < samples->len) {
-      uint32_t newLen = 0;
-      while (newLen < samples->len) {
-        newLen += 1024;
-      }
+  if (queued > maxQueuedFrames) {
+    maxQueuedFrames = static_cast<uint32_t>(queued);
+  }
+}
 
-      logPrintf(LOG_COMP_AUDIO, LOG_SEV_VERBOSE, "Allocating new processed samples buffer of length %d\n", newLen);
 
-      processedSamples = std::unique_ptr<uint8_t[]>(new uint8_t[newLen]);
-      if (!processedSamples) {
-        logPrintf(LOG_COMP_AUDIO, LOG_SEV_ERROR, "Failed to allocate buffer of length %d for processed samples\n", newLen);
-        return false;
-      }
+void Player::logOutput() {
+  uint32_t count = underruns.load(std::memory_order_relaxed);
+  logPrintf(LOG_COMP_AUDIO, count != loggedUnderruns ? LOG_SEV_WARN : LOG_SEV_VERBOSE,
+    "Player: Output latency %d us (%d to %d frames queued, expected %d), %d underruns in the last minute\n",
+    GetOutputLatencyUs(), minQueuedFrames, maxQueuedFrames, PLAYER_DMA_BUF_COUNT * PLAYER_DMA_BUF_LEN, count - loggedUnderruns);
 
-      processedSamplesTotalLen = newLen;
-    }
+  // Whatever isn't waiting on the DMA is rendering, or running commands and clicks
+  // between blocks.
+  int64_t nowUs = esp_timer_get_time();
+  int64_t elapsedUs = nowUs - loadSinceUs;
+  if (elapsedUs > 0) {
+    int busyPermille = static_cast<int>(1000 - waitUs * 1000 / elapsedUs);
+    logPrintf(LOG_COMP_AUDIO, LOG_SEV_VERBOSE, "Player: Audio task busy %d.%d%% of the last minute\n", busyPermille / 10, busyPermille % 10);
+  }
 
-    // Consider using a different algorithm here where we shift bits, rather than
-    // doing floating-point math.
-    const int16_t *samples16 = reinterpret_cast<const int16_t*>(samples->samples);
-    uint32_t samples16Len = samples->len / 2;
+  loggedUnderruns = count;
+  minQueuedFrames = UINT32_MAX;
+  maxQueuedFrames = 0;
+  waitUs = 0;
+  loadSinceUs = nowUs;
+}
 
-    int16_t *processedSamples16 = reinterpret_cast<int16_t*>(processedSamples.get());
 
-    // Volume could be changed by the UI thread, but putting a lock around seems unnecessary. We'll make a local
-    // copy of it here, so it doesn't get changed while we're using it.
-    float localVolume = volume;
+uint64_t Player::GetFrameAtTime(uint32_t timeUs) const {
+  // Right after a write, the frame being heard is everything queued back.
+  int64_t heardAtWrite = static_cast<int64_t>(GetFramePosition()) - queuedFrames.load(std::memory_order_relaxed);
+  int32_t sinceWriteUs = static_cast<int32_t>(timeUs - writeTimeUs);
+  int64_t frame = heardAtWrite + static_cast<int64_t>(sinceWriteUs) * PLAYER_SAMPLE_RATE / 1000000;
+  return frame > 0 ? frame : 0;
+}
 
-    //logPrintf(LOG_COMP_AUDIO, LOG_SEV_VERBOSE, "Applying volume of %s\n", std::to_string(localVolume).c_str());
 
-    // *** Need to come up with a logarithmic scale here, or something. Most of the volume change is near the bottom of the scale.
-    localVolume *= 3;
-    for (uint16_t i = 0; i < samples16Len; i++) {
-      processedSamples16[i] = samples16[i] * localVolume; 
-    }
+uint32_t Player::GetTimeOfFrame(uint64_t frame) const {
+  int64_t heardAtWrite = static_cast<int64_t>(GetFramePosition()) - queuedFrames.load(std::memory_order_relaxed);
+  int64_t framesAfterWrite = static_cast<int64_t>(frame) - heardAtWrite;
+  return writeTimeUs + static_cast<int32_t>(framesAfterWrite * 1000000 / PLAYER_SAMPLE_RATE);
+}
 
-    processedSamplesLen = samples->len;
 
-  } catch (std::bad_alloc&) {
-    logPrintf(LOG_COMP_AUDIO, LOG_SEV_ERROR, "bad_alloc exception while processing samples\n");
-    processedSamplesLen = processedSamplesTotalLen = 0;
-    return false;
-  }
+uint32_t Player::GetOutputLatencyFrames() const {
+  return queuedFrames.load(std::memory_order_relaxed) + PLAYER_BLOCK_FRAMES;
+}
 
-  //logPrintf(LOG_COMP_AUDIO, LOG_SEV_VERBOSE, "Done applying volume\n");
 
-  return true;
+uint32_t Player::GetOutputLatencyUs() {
+  return static_cast<uint32_t>(static_cast<uint64_t>(GetPlayer().GetOutputLatencyFrames()) * 1000000 / PLAYER_SAMPLE_RATE);
 }
 
-
 void Player::Init(uint8_t bckPin, uint8_t wsPin, uint8_t dataOutPin) {
-  // Install the I2S driver
+  // Set up the I2S TX channel
   // Note: ESP32-S3 does not have a built-in DAC
+  Player& player = GetPlayer();
+
+  i2s_chan_config_t chanConfig = I2S_CHANNEL_DEFAULT_CONFIG(I2S_NUM_0, I2S_ROLE_MASTER);
+  chanConfig.dma_desc_num = PLAYER_DMA_BUF_COUNT;
+  chanConfig.dma_frame_num = PLAYER_DMA_BUF_LEN;
+  chanConfig.auto_clear = true;  // Silence when we fall behind, not old buffers again
 
-  i2s_config_t i2sConfig; 
-  i2sConfig.mode = static_cast<i2s_mode_t>(I2S_MODE_MASTER | I2S_MODE_TX);
-  i2sConfig.sample_rate = 44100;
-  i2sConfig.bits_per_sample = I2S_BITS_PER_SAMPLE_16BIT;
-  i2sConfig.channel_format = I2S_CHANNEL_FMT_RIGHT_LEFT;
-  i2sConfig.communication_format = static_cast<i2s_comm_format_t>(I2S_COMM_FORMAT_STAND_I2S);
-  i2sConfig.intr_alloc_flags = ESP_INTR_FLAG_LEVEL1; // High interrupt priority
-  i2sConfig.dma_buf_count = 8; // Max buffers
-  i2sConfig.dma_buf_len = 1024; // Max value
-  i2sConfig.use_apll = 0; // must be disabled in V2.0.1-RC1
-  i2sConfig.tx_desc_auto_clear = true;
-  i2sConfig.fixed_mclk = 0;
-  i2sConfig.mclk_multiple = I2S_MCLK_MULTIPLE_DEFAULT;
-  i2sConfig.bits_per_chan = I2S_BITS_PER_CHAN_DEFAULT;
-
-  esp_err_t err = i2s_driver_install(I2S_NUM_0, &i2sConfig, 0, NULL);
+  esp_err_t err = i2s_new_channel(&chanConfig, &player.txChannel, NULL);
   if (err != ESP_OK) {
-    logPrintf(LOG_COMP_AUDIO, LOG_SEV_ERROR, "Error from i2s_driver_install: %d\n", err);
+    logPrintf(LOG_COMP_AUDIO, LOG_SEV_ERROR, "Error from i2s_new_channel: %d\n", err);
     return;
   }
 
-  i2s_zero_dma_buffer(I2S_NUM_0);
+  i2s_std_config_t stdConfig = {
+    .clk_cfg = I2S_STD_CLK_DEFAULT_CONFIG(PLAYER_SAMPLE_RATE),
+    .slot_cfg = I2S_STD_PHILIPS_SLOT_DEFAULT_CONFIG(I2S_DATA_BIT_WIDTH_16BIT, I2S_SLOT_MODE_STEREO),
+    .gpio_cfg = {
+      .mclk = I2S_GPIO_UNUSED,
+      .bclk = static_cast<gpio_num_t>(bckPin),
+      .ws = static_cast<gpio_num_t>(wsPin),
+      .dout = static_cast<gpio_num_t>(dataOutPin),
+      .din = I2S_GPIO_UNUSED,
+      .invert_flags = {
+        .mclk_inv = false,
+        .bclk_inv = false,
+        .ws_inv = false,
+      },
+    },
+  };
+
+  err = i2s_channel_init_std_mode(player.txChannel, &stdConfig);
+  if (err != ESP_OK) {
+    logPrintf(LOG_COMP_AUDIO, LOG_SEV_ERROR, "Error from i2s_channel_init_std_mode: %d\n", err);
+    return;
+  }
 
-  i2s_pin_config_t pinConfig;
-  pinConfig.bck_io_num = bckPin;
-  pinConfig.ws_io_num = wsPin;
-  pinConfig.data_out_num = dataOutPin;
-  pinConfig.data_in_num = I2S_PIN_NO_CHANGE;
+  // Each buffer the DMA finishes wakes the audio task, and says where the output
+  // has got to, which is how the latency is measured.
+  i2s_event_callbacks_t callbacks = {};
+  callbacks.on_sent = onSent;
+  callbacks.on_send_q_ovf = onSendQueueOverflow;
+  err = i2s_channel_register_event_callback(player.txChannel, &callbacks, &player);
+  if (err != ESP_OK) {
+    logPrintf(LOG_COMP_AUDIO, LOG_SEV_ERROR, "Error from i2s_channel_register_event_callback: %d\n", err);
+    return;
+  }
 
-  err = i2s_set_pin(I2S_NUM_0, &pinConfig);
+  err = i2s_channel_enable(player.txChannel);
   if (err != ESP_OK) {
-    logPrintf(LOG_COMP_AUDIO, LOG_SEV_ERROR, "Error from i2s_set_pin: %d\n", err);
+    logPrintf(LOG_COMP_AUDIO, LOG_SEV_ERROR, "Error from i2s_channel_enable: %d\n", err);
     return;
   }
 
-  logPrintf(LOG_COMP_AUDIO, LOG_SEV_VERBOSE, "I2S driver installed successfully\n");
+  logPrintf(LOG_COMP_AUDIO, LOG_SEV_INFO, "I2S channel enabled: %d buffers of %d frames, %d us of latency expected\n",
+    PLAYER_DMA_BUF_COUNT, PLAYER_DMA_BUF_LEN, static_cast<int>(static_cast<uint64_t>(PLAYER_OUTPUT_LATENCY_FRAMES) * 1000000 / PLAYER_SAMPLE_RATE));
 }
 
 
@@ -0,0 +1,250 @@
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "audio/resampler.hpp"
+
+
+namespace AudioLib {
+
+// Cutoff, as a fraction of the lower Nyquist frequency. Leaves room for the
+// transition band, so not much folds back into the top octave.
+#define RESAMPLER_CUTOFF 0.95f
+
+// Kaiser window shape. About 70 dB down in the stop band.
+#define RESAMPLER_KAISER_BETA 7.0f
+
+// Fraction of a phase the coefficients are interpolated with
+#define RESAMPLER_FRAC_BITS 15
+
+// The window's centre. Output frames land between this and the next frame in.
+#define RESAMPLER_CENTRE (RESAMPLER_TAPS / 2 - 1)
+
+
+static inline int16_t saturate16(int32_t val) {
+  if (val > INT16_MAX) {
+    return INT16_MAX;
+  } else if (val < INT16_MIN) {
+    return INT16_MIN;
+  }
+
+  return static_cast<int16_t>(val);
+}
+
+
+// Modified Bessel function of the first kind, order 0, for the Kaiser window.
+// Single precision, since that's all the FPU does.
+static float besselI0(float x) {
+  float sum = 1;
+  float term = 1;
+  for (int k = 1; k < 30; k++) {
+    float factor = x / (2 * k);
+    term *= factor * factor;
+    sum += term;
+    if (term < sum * 1e-8f) {
+      break;
+    }
+  }
+
+  return sum;
+}
+
+
+///////////////////////////////////////////////////////////////////////////////
+// class Resampler
+///////////////////////////////////////////////////////////////////////////////
+Resampler::Resampler():
+  inRate(0),
+  outRate(0),
+  numChannels(2),
+  filterInRate(0),
+  filterOutRate(0),
+  step(0),
+  phase(0),
+  pending(0),
+  drainFrames(0),
+  head(0) {}
+
+
+bool Resampler::Init(uint32_t _inRate, uint32_t _outRate, uint8_t _numChannels) {
+  if (!_inRate || !_outRate || _inRate > _outRate * RESAMPLER_MAX_RATIO || _outRate > _inRate * RESAMPLER_MAX_RATIO) {
+    return false;
+  }
+
+  if (_numChannels != 1 && _numChannels != 2) {
+    return false;
+  }
+
+  inRate = _inRate;
+  outRate = _outRate;
+  numChannels = _numChannels;
+  // Rounded up, so when the rates divide evenly the last frame out doesn't spill
+  // past the end of the input.
+  step = ((static_cast<uint64_t>(inRate) << 32) + outRate - 1) / outRate;
+
+  if (Active() && (inRate != filterInRate || outRate != filterOutRate)) {
+    if (!coefs) {
+      coefs = std::unique_ptr<int16_t[]>(new int16_t[(RESAMPLER_PHASES + 1) * RESAMPLER_TAPS]);
+    }
+
+    buildFilter();
+    filterInRate = inRate;
+    filterOutRate = outRate;
+  }
+
+  Reset();
+  return true;
+}
+
+
+void Resampler::Reset() {
+  memset(history, 0, sizeof(history));
+  head = 0;
+  phase = 0;
+
+  // Frames go in at the end of the window. The first frame out is the first frame
+  // in, once that's reached the centre.
+  pending = RESAMPLER_TAPS - RESAMPLER_CENTRE;
+  drainFrames = RESAMPLER_TAPS / 2;
+}
+
+
+void Resampler::buildFilter() {
+  // In cycles per input frame. Downsampling has to cut off below the output's
+  // Nyquist frequency, and upsampling below the input's.
+  float cutoff = 0.5f * RESAMPLER_CUTOFF;
+  if (outRate < inRate) {
+    cutoff = cutoff * outRate / inRate;
+  }
+
+  float halfWidth = RESAMPLER_TAPS / 2.0f;
+  float windowScale = 1 / besselI0(RESAMPLER_KAISER_BETA);
+  float row[RESAMPLER_TAPS];
+
+  for (uint32_t p = 0; p <= RESAMPLER_PHASES; p++) {
+    float sum = 0;
+    for (uint32_t j = 0; j < RESAMPLER_TAPS; j++) {
+      float x = static_cast<float>(j) - RESAMPLER_CENTRE - static_cast<float>(p) / RESAMPLER_PHASES;
+      float angle = 2 * static_cast<float>(M_PI) * cutoff * x;
+      float sinc = x == 0 ? 1 : sinf(angle) / angle;
+      float r = x / halfWidth;
+      float window = r * r < 1 ? besselI0(RESAMPLER_KAISER_BETA * sqrtf(1 - r * r)) * windowScale : 0;
+      row[j] = sinc * window;
+      sum += row[j];
+    }
+
+    // Each phase has to pass DC at exactly unity, or a steady signal would pick up
+    // a buzz at the rate the phases go round. Whatever rounding leaves over goes on
+    // the biggest tap.
+    int16_t *coefRow = coefs.get() + p * RESAMPLER_TAPS;
+    int32_t total = 0;
+    uint32_t biggest = 0;
+    for (uint32_t j = 0; j < RESAMPLER_TAPS; j++) {
+      coefRow[j] = static_cast<int16_t>(lroundf(row[j] / sum * (1 << RESAMPLER_COEF_BITS)));
+      total += coefRow[j];
+      if (abs(coefRow[j]) > abs(coefRow[biggest])) {
+        biggest = j;
+      }
+    }
+
+    coefRow[biggest] += (1 << RESAMPLER_COEF_BITS) - total;
+  }
+}
+
+
+void Resampler::push(const int16_t *frame) {
+  history[0][head] = history[0][head + RESAMPLER_TAPS] = frame[0];
+  history[1][head] = history[1][head + RESAMPLER_TAPS] = frame[numChannels - 1];
+  head = (head + 1) % RESAMPLER_TAPS;
+}
+
+
+uint32_t Resampler::Process(const int16_t *in, uint32_t *inFrames, int16_t *out, uint32_t outFrames) {
+  if (!Active()) {
+    uint32_t numFrames = *inFrames < outFrames ? *inFrames : outFrames;
+    memcpy(out, in, numFrames * numChannels * sizeof(int16_t));
+    *inFrames = numFrames;
+    return numFrames;
+  }
+
+  uint32_t taken = 0;
+  uint32_t written = 0;
+
+  while (written < outFrames) {
+    while (pending && taken < *inFrames) {
+      push(in + taken * numChannels);
+      taken++;
+      pending--;
+    }
+
+    if (pending) {
+      break;
+    }
+
+    // Blend the two phases either side of where this frame lands, then run both
+    // channels through the result.
+    const int16_t *coef0 = coefs.get() + (phase >> (32 - RESAMPLER_PHASE_BITS)) * RESAMPLER_TAPS;
+    const int16_t *coef1 = coef0 + RESAMPLER_TAPS;
+    int32_t frac = (phase >> (32 - RESAMPLER_PHASE_BITS - RESAMPLER_FRAC_BITS)) & ((1 << RESAMPLER_FRAC_BITS) - 1);
+
+    const int16_t *left = history[0] + head;
+    const int16_t *right = history[1] + head;
+    int32_t accL = 0;
+    int32_t accR = 0;
+    for (uint32_t j = 0; j < RESAMPLER_TAPS; j++) {
+      int32_t coef = coef0[j] + (((coef1[j] - coef0[j]) * frac) >> RESAMPLER_FRAC_BITS);
+      accL += left[j] * coef;
+      accR += right[j] * coef;
+    }
+
+    out[written * numChannels] = saturate16((accL + (1 << (RESAMPLER_COEF_BITS - 1))) >> RESAMPLER_COEF_BITS);
+    if (numChannels == 2) {
+      out[written * 2 + 1] = saturate16((accR + (1 << (RESAMPLER_COEF_BITS - 1))) >> RESAMPLER_COEF_BITS);
+    }
+    written++;
+
+    uint64_t next = phase + step;
+    pending = static_cast<uint32_t>(next >> 32);
+    phase = static_cast<uint32_t>(next);
+  }
+
+  *inFrames = taken;
+  return written;
+}
+
+
+uint32_t Resampler::Drain(int16_t *out, uint32_t outFrames) {
+  static const int16_t silence[RESAMPLER_TAPS * 2] = {};
+
+  if (!Active()) {
+    drainFrames = 0;
+    return 0;
+  }
+
+  uint32_t numFrames = drainFrames;
+  uint32_t written = Process(silence, &numFrames, out, outFrames);
+  drainFrames -= numFrames;
+  return written;
+}
+
+
+uint32_t Resampler::GetMaxOutputFrames(uint32_t inFrames) const {
+  if (!Active()) {
+    return inFrames;
+  }
+
+  uint64_t frames = static_cast<uint64_t>(inFrames + RESAMPLER_TAPS / 2) * outRate / inRate;
+  return static_cast<uint32_t>(frames) + 2;
+}
+
+
+uint32_t Resampler::GetOutputFrames(uint32_t inFrames) const {
+  if (!Active()) {
+    return inFrames;
+  }
+
+  return static_cast<uint32_t>((static_cast<uint64_t>(inFrames) * outRate + inRate - 1) / inRate);
+}
+
+
+} // namespace AudioLib
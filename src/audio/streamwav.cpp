@@ -0,0 +1,516 @@
+#include <string.h>
+
+#include "audio/streamwav.hpp"
+#include "log.hpp"
+
+
+namespace AudioLib {
+
+#define STREAMWAV_BUFFER_BYTES (STREAMWAV_BUFFER_FRAMES * STREAMWAV_BYTES_PER_FRAME)
+
+// endSeq before the reader has hit the end of anything
+#define STREAMWAV_NO_END 0xffffffff
+
+// Task names may not be longer than 16 chars in FreeRTOS
+#define STREAMWAV_READER_THREAD_NAME "StreamReader"
+
+// Above the UI, so a long redraw can't hold up a read. It spends nearly all its
+// time waiting on the card or for a buffer to come free, and it's kept off the
+// audio task's core.
+#define STREAMWAV_READER_PRIORITY 6
+#define STREAMWAV_READER_CORE 0
+#define STREAMWAV_READER_STACK_SIZE (1024 * 4)
+
+// The reader is woken whenever a buffer is freed, so this is only a backstop.
+#define STREAMWAV_READER_POLL_MS 50
+
+
+///////////////////////////////////////////////////////////////////////////////
+// class StreamWav
+///////////////////////////////////////////////////////////////////////////////
+StreamWav::StreamWav():
+  filled(0),
+  released(0),
+  restartSeq(0),
+  endSeq(STREAMWAV_NO_END),
+  holding(false),
+  playedSinceRestart(false),
+  starved(false),
+  file(NULL),
+  dataStart(0),
+  dataLen(0),
+  dataRead(0),
+  readerSeq(0),
+  converting(false),
+  rawPos(0),
+  rawLen(0),
+  valid(false),
+  underruns(0),
+  starvedBlocks(0),
+  minBuffered(STREAMWAV_NUM_BUFFERS),
+  workUs(0),
+  framesRead(0),
+  maxReadUs(0),
+  readErrors(0),
+  loggedUnderruns(0),
+  fileLock(NULL),
+  readerTaskHandle(NULL) {}
+
+
+StreamWav::~StreamWav() {
+  // The reader task lives as long as the program does, just like the audio task,
+  // so there's nothing sensible to tear down here.
+}
+
+
+bool StreamWav::allocate() {
+  if (readerTaskHandle) {
+    return true;
+  }
+
+  // Done once, the first time a file is opened, and kept from then on.
+  try {
+    for (uint8_t i = 0; i < STREAMWAV_NUM_BUFFERS; i++) {
+      buffers[i].data = std::unique_ptr<uint8_t[]>(new uint8_t[STREAMWAV_BUFFER_BYTES]);
+    }
+  } catch (std::bad_alloc&) {
+    logPrintf(LOG_COMP_AUDIO, LOG_SEV_ERROR, "StreamWav: Unable to allocate %d buffers of %d bytes\n", STREAMWAV_NUM_BUFFERS, STREAMWAV_BUFFER_BYTES);
+    return false;
+  }
+
+  fileLock = xSemaphoreCreateMutex();
+  if (!fileLock) {
+    logPrintf(LOG_COMP_AUDIO, LOG_SEV_ERROR, "StreamWav: Unable to create file lock\n");
+    return false;
+  }
+
+  BaseType_t ret = xTaskCreatePinnedToCore(
+    StreamWav::readerTaskInit,
+    STREAMWAV_READER_THREAD_NAME,
+    STREAMWAV_READER_STACK_SIZE,
+    this,
+    STREAMWAV_READER_PRIORITY,
+    &readerTaskHandle,
+    STREAMWAV_READER_CORE);
+
+  if (ret != pdPASS) {
+    logPrintf(LOG_COMP_AUDIO, LOG_SEV_ERROR, "***ERROR: StreamWav: Unable to create reader task: %d\n", ret);
+    readerTaskHandle = NULL;
+    return false;
+  }
+
+  return true;
+}
+
+
+bool StreamWav::Open(const char *fileName, uint32_t outputRate) {
+  if (!allocate()) {
+    return false;
+  }
+
+  xSemaphoreTake(fileLock, portMAX_DELAY);
+
+  valid = false;
+  closeFile();
+
+  bool success = openFile(fileName) && setupResampler(outputRate);
+  if (success) {
+    filled = 0;
+    released = 0;
+    restartSeq = 0;
+    endSeq = STREAMWAV_NO_END;
+    holding = false;
+    playedSinceRestart = false;
+    starved = false;
+    readerSeq = 0;
+    dataRead = 0;
+    rawPos = 0;
+    rawLen = 0;
+
+    underruns = 0;
+    starvedBlocks = 0;
+    minBuffered = STREAMWAV_NUM_BUFFERS;
+    workUs = 0;
+    framesRead = 0;
+    maxReadUs = 0;
+    readErrors = 0;
+    loggedUnderruns = 0;
+
+    // Prime the buffers here, so playback can start straight away.
+    fill();
+    valid = true;
+  }
+
+  xSemaphoreGive(fileLock);
+
+  return success;
+}
+
+
+bool StreamWav::openFile(const char *fileName) {
+  file = fopen(fileName, "r");
+  if (!file) {
+    logPrintf(LOG_COMP_SDCARD, LOG_SEV_ERROR, "*** StreamWav::openFile: Unable to open .wav file for reading. File: %s\n", fileName);
+    return false;
+  }
+
+  if (!wavHeader.ReadFromFile(file)) {
+    logPrintf(LOG_COMP_SDCARD, LOG_SEV_ERROR, "Failed to parse .wav file %s: %s\n", fileName, wavHeader.GetError());
+    closeFile();
+    return false;
+  }
+
+  wavHeader.Dump();
+
+  // Reads are cut at frames, which ADPCM doesn't have. It's for short sounds kept
+  // in memory anyway.
+  if (wavHeader.sampleType == WS_ImaAdpcm) {
+    logPrintf(LOG_COMP_SDCARD, LOG_SEV_ERROR, "StreamWav: %s is ADPCM, which can only be played from memory\n", fileName);
+    closeFile();
+    return false;
+  }
+
+  // Whole frames only, so every buffer starts on the left channel.
+  dataStart = wavHeader.dataStart;
+  dataLen = wavHeader.dataLen;
+  fseek(file, dataStart, SEEK_SET);
+
+  logPrintf(LOG_COMP_AUDIO, LOG_SEV_INFO, "StreamWav: Opened %s, %d frames\n", fileName, wavHeader.GetNumFrames());
+  return true;
+}
+
+
+bool StreamWav::setupResampler(uint32_t outputRate) {
+  uint32_t fileRate = wavHeader.samplesPerSecond;
+
+  try {
+    if (!resampler.Init(fileRate, outputRate ? outputRate : fileRate)) {
+      logPrintf(LOG_COMP_AUDIO, LOG_SEV_ERROR, "StreamWav: Can't resample from %d to %d\n", fileRate, outputRate);
+      closeFile();
+      return false;
+    }
+
+    converting = resampler.Active() || !wavHeader.IsCanonical();
+    if (converting && !raw) {
+      fileBuf = std::unique_ptr<uint8_t[]>(new uint8_t[STREAMWAV_FILE_BUFFER_BYTES]);
+      raw = std::unique_ptr<int16_t[]>(new int16_t[STREAMWAV_RAW_FRAMES * 2]);
+    }
+  } catch (std::bad_alloc&) {
+    logPrintf(LOG_COMP_AUDIO, LOG_SEV_ERROR, "StreamWav: Unable to allocate the converter\n");
+    closeFile();
+    return false;
+  }
+
+  if (!wavHeader.IsCanonical()) {
+    logPrintf(LOG_COMP_AUDIO, LOG_SEV_INFO, "StreamWav: Converting %d channels of %d bits to 16-bit stereo\n", wavHeader.numChannels, wavHeader.bitsPerSample);
+  }
+
+  if (resampler.Active()) {
+    logPrintf(LOG_COMP_AUDIO, LOG_SEV_INFO, "StreamWav: Resampling from %d to %d\n", fileRate, outputRate);
+  }
+
+  return true;
+}
+
+
+void StreamWav::closeFile() {
+  if (file) {
+    fclose(file);
+    file = NULL;
+  }
+}
+
+
+void StreamWav::readerTaskInit(void *param) {
+  StreamWav *stream = reinterpret_cast<StreamWav*>(param);
+  stream->readerTask();
+}
+
+
+void StreamWav::readerTask() {
+  while (true) {
+    ulTaskNotifyTake(pdTRUE, pdMS_TO_TICKS(STREAMWAV_READER_POLL_MS));
+
+    xSemaphoreTake(fileLock, portMAX_DELAY);
+    fill();
+
+    // The audio task can't log, so it's done from here.
+    uint32_t count = underruns.load(std::memory_order_relaxed);
+    if (count != loggedUnderruns) {
+      loggedUnderruns = count;
+      logPrintf(LOG_COMP_AUDIO, LOG_SEV_WARN, "StreamWav: Underrun. Total: %d, blocks missed: %d, longest read: %d us\n",
+        count, starvedBlocks.load(std::memory_order_relaxed), maxReadUs.load(std::memory_order_relaxed));
+    }
+
+    xSemaphoreGive(fileLock);
+  }
+}
+
+
+void StreamWav::fill() {
+  if (!file) {
+    return;
+  }
+
+  while (true) {
+    uint32_t seq = restartSeq.load(std::memory_order_acquire);
+    if (seq != readerSeq) {
+      fseek(file, dataStart, SEEK_SET);
+      dataRead = 0;
+      rawPos = rawLen = 0;
+      resampler.Reset();
+      readerSeq = seq;
+    }
+
+    if (dataRead >= dataLen && (!converting || (rawPos == rawLen && resampler.Drained()))) {
+      endSeq.store(readerSeq, std::memory_order_release);
+      return;
+    }
+
+    uint32_t numFilled = filled.load(std::memory_order_relaxed);
+    if (numFilled - released.load(std::memory_order_acquire) >= STREAMWAV_NUM_BUFFERS) {
+      return;
+    }
+
+    Buffer& buffer = buffers[numFilled % STREAMWAV_NUM_BUFFERS];
+
+    uint32_t startTime = micros();
+    uint32_t len;
+    if (converting) {
+      len = readConverted(reinterpret_cast<int16_t*>(buffer.data.get())) * STREAMWAV_BYTES_PER_FRAME;
+    } else {
+      len = readData(buffer.data.get(), STREAMWAV_BUFFER_BYTES);
+    }
+
+    uint32_t elapsedUs = micros() - startTime;
+    workUs.fetch_add(elapsedUs, std::memory_order_relaxed);
+    if (elapsedUs > maxReadUs.load(std::memory_order_relaxed)) {
+      maxReadUs.store(elapsedUs, std::memory_order_relaxed);
+    }
+
+    if (len == 0) {
+      // A short read right at the end. Go round again to mark the end.
+      continue;
+    }
+
+    buffer.len = len;
+    buffer.restartSeq = readerSeq;
+    framesRead.fetch_add(len / STREAMWAV_BYTES_PER_FRAME, std::memory_order_relaxed);
+
+    filled.store(numFilled + 1, std::memory_order_release);
+  }
+}
+
+
+uint32_t StreamWav::readData(uint8_t *dest, uint32_t maxLen) {
+  uint32_t len = dataLen - dataRead;
+  if (len > maxLen) {
+    len = maxLen;
+  }
+
+  size_t got = fread(dest, 1, len, file);
+  if (got != len) {
+    // Play what we've got, and end the stream there.
+    readErrors.fetch_add(1, std::memory_order_relaxed);
+    logPrintf(LOG_COMP_SDCARD, LOG_SEV_ERROR, "*** StreamWav: Short read at %d of %d bytes\n", dataRead + static_cast<uint32_t>(got), dataLen);
+    len = got - got % wavHeader.blockAlign;
+    dataLen = dataRead + len;
+  }
+
+  dataRead += len;
+  return len;
+}
+
+
+uint32_t StreamWav::readConverted(int16_t *dest) {
+  uint32_t outFrames = 0;
+
+  while (outFrames < STREAMWAV_BUFFER_FRAMES) {
+    int16_t *out = dest + outFrames * 2;
+    uint32_t room = STREAMWAV_BUFFER_FRAMES - outFrames;
+
+    if (rawPos == rawLen) {
+      if (dataRead < dataLen) {
+        rawLen = readRaw();
+        rawPos = 0;
+        continue;
+      }
+
+      if (resampler.Drained()) {
+        break;
+      }
+
+      outFrames += resampler.Drain(out, room);
+      continue;
+    }
+
+    // Just a copy, if the rates are the same
+    uint32_t inFrames = rawLen - rawPos;
+    outFrames += resampler.Process(raw.get() + rawPos * 2, &inFrames, out, room);
+    rawPos += inFrames;
+  }
+
+  return outFrames;
+}
+
+
+uint32_t StreamWav::readRaw() {
+  uint32_t numFrames = STREAMWAV_FILE_BUFFER_BYTES / wavHeader.blockAlign;
+  if (numFrames > STREAMWAV_RAW_FRAMES) {
+    numFrames = STREAMWAV_RAW_FRAMES;
+  }
+
+  numFrames = readData(fileBuf.get(), numFrames * wavHeader.blockAlign) / wavHeader.blockAlign;
+  wavHeader.ToCanonical(fileBuf.get(), numFrames, raw.get());
+  return numFrames;
+}
+
+
+bool StreamWav::takeBuffer() {
+  uint32_t seq = restartSeq.load(std::memory_order_relaxed);
+  uint32_t numFilled = filled.load(std::memory_order_acquire);
+  uint32_t numReleased = released.load(std::memory_order_relaxed);
+
+  // Throw out anything read from before the last restart.
+  while (numReleased != numFilled && buffers[numReleased % STREAMWAV_NUM_BUFFERS].restartSeq != seq) {
+    numReleased++;
+    released.store(numReleased, std::memory_order_release);
+    xTaskNotifyGive(readerTaskHandle);
+  }
+
+  if (numReleased == numFilled) {
+    return false;
+  }
+
+  const Buffer& buffer = buffers[numReleased % STREAMWAV_NUM_BUFFERS];
+  samples.samples = buffer.data.get();
+  samples.len = buffer.len;
+  holding = true;
+  return true;
+}
+
+
+void StreamWav::releaseBuffer() {
+  if (!holding) {
+    return;
+  }
+
+  holding = false;
+  released.fetch_add(1, std::memory_order_release);
+  xTaskNotifyGive(readerTaskHandle);
+}
+
+
+bool StreamWav::HasMoreData() {
+  if (!valid) {
+    return false;
+  }
+
+  // The player is done with the current buffer. How many are ready behind it
+  // shows how close the reader is to falling behind, until it runs out of file.
+  bool readerAtEnd = endSeq.load(std::memory_order_acquire) == restartSeq.load(std::memory_order_relaxed);
+  if (holding && !readerAtEnd) {
+    uint32_t ready = filled.load(std::memory_order_acquire) - released.load(std::memory_order_relaxed) - 1;
+    if (ready < minBuffered.load(std::memory_order_relaxed)) {
+      minBuffered.store(ready, std::memory_order_relaxed);
+    }
+  }
+
+  releaseBuffer();
+  playedSinceRestart = true;
+
+  // There's more unless the reader has hit the end, and we've had everything it read.
+  if (endSeq.load(std::memory_order_acquire) != restartSeq.load(std::memory_order_relaxed)) {
+    return true;
+  }
+
+  return takeBuffer();
+}
+
+
+void StreamWav::Restart() {
+  if (!valid || !playedSinceRestart) {
+    // Still at the top, which is also where Open() leaves us.
+    return;
+  }
+
+  releaseBuffer();
+  restartSeq.fetch_add(1, std::memory_order_release);
+  playedSinceRestart = false;
+  starved = false;
+  xTaskNotifyGive(readerTaskHandle);
+}
+
+
+uint32_t StreamWav::GetNumFrames() const {
+  return resampler.GetOutputFrames(wavHeader.GetNumFrames());
+}
+
+
+uint32_t StreamWav::GetSampleRate() {
+  return resampler.Active() ? resampler.GetOutputRate() : wavHeader.samplesPerSecond;
+}
+
+
+uint16_t StreamWav::GetBitsPerSample() {
+  return 16;
+}
+
+
+const AudioSamples* StreamWav::GetSamples() {
+  if (!valid) {
+    return NULL;
+  }
+
+  if (holding || takeBuffer()) {
+    starved = false;
+    return &samples;
+  }
+
+  if (endSeq.load(std::memory_order_acquire) == restartSeq.load(std::memory_order_relaxed)) {
+    // Everything's been played. Check again, in case the last buffer went out just
+    // after we looked.
+    if (!takeBuffer()) {
+      return NULL;
+    }
+
+    starved = false;
+    return &samples;
+  }
+
+  // The reader hasn't kept up. Nothing to play this time around.
+  if (!starved) {
+    starved = true;
+    underruns.fetch_add(1, std::memory_order_relaxed);
+  }
+
+  starvedBlocks.fetch_add(1, std::memory_order_relaxed);
+
+  samples.samples = NULL;
+  samples.len = 0;
+  return &samples;
+}
+
+
+StreamStats StreamWav::GetStats() const {
+  // Buffers are counted as full ones. Only the last in the file is any shorter.
+  StreamStats stats;
+  stats.underruns = underruns.load(std::memory_order_relaxed);
+  stats.starvedBlocks = starvedBlocks.load(std::memory_order_relaxed);
+  stats.bufferedFrames = (filled.load(std::memory_order_relaxed) - released.load(std::memory_order_relaxed)) * STREAMWAV_BUFFER_FRAMES;
+  stats.minBufferedFrames = minBuffered.load(std::memory_order_relaxed) * STREAMWAV_BUFFER_FRAMES;
+  stats.capacityFrames = STREAMWAV_NUM_BUFFERS * STREAMWAV_BUFFER_FRAMES;
+  stats.maxWorkUs = maxReadUs.load(std::memory_order_relaxed);
+  stats.errors = readErrors.load(std::memory_order_relaxed);
+
+  // framesRead counts frames after resampling, so they're seconds at the output rate.
+  uint32_t frames = framesRead.load(std::memory_order_relaxed);
+  if (frames) {
+    stats.workUsPerSecond = static_cast<uint32_t>(static_cast<uint64_t>(workUs.load(std::memory_order_relaxed)) * resampler.GetOutputRate() / frames);
+  }
+
+  return stats;
+}
+
+
+} // namespace AudioLib
@@ -0,0 +1,134 @@
+#include "audio/taptempo.hpp"
+
+
+namespace AudioLib {
+
+///////////////////////////////////////////////////////////////////////////////
+// class TapTempo
+///////////////////////////////////////////////////////////////////////////////
+TapTempo::TapTempo() {
+  Reset();
+}
+
+
+void TapTempo::Reset() {
+  numIntervals = 0;
+  nextInterval = 0;
+  lastTapUs = 0;
+  haveLastTap = false;
+  periodUs = 0;
+  bpm = 0;
+  confidence = 0;
+}
+
+
+bool TapTempo::Active(uint32_t nowUs) const {
+  return haveLastTap && nowUs - lastTapUs <= TAPTEMPO_TIMEOUT_US;
+}
+
+
+bool TapTempo::AddTap(uint32_t timeUs) {
+  if (!haveLastTap) {
+    lastTapUs = timeUs;
+    haveLastTap = true;
+    return false;
+  }
+
+  uint32_t interval = timeUs - lastTapUs;
+  if (interval < TAPTEMPO_MIN_INTERVAL_US) {
+    // Same tap, or a flam. Keep timing from the first one.
+    return false;
+  }
+
+  if (interval > TAPTEMPO_TIMEOUT_US) {
+    // Start over, with this as the first tap.
+    Reset();
+    lastTapUs = timeUs;
+    haveLastTap = true;
+    return false;
+  }
+
+  lastTapUs = timeUs;
+
+  intervals[nextInterval] = interval;
+  nextInterval = (nextInterval + 1) % TAPTEMPO_MAX_INTERVALS;
+  if (numIntervals < TAPTEMPO_MAX_INTERVALS) {
+    numIntervals++;
+  }
+
+  if (numIntervals < TAPTEMPO_MIN_INTERVALS) {
+    return false;
+  }
+
+  return estimate();
+}
+
+
+bool TapTempo::estimate() {
+  // Median, by insertion sort. There are only a handful.
+  uint32_t sorted[TAPTEMPO_MAX_INTERVALS] = { 0 };
+  for (uint8_t i = 0; i < numIntervals; i++) {
+    uint32_t val = intervals[i];
+    uint8_t j = i;
+    while (j > 0 && sorted[j - 1] > val) {
+      sorted[j] = sorted[j - 1];
+      j--;
+    }
+
+    sorted[j] = val;
+  }
+
+  float median = (numIntervals % 2) ? sorted[numIntervals / 2] : (sorted[numIntervals / 2 - 1] + sorted[numIntervals / 2]) / 2.0f;
+  float maxDeviation = median * TAPTEMPO_OUTLIER_PERCENT / 100;
+
+  float sum = 0;
+  uint8_t inliers = 0;
+  for (uint8_t i = 0; i < numIntervals; i++) {
+    float deviation = sorted[i] - median;
+    if (deviation <= maxDeviation && deviation >= -maxDeviation) {
+      sum += sorted[i];
+      inliers++;
+    }
+  }
+
+  // With an even number, the median is halfway between the middle two, which can
+  // both be too far from it (half-time taps in among the beats). Then nothing
+  // can be trusted, and the last estimate stands.
+  if (!inliers) {
+    return false;
+  }
+
+  float mean = sum / inliers;
+
+  float spread = 0;
+  for (uint8_t i = 0; i < numIntervals; i++) {
+    float deviation = sorted[i] - mean;
+    if (deviation <= maxDeviation && deviation >= -maxDeviation) {
+      spread += deviation < 0 ? -deviation : deviation;
+    }
+  }
+
+  spread /= inliers;
+
+  if (periodUs == 0) {
+    periodUs = mean;
+  } else {
+    periodUs += (mean - periodUs) * TAPTEMPO_SMOOTHING;
+  }
+
+  bpm = 60000000.0f / periodUs;
+
+  // Fewer taps, more outliers, or a wider spread all make us less sure.
+  float countFactor = inliers >= TAPTEMPO_FULL_CONFIDENCE_INTERVALS ? 1 : static_cast<float>(inliers) / TAPTEMPO_FULL_CONFIDENCE_INTERVALS;
+  float inlierFactor = static_cast<float>(inliers) / numIntervals;
+  float spreadFactor = 1 - spread / maxDeviation;
+  if (spreadFactor < 0) {
+    spreadFactor = 0;
+  }
+
+  confidence = static_cast<uint8_t>(100 * countFactor * inlierFactor * spreadFactor + 0.5f);
+  return true;
+}
+
+
+} // namespace AudioLib
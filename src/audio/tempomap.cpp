@@ -0,0 +1,98 @@
+#include <new>
+
+#include "audio/mixer.hpp"
+#include "audio/tempomap.hpp"
+#include "log.hpp"
+
+
+namespace AudioLib {
+
+#define TEMPOMAP_PHASE_ONE 4294967296.0 // 2^32
+
+///////////////////////////////////////////////////////////////////////////////
+// class TempoMap
+///////////////////////////////////////////////////////////////////////////////
+uint64_t TempoMap::BPMToBeatIncrement(float bpm) {
+  return static_cast<uint64_t>(((60.0 * PLAYER_SAMPLE_RATE) / bpm) * TEMPOMAP_PHASE_ONE + 0.5);
+}
+
+
+bool TempoMap::addSegment(float bpm, uint32_t numBeats, uint8_t beatsPerBar) {
+  if (segments.size() >= TEMPOMAP_MAX_SEGMENTS) {
+    logPrintf(LOG_COMP_AUDIO, LOG_SEV_ERROR, "TempoMap: Too many segments. Max is %d. Shorten the ramps.\n", TEMPOMAP_MAX_SEGMENTS);
+    return false;
+  }
+
+  TempoSegment segment;
+  segment.beatIncrement = BPMToBeatIncrement(bpm);
+  segment.numBeats = numBeats;
+  segment.beatsPerBar = beatsPerBar;
+  segments.push_back(segment);
+  return true;
+}
+
+
+bool TempoMap::Compile(float bpm, uint8_t beatsPerBar, const std::vector<TempoChange>& changes) {
+  segments.clear();
+
+  if (bpm <= 0 || beatsPerBar == 0) {
+    logPrintf(LOG_COMP_AUDIO, LOG_SEV_ERROR, "TempoMap: Invalid starting tempo or time signature\n");
+    return false;
+  }
+
+  try {
+    uint32_t curBar = 1;
+    float curBpm = bpm;
+    uint8_t curBeatsPerBar = beatsPerBar;
+
+    for (const TempoChange& change : changes) {
+      if (change.bar < curBar || change.bpm <= 0) {
+        logPrintf(LOG_COMP_AUDIO, LOG_SEV_ERROR, "TempoMap: Invalid tempo change at bar %d. Changes must be in order, and not inside a ramp.\n", change.bar);
+        segments.clear();
+        return false;
+      }
+
+      // Steady until the change
+      if (change.bar > curBar && !addSegment(curBpm, (change.bar - curBar) * curBeatsPerBar, curBeatsPerBar)) {
+        segments.clear();
+        return false;
+      }
+
+      if (change.beatsPerBar) {
+        curBeatsPerBar = change.beatsPerBar;
+      }
+
+      curBar = change.bar;
+
+      if (change.rampBars) {
+        uint32_t rampBeats = change.rampBars * curBeatsPerBar;
+        for (uint32_t beat = 0; beat < rampBeats; beat++) {
+          float beatBpm = curBpm + (change.bpm - curBpm) * (beat + 0.5f) / rampBeats;
+          if (!addSegment(beatBpm, 1, curBeatsPerBar)) {
+            segments.clear();
+            return false;
+          }
+        }
+
+        curBar += change.rampBars;
+      }
+
+      curBpm = change.bpm;
+    }
+
+    // The last tempo carries on until the click is stopped.
+    if (!addSegment(curBpm, 0, curBeatsPerBar)) {
+      segments.clear();
+      return false;
+    }
+  } catch (std::bad_alloc&) {
+    logPrintf(LOG_COMP_AUDIO, LOG_SEV_ERROR, "TempoMap: Out of memory compiling tempo map\n");
+    segments.clear();
+    return false;
+  }
+
+  return true;
+}
+
+
+} // namespace AudioLib
@@ -0,0 +1,40 @@
+#include "audio/volumecurve.hpp"
+
+
+namespace AudioLib {
+
+// 32768 * 10^(dB / 20), for dB from VOLUME_CURVE_MIN_DB at step 1 to 0 at
+// VOLUME_CURVE_STEPS, in equal steps. Worked out ahead of time, so there's no
+// pow() at run time.
+static const int16_t volumeCurve[VOLUME_CURVE_STEPS + 1] = {
+      0,   328,   343,   360,   377,   395,   413,   433,   454,   475,
+    498,   522,   547,   573,   600,   628,   658,   690,   723,   757,
+    793,   831,   870,   912,   955,  1001,  1048,  1098,  1151,  1205,
+   1263,  1323,  1386,  1452,  1521,  1593,  1669,  1749,  1832,  1919,
+   2011,  2106,  2207,  2312,  2422,  2537,  2658,  2784,  2917,  3056,
+   3201,  3354,  3514,  3681,  3856,  4040,  4232,  4434,  4645,  4866,
+   5098,  5340,  5595,  5861,  6140,  6432,  6739,  7060,  7396,  7748,
+   8117,  8503,  8908,  9332,  9777, 10242, 10730, 11241, 11776, 12337,
+  12924, 13540, 14184, 14860, 15567, 16309, 17085, 17899, 18751, 19644,
+  20579, 21559, 22586, 23661, 24788, 25968, 27205, 28500, 29857, 31279,
+  32767,
+};
+
+
+int16_t VolumeCurve::PositionToGain(float position) {
+  if (position <= 0) {
+    return 0;
+  } else if (position >= 1) {
+    return volumeCurve[VOLUME_CURVE_STEPS];
+  }
+
+  return volumeCurve[static_cast<uint8_t>(position * VOLUME_CURVE_STEPS + 0.5f)];
+}
+
+
+int16_t VolumeCurve::StepToGain(uint8_t step) {
+  return volumeCurve[step > VOLUME_CURVE_STEPS ? VOLUME_CURVE_STEPS : step];
+}
+
+
+} // namespace AudioLib
@@ -1,174 +1,417 @@
+#include <math.h>
 #include <stdlib.h>
+#include <string.h>
 
-#include "audio/memwav.hpp"
+#include "audio/adpcm.hpp"
+#include "audio/wav.hpp"
 #include "log.hpp"
 
 
 namespace AudioLib {
 
-#define WAV_HEADER_SIZE 36
+#define WAV_RIFF_HEADER_SIZE 12
+#define WAV_CHUNK_HEADER_SIZE 8
+
+// fmt chunk sizes: plain PCM, with cbSize, and WAVE_FORMAT_EXTENSIBLE
 #define WAV_FMT_SIZE 16
+#define WAV_FMT_EXTENSIBLE_SIZE 40
 
 #define WAV_FMT_TAG_PCM 1
+#define WAV_FMT_TAG_FLOAT 3
+#define WAV_FMT_TAG_IMA_ADPCM 0x11
+#define WAV_FMT_TAG_EXTENSIBLE 0xfffe
 
+// Where the sub-format GUID sits in an extensible fmt chunk. It's the format tag
+// it stands for, followed by these 14 bytes.
+#define WAV_FMT_SUBFORMAT_OFFSET 24
+static const uint8_t subFormatGuidTail[14] = {
+  0x00, 0x00, 0x00, 0x00, 0x10, 0x00, 0x80, 0x00, 0x00, 0xaa, 0x00, 0x38, 0x9b, 0x71
+};
 
 
-///////////////////////////////////////////////////////////////////////////////
-// class WavHeader
-///////////////////////////////////////////////////////////////////////////////
-WavHeader::WavHeader() {
-  memset(riff, 0, WAV_HEADER_SIZE);
+// .wav files are little-endian, and chunk fields aren't necessarily aligned.
+static inline uint16_t readLE16(const uint8_t *p) {
+  return static_cast<uint16_t>(p[0] | (p[1] << 8));
 }
 
 
-void WavHeader::Dump() {
-  // A buffer for logging 4-character strings
-  char scratchBuf[5];
-  scratchBuf[4] = '\0'; // Ensure it's NULL-terminated
+static inline uint32_t readLE32(const uint8_t *p) {
+  return static_cast<uint32_t>(p[0]) | (static_cast<uint32_t>(p[1]) << 8) |
+    (static_cast<uint32_t>(p[2]) << 16) | (static_cast<uint32_t>(p[3]) << 24);
+}
 
-  logPrintf(LOG_COMP_AUDIO, LOG_SEV_INFO, "Dumping .wav header:\n");
 
-  memcpy(scratchBuf, riff, 4);
-  logPrintf(LOG_COMP_AUDIO, LOG_SEV_INFO, "\tChunk ID: %s\n", scratchBuf);
-  logPrintf(LOG_COMP_AUDIO, LOG_SEV_INFO, "\tSize: %d\n", size);
+static inline int16_t saturate16(int32_t val) {
+  if (val > INT16_MAX) {
+    return INT16_MAX;
+  } else if (val < INT16_MIN) {
+    return INT16_MIN;
+  }
 
-  memcpy(scratchBuf, waveId, 4);
-  logPrintf(LOG_COMP_AUDIO, LOG_SEV_INFO, "\tWave ID: %s\n", scratchBuf);
+  return static_cast<int16_t>(val);
+}
 
-  memcpy(scratchBuf, fmtId, 4);
-  logPrintf(LOG_COMP_AUDIO, LOG_SEV_INFO, "\tFmt ID: %s\n", scratchBuf);
-  logPrintf(LOG_COMP_AUDIO, LOG_SEV_INFO, "\tFmt Size: %d\n", fmtSize);
-  logPrintf(LOG_COMP_AUDIO, LOG_SEV_INFO, "\tFmt Tag: %d\n", fmtTag);
-  logPrintf(LOG_COMP_AUDIO, LOG_SEV_INFO, "\tNum Channels: %d\n", numChannels);
-  logPrintf(LOG_COMP_AUDIO, LOG_SEV_INFO, "\tSamples Per Second: %d\n", samplesPerSecond);
-  logPrintf(LOG_COMP_AUDIO, LOG_SEV_INFO, "\tBytes Per Second: %d\n", bytesPerSecond);
-  logPrintf(LOG_COMP_AUDIO, LOG_SEV_INFO, "\tBlock Align: %d\n", blockAlign);
-  logPrintf(LOG_COMP_AUDIO, LOG_SEV_INFO, "\tBits Per Sample: %d\n", bitsPerSample);
 
-  // Not present with PCM
-  //logPrintf(LOG_COMP_AUDIO, LOG_SEV_INFO, "\tExtension Size: %d\n", extensionSize);
-  //logPrintf(LOG_COMP_AUDIO, LOG_SEV_INFO, "\tValid Bits Per Sample: %d\n", validBitsPerSample);
-  //logPrintf(LOG_COMP_AUDIO, LOG_SEV_INFO, "\tChannel Mask: %d\n", channelMask);
+// One sample of each type to 16 bits, rounded
+static inline int16_t fromUnsigned8(const uint8_t *p) {
+  return static_cast<int16_t>((p[0] - 128) * 256);
 }
 
 
-bool WavHeader::ReadFromBuffer(const uint8_t *buf, uint32_t len) {
-  // Read the header (first 44 bytes) of the buffer and do some basic validation
-  // to ensure we're dealing with the expected PCM data.
-  if (len < WAV_HEADER_SIZE) {
-    logPrintf(LOG_COMP_AUDIO, LOG_SEV_ERROR, "Expected a buffer of at least %d length when reading .wav file. Got only %d.\n", WAV_HEADER_SIZE, len);
-    return false;    
-  }
+static inline int16_t fromSigned16(const uint8_t *p) {
+  return static_cast<int16_t>(readLE16(p));
+}
 
-  // Copy and validate the data
-  bool valid = true;
 
-  // A buffer for logging 4-character strings
-  char scratchBuf[5];
-  scratchBuf[4] = '\0'; // Ensure it's NULL-terminated
+// Top 16 bits of a full-scale 32-bit sample
+static inline int16_t roundTo16(int32_t val) {
+  return saturate16((val >> 16) + ((val >> 15) & 1));
+}
 
-  logPrintf(LOG_COMP_AUDIO, LOG_SEV_INFO, "Validating WAV header...\n");
 
-  memcpy(riff, buf, WAV_HEADER_SIZE);
-  if (memcmp(riff, "RIFF", 4) != 0) {
-    valid = false;
-    memcpy(scratchBuf, riff, 4);
-    logPrintf(LOG_COMP_AUDIO, LOG_SEV_ERROR, "Initial chunk ID invalid. Expected %s, got %s\n", "RIFF", scratchBuf);
-  }
+static inline int16_t fromSigned24(const uint8_t *p) {
+  uint32_t val = (static_cast<uint32_t>(p[0]) << 8) | (static_cast<uint32_t>(p[1]) << 16) | (static_cast<uint32_t>(p[2]) << 24);
+  return roundTo16(static_cast<int32_t>(val));
+}
+
+
+static inline int16_t fromSigned32(const uint8_t *p) {
+  return roundTo16(static_cast<int32_t>(readLE32(p)));
+}
 
-  if (size > len) {
-    valid = false;
-    logPrintf(LOG_COMP_AUDIO, LOG_SEV_ERROR, "Initial chunk size exceeds buffer size. Size: %d, buffer size: %d\n", size, len);
-  }
 
-  if (memcmp(waveId, "WAVE", 4) != 0) {
-    valid = false;
-    memcpy(scratchBuf, waveId, 4);
-    logPrintf(LOG_COMP_AUDIO, LOG_SEV_ERROR, "Wave ID invalid. Expected %s, got %s\n", "WAVE", scratchBuf);
+static inline int16_t fromFloat32(const uint8_t *p) {
+  uint32_t bits = readLE32(p);
+  float val;
+  memcpy(&val, &bits, sizeof(val));
+
+  val *= 32768.0f;
+  if (val > -32768.0f && val < 32767.0f) {
+    return static_cast<int16_t>(lrintf(val));
+  } else if (val >= 32767.0f) {
+    return INT16_MAX;
+  } else if (val <= -32768.0f) {
+    return INT16_MIN;
   }
 
-  if (memcmp(fmtId, "fmt ", 4) != 0) {
-    valid = false;
-    memcpy(scratchBuf, fmtId, 4);
-    logPrintf(LOG_COMP_AUDIO, LOG_SEV_ERROR, "Format ID invalid. Expected %s, got %s\n", "fmt ", scratchBuf);
+  // NaN
+  return 0;
+}
+
+
+template<int16_t (*fromSample)(const uint8_t*), uint8_t outChannels>
+static void convertFrames(const uint8_t *in, uint32_t numFrames, uint32_t blockAlign, uint32_t rightOffset, int16_t *out) {
+  for (uint32_t i = 0; i < numFrames; i++) {
+    out[0] = fromSample(in);
+    if (outChannels == 2) {
+      out[1] = fromSample(in + rightOffset);
+    }
+    in += blockAlign;
+    out += outChannels;
   }
+}
+
+
+// Where walk() gets its bytes from
+class WavBufferReader {
+public:
+  WavBufferReader(const uint8_t *_buf, uint32_t _len):
+    buf(_buf),
+    len(_len) {}
+
+  uint32_t GetSize() const { return len; }
+
+  bool Read(uint32_t pos, uint8_t *dest, uint32_t numBytes) {
+    if (pos > len || numBytes > len - pos) {
+      return false;
+    }
 
-  if (fmtSize != WAV_FMT_SIZE) {
-    valid = false;
-    logPrintf(LOG_COMP_AUDIO, LOG_SEV_ERROR, "Format size invalid. Size: %d, expected: %d\n", fmtSize, WAV_FMT_SIZE);
+    memcpy(dest, buf + pos, numBytes);
+    return true;
   }
 
-  if (fmtTag != WAV_FMT_TAG_PCM) {
-    valid = false;
-    logPrintf(LOG_COMP_AUDIO, LOG_SEV_ERROR, "Format tag invalid. (Not PCM encoding?) Got: %d, expected: %d\n", fmtTag, WAV_FMT_TAG_PCM);
+private:
+  const uint8_t *buf;
+  uint32_t len;
+};
+
+
+class WavFileReader {
+public:
+  WavFileReader(FILE *_file):
+    file(_file),
+    size(0) {
+    if (fseek(file, 0, SEEK_END) == 0) {
+      long end = ftell(file);
+      size = end > 0 ? static_cast<uint32_t>(end) : 0;
+    }
   }
 
-  if (numChannels != 2) {
-    valid = false;
-    logPrintf(LOG_COMP_AUDIO, LOG_SEV_ERROR, "Num channels invalid. Got: %d, expected: %d\n", numChannels, 2);
+  uint32_t GetSize() const { return size; }
+
+  bool Read(uint32_t pos, uint8_t *dest, uint32_t numBytes) {
+    if (pos > size || numBytes > size - pos) {
+      return false;
+    }
+
+    return fseek(file, pos, SEEK_SET) == 0 && fread(dest, 1, numBytes, file) == numBytes;
   }
 
+private:
+  FILE *file;
+  uint32_t size;
+};
 
-  // TODO: Properly sanity check the remaining fields?
 
-  logPrintf(LOG_COMP_AUDIO, LOG_SEV_INFO, "Done validating WAV header. Result is %s\n", valid ? "VALID" : "INVALID");
 
-  Dump();
+///////////////////////////////////////////////////////////////////////////////
+// class WavHeader
+///////////////////////////////////////////////////////////////////////////////
+WavHeader::WavHeader():
+  fmtTag(0),
+  numChannels(0),
+  samplesPerSecond(0),
+  bytesPerSecond(0),
+  blockAlign(0),
+  bitsPerSample(0),
+  sampleType(WS_None),
+  dataStart(0),
+  dataLen(0),
+  framesPerBlock(1),
+  error(NULL) {}
+
 
-  return valid;
+void WavHeader::Dump() {
+  logPrintf(LOG_COMP_AUDIO, LOG_SEV_VERBOSE, "Dumping .wav header:\n");
+  logPrintf(LOG_COMP_AUDIO, LOG_SEV_VERBOSE, "\tFmt Tag: %d\n", fmtTag);
+  logPrintf(LOG_COMP_AUDIO, LOG_SEV_VERBOSE, "\tNum Channels: %d\n", numChannels);
+  logPrintf(LOG_COMP_AUDIO, LOG_SEV_VERBOSE, "\tSamples Per Second: %u\n", samplesPerSecond);
+  logPrintf(LOG_COMP_AUDIO, LOG_SEV_VERBOSE, "\tBytes Per Second: %u\n", bytesPerSecond);
+  logPrintf(LOG_COMP_AUDIO, LOG_SEV_VERBOSE, "\tBlock Align: %d\n", blockAlign);
+  logPrintf(LOG_COMP_AUDIO, LOG_SEV_VERBOSE, "\tBits Per Sample: %d\n", bitsPerSample);
+  logPrintf(LOG_COMP_AUDIO, LOG_SEV_VERBOSE, "\tData Start: %u\n", dataStart);
+  logPrintf(LOG_COMP_AUDIO, LOG_SEV_VERBOSE, "\tData Length: %u\n", dataLen);
 }
 
 
-uint32_t WavHeader::GetSize() {
-  return WAV_HEADER_SIZE;
+bool WavHeader::ReadFromBuffer(const uint8_t *buf, uint32_t len) {
+  WavBufferReader reader(buf, len);
+  return walk(reader);
 }
 
 
+bool WavHeader::ReadFromFile(FILE *file) {
+  WavFileReader reader(file);
+  return walk(reader);
+}
+
+
+bool WavHeader::fail(const char *reason) {
+  error = reason;
+  return false;
+}
+
+
+template<class Reader>
+bool WavHeader::walk(Reader& reader) {
+  uint8_t buf[WAV_FMT_EXTENSIBLE_SIZE];
+
+  error = NULL;
+  sampleType = WS_None;
+  dataStart = 0;
+  dataLen = 0;
+  framesPerBlock = 1;
+
+  if (!reader.Read(0, buf, WAV_RIFF_HEADER_SIZE)) {
+    return fail("Too short to be a .wav file");
+  }
+
+  if (memcmp(buf, "RIFF", 4) != 0 || memcmp(buf + 8, "WAVE", 4) != 0) {
+    return fail("Not a RIFF WAVE file");
+  }
+
+  // The RIFF size isn't checked. Files written as they're recorded often leave it
+  // wrong, and the file's own length is what really bounds the chunks.
+  uint32_t end = reader.GetSize();
+  uint32_t pos = WAV_RIFF_HEADER_SIZE;
+  bool haveFmt = false;
+
+  while (end - pos >= WAV_CHUNK_HEADER_SIZE) {
+    if (!reader.Read(pos, buf, WAV_CHUNK_HEADER_SIZE)) {
+      return fail("Unable to read a chunk header");
+    }
+
+    uint32_t chunkLen = readLE32(buf + 4);
+    pos += WAV_CHUNK_HEADER_SIZE;
+    uint32_t left = end - pos;
+
+    if (memcmp(buf, "fmt ", 4) == 0) {
+      if (chunkLen < WAV_FMT_SIZE || chunkLen > left) {
+        return fail("Bad fmt chunk size");
+      }
+
+      // Anything past the extensible fields is of no interest.
+      uint32_t fmtLen = chunkLen < WAV_FMT_EXTENSIBLE_SIZE ? chunkLen : WAV_FMT_EXTENSIBLE_SIZE;
+      if (!reader.Read(pos, buf, fmtLen)) {
+        return fail("Unable to read the fmt chunk");
+      }
+
+      if (!parseFmt(buf, fmtLen)) {
+        return false;
+      }
+
+      haveFmt = true;
+    } else if (memcmp(buf, "data", 4) == 0) {
+      if (!haveFmt) {
+        return fail("data chunk comes before the fmt chunk");
+      }
+
+      // A file cut short plays up to where it stops.
+      dataStart = pos;
+      dataLen = chunkLen < left ? chunkLen : left;
+      dataLen -= dataLen % blockAlign;
+      if (dataLen == 0) {
+        return fail("No samples");
+      }
+
+      return true;
+    }
+
+    // Anything else is skipped. Chunks are padded to an even length.
+    uint32_t skip = chunkLen + (chunkLen & 1);
+    if (chunkLen >= left || skip > left) {
+      break;
+    }
+
+    pos += skip;
+  }
+
+  return fail(haveFmt ? "No data chunk" : "No fmt chunk");
+}
 
-///////////////////////////////////////////////////////////////////////////////
-// class WavData
-///////////////////////////////////////////////////////////////////////////////
-WavData::WavData(): 
-  buf(NULL), 
-  bufLen(0) {}
 
+bool WavHeader::parseFmt(const uint8_t *fmt, uint32_t len) {
+  fmtTag = readLE16(fmt);
+  numChannels = readLE16(fmt + 2);
+  samplesPerSecond = readLE32(fmt + 4);
+  bytesPerSecond = readLE32(fmt + 8);
+  blockAlign = readLE16(fmt + 12);
+  bitsPerSample = readLE16(fmt + 14);
 
-bool WavData::Init(uint8_t *_buf, uint32_t _bufLen) {
-  if (_bufLen <= 8) {
-    logPrintf(LOG_COMP_AUDIO, LOG_SEV_ERROR, "Wav data size invalid. Expcted > 8, got %d\n", _bufLen);
-    return false;
+  if (fmtTag == WAV_FMT_TAG_EXTENSIBLE) {
+    if (len < WAV_FMT_EXTENSIBLE_SIZE) {
+      return fail("Extensible fmt chunk too short");
+    }
+
+    const uint8_t *guid = fmt + WAV_FMT_SUBFORMAT_OFFSET;
+    if (memcmp(guid + 2, subFormatGuidTail, sizeof(subFormatGuidTail)) != 0) {
+      return fail("Unknown extensible sub-format");
+    }
+
+    fmtTag = readLE16(guid);
   }
 
-  // A buffer for logging 4-character strings
-  char scratchBuf[5];
-  scratchBuf[4] = '\0'; // Ensure it's NULL-terminated
+  if (numChannels == 0) {
+    return fail("No channels");
+  }
 
-  if (memcmp(_buf, "data", 4) != 0) {
-    memcpy(scratchBuf, _buf, 4);
-    logPrintf(LOG_COMP_AUDIO, LOG_SEV_ERROR, "Data ID invalid. Expected %s, got %s\n", "data", scratchBuf);
-    return false;
+  if (samplesPerSecond == 0) {
+    return fail("Sample rate is 0");
   }
 
-  _buf += 4;
-  uint32_t *dataSize = reinterpret_cast<uint32_t*>(_buf);
-  if (*dataSize < _bufLen - 8) {
-    // Something is wrong with the data...
-    logPrintf(LOG_COMP_AUDIO, LOG_SEV_ERROR, "Wav data size parsed from buffer is invalid. Expcted >= %d, got %d\n", _bufLen, *dataSize);
-    return false;
+  if (fmtTag == WAV_FMT_TAG_PCM) {
+    switch (bitsPerSample) {
+      case 8:
+        sampleType = WS_Unsigned8;
+        break;
+      case 16:
+        sampleType = WS_Signed16;
+        break;
+      case 24:
+        sampleType = WS_Signed24;
+        break;
+      case 32:
+        sampleType = WS_Signed32;
+        break;
+      default:
+        return fail("Unsupported bits per sample");
+    }
+  } else if (fmtTag == WAV_FMT_TAG_FLOAT && bitsPerSample == 32) {
+    sampleType = WS_Float32;
+  } else if (fmtTag == WAV_FMT_TAG_IMA_ADPCM && bitsPerSample == ADPCM_BITS_PER_SAMPLE) {
+    // Blocks rather than frames, so it's checked here.
+    framesPerBlock = ImaAdpcm::GetFramesPerBlock(blockAlign, numChannels);
+    if (!framesPerBlock) {
+      framesPerBlock = 1;
+      return fail("Block align doesn't fit IMA ADPCM");
+    }
+
+    sampleType = WS_ImaAdpcm;
+    return true;
+  } else {
+    return fail("Not PCM, 32-bit float or IMA ADPCM");
   }
 
-  // The remaining portion of the buffer is expected to be samples.
-  buf = _buf + 4;
-  bufLen = _bufLen - 8;
+  if (blockAlign != static_cast<uint32_t>(numChannels) * (bitsPerSample / 8)) {
+    sampleType = WS_None;
+    return fail("Block align doesn't match the channels and bits per sample");
+  }
 
   return true;
 }
 
 
-bool WavData::Update(uint8_t *_buf, uint32_t _bufLen) {
-  buf = _buf;
-  bufLen = _bufLen;
-  return true;
+bool WavHeader::IsCanonical() const {
+  return sampleType == WS_Signed16 && numChannels == 2;
+}
+
+
+void WavHeader::ToCanonical(const uint8_t *in, uint32_t numFrames, int16_t *out) const {
+  if (IsCanonical()) {
+    memmove(out, in, numFrames * 2 * sizeof(int16_t));
+    return;
+  }
+
+  convert<2>(in, numFrames, out);
+}
+
+
+void WavHeader::ToMono(const uint8_t *in, uint32_t numFrames, int16_t *out) const {
+  convert<1>(in, numFrames, out);
+}
+
+
+template<uint8_t outChannels>
+void WavHeader::convert(const uint8_t *in, uint32_t numFrames, int16_t *out) const {
+  // Mono reads the same sample for both channels.
+  uint32_t rightOffset = numChannels > 1 ? bitsPerSample / 8 : 0;
+
+  switch (sampleType) {
+    case WS_Unsigned8:
+      convertFrames<fromUnsigned8, outChannels>(in, numFrames, blockAlign, rightOffset, out);
+      break;
+    case WS_Signed16:
+      convertFrames<fromSigned16, outChannels>(in, numFrames, blockAlign, rightOffset, out);
+      break;
+    case WS_Signed24:
+      convertFrames<fromSigned24, outChannels>(in, numFrames, blockAlign, rightOffset, out);
+      break;
+    case WS_Signed32:
+      convertFrames<fromSigned32, outChannels>(in, numFrames, blockAlign, rightOffset, out);
+      break;
+    case WS_Float32:
+      convertFrames<fromFloat32, outChannels>(in, numFrames, blockAlign, rightOffset, out);
+      break;
+    case WS_ImaAdpcm:
+      for (uint32_t frame = 0; frame < numFrames; frame += framesPerBlock) {
+        ImaAdpcm::DecodeBlock(in, blockAlign, numChannels, out + frame * outChannels, outChannels, numFrames - frame);
+        in += blockAlign;
+      }
+      break;
+    default:
+      memset(out, 0, numFrames * outChannels * sizeof(int16_t));
+      break;
+  }
 }
 
 
@@ -0,0 +1,67 @@
+#include <Arduino.h>
+#include <string.h>
+
+#include "audio.hpp"
+#include "console.hpp"
+#include "log.hpp"
+#include "screen/setlist-screen.hpp"
+
+
+// Longest command line. Anything past it is dropped.
+#define CONSOLE_MAX_LINE 64
+
+
+static char line[CONSOLE_MAX_LINE];
+static uint8_t lineLen = 0;
+
+
+static void writeCsvLine(const char *csvLine) {
+  // Straight out, so the log's prefixes don't get into the CSV.
+  Serial.println(csvLine);
+}
+
+
+static void runCommand(const char *command) {
+  if (strcmp(command, "latency") == 0) {
+    AudioComp::WriteLatencyCsv(writeCsvLine);
+  } else if (strcmp(command, "latency clear") == 0) {
+    AudioComp::ClearLatencyStats();
+    logPrintf(LOG_COMP_GENERAL, LOG_SEV_INFO, "Latency stats cleared\n");
+  } else if (strcmp(command, "stream") == 0) {
+    AudioLib::StreamStats stats = AudioComp::GetBackingTrackStats();
+    logPrintf(LOG_COMP_GENERAL, LOG_SEV_INFO, "Backing track: %u underruns (%u blocks), %u errors, %u of %u frames ready, fewest %u, "
+      "%u us of work per second, longest %u us\n", static_cast<unsigned>(stats.underruns), static_cast<unsigned>(stats.starvedBlocks),
+      static_cast<unsigned>(stats.errors), static_cast<unsigned>(stats.bufferedFrames), static_cast<unsigned>(stats.capacityFrames),
+      static_cast<unsigned>(stats.minBufferedFrames), static_cast<unsigned>(stats.workUsPerSecond), static_cast<unsigned>(stats.maxWorkUs));
+  } else if (strcmp(command, "commands") == 0) {
+    logPrintf(LOG_COMP_GENERAL, LOG_SEV_INFO, "Audio commands: %u queued, at most %u, %u dropped\n",
+      static_cast<unsigned>(AudioComp::GetCommandQueueDepth()), static_cast<unsigned>(AudioComp::GetCommandQueueHighWater()),
+      static_cast<unsigned>(AudioComp::GetCommandsDropped()));
+  } else if (strcmp(command, "diag") == 0) {
+    AudioComp::RunDiagnostics();
+  } else if (strcmp(command, "diag stream") == 0) {
+    AudioComp::RunStreamCheck();
+  } else if (strcmp(command, "export") == 0) {
+    // The setlist on the screen
+    SetlistScreen::GetSetlistScreen()->ExportSetlist();
+  } else if (command[0]) {
+    logPrintf(LOG_COMP_GENERAL, LOG_SEV_WARN, "Unknown command: %s. Try latency, latency clear, stream, commands, diag, diag stream or export.\n", command);
+  }
+}
+
+
+///////////////////////////////////////////////////////////////////////////////
+// namespace Console
+///////////////////////////////////////////////////////////////////////////////
+void Console::Poll() {
+  while (Serial.available() > 0) {
+    int c = Serial.read();
+    if (c == '\r' || c == '\n') {
+      line[lineLen] = '\0';
+      runCommand(line);
+      lineLen = 0;
+    } else if (lineLen < CONSOLE_MAX_LINE - 1) {
+      line[lineLen++] = static_cast<char>(c);
+    }
+  }
+}
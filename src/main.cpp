@@ -3,6 +3,7 @@
 
 #include "audio.hpp"
 #include "components/component.hpp"
+#include "console.hpp"
 #include "log.hpp"
 #include "screen/band-chooser-screen.hpp"
 #include "screen/setlist-screen.hpp"
@@ -130,6 +131,7 @@ void loop(void *) {
   logPrintf(LOG_COMP_GENERAL, LOG_SEV_VERBOSE, "Starting component message loop\n");
   while(true) {
     Component::Loop();
+    Console::Poll();
     yield();
   }
 }
@@ -1,3 +1,6 @@
+#include <ctype.h>
+#include <sys/stat.h>
+
 #include "audio.hpp"
 #include "audio/player.hpp"
 #include "components/button.hpp"
@@ -5,12 +8,13 @@
 #include "log.hpp"
 #include "screen/setlist-screen.hpp"
 #include "tftmanager.hpp"
+#include "trigger.hpp"
 
 
 #define SONGS_FILE_PATH SDCARD_ROOT"/songs.json"
 #define SONGS_MAX_SIZE (32 * 1024)
 
-#define BOTTOM_ROW_NUM_ITEMS 4
+#define BOTTOM_ROW_NUM_ITEMS 5
 #define BOTTOM_ROW_HEIGHT 50
 #define BOTTOM_ROW_WIDTH TftManager::Width()
 #define BOTTOM_ROW_ITEM_WIDTH (BOTTOM_ROW_WIDTH / BOTTOM_ROW_NUM_ITEMS)
@@ -29,12 +33,30 @@
 #define SET_LIST_WIDTH (TftManager::Width() - RIGHT_COLUMN_WIDTH)
 #define SET_LIST_HEIGHT (TftManager::Height() - BOTTOM_ROW_HEIGHT)
 #define SET_LIST_MAX_NAME_LEN 40
-#define SET_LIST_MAX_BPM_LEN 3
+#define SET_LIST_MAX_BPM_LEN 5
 
 #define SONG_DETAIL_TITLE_HEIGHT 50
 
 #define VOLUME_CHANGE 0.05
 
+#define TEMPO_CHANGE 0.1f
+#define TEMPO_MAX 300
+
+// Tap tempo estimates below this (out of 100) are ignored
+#define TAP_TEMPO_MIN_CONFIDENCE 50
+
+// Exported click tracks go here, as <setlist name>.wav
+#define EXPORT_DIR SDCARD_ROOT"/export"
+#define EXPORT_MAX_PATH 128
+
+// Songs that don't say how many bars they are get this many, or run this far
+// past their last tempo change, whichever is longer.
+#define EXPORT_DEFAULT_BARS 64
+#define EXPORT_BARS_AFTER_CHANGES 8
+
+// Bars of beats before each song
+#define EXPORT_COUNT_IN_BARS 1
+
 ///////////////////////////////////////////////////////////////////////////////
 // class SetlistSong
 ///////////////////////////////////////////////////////////////////////////////
@@ -46,7 +68,7 @@ bool SetlistSong::SetSong(const Serializable::Song *_song, const Serializable::S
   try {
     song = _song;
     setlistSong = _setlistSong;
-    bpm = std::to_string(_song->GetBPM());
+    bpm = Serializable::Song::BPMToString(_song->GetBPM());
     logPrintf(LOG_COMP_SCREEN, LOG_SEV_VERBOSE, "SetlistSong::SetSong: song: %s, BPM: %s\n", song->GetName().c_str(), bpm.c_str());
     return true;
   } catch (std::bad_alloc&) {
@@ -201,7 +223,7 @@ public:
   virtual ~TempoUpButton() {}
 
   virtual void OnPress() {
-    setlistScreen->SetTempo(setlistScreen->GetTempo() + 1);
+    setlistScreen->SetTempo(setlistScreen->GetTempo() + TEMPO_CHANGE);
   }
 
 private:
@@ -222,11 +244,47 @@ public:
   virtual ~TempoDownButton() {}
 
   virtual void OnPress() {
-    setlistScreen->SetTempo(setlistScreen->GetTempo() - 1);
+    setlistScreen->SetTempo(setlistScreen->GetTempo() - TEMPO_CHANGE);
+  }
+
+private:
+  SetlistScreen *setlistScreen;
+};
+
+
+
+
+///////////////////////////////////////////////////////////////////////////////
+// class TapTempoButton
+///////////////////////////////////////////////////////////////////////////////
+class TapTempoButton : public Button {
+public:
+  TapTempoButton(CanvasState& cs, uint16_t _width, uint16_t _height, SetlistScreen *_setlistScreen):
+    Button(cs, _width, _height, "Tap"),
+    setlistScreen(_setlistScreen),
+    lastHitCount(Trigger::GetHitCount()) {}
+
+  virtual ~TapTempoButton() {}
+
+  virtual void OnPress() {
+    setlistScreen->Tap(TftManager::GetTouchTimeUs(), false);
+  }
+
+  virtual void Run(TSPoint *point) {
+    Button::Run(point);
+
+    // Run every time around the component loop, so it's a handy place to pick up
+    // pad hits too.
+    uint32_t hitCount = Trigger::GetHitCount();
+    if (hitCount != lastHitCount) {
+      lastHitCount = hitCount;
+      setlistScreen->Tap(Trigger::GetLastHitTimeUs(), true);
+    }
   }
 
 private:
   SetlistScreen *setlistScreen;
+  uint32_t lastHitCount;
 };
 
 
@@ -250,11 +308,14 @@ SetlistScreen::SetlistScreen():
   clickOnOffButton(NULL),
   tempoUpButton(NULL),
   tempoDownButton(NULL),
+  tapTempoButton(NULL),
   tempoTextBox(NULL),
   setlist(NULL),
   songStartIndex(0),
   nextPageIdx(-1),
-  prevPageIdx(-1) {}
+  prevPageIdx(-1),
+  curTempo(0),
+  tempoMapActive(false) {}
 
 
 SetlistScreen::~SetlistScreen() {}
@@ -273,8 +334,10 @@ void SetlistScreen::Init() {
     return;
   }
 
-  if (!AudioComp::SetClickFile(SDCARD_ROOT"/metronome/click.wav")) {
-    logPrintf(LOG_COMP_SCREEN, LOG_SEV_ERROR, "Unable to process click file\n");
+  // Every click sound is read now, so songs can switch between them without
+  // touching the card.
+  if (!AudioComp::LoadClickBank(SDCARD_ROOT"/metronome") || !AudioComp::SetClickVoice(CLICKBANK_DEFAULT_VOICE)) {
+    logPrintf(LOG_COMP_SCREEN, LOG_SEV_ERROR, "Unable to load click sounds\n");
   }
 }
 
@@ -338,8 +401,8 @@ void SetlistScreen::Show() {
   setListBox->SetWidthAndHeight(SET_LIST_WIDTH, SET_LIST_HEIGHT);
   setListBox->SetSelectedTextColor(TFT_BLACK, TFT_WHITE);
 
-  if (!setListBox->AllocColumn(0, SET_LIST_MAX_NAME_LEN, 90)
-    || !setListBox->AllocColumn(1, SET_LIST_MAX_BPM_LEN, 10)) {
+  if (!setListBox->AllocColumn(0, SET_LIST_MAX_NAME_LEN, 86)
+    || !setListBox->AllocColumn(1, SET_LIST_MAX_BPM_LEN, 14)) {
     logPrintf(LOG_COMP_SCREEN, LOG_SEV_ERROR, "****** OUT OF MEMORY ******* Unable to alloc columns for setListBox\n");
     return;
   }
@@ -494,6 +557,17 @@ void SetlistScreen::Show() {
   tempoUpButton->Init();
 
 
+  cs.cursorX += BOTTOM_ROW_ITEM_WIDTH;
+  tapTempoButton = new TapTempoButton(cs, BOTTOM_ROW_ITEM_WIDTH, BOTTOM_ROW_HEIGHT, this);
+  if (!tapTempoButton || !pushComponent(reinterpret_cast<Component**>(&tapTempoButton))) {
+    logPrintf(LOG_COMP_SCREEN, LOG_SEV_ERROR, "****** OUT OF MEMORY ******* Unable to alloc tapTempoButton\n");
+    return;    
+  }
+
+  tapTempoButton->SetColors(TFT_WHITE, TFT_BLUE);
+  tapTempoButton->Init();
+
+
   selectionChanged();
   Component::ManualDraw();
 }
@@ -598,9 +672,34 @@ void SetlistScreen::selectionChanged() {
     selectedSong->GetSong()->GetName(), selectedSong->GetSetlistSong()->GetNotes());
 
   curTempo = selectedSong->GetSong()->GetBPM();
+  tapTempo.Reset();
+  AudioComp::SetTimeSignature(selectedSong->GetSong()->GetBeatsPerBar());
+  AudioComp::SetClickPattern(selectedSong->GetSong()->GetSubdivision(), selectedSong->GetSong()->GetSwing());
+  AudioComp::SetSubdivisionLevels(selectedSong->GetSong()->GetSubdivisionLevel(1), selectedSong->GetSong()->GetSubdivisionLevel(2));
+  AudioComp::SetClickVoice(selectedSong->GetSong()->GetClickVoice().c_str());
+
+  // Compiled here, rather than on the audio task, so all the audio task has to do is
+  // step through the beats.
+  AudioLib::TempoMap tempoMap;
+  const std::vector<AudioLib::TempoChange>& tempoChanges = selectedSong->GetSong()->GetTempoChanges();
+  if (!tempoChanges.empty() && !tempoMap.Compile(curTempo, selectedSong->GetSong()->GetBeatsPerBar(), tempoChanges)) {
+    logPrintf(LOG_COMP_SCREEN, LOG_SEV_WARN, "selectionChanged: Unable to compile tempo map for %s. Using a steady tempo.\n", 
+      selectedSong->GetSong()->GetName().c_str());
+  }
+  AudioComp::SetTempoMap(tempoMap);
+  tempoMapActive = !tempoMap.Empty();
   AudioComp::StartClick(curTempo);
+
+  // The backing track, if there is one, starts along with the click.
+  const std::string& mp3File = selectedSong->GetSong()->GetMp3File();
+  if (mp3File.empty()) {
+    AudioComp::StopAudioFile();
+  } else if (!AudioComp::PlayAudioFile((std::string(SDCARD_ROOT "/") + mp3File).c_str())) {
+    logPrintf(LOG_COMP_SCREEN, LOG_SEV_WARN, "selectionChanged: Unable to play backing track %s\n", mp3File.c_str());
+  }
+
   //tempoTextBox->Update(std::string("Tempo: ").append(std::to_string(curTempo)));
-  tempoTextBox->Update(std::to_string(curTempo));
+  tempoTextBox->Update(Serializable::Song::BPMToString(curTempo));
 
   logPrintf(LOG_COMP_SCREEN, LOG_SEV_VERBOSE, "Setting songDetailTitle to %s\n", selectedSong->GetSong()->GetName().c_str());
   songDetailTitle->SetText(selectedSong->GetSong()->GetName());
@@ -650,13 +749,115 @@ bool SetlistScreen::SwapGridArea() {
 }
 
 
-void SetlistScreen::SetTempo(uint16_t newTempo) {
-  if (newTempo > 300) {
+void SetlistScreen::SetTempo(float newTempo) {
+  // Snap to the nearest tenth, so repeated Tempo+/- presses don't accumulate
+  // floating point error.
+  newTempo = static_cast<int32_t>(newTempo * 10 + 0.5f) / 10.0f;
+  if (newTempo <= 0 || newTempo > TEMPO_MAX) {
     return;
   }
 
   curTempo = newTempo;
-  AudioComp::StartClick(curTempo);
+
+  // Picking a tempo by hand overrides the song's tempo changes.
+  if (tempoMapActive) {
+    AudioComp::SetTempoMap(AudioLib::TempoMap());
+    tempoMapActive = false;
+  }
+
+  // Don't lose our place in the bar.
+  AudioComp::ChangeTempo(curTempo);
   //tempoTextBox->Update(std::string("Tempo: ").append(std::to_string(curTempo)));
-  tempoTextBox->Update(std::to_string(curTempo));
+  tempoTextBox->Update(Serializable::Song::BPMToString(curTempo));
+}
+
+
+static uint16_t exportBars(const Serializable::Song *song) {
+  if (song->GetBars()) {
+    return song->GetBars();
+  }
+
+  uint32_t bars = EXPORT_DEFAULT_BARS;
+  for (const AudioLib::TempoChange& change : song->GetTempoChanges()) {
+    uint32_t end = change.bar + change.rampBars + EXPORT_BARS_AFTER_CHANGES - 1;
+    if (end > bars) {
+      bars = end;
+    }
+  }
+
+  return bars > UINT16_MAX ? UINT16_MAX : static_cast<uint16_t>(bars);
+}
+
+
+bool SetlistScreen::ExportSetlist() {
+  if (!setlist || setlistSongs.empty()) {
+    logPrintf(LOG_COMP_SCREEN, LOG_SEV_WARN, "ExportSetlist: There's no setlist to export\n");
+    return false;
+  }
+
+  std::vector<AudioComp::ExportSong> songs;
+  try {
+    songs.resize(setlistSongs.size());
+    for (size_t i = 0; i < setlistSongs.size(); i++) {
+      const Serializable::Song *song = setlistSongs[i]->GetSong();
+      songs[i].clickVoice = song->GetClickVoice();
+
+      AudioLib::RenderSong& renderSong = songs[i].song;
+      renderSong.bpm = song->GetBPM();
+      renderSong.beatsPerBar = song->GetBeatsPerBar();
+      renderSong.subdivision = song->GetSubdivision();
+      renderSong.swing = song->GetSwing();
+      for (uint8_t level = 1; level < CLICKTRACK_NUM_LEVELS; level++) {
+        renderSong.subdivisionLevels[level - 1] = song->GetSubdivisionLevel(level);
+      }
+      renderSong.bars = exportBars(song);
+      renderSong.countInBars = EXPORT_COUNT_IN_BARS;
+
+      const std::vector<AudioLib::TempoChange>& tempoChanges = song->GetTempoChanges();
+      if (!tempoChanges.empty() && !renderSong.tempoMap.Compile(song->GetBPM(), song->GetBeatsPerBar(), tempoChanges)) {
+        logPrintf(LOG_COMP_SCREEN, LOG_SEV_WARN, "ExportSetlist: Unable to compile tempo map for %s. Using a steady tempo.\n",
+          song->GetName().c_str());
+        renderSong.tempoMap.Clear();
+      }
+    }
+  } catch (std::bad_alloc&) {
+    logPrintf(LOG_COMP_SCREEN, LOG_SEV_ERROR, "ExportSetlist: Out of memory building the song list\n");
+    return false;
+  }
+
+  // Anything in the setlist's name the card might not like becomes an underscore.
+  std::string name = setlist->GetName();
+  for (char& c : name) {
+    if (!isalnum(static_cast<unsigned char>(c)) && c != ' ' && c != '-' && c != '_') {
+      c = '_';
+    }
+  }
+
+  // It's fine if it's there already.
+  mkdir(EXPORT_DIR, 0777);
+
+  char fileName[EXPORT_MAX_PATH];
+  snprintf(fileName, sizeof(fileName), EXPORT_DIR "/%s.wav", name.c_str());
+  logPrintf(LOG_COMP_SCREEN, LOG_SEV_INFO, "ExportSetlist: Exporting %d songs to %s\n", static_cast<int>(songs.size()), fileName);
+  return AudioComp::ExportClickTrack(fileName, songs);
+}
+
+
+void SetlistScreen::Tap(uint32_t timeUs, bool fromTrigger) {
+  if (fromTrigger && !tapTempo.Active(timeUs)) {
+    // The pad is just being played.
+    return;
+  }
+
+  if (!tapTempo.AddTap(timeUs)) {
+    return;
+  }
+
+  logPrintf(LOG_COMP_SCREEN, LOG_SEV_VERBOSE, "Tap tempo: %s BPM, confidence: %d\n",
+    Serializable::Song::BPMToString(tapTempo.GetBPM()).c_str(), tapTempo.GetConfidence());
+
+  // The estimate is already smoothed, so it can go straight to the click.
+  if (tapTempo.GetConfidence() >= TAP_TEMPO_MIN_CONFIDENCE) {
+    SetTempo(tapTempo.GetBPM());
+  }
 }
@@ -1,3 +1,6 @@
+#include <stdio.h>
+#include <string.h>
+
 #include <serializable/songs.hpp>
 
 namespace Serializable {
@@ -9,13 +12,63 @@ bool Song::DeserializeSelf(const ArduinoJson::JsonObject& obj) {
   logPrintf(LOG_COMP_SERIALIZE, LOG_SEV_VERBOSE, "Song::DeserializeSelf\n");
   try {
     name = obj["name"].as<const char*>();
-    bpm = obj["BPM"].as<unsigned short>();
+    bpm = obj["BPM"].as<float>();
     const char *mp3 = obj["MP3"];
     if (mp3) {
       mp3File = mp3;
     }
 
-    logPrintf(LOG_COMP_SERIALIZE, LOG_SEV_VERBOSE, "Song: %s, BPM: %d\n", name.c_str(), bpm);
+    // Optional. Defaults to 4/4.
+    const char *timeSignature = obj["timeSignature"];
+    if (timeSignature && !parseTimeSignature(timeSignature)) {
+      logPrintf(LOG_COMP_SERIALIZE, LOG_SEV_WARN, "Song: %s has invalid time signature \"%s\". Using 4/4.\n", name.c_str(), timeSignature);
+    }
+
+    // Optional. "8th", "triplet" or "16th". Defaults to none.
+    const char *subdivisionName = obj["subdivision"];
+    if (subdivisionName && !parseSubdivision(subdivisionName)) {
+      logPrintf(LOG_COMP_SERIALIZE, LOG_SEV_WARN, "Song: %s has invalid subdivision \"%s\". Ignoring it.\n", name.c_str(), subdivisionName);
+    }
+
+    // Optional. Percentage, from 50 (straight) to 75.
+    if (obj.containsKey("swing")) {
+      unsigned int swingVal = obj["swing"].as<unsigned int>();
+      if (swingVal >= CLICKTRACK_MIN_SWING && swingVal <= CLICKTRACK_MAX_SWING) {
+        swing = swingVal;
+      } else {
+        logPrintf(LOG_COMP_SERIALIZE, LOG_SEV_WARN, "Song: %s has invalid swing %d. Must be from %d to %d.\n", 
+          name.c_str(), swingVal, CLICKTRACK_MIN_SWING, CLICKTRACK_MAX_SWING);
+      }
+    }
+
+    // Optional. Percentages of the beat's level, for 8ths (or triplets) then 16ths.
+    if (obj.containsKey("subdivisionLevels") && !parseSubdivisionLevels(obj["subdivisionLevels"].as<ArduinoJson::JsonArray>())) {
+      logPrintf(LOG_COMP_SERIALIZE, LOG_SEV_WARN, "Song: %s has invalid subdivision levels. Must be up to two, from 0 to 100.\n", name.c_str());
+      subdivisionLevels[0] = CLICKTRACK_DEFAULT_LEVEL_1_PERCENT;
+      subdivisionLevels[1] = CLICKTRACK_DEFAULT_LEVEL_2_PERCENT;
+    }
+
+    // Optional. The name of a sound in the metronome directory, or "synth" for the
+    // built-in one. Defaults to "click".
+    const char *click = obj["click"];
+    if (click) {
+      clickVoice = click;
+    }
+
+    // Optional. How many bars long the song is. Only used when exporting the click.
+    if (obj.containsKey("bars")) {
+      bars = obj["bars"].as<uint16_t>();
+    }
+
+    // Optional. Tempo and meter changes part way through the song.
+    if (obj.containsKey("tempoMap") && !parseTempoMap(obj["tempoMap"].as<ArduinoJson::JsonArray>())) {
+      logPrintf(LOG_COMP_SERIALIZE, LOG_SEV_WARN, "Song: %s has an invalid tempo map. Ignoring it.\n", name.c_str());
+      tempoChanges.clear();
+    }
+
+    logPrintf(LOG_COMP_SERIALIZE, LOG_SEV_VERBOSE, "Song: %s, BPM: %s, time signature: %d/%d, subdivision: %d, swing: %d, levels: %d/%d, click: %s, tempo changes: %d\n", 
+      name.c_str(), BPMToString(bpm).c_str(), beatsPerBar, beatUnit, subdivision, swing, subdivisionLevels[0], subdivisionLevels[1],
+      clickVoice.c_str(), tempoChanges.size());
   } catch (std::bad_alloc&) {
     logLn(LOG_COMP_SERIALIZE, LOG_SEV_ERROR, "Out of memory copying song data");
     return false;
@@ -25,6 +78,101 @@ bool Song::DeserializeSelf(const ArduinoJson::JsonObject& obj) {
 }
 
 
+bool Song::parseTimeSignature(const char *timeSignature) {
+  return parseTimeSignature(timeSignature, &beatsPerBar, &beatUnit);
+}
+
+
+bool Song::parseTimeSignature(const char *timeSignature, uint8_t *top, uint8_t *bottom) {
+  unsigned int topVal = 0, bottomVal = 0;
+  if (sscanf(timeSignature, "%u/%u", &topVal, &bottomVal) != 2 || topVal == 0 || topVal > 32 || bottomVal == 0 || bottomVal > 32) {
+    return false;
+  }
+
+  *top = topVal;
+  *bottom = bottomVal;
+  return true;
+}
+
+
+bool Song::parseTempoMap(const ArduinoJson::JsonArray& jsonTempoMap) {
+  // Only checked for sense here. Whether the bars line up with the ramps is up to
+  // TempoMap::Compile().
+  uint16_t lastBar = 0;
+  for (ArduinoJson::JsonObject jsonChange : jsonTempoMap) {
+    AudioLib::TempoChange change;
+    change.bar = jsonChange["bar"].as<unsigned int>();
+    change.bpm = jsonChange["BPM"].as<float>();
+    change.rampBars = jsonChange["rampBars"].as<unsigned int>();
+
+    if (change.bar == 0 || change.bar <= lastBar || change.bpm <= 0) {
+      logPrintf(LOG_COMP_SERIALIZE, LOG_SEV_WARN, "Song: %s: Tempo change at bar %d is out of order or has no BPM.\n", name.c_str(), change.bar);
+      return false;
+    }
+
+    const char *timeSignature = jsonChange["timeSignature"];
+    uint8_t unused;
+    if (timeSignature && !parseTimeSignature(timeSignature, &change.beatsPerBar, &unused)) {
+      logPrintf(LOG_COMP_SERIALIZE, LOG_SEV_WARN, "Song: %s: Tempo change at bar %d has invalid time signature \"%s\".\n", 
+        name.c_str(), change.bar, timeSignature);
+      return false;
+    }
+
+    tempoChanges.push_back(change);
+    lastBar = change.bar;
+  }
+
+  return true;
+}
+
+
+bool Song::parseSubdivisionLevels(const ArduinoJson::JsonArray& jsonLevels) {
+  // Any that are left out keep their defaults.
+  uint8_t level = 1;
+  for (ArduinoJson::JsonVariant jsonLevel : jsonLevels) {
+    unsigned int percent = jsonLevel.as<unsigned int>();
+    if (level >= CLICKTRACK_NUM_LEVELS || percent > 100) {
+      return false;
+    }
+
+    subdivisionLevels[level - 1] = percent;
+    level++;
+  }
+
+  return true;
+}
+
+
+bool Song::parseSubdivision(const char *subdivisionName) {
+  if (strcmp(subdivisionName, "none") == 0) {
+    subdivision = AudioLib::SD_None;
+  } else if (strcmp(subdivisionName, "8th") == 0) {
+    subdivision = AudioLib::SD_Eighths;
+  } else if (strcmp(subdivisionName, "triplet") == 0) {
+    subdivision = AudioLib::SD_Triplets;
+  } else if (strcmp(subdivisionName, "16th") == 0) {
+    subdivision = AudioLib::SD_Sixteenths;
+  } else {
+    return false;
+  }
+
+  return true;
+}
+
+
+std::string Song::BPMToString(float bpm) {
+  // Work in tenths, so we don't end up with "128.500000" or "128.49999".
+  uint32_t tenths = static_cast<uint32_t>(bpm * 10 + 0.5f);
+
+  std::string str = std::to_string(tenths / 10);
+  if (tenths % 10 != 0) {
+    str.append(".").append(std::to_string(tenths % 10));
+  }
+
+  return str;
+}
+
+
 
 ///////////////////////////////////////////////////////////////////////////////
 // SongList
@@ -1,3 +1,5 @@
+#include <esp_timer.h>
+
 #include "Free_Fonts.h"
 
 #include "components/canvasstate.hpp"
@@ -15,6 +17,7 @@
 #define CALIBRATION_DATA_LEN 5
 
 SetlistTft* tft = NULL;
+uint32_t touchTimeUs = 0;
 
 
 // len specifies size in bytes, not items
@@ -142,12 +145,18 @@ uint16_t TftManager::Height() {
 }
 
 
+uint32_t TftManager::GetTouchTimeUs() {
+  return touchTimeUs;
+}
+
+
 // Returns true if the screen was touched.
 bool TftManager::GetTouchCoords(TSPoint *coords) {
   bool touched = false;
   uint16_t x = 0, y = 0;
   if (tft->getTouch(&x, &y, MINPRESSURE)) {
     touched = true;
+    touchTimeUs = static_cast<uint32_t>(esp_timer_get_time());
 
     if (coords) {
       coords->x = x;
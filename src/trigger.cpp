@@ -1,4 +1,7 @@
+#include <atomic>
+
 #include <driver/adc.h>
+#include <esp_timer.h>
 #include <freertos/FreeRTOS.h>
 #include <freertos/task.h>
 
@@ -12,10 +15,20 @@
 #define TRIGGER_PROCESSOR_THREAD_NAME "TriggerProc"
 #define TRIGGER_LISTENER_THREAD_NAME "TriggerListnr"
 
-// Number of conversions that can be performed on a single interrupt
+// Number of bytes of conversions handed over on a single interrupt. Each result
+// is SOC_ADC_DIGI_RESULT_BYTES long.
 #define CONV_NUM_PER_INTERRUPT 64
 #define CONV_STORE_BUF_SIZE 4096
 
+// A hit can't be seen until the frame of conversions it's in is handed over. At
+// this rate that's 16 results every 0.8 ms, rather than every 16 ms at 1 kHz.
+#define TRIGGER_SAMPLE_FREQ_HZ 20000
+#define TRIGGER_SAMPLE_PERIOD_US (1000000 / TRIGGER_SAMPLE_FREQ_HZ)
+
+// Long enough for the audio task to have picked the hit up, so the latency report
+// is for this hit. Only the report waits for this.
+#define TRIGGER_REPORT_DELAY_MS 20
+
 #define POLL_MS 250
 
 // Pin 5, which is GPIO 5, which is ADC1 channel 4
@@ -26,7 +39,6 @@
 
 
 #define TRIGGER_THRESHOLD 4000
-uint32_t maxTriggerVal = TRIGGER_THRESHOLD;
 esp_err_t errVal = ESP_OK;
 
 // In an effort to avoid false positives on fast reads, two positive readings within this amount of time 
@@ -35,8 +47,17 @@ esp_err_t errVal = ESP_OK;
 
 #define TRIGGER_EVENT_TRIGGERED 0x00000001
 
-uint32_t clickRestartTime = 0;
+// Written by the listener for the processor to report. Nothing time critical.
+uint32_t hitTriggerVal = 0;
+uint32_t hitAdcDelayUs = 0;
+
+// Published for Trigger::GetHitCount() and GetLastHitTimeUs(). The time is
+// written before the count is bumped.
+std::atomic<uint32_t> hitCount(0);
+std::atomic<uint32_t> lastHitTimeUs(0);
 
+// The click is reset by the listener itself. This task just reports on it, so it
+// can take its time.
 void triggerProcessor(void *) {
   while (true) {
     if (errVal != ESP_OK) {
@@ -50,23 +71,19 @@ void triggerProcessor(void *) {
       continue;
     }
 
-    if (maxTriggerVal > TRIGGER_THRESHOLD) {
-      TIME_TYPE now = millis();
-      static TIME_TYPE lastPositiveReadTime = 0;
-      if (now - lastPositiveReadTime > DELAY_TIME_BETWEEN_SEPARATE_READINGS) {
-        // Restart the click *NOW*
-        AudioComp::RestartClick(clickRestartTime);
-
-        lastPositiveReadTime = now;
-        uint32_t triggerVal = maxTriggerVal;
-        maxTriggerVal = TRIGGER_THRESHOLD;
-        logPrintf(LOG_COMP_TRIGGER, LOG_SEV_VERBOSE, "THWACK!!! %d\n", triggerVal);
-      } else {
-        maxTriggerVal = TRIGGER_THRESHOLD;
-      }
-    }
+    uint32_t triggerVal = hitTriggerVal;
+    uint32_t adcDelayUs = hitAdcDelayUs;
+    logPrintf(LOG_COMP_TRIGGER, LOG_SEV_VERBOSE, "THWACK!!! %d\n", triggerVal);
+
+    delay(TRIGGER_REPORT_DELAY_MS);
 
-    delay(10);
+    // The handoff is measured from the (corrected) time of the hit, so it includes
+    // the ADC delay. Split it out.
+    AudioComp::TriggerLatency latency = AudioComp::GetTriggerLatency();
+    uint32_t handoffUs = latency.handoffUs > adcDelayUs ? latency.handoffUs - adcDelayUs : 0;
+    logPrintf(LOG_COMP_TRIGGER, LOG_SEV_VERBOSE, 
+      "Trigger latency (us): ADC %d + handoff %d + output %d = %d. Worst handoff incl. ADC: %d, hits: %d\n",
+      adcDelayUs, handoffUs, latency.outputUs, adcDelayUs + handoffUs + latency.outputUs, latency.maxHandoffUs, latency.hits);
   }
 }
 
@@ -101,7 +118,7 @@ void listenForTriggers(void *param) {
     .conv_limit_num = 250,
     .pattern_num = 1,
     .adc_pattern = &digiPattern,
-    .sample_freq_hz = 1000,
+    .sample_freq_hz = TRIGGER_SAMPLE_FREQ_HZ,
     .conv_mode = ADC_CONV_SINGLE_UNIT_1,
     .format = ADC_DIGI_OUTPUT_FORMAT_TYPE2,
   };
@@ -141,23 +158,34 @@ void listenForTriggers(void *param) {
     }
 
     if (err == ESP_OK) {
+      // The read returns as soon as the last conversion is in, so that's (close
+      // enough to) now.
+      uint32_t readTimeUs = static_cast<uint32_t>(esp_timer_get_time());
+
       // Process the data and see if there's a hit.
-      for (uint32_t i = 0; i < numResults; i++) {
+      for (uint32_t i = 0; i + SOC_ADC_DIGI_RESULT_BYTES <= numResults; i += SOC_ADC_DIGI_RESULT_BYTES) {
         adc_digi_output_data_t *data = reinterpret_cast<adc_digi_output_data_t*>(&(results[i]));
         if (data->type2.unit == 0) {
           uint32_t dataVal = data->type2.data;
-          if (dataVal > maxTriggerVal) {
-            maxTriggerVal = dataVal;
-            // If we get here, we have a valid trigger and the processor hasn't picked it up yet.
-            // (It could be the first one.)
-            if (dataVal > TRIGGER_THRESHOLD) {
-              // Timing is critical here, as we want the click to start RIGHT when the trigger is hit. We can't
-              // pass a message to the audio thread quickly enough, so instead we'll tell it when the click was
-              // supposed to start, and subsequent clicks will be accurate.
-              clickRestartTime = millis();
+          if (dataVal > TRIGGER_THRESHOLD) {
+            // Work out when this conversion happened from how many came after it.
+            uint32_t adcDelayUs = ((numResults - i) / SOC_ADC_DIGI_RESULT_BYTES - 1) * TRIGGER_SAMPLE_PERIOD_US;
+            uint32_t hitTimeUs = readTimeUs - adcDelayUs;
+
+            if (hitTimeUs - lastHitTimeUs.load(std::memory_order_relaxed) > DELAY_TIME_BETWEEN_SEPARATE_READINGS * 1000) {
+              // Timing is critical here, as we want the click to line up with the moment the trigger was hit.
+              // This goes straight to the audio task without queueing or waiting, and it lines the beat up with
+              // hitTimeUs, so subsequent clicks are accurate however long it takes to get there.
+              AudioComp::ResetClickPhase(hitTimeUs);
+              lastHitTimeUs.store(hitTimeUs, std::memory_order_relaxed);
+              hitCount.fetch_add(1, std::memory_order_release);
+
+              hitTriggerVal = dataVal;
+              hitAdcDelayUs = adcDelayUs;
               xTaskNotifyGive(triggerProcessorHandle);
-              break; // No point in continuing to process stuff
             }
+
+            break; // No point in continuing to process stuff
           }
         }
       }
@@ -174,6 +202,16 @@ void listenForTriggers(void *param) {
 }
 
 
+uint32_t Trigger::GetHitCount() {
+  return hitCount.load(std::memory_order_acquire);
+}
+
+
+uint32_t Trigger::GetLastHitTimeUs() {
+  return lastHitTimeUs.load(std::memory_order_relaxed);
+}
+
+
 void Trigger::Init() {
   TaskHandle_t processorTask = NULL;
 